@@ -0,0 +1,268 @@
+/*
+ * admission.c -- Connection and transfer limits, client token buckets
+ */
+
+#include "admission.h"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "server.h"
+
+int max_connections = 0;
+int max_transfers = TRANSFERS_DEFAULT;
+double client_rate = 0;
+double client_bandwidth = 0;
+
+static int connections = 0;
+static int transfers = 0;
+
+// Client table, sharded like the lock table
+typedef struct {
+  pthread_mutex_t mutex;
+  client_t* buckets[CLIENT_BUCKETS];
+} client_shard_t;
+
+static client_shard_t client_shards[CLIENT_SHARDS];
+
+// Throttled connections, soonest first, linked through conn->next
+static conn_t* throttled = NULL;
+static pthread_mutex_t throttle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t throttle_cond;
+
+static client_shard_t* shard_of(struct in_addr addr) {
+  return &client_shards[(addr.s_addr * 2654435761u >> 16) % CLIENT_SHARDS];
+}
+
+static size_t bucket_of(struct in_addr addr) {
+  return (addr.s_addr * 2654435761u) % CLIENT_BUCKETS;
+}
+
+// Request tokens a full bucket holds, at least one so that a rate under
+// one per second still lets a request through now and then
+static double request_burst(void) {
+  return client_rate > 1 ? client_rate : 1;
+}
+
+// How long an unused entry takes to fill its buckets up again
+static uint64_t client_idle_us(void) {
+  if (client_rate > 0 && client_rate < 1) {
+    return (uint64_t)(1e6 / client_rate);
+  }
+  return CLIENT_IDLE_US;
+}
+
+// Add the tokens earned since the last refill, shard mutex held
+static void refill(client_t* client, uint64_t now) {
+  double seconds = (now - client->refilled_us) / 1e6;
+
+  client->refilled_us = now;
+  client->requests += seconds * client_rate;
+  if (client->requests > request_burst()) {
+    client->requests = request_burst();
+  }
+  client->bytes += seconds * client_bandwidth;
+  if (client->bytes > client_bandwidth) {
+    client->bytes = client_bandwidth;
+  }
+}
+
+// Throttle thread, rearms each parked connection once its time is up
+static void* throttle_thread(void* arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&throttle_mutex);
+  while (1) {
+    if (throttled == NULL) {
+      pthread_cond_wait(&throttle_cond, &throttle_mutex);
+      continue;
+    }
+
+    uint64_t now = metrics_now_us();
+    if (throttled->throttle_until > now) {
+      // The condition uses CLOCK_MONOTONIC, like metrics_now_us()
+      uint64_t until = throttled->throttle_until;
+      struct timespec ts = {until / 1000000, (until % 1000000) * 1000};
+      pthread_cond_timedwait(&throttle_cond, &throttle_mutex, &ts);
+      continue;
+    }
+
+    conn_t* conn = throttled;
+    throttled = conn->next;
+    pthread_mutex_unlock(&throttle_mutex);
+    rearm_connection(conn, conn->throttle_events);
+    pthread_mutex_lock(&throttle_mutex);
+  }
+
+  return NULL;
+}
+
+int admission_init(void) {
+  struct rlimit limit;
+  pthread_condattr_t attr;
+  pthread_t tid;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    if (limit.rlim_cur < limit.rlim_max) {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+      getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (max_connections == 0) {
+      // Leave room for the server's own files and the spare descriptor
+      rlim_t fit = limit.rlim_cur > 64 ? (limit.rlim_cur - 64) / CONN_FDS : 1;
+      max_connections = fit < MAX_CONNECTIONS_CAP ? (int)fit
+                                                  : MAX_CONNECTIONS_CAP;
+    }
+  }
+
+  for (int i = 0; i < CLIENT_SHARDS; i++) {
+    pthread_mutex_init(&client_shards[i].mutex, NULL);
+  }
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&throttle_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&tid, NULL, throttle_thread, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+client_t* admit_connection(struct in_addr addr) {
+  if (max_connections > 0 &&
+      __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED) >
+          max_connections) {
+    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  client_shard_t* shard = shard_of(addr);
+  size_t bucket = bucket_of(addr);
+
+  uint64_t now = metrics_now_us();
+  client_t* client = NULL;
+
+  pthread_mutex_lock(&shard->mutex);
+  client_t** link = &shard->buckets[bucket];
+  while (*link != NULL) {
+    client_t* entry = *link;
+    if (entry->addr.s_addr == addr.s_addr) {
+      client = entry;
+      link = &entry->next;
+    } else if (entry->refs == 0 &&
+               now - entry->refilled_us >= client_idle_us()) {
+      // Its buckets have filled up again, a new entry would be the same
+      *link = entry->next;
+      free(entry);
+    } else {
+      link = &entry->next;
+    }
+  }
+  if (client == NULL) {
+    client = calloc(1, sizeof(client_t));
+    if (client == NULL) {
+      pthread_mutex_unlock(&shard->mutex);
+      __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    client->addr = addr;
+    client->requests = request_burst();
+    client->bytes = client_bandwidth;
+    client->refilled_us = now;
+    client->next = shard->buckets[bucket];
+    shard->buckets[bucket] = client;
+  }
+  client->refs++;
+  pthread_mutex_unlock(&shard->mutex);
+  return client;
+}
+
+void release_connection(client_t* client) {
+  client_shard_t* shard = shard_of(client->addr);
+
+  // The entry stays behind with its buckets, so reconnecting doesn't
+  // refill them; admit_connection reclaims it once idle
+  pthread_mutex_lock(&shard->mutex);
+  refill(client, metrics_now_us());
+  client->refs--;
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (max_connections > 0) {
+    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+  }
+}
+
+uint32_t client_take_request(client_t* client) {
+  if (client_rate <= 0) {
+    return 0;
+  }
+
+  client_shard_t* shard = shard_of(client->addr);
+  uint32_t wait_ms = 0;
+
+  pthread_mutex_lock(&shard->mutex);
+  refill(client, metrics_now_us());
+  if (client->requests >= 1) {
+    client->requests -= 1;
+  } else {
+    wait_ms = (uint32_t)((1 - client->requests) / client_rate * 1000) + 1;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return wait_ms;
+}
+
+uint64_t client_charge_bytes(client_t* client, uint64_t bytes) {
+  if (client_bandwidth <= 0) {
+    return 0;
+  }
+
+  client_shard_t* shard = shard_of(client->addr);
+  uint64_t pause = 0;
+
+  pthread_mutex_lock(&shard->mutex);
+  refill(client, metrics_now_us());
+  client->bytes -= bytes;
+  if (client->bytes < 0) {
+    pause = (uint64_t)(-client->bytes / client_bandwidth * 1e6);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return pause;
+}
+
+int admit_transfer(void) {
+  if (max_transfers <= 0) {
+    return 1;
+  }
+  if (__atomic_add_fetch(&transfers, 1, __ATOMIC_RELAXED) > max_transfers) {
+    __atomic_sub_fetch(&transfers, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+void release_transfer(void) {
+  if (max_transfers > 0) {
+    __atomic_sub_fetch(&transfers, 1, __ATOMIC_RELAXED);
+  }
+}
+
+void throttle_connection(conn_t* conn, uint64_t us, unsigned int events) {
+  conn->throttle_until = metrics_now_us() + us;
+  conn->throttle_events = events;
+
+  pthread_mutex_lock(&throttle_mutex);
+  conn_t** link = &throttled;
+  while (*link != NULL && (*link)->throttle_until <= conn->throttle_until) {
+    link = &(*link)->next;
+  }
+  conn->next = *link;
+  *link = conn;
+  if (throttled == conn) {
+    pthread_cond_signal(&throttle_cond);
+  }
+  pthread_mutex_unlock(&throttle_mutex);
+}
@@ -0,0 +1,107 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Admission control and per-client throttling
+ *
+ * Limits, each answered with a BUSY reply that says how long to wait
+ * (see protocol.h) instead of letting an overloaded server slow down
+ * for everybody:
+ *
+ *   connections  open at once (-C); one more is accepted, told BUSY
+ *                and closed
+ *   transfers    GETs and WRITEs in flight at once (-T), over the top a
+ *                request is turned away before any data moves
+ *   requests     per second and client address (-R), a token bucket
+ *                holding one second's worth, or one request under a
+ *                rate of one per second
+ *   bandwidth    bytes per second and client address (-B), also a
+ *                token bucket; a connection that overdraws it is not
+ *                turned away but sits out until the debt is paid off
+ *
+ * The listen queue is bounded too (ACCEPT_BACKLOG). Connections from the
+ * same address share their client's buckets. The entry outlives them
+ * until its buckets are full again (CLIENT_IDLE_US), so a client can't
+ * reset them by reconnecting. STOP and STATS are never turned away.
+ */
+
+#define ACCEPT_BACKLOG 256
+#define BUSY_RETRY_MS 100         // hint when a server-wide limit is hit
+#define CONN_FDS 4                // file descriptors a connection may use
+#define MAX_CONNECTIONS_CAP 65536 // highest default for -C
+#define TRANSFERS_DEFAULT 256
+#define CLIENT_SHARDS 16
+#define CLIENT_BUCKETS 256
+#define CLIENT_IDLE_US 1000000    // buckets hold one second's worth
+
+// One client address and its token buckets
+typedef struct client {
+  struct in_addr addr;
+  int refs;  // open connections, 0 while idle
+  double requests;  // tokens, refilled at client_rate per second
+  double bytes;     // tokens, may go negative, refilled at client_bandwidth
+  uint64_t refilled_us;
+  struct client* next;  // hash chain
+} client_t;
+
+// Set by the -C, -T, -R and -B flags, 0 for no limit
+extern int max_connections;
+extern int max_transfers;
+extern double client_rate;       // requests per second
+extern double client_bandwidth;  // bytes per second
+
+struct conn;
+
+/**
+ * Pick the connection limit if -C didn't, from the file descriptor limit
+ * (raised to its hard maximum first), and start the throttle thread
+ * @return 0, or -1 if the thread could not be started
+ */
+int admission_init(void);
+
+/**
+ * Count in a new connection and find its client
+ * @param addr - the client's address
+ * @return the client with a reference for the connection, or NULL if the
+ *         server is at its connection limit (or out of memory)
+ */
+client_t* admit_connection(struct in_addr addr);
+
+// Count out a closed connection and drop its client reference
+
+void release_connection(client_t* client);
+
+/**
+ * Take a request token
+ * @param client - client sending the request
+ * @return 0 if the request may run, else milliseconds until it could
+ */
+uint32_t client_take_request(client_t* client);
+
+/**
+ * Charge bytes a connection moved to its client's bandwidth
+ * @return microseconds the connection should pause, 0 if none
+ */
+uint64_t client_charge_bytes(client_t* client, uint64_t bytes);
+
+// Count in a GET or WRITE, 0 if max_transfers are already running
+
+int admit_transfer(void);
+
+// Count out a transfer admitted by admit_transfer
+
+void release_transfer(void);
+
+/**
+ * Park a connection for a while, then watch it for events again
+ * @param conn - connection that would have been rearmed
+ * @param us - how long to wait
+ * @param events - EPOLLIN or EPOLLOUT for rearm_connection
+ */
+void throttle_connection(struct conn* conn, uint64_t us, unsigned int events);
+
+#endif
@@ -0,0 +1,468 @@
+/*
+ * bench.c -- Load generator and benchmark for the file server
+ *
+ * Runs a number of client threads against a running server, each with
+ * its own connection, issuing a mix of GETs and WRITEs over a set of
+ * files until the time or operation budget runs out, then reports the
+ * throughput and latency percentiles per operation.
+ *
+ * The requests are made with the rfs client code (client.h), so what is
+ * measured is what rfs does. Its progress output is sent to /dev/null.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+
+#define MAX_SIZES 16
+#define MAX_CLIENTS 256
+#define BENCH_GET 0
+#define BENCH_WRITE 1
+
+// Set by the command line
+const char* bench_host = "127.0.0.1";
+int bench_port = 2000;
+int clients = 8;
+double duration = 10;  // seconds, unless ops is set
+long ops = 0;          // stop after this many operations in total
+long sizes[MAX_SIZES];
+int size_count = 0;
+int read_percent = 90;
+int keys = 100;
+double skew = 0;  // zipf theta, 0 for uniform
+const char* prefix = "bench";
+
+// Local files WRITE sends, one per size
+char local_files[MAX_SIZES][64];
+
+// Cumulative zipf distribution over the keys
+double* key_cdf;
+
+// Where the report goes, stdout itself is /dev/null
+FILE* report;
+
+// Operations handed out so far, for -n
+long issued = 0;
+pthread_mutex_t issued_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// gethostbyname() in connect_to_server isn't thread safe
+pthread_mutex_t connect_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Latencies of one operation type, in microseconds
+typedef struct {
+  double* us;
+  long count;
+  long capacity;
+  long errors;
+  long bytes;
+} samples_t;
+
+// One client thread
+typedef struct {
+  pthread_t tid;
+  unsigned int seed;
+  double deadline;
+  samples_t samples[2];  // BENCH_GET and BENCH_WRITE
+} bench_client_t;
+
+// Monotonic time in seconds
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse a size like 4096, 4k, 1m or 1g
+// @return the size in bytes, or -1
+static long parse_size(const char* text) {
+  char* end;
+  long size = strtol(text, &end, 10);
+
+  if (end == text || size < 0) {
+    return -1;
+  }
+  switch (*end) {
+    case 'k':
+    case 'K':
+      size <<= 10;
+      end++;
+      break;
+    case 'm':
+    case 'M':
+      size <<= 20;
+      end++;
+      break;
+    case 'g':
+    case 'G':
+      size <<= 30;
+      end++;
+      break;
+  }
+  return *end == '\0' ? size : -1;
+}
+
+// Parse the comma separated -s list into sizes[]
+// @return 0, or -1 if an entry isn't a size
+static int parse_sizes(char* list) {
+  size_count = 0;
+  for (char* item = strtok(list, ","); item != NULL;
+       item = strtok(NULL, ",")) {
+    if (size_count == MAX_SIZES || (sizes[size_count] = parse_size(item)) < 0) {
+      return -1;
+    }
+    size_count++;
+  }
+  return size_count > 0 ? 0 : -1;
+}
+
+// Write a local file of random bytes for each size
+// @return 0, or -1 if one can't be written
+static int create_local_files(void) {
+  char block[65536];
+
+  for (size_t i = 0; i < sizeof(block); i++) {
+    block[i] = rand();
+  }
+  for (int i = 0; i < size_count; i++) {
+    snprintf(local_files[i], sizeof(local_files[i]), "/tmp/rfs-bench.XXXXXX");
+    int fd = mkstemp(local_files[i]);
+    if (fd < 0) {
+      return -1;
+    }
+    for (long left = sizes[i]; left > 0;) {
+      long n = left < (long)sizeof(block) ? left : (long)sizeof(block);
+      if (write(fd, block, n) != n) {
+        close(fd);
+        return -1;
+      }
+      left -= n;
+    }
+    close(fd);
+  }
+  return 0;
+}
+
+static void remove_local_files(void) {
+  for (int i = 0; i < size_count; i++) {
+    if (local_files[i][0] != '\0') {
+      unlink(local_files[i]);
+    }
+  }
+}
+
+// Build the zipf distribution, key k weighs 1 / (k + 1)^skew
+// @return 0, or -1 out of memory
+static int build_key_cdf(void) {
+  double total = 0;
+
+  key_cdf = malloc(sizeof(double) * keys);
+  if (key_cdf == NULL) {
+    return -1;
+  }
+  for (int k = 0; k < keys; k++) {
+    total += 1.0 / pow(k + 1, skew);
+    key_cdf[k] = total;
+  }
+  for (int k = 0; k < keys; k++) {
+    key_cdf[k] /= total;
+  }
+  return 0;
+}
+
+// Pick a key, key 0 being the hottest
+static int pick_key(unsigned int* seed) {
+  double u = rand_r(seed) / ((double)RAND_MAX + 1);
+  int low = 0;
+  int high = keys - 1;
+
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (key_cdf[mid] > u) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return low;
+}
+
+static void remote_path(int key, char* path, size_t size) {
+  snprintf(path, size, "%s/key%d", prefix, key);
+}
+
+// Keep one latency sample
+static void add_sample(samples_t* samples, double us) {
+  if (samples->count == samples->capacity) {
+    long capacity = samples->capacity > 0 ? samples->capacity * 2 : 4096;
+    double* grown = realloc(samples->us, sizeof(double) * capacity);
+    if (grown == NULL) {
+      return;
+    }
+    samples->us = grown;
+    samples->capacity = capacity;
+  }
+  samples->us[samples->count++] = us;
+}
+
+// Is there time or budget left for one more operation
+static int take_op(bench_client_t* client) {
+  if (ops == 0) {
+    return now() < client->deadline;
+  }
+  pthread_mutex_lock(&issued_mutex);
+  int more = issued < ops;
+  if (more) {
+    issued++;
+  }
+  pthread_mutex_unlock(&issued_mutex);
+  return more;
+}
+
+static int connect_client(void) {
+  pthread_mutex_lock(&connect_mutex);
+  int socket_desc = connect_to_server(bench_host, bench_port);
+  pthread_mutex_unlock(&connect_mutex);
+  return socket_desc;
+}
+
+// Run one operation, reconnecting first if the last one broke the
+// connection
+// @return 0, or -1 if it failed
+static int run_op(int* socket_desc, int type, int key) {
+  char path[64];
+
+  if (*socket_desc < 0 && (*socket_desc = connect_client()) < 0) {
+    return -1;
+  }
+  remote_path(key, path, sizeof(path));
+  int result = type == BENCH_GET
+                   ? do_get(*socket_desc, path, "/dev/null")
+                   : do_write(*socket_desc, local_files[key % size_count],
+                              path);
+  if (result != 0) {
+    // The reply may not have been read, start over on a new connection
+    close(*socket_desc);
+    *socket_desc = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void* client_thread(void* arg) {
+  bench_client_t* client = arg;
+  int socket_desc = -1;
+
+  while (take_op(client)) {
+    int type = (int)(rand_r(&client->seed) % 100) < read_percent
+                   ? BENCH_GET
+                   : BENCH_WRITE;
+    int key = pick_key(&client->seed);
+    samples_t* samples = &client->samples[type];
+
+    double start = now();
+    if (run_op(&socket_desc, type, key) != 0) {
+      samples->errors++;
+      continue;
+    }
+    add_sample(samples, (now() - start) * 1e6);
+    samples->bytes += sizes[key % size_count];
+  }
+
+  if (socket_desc >= 0) {
+    close(socket_desc);
+  }
+  return NULL;
+}
+
+// Write every key once so the GETs find them
+// @return 0, or -1 if a WRITE failed
+static int preload(void) {
+  int socket_desc = -1;
+
+  for (int key = 0; key < keys; key++) {
+    if (run_op(&socket_desc, BENCH_WRITE, key) != 0) {
+      fprintf(report, "error occured!: Preloading key %d failed\n", key);
+      return -1;
+    }
+  }
+  close(socket_desc);
+  return 0;
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Sample at a percentile of sorted samples
+static double percentile(const samples_t* samples, double p) {
+  long index = (long)(p / 100 * samples->count);
+  if (index >= samples->count) {
+    index = samples->count - 1;
+  }
+  return samples->us[index];
+}
+
+// Merge the samples of one operation type over all clients
+static void merge_samples(bench_client_t* all, int type, samples_t* merged) {
+  memset(merged, 0, sizeof(*merged));
+  for (int i = 0; i < clients; i++) {
+    samples_t* samples = &all[i].samples[type];
+    for (long j = 0; j < samples->count; j++) {
+      add_sample(merged, samples->us[j]);
+    }
+    merged->errors += samples->errors;
+    merged->bytes += samples->bytes;
+  }
+  qsort(merged->us, merged->count, sizeof(double), compare_double);
+}
+
+static void print_line(const char* name, const samples_t* samples,
+                       double elapsed) {
+  if (samples->count == 0) {
+    fprintf(report, "%-6s %10s %10s %10s %10s %10s %8ld\n", name, "-", "-",
+            "-", "-", "-", samples->errors);
+    return;
+  }
+  fprintf(report, "%-6s %10.0f %10.2f %10.0f %10.0f %10.0f %8ld\n", name,
+          samples->count / elapsed, samples->bytes / elapsed / (1 << 20),
+          percentile(samples, 50), percentile(samples, 99),
+          percentile(samples, 99.9), samples->errors);
+}
+
+static void usage(void) {
+  fprintf(report,
+          "Usage: rfs-bench [-h host] [-p port] [-c clients] [-t seconds | "
+          "-n ops]\n"
+          "                 [-s sizes] [-r read%%] [-k keys] [-a skew] "
+          "[-P prefix]\n"
+          "  -c N      concurrent clients, one connection each (default 8)\n"
+          "  -t S      run for S seconds (default 10)\n"
+          "  -n N      run N operations in total instead\n"
+          "  -s LIST   file sizes, e.g. 4k,1m (default 4k), key i gets size "
+          "i %% count\n"
+          "  -r PCT    percent of operations that are GETs (default 90)\n"
+          "  -k N      number of files (default 100)\n"
+          "  -a THETA  zipf skew of the keys, 0 for uniform (default 0)\n"
+          "  -P DIR    remote directory of the files (default bench)\n");
+}
+
+int main(int argc, char* argv[]) {
+  static bench_client_t all[MAX_CLIENTS];
+  char default_sizes[] = "4k";
+  int opt;
+
+  // The client code reports every step on stdout
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  if (report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    perror("rfs-bench");
+    return 1;
+  }
+  parse_sizes(default_sizes);
+
+  while ((opt = getopt(argc, argv, "h:p:c:t:n:s:r:k:a:P:")) != -1) {
+    switch (opt) {
+      case 'h':
+        bench_host = optarg;
+        break;
+      case 'p':
+        bench_port = atoi(optarg);
+        break;
+      case 'c':
+        clients = atoi(optarg);
+        break;
+      case 't':
+        duration = atof(optarg);
+        break;
+      case 'n':
+        ops = atol(optarg);
+        break;
+      case 's':
+        if (parse_sizes(optarg) != 0) {
+          fprintf(report, "Error: Bad size list for -s\n");
+          return 1;
+        }
+        break;
+      case 'r':
+        read_percent = atoi(optarg);
+        break;
+      case 'k':
+        keys = atoi(optarg);
+        break;
+      case 'a':
+        skew = atof(optarg);
+        break;
+      case 'P':
+        prefix = optarg;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+  if (clients < 1 || clients > MAX_CLIENTS || keys < 1 || duration <= 0 ||
+      ops < 0 || read_percent < 0 || read_percent > 100 || skew < 0) {
+    usage();
+    return 1;
+  }
+
+  if (build_key_cdf() != 0 || create_local_files() != 0) {
+    fprintf(report, "error occured!: Cannot set up local files\n");
+    remove_local_files();
+    return 1;
+  }
+  if (preload() != 0) {
+    remove_local_files();
+    return 1;
+  }
+
+  fprintf(report, "%d clients, %d keys (skew %.2f), %d%% GET, sizes", clients,
+          keys, skew, read_percent);
+  for (int i = 0; i < size_count; i++) {
+    fprintf(report, " %ld", sizes[i]);
+  }
+  if (ops > 0) {
+    fprintf(report, ", %ld ops\n", ops);
+  } else {
+    fprintf(report, ", %.0f s\n", duration);
+  }
+  fflush(report);
+
+  double start = now();
+  for (int i = 0; i < clients; i++) {
+    all[i].seed = (unsigned int)(start * 1e6) + i * 7919;
+    all[i].deadline = start + duration;
+    if (pthread_create(&all[i].tid, NULL, client_thread, &all[i]) != 0) {
+      fprintf(report, "error occured!: Cannot start client %d\n", i);
+      return 1;
+    }
+  }
+  for (int i = 0; i < clients; i++) {
+    pthread_join(all[i].tid, NULL);
+  }
+  double elapsed = now() - start;
+
+  samples_t get_samples;
+  samples_t write_samples;
+  merge_samples(all, BENCH_GET, &get_samples);
+  merge_samples(all, BENCH_WRITE, &write_samples);
+
+  fprintf(report, "\n%-6s %10s %10s %10s %10s %10s %8s\n", "op", "ops/s",
+          "MB/s", "p50 us", "p99 us", "p99.9 us", "errors");
+  print_line("GET", &get_samples, elapsed);
+  print_line("WRITE", &write_samples, elapsed);
+  fprintf(report, "\n%ld operations in %.2f s, %.0f ops/s\n",
+          get_samples.count + write_samples.count, elapsed,
+          (get_samples.count + write_samples.count) / elapsed);
+
+  remove_local_files();
+  return get_samples.errors + write_samples.errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * bufpool.c -- pool of large, page aligned transfer buffers
+ */
+
+#include "bufpool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+size_t buf_pool_cap = (size_t)BUF_POOL_DEFAULT_MB << 20;
+
+static unsigned char* arena = NULL;
+static int count = 0;
+
+// One reactor's share, buffers first .. first + count - 1 of the arena;
+// a stack of the indexes no worker has cached
+typedef struct {
+  pthread_mutex_t mutex;
+  int* free_buffers;
+  int free_count;
+  int first;
+  int count;
+} pool_shard_t;
+
+static pool_shard_t* shards = NULL;
+static int shard_count = 1;
+
+// The calling worker's shard and its own free buffers
+static __thread int home = 0;
+static __thread int cache[BUF_POOL_CACHE];
+static __thread int cached = 0;
+
+int buf_pool_init(int reactors) {
+  count = buf_pool_cap / BUF_POOL_SIZE;
+  if (count < 1) {
+    count = 1;
+  }
+  shard_count = reactors < count ? reactors : count;
+  if (shard_count < 1) {
+    shard_count = 1;
+  }
+
+  arena = mmap(NULL, (size_t)count * BUF_POOL_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  shards = calloc(shard_count, sizeof(pool_shard_t));
+  if (arena == MAP_FAILED || shards == NULL) {
+    return -1;
+  }
+
+  for (int s = 0; s < shard_count; s++) {
+    pool_shard_t* shard = &shards[s];
+
+    shard->first = s * count / shard_count;
+    shard->count = (s + 1) * count / shard_count - shard->first;
+    shard->free_buffers = malloc(shard->count * sizeof(int));
+    if (shard->free_buffers == NULL) {
+      return -1;
+    }
+    pthread_mutex_init(&shard->mutex, NULL);
+    for (int i = shard->count - 1; i >= 0; i--) {
+      shard->free_buffers[shard->free_count++] = shard->first + i;
+    }
+  }
+  return 0;
+}
+
+void buf_pool_bind(int reactor) {
+  home = reactor % shard_count;
+}
+
+// Shard a buffer belongs to
+static pool_shard_t* owner_of(int buf) {
+  // Never past its shard, at most a shard short of it
+  int s = (int)((long)buf * shard_count / count);
+
+  while (buf >= shards[s].first + shards[s].count) {
+    s++;
+  }
+  return &shards[s];
+}
+
+static int take_from(pool_shard_t* shard) {
+  int buf = -1;
+
+  pthread_mutex_lock(&shard->mutex);
+  if (shard->free_count > 0) {
+    buf = shard->free_buffers[--shard->free_count];
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return buf;
+}
+
+int buf_pool_take(void) {
+  if (cached > 0) {
+    return cache[--cached];
+  }
+
+  // Own shard first, then borrow from the others rather than fail
+  for (int i = 0; i < shard_count; i++) {
+    int buf = take_from(&shards[(home + i) % shard_count]);
+    if (buf >= 0) {
+      return buf;
+    }
+  }
+  return -1;
+}
+
+void buf_pool_put(int buf) {
+  pool_shard_t* shard = owner_of(buf);
+
+  // Only keep it while its shard is far from empty, and only if it is
+  // one of ours; borrowed buffers and buffers that run short go back
+  // where every worker can get at them
+  if (shard == &shards[home] && cached < BUF_POOL_CACHE &&
+      __atomic_load_n(&shard->free_count, __ATOMIC_RELAXED) >
+          shard->count / 4) {
+    cache[cached++] = buf;
+    return;
+  }
+
+  pthread_mutex_lock(&shard->mutex);
+  shard->free_buffers[shard->free_count++] = buf;
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+unsigned char* buf_pool_data(int buf) {
+  return arena + (size_t)buf * BUF_POOL_SIZE;
+}
+
+int buf_pool_count(void) {
+  return count;
+}
@@ -0,0 +1,62 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+/*
+ * Pool of large transfer buffers
+ *
+ * The buffers are carved out of one anonymous mapping reserved at
+ * startup, so they are page aligned, never freed, and the pool can never
+ * hold more than buf_pool_cap bytes no matter how many connections come
+ * in. Pages are only touched once a buffer is first used.
+ *
+ * The buffers are split into one shard per reactor (see reactor.h),
+ * each with its own mutex. A worker takes from its reactor's shard and
+ * only borrows from the others when that one is empty; a buffer always
+ * goes back to the shard it came from, so the pages stay with the
+ * reactor that first touched them.
+ *
+ * Each worker keeps up to BUF_POOL_CACHE free buffers for itself, so a
+ * busy worker takes and returns buffers without any mutex, as long as
+ * more than a quarter of its shard is free. When every buffer is out,
+ * buf_pool_take() fails and the caller takes a path that needs no buffer
+ * or turns the transfer away.
+ */
+
+#define BUF_POOL_SIZE (512 * 1024)
+#define BUF_POOL_DEFAULT_MB 64
+#define BUF_POOL_CACHE 4
+
+// Set by the -b flag, bytes the pool may hold, at least one buffer
+extern size_t buf_pool_cap;
+
+/**
+ * Reserve the pool
+ * @param reactors - number of shards to split it into, fewer if there
+ *                   aren't enough buffers
+ * @return 0, or -1 if the memory can't be mapped
+ */
+int buf_pool_init(int reactors);
+
+// Make the calling worker take from its reactor's shard
+
+void buf_pool_bind(int reactor);
+
+// Take a buffer, -1 when they are all in use
+
+int buf_pool_take(void);
+
+// Give a buffer back
+
+void buf_pool_put(int buf);
+
+// Memory of a buffer, BUF_POOL_SIZE bytes
+
+unsigned char* buf_pool_data(int buf);
+
+// Number of buffers in the pool
+
+int buf_pool_count(void);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * checksum.c -- CRC32C of file data, and keeping it with the file
+ */
+
+#include "checksum.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/xattr.h>
+
+#include "protocol.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C polynomial, bit reversed
+#define CRC_POLY 0x82f63b78
+
+// Stream lengths of the interleaved hardware loop, powers of two
+#define CRC_LONG 8192
+#define CRC_SHORT 256
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static uint32_t slice_table[8][256];
+static uint32_t long_zeros[4][256];   // appends CRC_LONG zeros to a CRC
+static uint32_t short_zeros[4][256];  // appends CRC_SHORT zeros
+static int use_hardware = 0;
+
+// Multiply a vector by a 32x32 matrix over GF(2)
+static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+  uint32_t sum = 0;
+
+  while (vec != 0) {
+    if (vec & 1) {
+      sum ^= *mat;
+    }
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2_matrix_times(mat, mat[n]);
+  }
+}
+
+// Operator that appends len zero bytes to a CRC, len a power of two
+static void zeros_operator(uint32_t* even, size_t len) {
+  uint32_t odd[32];
+  uint32_t row = 1;
+
+  // One zero bit, then two, then four
+  odd[0] = CRC_POLY;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+
+  // Each square doubles it, starting from one zero byte
+  do {
+    gf2_matrix_square(even, odd);
+    len >>= 1;
+    if (len == 0) {
+      return;
+    }
+    gf2_matrix_square(odd, even);
+    len >>= 1;
+  } while (len != 0);
+  memcpy(even, odd, sizeof(odd));
+}
+
+// The operator as one table per byte of the CRC
+static void zeros_tables(uint32_t zeros[4][256], size_t len) {
+  uint32_t op[32];
+
+  zeros_operator(op, len);
+  for (uint32_t n = 0; n < 256; n++) {
+    zeros[0][n] = gf2_matrix_times(op, n);
+    zeros[1][n] = gf2_matrix_times(op, n << 8);
+    zeros[2][n] = gf2_matrix_times(op, n << 16);
+    zeros[3][n] = gf2_matrix_times(op, n << 24);
+  }
+}
+
+static void init_tables(void) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; k++) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+    }
+    slice_table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; n++) {
+    for (int k = 1; k < 8; k++) {
+      uint32_t prev = slice_table[k - 1][n];
+      slice_table[k][n] = (prev >> 8) ^ slice_table[0][prev & 0xff];
+    }
+  }
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  use_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+  if (use_hardware) {
+    zeros_tables(long_zeros, CRC_LONG);
+    zeros_tables(short_zeros, CRC_SHORT);
+  }
+}
+
+static uint32_t crc_software(uint32_t crc, const unsigned char* p,
+                             size_t len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    word ^= crc;
+    crc = slice_table[7][word & 0xff] ^ slice_table[6][(word >> 8) & 0xff] ^
+          slice_table[5][(word >> 16) & 0xff] ^
+          slice_table[4][(word >> 24) & 0xff] ^
+          slice_table[3][(word >> 32) & 0xff] ^
+          slice_table[2][(word >> 40) & 0xff] ^
+          slice_table[1][(word >> 48) & 0xff] ^ slice_table[0][word >> 56];
+    p += 8;
+    len -= 8;
+  }
+#endif
+  while (len > 0) {
+    crc = slice_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+// Append the zeros of a table to a CRC
+static uint32_t crc_shift(uint32_t zeros[4][256], uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+         zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static inline uint64_t load_u64(const unsigned char* p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+// Three independent crc32 chains keep the instruction's pipeline full
+__attribute__((target("sse4.2"))) static uint32_t crc_hardware(
+    uint32_t crc, const unsigned char* p, size_t len) {
+  uint64_t crc0 = crc;
+
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+    len--;
+  }
+
+  while (len >= 3 * CRC_LONG) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const unsigned char* end = p + CRC_LONG;
+    do {
+      crc0 = _mm_crc32_u64(crc0, load_u64(p));
+      crc1 = _mm_crc32_u64(crc1, load_u64(p + CRC_LONG));
+      crc2 = _mm_crc32_u64(crc2, load_u64(p + 2 * CRC_LONG));
+      p += 8;
+    } while (p < end);
+    crc0 = crc_shift(long_zeros, (uint32_t)crc0) ^ crc1;
+    crc0 = crc_shift(long_zeros, (uint32_t)crc0) ^ crc2;
+    p += 2 * CRC_LONG;
+    len -= 3 * CRC_LONG;
+  }
+
+  while (len >= 3 * CRC_SHORT) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const unsigned char* end = p + CRC_SHORT;
+    do {
+      crc0 = _mm_crc32_u64(crc0, load_u64(p));
+      crc1 = _mm_crc32_u64(crc1, load_u64(p + CRC_SHORT));
+      crc2 = _mm_crc32_u64(crc2, load_u64(p + 2 * CRC_SHORT));
+      p += 8;
+    } while (p < end);
+    crc0 = crc_shift(short_zeros, (uint32_t)crc0) ^ crc1;
+    crc0 = crc_shift(short_zeros, (uint32_t)crc0) ^ crc2;
+    p += 2 * CRC_SHORT;
+    len -= 3 * CRC_SHORT;
+  }
+
+  while (len >= 8) {
+    crc0 = _mm_crc32_u64(crc0, load_u64(p));
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+    len--;
+  }
+  return (uint32_t)crc0;
+}
+#endif
+
+uint32_t checksum_update(uint32_t crc, const void* buf, size_t len) {
+  pthread_once(&tables_once, init_tables);
+
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (use_hardware) {
+    return ~crc_hardware(crc, buf, len);
+  }
+#endif
+  return ~crc_software(crc, buf, len);
+}
+
+int checksum_load(int fd, uint32_t* crc) {
+  unsigned char value[CHECKSUM_SIZE];
+
+  if (fgetxattr(fd, CHECKSUM_XATTR, value, sizeof(value)) !=
+      (ssize_t)sizeof(value)) {
+    return -1;
+  }
+  *crc = rfs_get_u32(value);
+  return 0;
+}
+
+int checksum_store(int fd, uint32_t crc) {
+  unsigned char value[CHECKSUM_SIZE];
+
+  rfs_put_u32(value, crc);
+  return fsetxattr(fd, CHECKSUM_XATTR, value, sizeof(value), 0) == 0 ? 0 : -1;
+}
+
+const char* checksum_engine(void) {
+  pthread_once(&tables_once, init_tables);
+  return use_hardware ? "sse4.2" : "software";
+}
@@ -0,0 +1,56 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) checksums of whole files
+ *
+ * rfs -c ends a WRITE's payload with the CRC32C of the file, computed as
+ * the file is sent. The server computes it again as the data arrives and
+ * refuses the WRITE if the two differ, so nothing reads the file twice.
+ * The checksum is kept in the file's CHECKSUM_XATTR extended attribute,
+ * which stays with the file when it is renamed to a version. A GET that
+ * asks for it gets it after the data, for rfs to compare with what it
+ * received. See RFS_FLAG_CHECKSUM in protocol.h.
+ *
+ * With SSE 4.2 the crc32 instruction runs over three interleaved streams
+ * of CRC_LONG (then CRC_SHORT) bytes, whose CRCs are combined with
+ * tables that append that many zeros to a CRC, as in Mark Adler's
+ * crc32c.c. Without it slicing by 8 tables are used.
+ */
+
+#define CHECKSUM_SIZE 4
+#define CHECKSUM_XATTR "user.rfs.crc32c"
+
+/**
+ * Add data to a CRC32C
+ * @param crc - CRC32C of the data before, 0 to start
+ * @param buf - data
+ * @param len - bytes of data
+ * @return CRC32C of everything so far
+ */
+uint32_t checksum_update(uint32_t crc, const void* buf, size_t len);
+
+/**
+ * Read the checksum kept with a file
+ * @param fd - open file
+ * @param crc - output, its CRC32C
+ * @return 0, or -1 if it has none
+ */
+int checksum_load(int fd, uint32_t* crc);
+
+/**
+ * Keep a checksum with a file
+ * @param fd - open file
+ * @param crc - CRC32C of its contents
+ * @return 0, or -1 if the file system has no extended attributes
+ */
+int checksum_store(int fd, uint32_t crc);
+
+// "sse4.2" or "software", whichever checksum_update() uses
+
+const char* checksum_engine(void);
+
+#endif
@@ -0,0 +1,526 @@
+/*
+ * chunkstore.c -- Content addressed chunk store with deduplication
+ *
+ * Chunk boundaries come from a gear rolling hash: a boundary is placed
+ * where the low bits of the hash are all zero, so they move with the
+ * content instead of with byte offsets. Inserting a few bytes into a
+ * large file only changes the chunk or two around the edit.
+ */
+
+#define _GNU_SOURCE
+
+#include "chunkstore.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "server.h"
+
+int chunk_store_enabled = 0;
+
+// Refcount entry for one stored chunk
+typedef struct chunk_entry {
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  long refs;
+  struct chunk_entry* next;
+} chunk_entry_t;
+
+// Chunks are spread over shards by digest, each a chained hash table
+typedef struct {
+  pthread_mutex_t mutex;
+  chunk_entry_t* buckets[1024];
+} chunk_shard_t;
+
+static chunk_shard_t chunk_shards[CHUNK_SHARDS];
+
+// Random values for the gear hash, filled in once at startup
+static uint64_t gear[256];
+
+// Pick the shard and bucket of a digest, the digest is already random
+static chunk_shard_t* chunk_shard(const unsigned char* digest, size_t* bucket) {
+  *bucket = ((size_t)digest[1] << 8 | digest[2]) % 1024;
+  return &chunk_shards[digest[0] % CHUNK_SHARDS];
+}
+
+// Find a chunk entry, shard mutex held
+static chunk_entry_t** find_chunk(chunk_shard_t* shard, size_t bucket,
+                                  const unsigned char* digest) {
+  chunk_entry_t** link = &shard->buckets[bucket];
+
+  while (*link != NULL &&
+         memcmp((*link)->digest, digest, SHA256_DIGEST_SIZE) != 0) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// Build the path of a chunk file
+static void chunk_path(const unsigned char* digest, char* path) {
+  char hex[SHA256_HEX_SIZE];
+
+  sha256_hex(digest, hex);
+  snprintf(path, MAX_PATH, "%s/%.2s/%s", CHUNKS_DIR, hex, hex);
+}
+
+// Write a chunk file, through a temp name so it appears complete
+// With a durability mode, it is also on disk before a recipe names it.
+static int write_chunk(const unsigned char* digest, const unsigned char* data,
+                       size_t len) {
+  char path[MAX_PATH];
+  char tmp_path[MAX_PATH + 4];
+
+  chunk_path(digest, path);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  size_t off = 0;
+  while (off < len) {
+    ssize_t n = write(fd, data + off, len - off);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      close(fd);
+      unlink(tmp_path);
+      return -1;
+    }
+    off += n;
+  }
+  if (durability_mode != DURABILITY_OFF && fdatasync(fd) != 0) {
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+  }
+  close(fd);
+
+  if (rename(tmp_path, path) != 0) {
+    return -1;
+  }
+  if (durability_mode != DURABILITY_OFF && sync_parent(path) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Take a reference on a chunk, storing it first if it is new
+// The shard mutex covers the write, so a chunk can't be deleted by one
+// connection while another is deciding it already exists.
+// @param data - chunk contents, NULL to only reference an existing chunk
+static int chunk_ref(const unsigned char* digest, const unsigned char* data,
+                     size_t len) {
+  size_t bucket;
+  chunk_shard_t* shard = chunk_shard(digest, &bucket);
+
+  pthread_mutex_lock(&shard->mutex);
+
+  chunk_entry_t** link = find_chunk(shard, bucket, digest);
+  if (*link != NULL) {
+    (*link)->refs++;
+    pthread_mutex_unlock(&shard->mutex);
+    return 0;
+  }
+  if (data == NULL) {
+    pthread_mutex_unlock(&shard->mutex);
+    return -1;
+  }
+
+  chunk_entry_t* entry = malloc(sizeof(chunk_entry_t));
+  if (entry == NULL || write_chunk(digest, data, len) != 0) {
+    pthread_mutex_unlock(&shard->mutex);
+    free(entry);
+    return -1;
+  }
+  memcpy(entry->digest, digest, SHA256_DIGEST_SIZE);
+  entry->refs = 1;
+  entry->next = NULL;
+  *link = entry;
+
+  pthread_mutex_unlock(&shard->mutex);
+  return 0;
+}
+
+// Drop a reference on a chunk, deleting it when it was the last one
+static void chunk_unref(const unsigned char* digest) {
+  size_t bucket;
+  chunk_shard_t* shard = chunk_shard(digest, &bucket);
+  char path[MAX_PATH];
+
+  pthread_mutex_lock(&shard->mutex);
+
+  chunk_entry_t** link = find_chunk(shard, bucket, digest);
+  chunk_entry_t* entry = *link;
+  if (entry != NULL && --entry->refs == 0) {
+    *link = entry->next;
+    chunk_path(digest, path);
+    unlink(path);
+    free(entry);
+  }
+
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+// Parse a recipe file without touching refcounts
+static recipe_t* parse_recipe(const char* recipe_path) {
+  FILE* fp = fopen(recipe_path, "r");
+  char hex[SHA256_HEX_SIZE];
+  unsigned long long size;
+  size_t count;
+  unsigned int len;
+
+  if (fp == NULL) {
+    return NULL;
+  }
+  if (fscanf(fp, "RFSCHUNKS 1 %llu %zu\n", &size, &count) != 2) {
+    fclose(fp);
+    return NULL;
+  }
+
+  recipe_t* recipe = calloc(1, sizeof(recipe_t));
+  if (recipe == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  recipe->size = size;
+  recipe->chunks = calloc(count > 0 ? count : 1, sizeof(chunk_ref_t));
+  if (recipe->chunks == NULL) {
+    free(recipe);
+    fclose(fp);
+    return NULL;
+  }
+
+  for (; recipe->count < count; recipe->count++) {
+    chunk_ref_t* chunk = &recipe->chunks[recipe->count];
+    if (fscanf(fp, "%64s %u\n", hex, &len) != 2 ||
+        strlen(hex) != SHA256_DIGEST_SIZE * 2) {
+      break;
+    }
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+      sscanf(hex + i * 2, "%2hhx", &chunk->digest[i]);
+    }
+    chunk->len = len;
+  }
+  fclose(fp);
+
+  if (recipe->count != count) {
+    free(recipe->chunks);
+    free(recipe);
+    return NULL;
+  }
+  return recipe;
+}
+
+// Free a parsed recipe without touching refcounts
+static void free_recipe_memory(recipe_t* recipe) {
+  free(recipe->chunks);
+  free(recipe);
+}
+
+// nftw callback, count the references of every recipe in the tree
+static int count_recipe_refs(const char* path, const struct stat* st,
+                             int type, struct FTW* ftw) {
+  (void)st;
+  (void)ftw;
+
+  if (type != FTW_F) {
+    return 0;
+  }
+  recipe_t* recipe = parse_recipe(path);
+  if (recipe == NULL) {
+    log_error("  error occured!: Ignoring broken recipe %s", path);
+    return 0;
+  }
+
+  // chunk_ref only creates entries along with the chunk data, so the
+  // entries for chunks already on disk are added here directly
+  for (size_t i = 0; i < recipe->count; i++) {
+    size_t bucket;
+    chunk_shard_t* shard = chunk_shard(recipe->chunks[i].digest, &bucket);
+    chunk_entry_t** link = find_chunk(shard, bucket, recipe->chunks[i].digest);
+
+    if (*link == NULL) {
+      *link = calloc(1, sizeof(chunk_entry_t));
+      if (*link == NULL) {
+        break;
+      }
+      memcpy((*link)->digest, recipe->chunks[i].digest, SHA256_DIGEST_SIZE);
+    }
+    (*link)->refs++;
+  }
+  free_recipe_memory(recipe);
+  return 0;
+}
+
+// Delete chunks nothing refers to, left by a crash mid-upload
+static void sweep_chunks(void) {
+  char dir_path[MAX_PATH];
+  char path[MAX_PATH + 1 + NAME_MAX];  // dir_path, '/' and any entry
+  unsigned char digest[SHA256_DIGEST_SIZE];
+
+  for (int d = 0; d < 256; d++) {
+    snprintf(dir_path, sizeof(dir_path), "%s/%02x", CHUNKS_DIR, d);
+    DIR* dir = opendir(dir_path);
+    if (dir == NULL) {
+      continue;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (entry->d_name[0] == '.') {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+
+      int named = strlen(entry->d_name) == SHA256_DIGEST_SIZE * 2;
+      for (int i = 0; named && i < SHA256_DIGEST_SIZE; i++) {
+        named = sscanf(entry->d_name + i * 2, "%2hhx", &digest[i]) == 1;
+      }
+
+      size_t bucket;
+      chunk_shard_t* shard = chunk_shard(digest, &bucket);
+      if (!named || *find_chunk(shard, bucket, digest) == NULL) {
+        unlink(path);
+      }
+    }
+    closedir(dir);
+  }
+}
+
+// Set up the store at startup
+int chunk_store_init(void) {
+  char dir_path[MAX_PATH];
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+  // splitmix64, the table only has to be fixed and well mixed
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+
+  for (int i = 0; i < CHUNK_SHARDS; i++) {
+    pthread_mutex_init(&chunk_shards[i].mutex, NULL);
+  }
+
+  for (int d = 0; d < 256; d++) {
+    snprintf(dir_path, sizeof(dir_path), "%s/%02x", CHUNKS_DIR, d);
+    if (create_directories(dir_path) != 0) {
+      return -1;
+    }
+  }
+  if (create_directories(RECIPES_DIR) != 0) {
+    return -1;
+  }
+
+  // Runs before any worker starts, so the shard mutexes aren't needed
+  nftw(RECIPES_DIR, count_recipe_refs, 16, FTW_PHYS);
+  sweep_chunks();
+  return 0;
+}
+
+// Build the recipe path for a file under RECIPES_DIR
+// @param filepath - full file path, starting with ROOT_DIR
+// @param suffix - appended to the name, CURRENT_RECIPE or ".vN"
+// @param recipe - output buffer of MAX_PATH bytes
+int get_recipe_path(const char* filepath, const char* suffix, char* recipe) {
+  size_t root_len = strlen(ROOT_DIR);
+
+  if (strncmp(filepath, ROOT_DIR, root_len) != 0) {
+    return -1;
+  }
+  if (snprintf(recipe, MAX_PATH, "%s%s%s", RECIPES_DIR, filepath + root_len,
+               suffix) >= MAX_PATH) {
+    return -1;
+  }
+  return 0;
+}
+
+// Add a chunk to the store and to the recipe being built
+static int add_chunk(recipe_t* recipe, size_t* capacity,
+                     const unsigned char* data, size_t len) {
+  if (recipe->count == *capacity) {
+    size_t new_capacity = *capacity * 2;
+    chunk_ref_t* chunks =
+        realloc(recipe->chunks, new_capacity * sizeof(chunk_ref_t));
+    if (chunks == NULL) {
+      return -1;
+    }
+    recipe->chunks = chunks;
+    *capacity = new_capacity;
+  }
+
+  chunk_ref_t* chunk = &recipe->chunks[recipe->count];
+  sha256(data, len, chunk->digest);
+  chunk->len = len;
+  if (chunk_ref(chunk->digest, data, len) != 0) {
+    return -1;
+  }
+  recipe->count++;
+  recipe->size += len;
+  return 0;
+}
+
+// Write a recipe out in the text format described in chunkstore.h
+static int write_recipe(const recipe_t* recipe, const char* recipe_path) {
+  char hex[SHA256_HEX_SIZE];
+  FILE* fp = fopen(recipe_path, "w");
+
+  if (fp == NULL) {
+    return -1;
+  }
+  fprintf(fp, "RFSCHUNKS 1 %llu %zu\n", (unsigned long long)recipe->size,
+          recipe->count);
+  for (size_t i = 0; i < recipe->count; i++) {
+    sha256_hex(recipe->chunks[i].digest, hex);
+    fprintf(fp, "%s %u\n", hex, recipe->chunks[i].len);
+  }
+  if (durability_mode != DURABILITY_OFF &&
+      (fflush(fp) != 0 || fdatasync(fileno(fp)) != 0)) {
+    fclose(fp);
+    return -1;
+  }
+  if (fclose(fp) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Cut a file into chunks, store the new ones and write the recipe
+// @param fd - file to chunk, read with pread from offset 0
+// @param recipe_path - recipe to write
+int chunk_store_file(int fd, const char* recipe_path) {
+  size_t capacity = 64;
+  recipe_t recipe = {0, 0, malloc(capacity * sizeof(chunk_ref_t))};
+  unsigned char* chunk = malloc(CHUNK_MAX_SIZE);
+  unsigned char* buf = malloc(BUFFER_SIZE * 16);
+  size_t chunk_len = 0;
+  uint64_t hash = 0;
+  off_t offset = 0;
+  int result = -1;
+
+  if (recipe.chunks == NULL || chunk == NULL || buf == NULL) {
+    goto out;
+  }
+
+  while (1) {
+    ssize_t n = pread(fd, buf, BUFFER_SIZE * 16, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      goto out;
+    }
+    if (n == 0) {
+      break;
+    }
+    offset += n;
+
+    for (ssize_t i = 0; i < n; i++) {
+      chunk[chunk_len++] = buf[i];
+      hash = (hash << 1) + gear[buf[i]];
+
+      if ((chunk_len >= CHUNK_MIN_SIZE && (hash & CHUNK_MASK) == 0) ||
+          chunk_len == CHUNK_MAX_SIZE) {
+        if (add_chunk(&recipe, &capacity, chunk, chunk_len) != 0) {
+          goto out;
+        }
+        chunk_len = 0;
+        hash = 0;
+      }
+    }
+  }
+
+  if (chunk_len > 0 && add_chunk(&recipe, &capacity, chunk, chunk_len) != 0) {
+    goto out;
+  }
+
+  result = write_recipe(&recipe, recipe_path);
+
+out:
+  if (result != 0) {
+    for (size_t i = 0; i < recipe.count; i++) {
+      chunk_unref(recipe.chunks[i].digest);
+    }
+    unlink(recipe_path);
+  }
+  free(recipe.chunks);
+  free(chunk);
+  free(buf);
+  return result;
+}
+
+// Load a recipe for reading, its chunks are pinned until recipe_free
+recipe_t* recipe_load(const char* recipe_path) {
+  recipe_t* recipe = parse_recipe(recipe_path);
+
+  if (recipe == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < recipe->count; i++) {
+    if (chunk_ref(recipe->chunks[i].digest, NULL, 0) != 0) {
+      // The recipe was removed under us and its chunks are gone
+      while (i-- > 0) {
+        chunk_unref(recipe->chunks[i].digest);
+      }
+      free_recipe_memory(recipe);
+      return NULL;
+    }
+  }
+  return recipe;
+}
+
+// Read the size of the file a recipe describes, from its header
+long recipe_size(const char* recipe_path) {
+  FILE* fp = fopen(recipe_path, "r");
+  unsigned long long size;
+  size_t count;
+
+  if (fp == NULL) {
+    return -1;
+  }
+  int found = fscanf(fp, "RFSCHUNKS 1 %llu %zu\n", &size, &count) == 2;
+  fclose(fp);
+  return found ? (long)size : -1;
+}
+
+// Release a recipe from recipe_load
+void recipe_free(recipe_t* recipe) {
+  for (size_t i = 0; i < recipe->count; i++) {
+    chunk_unref(recipe->chunks[i].digest);
+  }
+  free_recipe_memory(recipe);
+}
+
+// Delete a recipe, then drop the references it held
+int recipe_remove(const char* recipe_path) {
+  recipe_t* recipe = parse_recipe(recipe_path);
+
+  if (unlink(recipe_path) != 0 || recipe == NULL) {
+    if (recipe != NULL) {
+      free_recipe_memory(recipe);
+    }
+    return -1;
+  }
+  recipe_free(recipe);
+  return 0;
+}
+
+// Open a chunk of a pinned recipe
+int chunk_open(const chunk_ref_t* chunk) {
+  char path[MAX_PATH];
+
+  chunk_path(chunk->digest, path);
+  return open(path, O_RDONLY);
+}
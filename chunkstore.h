@@ -0,0 +1,92 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * Content addressed chunk store
+ *
+ * Files are cut into chunks at content defined boundaries, so an edit only
+ * changes the chunks around it. Each chunk is stored once, named by its
+ * SHA-256, under CHUNKS_DIR/<first two hex digits>/<hex>. A recipe lists
+ * the chunks of one file version in order:
+ *
+ *   RFSCHUNKS 1 <file size> <chunk count>
+ *   <hex digest> <chunk length>
+ *   ...
+ *
+ * Chunks are refcounted in memory. The counts are rebuilt from the recipes
+ * at startup, and a chunk file is deleted once its count drops to zero.
+ */
+
+#define CHUNKS_DIR ROOT_DIR "/" META_NAME "/chunks"
+#define RECIPES_DIR ROOT_DIR "/" META_NAME "/recipes"
+#define CURRENT_RECIPE ".cur"
+
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_MAX_SIZE (256 * 1024)
+#define CHUNK_MASK ((1 << 16) - 1)  // about 64 KB between boundaries
+#define CHUNK_SHARDS 64
+
+// One chunk of a recipe
+typedef struct {
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  uint32_t len;
+} chunk_ref_t;
+
+// A parsed recipe, its chunks stay pinned until recipe_free
+typedef struct {
+  uint64_t size;
+  size_t count;
+  chunk_ref_t* chunks;
+} recipe_t;
+
+// Set by the -c flag, new uploads are chunked when on
+extern int chunk_store_enabled;
+
+// Create the store and rebuild chunk refcounts from the recipes
+
+int chunk_store_init(void);
+
+// Map a file path (plus suffix) to its recipe path under RECIPES_DIR
+
+int get_recipe_path(const char* filepath, const char* suffix, char* recipe);
+
+/**
+ * Chunk a file into the store and write its recipe
+ * @param fd - file to read from the start
+ * @param recipe_path - where the recipe goes, it references every chunk
+ * @return 0 on success, -1 on error (nothing stays referenced)
+ */
+int chunk_store_file(int fd, const char* recipe_path);
+
+/**
+ * Read a recipe and pin its chunks so they can't be deleted while in use
+ * @param recipe_path - recipe to read
+ * @return the recipe, or NULL if it is missing or broken
+ */
+recipe_t* recipe_load(const char* recipe_path);
+
+/**
+ * Read the size of a recipe's file without loading its chunks
+ * @param recipe_path - recipe to read
+ * @return the size, or -1 if it is missing or broken
+ */
+long recipe_size(const char* recipe_path);
+
+// Unpin a recipe's chunks and free it
+
+void recipe_free(recipe_t* recipe);
+
+// Delete a recipe and drop its chunk references
+
+int recipe_remove(const char* recipe_path);
+
+// Open one chunk for reading
+
+int chunk_open(const chunk_ref_t* chunk);
+
+#endif
@@ -7,19 +7,141 @@
  */
 
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "checksum.h"
+#include "client.h"
+#include "compress.h"
+#include "delta.h"
+#include "protocol.h"
+#include "ring.h"
+#include "sha256.h"
+#include "upload.h"
+
 #define BUFFER_SIZE 8196
 #define MAX_PATH 512
 #define DEFAULT_PORT 2000
 #define DEFAULT_HOST "127.0.0.1"
+#define MAX_PIPELINE 64
+#define DELTA_FALLBACK 1  // delta upload not possible, send the whole file
+#define TRANSFER_LOST 2   // connection dropped, a resumed attempt may finish
+#define SERVER_BUSY 3     // turned away with BUSY, try again after a while
+#define RESUME_RETRIES 5
+#define BUSY_RETRIES 6
+#define CONNECT_RETRIES 3
+#define MOVED_RETRIES 3
+#define BACKOFF_BASE_MS 50
+#define BACKOFF_MAX_MS 5000
+#define MAX_STREAMS 16
+#define PARALLEL_MIN_RANGE (4L << 20)    // smallest job worth a stream
+#define PARALLEL_MAX_RANGE (256L << 20)  // biggest job handed to a stream
+
+// Set by -d, WRITE sends only the changed blocks
+int use_delta = 0;
+
+// Set by -z, WRITE and GET send the file compressed
+int use_compress = 0;
+
+// Set by -R, interrupted transfers continue where they stopped
+int use_resume = 0;
+
+// Set by -c, WRITE and GET check the file against its CRC32C
+int use_checksum = 0;
+
+// Set by -o and -l, GET only this part of the file (length 0 to the end)
+long get_offset = 0;
+long get_length = 0;
+
+// Set by -r, WRITE, GET and LIST work on whole directory trees
+int recursive = 0;
+
+// Set by -j, WRITE and GET split a file over this many connections
+int streams = 1;
+
+// Set by the last BUSY reply, how long the server asked us to wait
+uint32_t busy_retry_ms = 0;
+
+// Server the command runs against, parallel streams connect here too
+const char* current_host = DEFAULT_HOST;
+int current_port = DEFAULT_PORT;
+
+// Set by the last MOVED reply, the node that owns the path
+char moved_to[RING_ADDR_MAX] = "";
+
+// Set by -S, "host:port,..." replicas of the server that GETs may read
+// from instead, NULL for none
+const char* read_replicas = NULL;
+
+// Nodes of the cluster the server is part of, NULL for a single server.
+// Requests go straight to the node that owns their path.
+ring_t* cluster_ring = NULL;
+
+// Bytes moved by all streams of a transfer, for the progress line
+typedef struct {
+  pthread_mutex_t mutex;
+  long done;
+  long total;  // 0 for no progress line
+} progress_t;
+
+// One range of a ranged transfer
+typedef struct {
+  long offset;
+  long len;
+  long done;  // bytes of it transferred so far
+} range_job_t;
+
+// Ranges of one file, taken by the streams transferring it
+typedef struct {
+  const char* host;
+  int port;
+  int opcode;  // RFS_OP_WRITE_RANGE or RFS_OP_GET_RANGE
+  const char* remote_path;
+  const unsigned char* token;  // upload session of a WRITE
+  int fd;                      // local file
+  long file_base;              // GET: local offset = remote offset - base
+  long total;                  // GET: size every reply must report
+  range_job_t* jobs;
+  int count;
+  int capacity;
+  int next;    // first job no stream has taken
+  int result;  // first failure, 0 while all is well
+  progress_t progress;
+  pthread_mutex_t mutex;
+} range_queue_t;
+
+// One command of a BATCH session
+typedef struct {
+  int opcode;
+  char local_path[MAX_PATH];
+  char remote_path[MAX_PATH];
+  int status;  // 0 pending, 1 succeeded, -1 failed
+} batch_cmd_t;
+
+// State shared by the batch sender thread and the reply reader
+typedef struct {
+  int socket_desc;
+  batch_cmd_t* cmds;
+  int count;
+  int sent;             // requests written to the socket
+  int done;             // replies received
+  int sender_finished;  // sender has no more requests to send
+  int failed;           // connection broke, sender should stop
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} batch_t;
 
 // Get the size of a file
 // filename - name of the file
@@ -77,7 +199,36 @@ void get_directory_path(const char* filepath, char* dirpath) {
   }
 }
 
+// Sleep before retry number attempt (0 based), exponential from
+// BACKOFF_BASE_MS with jitter so clients turned away together don't all
+// come back together, and never shorter than the server asked for
+// attempt - retries made so far
+// floor_ms - wait at least this long
+void backoff(int attempt, uint32_t floor_ms) {
+  static __thread unsigned int seed = 0;
+  long ms = BACKOFF_BASE_MS << (attempt < 10 ? attempt : 10);
+
+  if (seed == 0) {
+    seed = (unsigned int)time(NULL) ^ (unsigned int)getpid() ^
+           (unsigned int)(uintptr_t)&seed;
+  }
+  if (ms > BACKOFF_MAX_MS) {
+    ms = BACKOFF_MAX_MS;
+  }
+  // Anywhere in the upper half of the window
+  ms = ms / 2 + rand_r(&seed) % (ms / 2 + 1);
+  if (ms < (long)floor_ms) {
+    ms = floor_ms;
+  }
+
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+}
+
 // Connect to the server
+// A refused or timed out connect is tried again with backoff, the server
+// may just have too many connections waiting to be accepted.
 // host - server hostname or IP
 // port - server port
 int connect_to_server(const char* host, int port) {
@@ -110,11 +261,23 @@ int connect_to_server(const char* host, int port) {
   printf("Connecting to %s:%d...\n", host, port);
 
   // Connect to server
-  if (connect(socket_desc, (struct sockaddr*)&server_addr,
-              sizeof(server_addr)) < 0) {
-    printf("Unable to connect to server\n");
+  for (int attempt = 0;; attempt++) {
+    if (connect(socket_desc, (struct sockaddr*)&server_addr,
+                sizeof(server_addr)) == 0) {
+      break;
+    }
+    int busy = errno == ECONNREFUSED || errno == ETIMEDOUT || errno == EAGAIN;
     close(socket_desc);
-    return -1;
+    if (!busy || attempt == CONNECT_RETRIES) {
+      printf("Unable to connect to server\n");
+      return -1;
+    }
+    backoff(attempt, 0);
+    socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_desc < 0) {
+      printf("Unable to create socket\n");
+      return -1;
+    }
   }
 
   printf("Connected to server successfully\n\n");
@@ -122,295 +285,2517 @@ int connect_to_server(const char* host, int port) {
   return socket_desc;
 }
 
-//  Execute WRITE command ,send a local file to the server
+// Receive a reply header, reading an OK/ERROR message into msg
 // socket_desc - connected socket to the server
-// local_path - path to local file to send
-// remote_path - path to save the file on the server
-int do_write(int socket_desc, const char* local_path, const char* remote_path) {
-  char buffer[BUFFER_SIZE];
-  FILE* fp;
-  long file_size;
-  long bytes_sent = 0;
-  int n;
-
-  // Check if local file exists and get its size
-  file_size = get_file_size(local_path);
-  if (file_size < 0) {
-    printf("Error: Cannot access local file '%s'\n", local_path);
+// hdr - output reply header
+// msg - output buffer for the message, may be NULL for DATA replies
+// msg_size - size of msg
+int recv_reply(int socket_desc, rfs_header_t* hdr, char* msg,
+               size_t msg_size) {
+  unsigned char frame[RFS_HEADER_SIZE];
+
+  if (recv_all(socket_desc, frame, sizeof(frame)) < 0) {
     return -1;
   }
-
-  // Open local file for reading
-  fp = fopen(local_path, "rb");
-  if (fp == NULL) {
-    printf("Error: Cannot open local file '%s'\n", local_path);
+  if (rfs_decode_header(frame, hdr) != 0) {
+    printf("Error: Unsupported reply from server\n");
     return -1;
   }
+  if (hdr->opcode == RFS_OP_DATA || msg == NULL) {
+    return 0;
+  }
 
-  printf("Sending file: %s (%ld bytes)\n", local_path, file_size);
-  printf("Remote path: %s\n", remote_path);
+  // Keep as much of the message as fits, drain the rest
+  uint64_t remaining = hdr->payload_len;
+  if (hdr->opcode == RFS_OP_BUSY) {
+    unsigned char retry[4];
+    if (remaining < sizeof(retry) ||
+        recv_all(socket_desc, retry, sizeof(retry)) < 0) {
+      return -1;
+    }
+    busy_retry_ms = rfs_get_u32(retry);
+    remaining -= sizeof(retry);
+  }
+  size_t kept = 0;
+  char discard[256];
+
+  while (remaining > 0) {
+    size_t room = msg_size - 1 - kept;
+    char* dst = room > 0 ? msg + kept : discard;
+    size_t want = room > 0 ? room : sizeof(discard);
+    if (want > remaining) {
+      want = remaining;
+    }
+    if (recv_all(socket_desc, dst, want) < 0) {
+      return -1;
+    }
+    if (room > 0) {
+      kept += want;
+    }
+    remaining -= want;
+  }
+  msg[kept] = '\0';
+  if (hdr->opcode == RFS_OP_MOVED) {
+    snprintf(moved_to, sizeof(moved_to), "%s", msg);
+  }
+  return 0;
+}
 
-  // Send WRITE command with remote path
-  memset(buffer, 0, sizeof(buffer));
-  snprintf(buffer, sizeof(buffer), "WRITE %s", remote_path);
+// Where the ring of the cluster behind host:port is kept between runs
+// path - output buffer of MAX_PATH bytes
+// Returns 0, or -1 if there is no home directory to keep it in
+int ring_cache_path(const char* host, int port, char* path) {
+  const char* home = getenv("HOME");
 
-  if (send(socket_desc, buffer, strlen(buffer), 0) < 0) {
-    printf("Error: Unable to send command\n");
-    fclose(fp);
+  if (home == NULL ||
+      snprintf(path, MAX_PATH, "%s/.rfs-ring-%s-%d", home, host, port) >=
+          MAX_PATH) {
     return -1;
   }
+  return 0;
+}
 
-  // Wait for READY response
-  memset(buffer, 0, sizeof(buffer));
-  n = recv(socket_desc, buffer, sizeof(buffer), 0);
-  if (n <= 0 || strstr(buffer, "READY") == NULL) {
-    printf("Error: Server not ready - %s\n", buffer);
-    fclose(fp);
-    return -1;
+// Pick up the ring an earlier run saw behind host:port, if any
+// host/port - server given on the command line
+void load_ring_cache(const char* host, int port) {
+  char path[MAX_PATH];
+  char text[RING_TEXT_MAX];
+
+  if (ring_cache_path(host, port, path) != 0) {
+    return;
+  }
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    return;
   }
+  size_t len = fread(text, 1, sizeof(text) - 1, fp);
+  fclose(fp);
+  text[len] = '\0';
+  free(cluster_ring);
+  cluster_ring = ring_parse(text);
+}
 
-  // Send file size
-  memset(buffer, 0, sizeof(buffer));
-  snprintf(buffer, sizeof(buffer), "%ld", file_size);
+// Keep cluster_ring for the next run, or forget it for a single server
+// host/port - server given on the command line
+void save_ring_cache(const char* host, int port) {
+  char path[MAX_PATH];
+  char text[RING_TEXT_MAX];
 
-  if (send(socket_desc, buffer, strlen(buffer), 0) < 0) {
-    printf("Error: Unable to send file size\n");
-    fclose(fp);
-    return -1;
+  if (ring_cache_path(host, port, path) != 0) {
+    return;
   }
-
-  // Wait for SIZE_OK response
-  memset(buffer, 0, sizeof(buffer));
-  n = recv(socket_desc, buffer, sizeof(buffer), 0);
-  if (n <= 0 || strstr(buffer, "SIZE_OK") == NULL) {
-    printf("Error: Server rejected file size - %s\n", buffer);
+  if (cluster_ring == NULL) {
+    unlink(path);
+    return;
+  }
+  size_t len = ring_format(cluster_ring, text, sizeof(text));
+  FILE* fp = fopen(path, "w");
+  if (fp != NULL) {
+    fwrite(text, 1, len, fp);
     fclose(fp);
-    return -1;
   }
+}
 
-  // Send file data
-  printf("Transferring...\n");
-  while (bytes_sent < file_size) {
-    size_t to_read = sizeof(buffer);
-    if (file_size - bytes_sent < (long)to_read) {
-      to_read = file_size - bytes_sent;
-    }
+// Ask one node for the membership of its cluster
+// host/port - node to ask
+// text - output buffer of RING_TEXT_MAX bytes, "" if it isn't in one
+// Returns 0, or -1 if the node can't be asked
+int fetch_ring(const char* host, int port, char* text) {
+  unsigned char request[RFS_HEADER_SIZE];
+  rfs_header_t reply;
 
-    size_t bytes_read = fread(buffer, 1, to_read, fp);
-    if (bytes_read <= 0) {
-      printf("Error: Failed to read local file\n");
-      fclose(fp);
-      return -1;
+  int socket_desc = connect_to_server(host, port);
+  if (socket_desc < 0) {
+    return -1;
+  }
+  size_t len = rfs_build_request(request, RFS_OP_RING, 1, "", 0);
+  int result = -1;
+  if (send_all(socket_desc, request, len) == 0 &&
+      recv_reply(socket_desc, &reply, text, RING_TEXT_MAX) == 0) {
+    result = 0;
+    if (reply.opcode != RFS_OP_DATA) {
+      text[0] = '\0';  // a server from before clusters
+    } else if (reply.payload_len >= RING_TEXT_MAX ||
+               recv_all(socket_desc, text, reply.payload_len) < 0) {
+      result = -1;
+    } else {
+      text[reply.payload_len] = '\0';
     }
+  }
+  close(socket_desc);
+  return result;
+}
 
-    int sent = send(socket_desc, buffer, bytes_read, 0);
-    if (sent < 0) {
-      printf("Error: Failed to send file data\n");
-      fclose(fp);
-      return -1;
+// Bring cluster_ring up to date and cache it
+// host/port - server given on the command line, the ring is cached for it
+// ask - "host:port" of the node to ask first, NULL for host:port itself;
+//       the nodes of the old ring are tried if it doesn't answer
+// Returns 0, or -1 if no node answered
+int refresh_ring(const char* host, int port, const char* ask) {
+  char text[RING_TEXT_MAX];
+  char node_host[RING_ADDR_MAX];
+  int node_port;
+  int result = -1;
+
+  if (ask != NULL && ring_split_addr(ask, node_host, &node_port) == 0) {
+    result = fetch_ring(node_host, node_port, text);
+  }
+  if (result != 0) {
+    result = fetch_ring(host, port, text);
+  }
+  for (int n = 0; result != 0 && cluster_ring != NULL &&
+                  n < cluster_ring->count;
+       n++) {
+    if (ring_split_addr(cluster_ring->nodes[n], node_host, &node_port) == 0) {
+      result = fetch_ring(node_host, node_port, text);
     }
+  }
+  if (result != 0) {
+    return -1;
+  }
 
-    bytes_sent += sent;
+  free(cluster_ring);
+  cluster_ring = text[0] != '\0' ? ring_parse(text) : NULL;
+  save_ring_cache(host, port);
+  return 0;
+}
 
-    // Show progress
-    int progress = (int)((bytes_sent * 100) / file_size);
-    printf("\rProgress: %ld/%ld bytes (%d%%)", bytes_sent, file_size, progress);
-    fflush(stdout);
+// Ring for a command that asks every node, RM, LIST and BATCH
+// A cached ring is brought up to date, since it decides which nodes are
+// asked; without one the server is taken to be a single server, sparing
+// it a RING round trip, until a MOVED reply says otherwise.
+// host/port - server given on the command line
+void load_current_ring(const char* host, int port) {
+  load_ring_cache(host, port);
+  if (cluster_ring != NULL) {
+    refresh_ring(host, port, NULL);
   }
-  printf("\n");
+}
 
-  fclose(fp);
+// Node a path is sent to, the server itself unless it is in a cluster
+// host/port - server given on the command line
+// remote_path - path of the request
+// node_host/node_port - output, node_host is RING_ADDR_MAX bytes
+void route_path(const char* host, int port, const char* remote_path,
+                char* node_host, int* node_port) {
+  const char* owner = NULL;
 
-  // Receive final response
-  memset(buffer, 0, sizeof(buffer));
-  n = recv(socket_desc, buffer, sizeof(buffer), 0);
-  if (n > 0) {
-    printf("Server response: %s\n", buffer);
-    if (strstr(buffer, "Success!") != NULL) {
-      return 0;
-    }
+  if (cluster_ring != NULL) {
+    owner = cluster_ring->nodes[ring_owner(cluster_ring, remote_path)];
   }
+  if (owner == NULL || ring_split_addr(owner, node_host, node_port) != 0) {
+    snprintf(node_host, RING_ADDR_MAX, "%s", host);
+    *node_port = port;
+  }
+}
 
-  return -1;
+// Server a GET reads from, the primary or any of its -S replicas
+// node_host/node_port - set to the replica picked, node_host is
+//                       RING_ADDR_MAX bytes; left alone for the primary
+// returns 1 if a replica was picked, 0 for the primary
+int pick_replica(char* node_host, int* node_port) {
+  unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+  char addr[RING_ADDR_MAX];
+  int count = 1;
+
+  for (const char* p = read_replicas; *p != '\0'; p++) {
+    count += *p == ',';
+  }
+  int pick = rand_r(&seed) % (count + 1);
+  if (pick == count) {
+    return 0;
+  }
+
+  // The pick'th entry of the list
+  const char* entry = read_replicas;
+  for (int i = 0; i < pick; i++) {
+    entry = strchr(entry, ',') + 1;
+  }
+  snprintf(addr, sizeof(addr), "%.*s", (int)strcspn(entry, ","), entry);
+  return ring_split_addr(addr, node_host, node_port) == 0;
 }
 
-// Execute GET command , retrieve a file from the server
+// Send a WRITE request followed by the contents of an open local file
 // socket_desc - connected socket to the server
-// remote_path - path to file on the server
-// local_path - path to save the file locally
-int do_get(int socket_desc, const char* remote_path, const char* local_path) {
+// request_id - id the server will answer with
+// fp - local file, read from its current position
+// file_size - number of bytes to send
+// remote_path - path to save the file on the server
+// flags - RFS_FLAG_* of the request, with RFS_FLAG_CHECKSUM the CRC32C of
+//         the data follows it
+// show_progress - print a progress line while sending
+int send_write_request(int socket_desc, uint32_t request_id, FILE* fp,
+                       long file_size, const char* remote_path, int flags,
+                       int show_progress) {
   char buffer[BUFFER_SIZE];
-  char dir_path[MAX_PATH];
-  FILE* fp;
-  long file_size;
-  long bytes_received = 0;
-  int n;
+  long bytes_sent = 0;
+  uint32_t checksum = 0;
+  int checksum_len = (flags & RFS_FLAG_CHECKSUM) ? CHECKSUM_SIZE : 0;
+
+  // Request header and path go first, the first chunk of data shares the
+  // same send so a small file is a single write
+  size_t len = rfs_build_request((unsigned char*)buffer, RFS_OP_WRITE,
+                                 request_id, remote_path,
+                                 file_size + checksum_len);
+  rfs_set_flags((unsigned char*)buffer, flags);
+
+  while (1) {
+    size_t to_read = sizeof(buffer) - len;
+    if (file_size - bytes_sent < (long)to_read) {
+      to_read = file_size - bytes_sent;
+    }
 
-  printf("Requesting file: %s\n", remote_path);
-  printf("Local path: %s\n", local_path);
+    size_t bytes_read = 0;
+    if (to_read > 0) {
+      bytes_read = fread(buffer + len, 1, to_read, fp);
+      if (bytes_read <= 0) {
+        // The header promised file_size bytes, the stream can't recover
+        printf("Error: Failed to read local file\n");
+        return -1;
+      }
+      if (checksum_len > 0) {
+        checksum = checksum_update(checksum, buffer + len, bytes_read);
+      }
+    }
+
+    if (send_all(socket_desc, buffer, len + bytes_read) < 0) {
+      printf("Error: Failed to send file data\n");
+      return -1;
+    }
 
-  // Send GET command with remote path
-  memset(buffer, 0, sizeof(buffer));
-  snprintf(buffer, sizeof(buffer), "GET %s", remote_path);
+    bytes_sent += bytes_read;
+    len = 0;
 
-  if (send(socket_desc, buffer, strlen(buffer), 0) < 0) {
-    printf("Error: Unable to send command\n");
-    return -1;
-  }
+    // Show progress
+    if (show_progress && file_size > 0) {
+      int progress = (int)((bytes_sent * 100) / file_size);
+      printf("\rProgress: %ld/%ld bytes (%d%%)", bytes_sent, file_size,
+             progress);
+      fflush(stdout);
+    }
 
-  // Receive SIZE response or error occured!
-  memset(buffer, 0, sizeof(buffer));
-  n = recv(socket_desc, buffer, sizeof(buffer), 0);
-  if (n <= 0) {
-    printf("Error: No response from server\n");
-    return -1;
+    if (bytes_sent >= file_size) {
+      break;
+    }
   }
 
-  // Check for error
-  if (strncmp(buffer, "error occured!", 5) == 0) {
-    printf("Server error: %s\n", buffer);
-    return -1;
+  if (checksum_len > 0) {
+    unsigned char trailer[CHECKSUM_SIZE];
+    rfs_put_u32(trailer, checksum);
+    if (send_all(socket_desc, trailer, sizeof(trailer)) < 0) {
+      printf("Error: Failed to send file data\n");
+      return -1;
+    }
   }
 
-  // Parse file size from "SIZE <size>"
-  if (strncmp(buffer, "SIZE", 4) != 0) {
-    printf("Error: Unexpected response: %s\n", buffer);
-    return -1;
+  if (show_progress) {
+    printf("\n");
   }
+  return 0;
+}
 
-  file_size = atol(buffer + 5);
-  printf("File size: %ld bytes\n", file_size);
+// Open the local file a download is saved to, creating its directory
+// local_path - path to save the file locally
+// append - add to the end of the file instead of replacing it
+// Returns the file, or NULL after printing why it can't be written
+FILE* create_local_file(const char* local_path, int append) {
+  char dir_path[MAX_PATH];
+  FILE* fp;
 
   // Create local directory if needed
   get_directory_path(local_path, dir_path);
-  if (strlen(dir_path) > 0) {
-    if (create_directories(dir_path) != 0) {
-      printf("Error: Cannot create local directory '%s'\n", dir_path);
-      return -1;
-    }
+  if (strlen(dir_path) > 0 && create_directories(dir_path) != 0) {
+    printf("Error: Cannot create local directory '%s'\n", dir_path);
+    return NULL;
   }
 
   // Open local file for writing
-  fp = fopen(local_path, "wb");
+  fp = fopen(local_path, append ? "ab" : "wb");
   if (fp == NULL) {
     printf("Error: Cannot create local file '%s'\n", local_path);
-    return -1;
   }
+  return fp;
+}
 
-  strcpy(buffer, "READY");
-  if (send(socket_desc, buffer, strlen(buffer), 0) < 0) {
-    printf("Error: Unable to send READY\n");
-    fclose(fp);
+// Receive the payload of a DATA reply into a local file
+// socket_desc - connected socket to the server
+// local_path - path to save the file locally
+// payload_len - payload length from the DATA header
+// checksummed - the DATA frame is flagged RFS_FLAG_CHECKSUM, the payload
+//               ends with the CRC32C of the file
+// append - add to the end of the local file instead of replacing it
+// show_progress - print a progress line while receiving
+// Returns 0 on success, -1 if the connection failed, -2 if the local
+// file couldn't be written (the payload is still drained), or -3 if it
+// doesn't match its checksum (the local file is removed)
+int recv_file_payload(int socket_desc, const char* local_path,
+                      long payload_len, int checksummed, int append,
+                      int show_progress) {
+  char buffer[BUFFER_SIZE];
+  unsigned char trailer[CHECKSUM_SIZE];
+  long file_size = payload_len - (checksummed ? CHECKSUM_SIZE : 0);
+  uint32_t checksum = 0;
+  long bytes_received = 0;
+  int n;
+
+  if (file_size < 0) {
+    printf("Error: Missing checksum\n");
     return -1;
   }
+  FILE* fp = create_local_file(local_path, append);
 
   // Receive file data
-  printf("Receiving...\n");
   while (bytes_received < file_size) {
-    memset(buffer, 0, sizeof(buffer));
-    n = recv(socket_desc, buffer, sizeof(buffer), 0);
+    size_t to_recv = sizeof(buffer);
+    if (file_size - bytes_received < (long)to_recv) {
+      to_recv = file_size - bytes_received;
+    }
+
+    n = recv(socket_desc, buffer, to_recv, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
     if (n <= 0) {
       printf("\nError: Connection lost during transfer\n");
-      fclose(fp);
+      if (fp != NULL) {
+        fclose(fp);
+      }
       return -1;
     }
 
-    fwrite(buffer, 1, n, fp);
+    if (fp != NULL) {
+      fwrite(buffer, 1, n, fp);
+    }
+    if (checksummed) {
+      checksum = checksum_update(checksum, buffer, n);
+    }
     bytes_received += n;
 
     // Show progress
-    int progress = (int)((bytes_received * 100) / file_size);
-    printf("\rProgress: %ld/%ld bytes (%d%%)", bytes_received, file_size,
-           progress);
-    fflush(stdout);
+    if (show_progress) {
+      int progress = (int)((bytes_received * 100) / file_size);
+      printf("\rProgress: %ld/%ld bytes (%d%%)", bytes_received, file_size,
+             progress);
+      fflush(stdout);
+    }
+  }
+  if (show_progress) {
+    printf("\n");
   }
-  printf("\n");
 
-  fclose(fp);
+  if (checksummed && recv_all(socket_desc, trailer, sizeof(trailer)) < 0) {
+    printf("Error: Connection lost during transfer\n");
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    return -1;
+  }
 
-  printf("File saved successfully: %s\n", local_path);
+  if (fp == NULL) {
+    return -2;
+  }
+  fclose(fp);
+  if (checksummed && rfs_get_u32(trailer) != checksum) {
+    printf("Error: Checksum mismatch, '%s' arrived corrupted\n", local_path);
+    unlink(local_path);
+    return -3;
+  }
   return 0;
 }
 
-//  Execute RM command - delete a file or directory on the server
+// Receive a compressed DATA payload and unpack it into a local file
 // socket_desc - connected socket to the server
-// remote_path - path to file or directory to delete
-int do_rm(int socket_desc, const char* remote_path) {
-  char buffer[BUFFER_SIZE];
-  int n;
+// local_path - path to save the file locally
+// stream_size - payload length from the DATA header
+// show_progress - print a progress line while receiving
+// Returns like recv_file_payload, or -3 if the stream is corrupt
+int recv_compressed_payload(int socket_desc, const char* local_path,
+                            long stream_size, int show_progress) {
+  unsigned char header[COMPRESS_BLOCK_HEADER];
+  unsigned char* stored = malloc(COMPRESS_BLOCK_SIZE);
+  unsigned char* raw = malloc(COMPRESS_BLOCK_SIZE);
+  FILE* fp = create_local_file(local_path, 0);
+  long bytes_received = 0;
+  long raw_size = 0;
+  int result = 0;
 
-  printf("Deleting: %s\n", remote_path);
+  if (stored == NULL || raw == NULL) {
+    printf("Error: Out of memory\n");
+    result = -1;
+  }
 
-  memset(buffer, 0, sizeof(buffer));
-  snprintf(buffer, sizeof(buffer), "RM %s", remote_path);
+  while (result == 0 && bytes_received < stream_size) {
+    uint32_t raw_len;
+    uint32_t stored_len;
 
-  if (send(socket_desc, buffer, strlen(buffer), 0) < 0) {
-    printf("Error: Unable to send command\n");
-    return -1;
+    if (stream_size - bytes_received < COMPRESS_BLOCK_HEADER) {
+      result = -3;
+      break;
+    }
+    if (recv_all(socket_desc, header, sizeof(header)) < 0) {
+      result = -1;
+      break;
+    }
+    if (compress_get_header(header, &raw_len, &stored_len) != 0 ||
+        stored_len > stream_size - bytes_received - COMPRESS_BLOCK_HEADER) {
+      result = -3;
+      break;
+    }
+    if (recv_all(socket_desc, stored, stored_len) < 0) {
+      result = -1;
+      break;
+    }
+
+    unsigned char* data = stored;
+    if (stored_len < raw_len) {
+      if (decompress_block(stored, stored_len, raw, raw_len) != 0) {
+        result = -3;
+        break;
+      }
+      data = raw;
+    }
+    if (fp != NULL) {
+      fwrite(data, 1, raw_len, fp);
+    }
+    bytes_received += COMPRESS_BLOCK_HEADER + stored_len;
+    raw_size += raw_len;
+
+    // Show progress
+    if (show_progress) {
+      int progress = (int)((bytes_received * 100) / stream_size);
+      printf("\rProgress: %ld/%ld bytes (%d%%)", bytes_received, stream_size,
+             progress);
+      fflush(stdout);
+    }
+  }
+  if (show_progress) {
+    printf("\n");
   }
 
-  // Receive response
-  memset(buffer, 0, sizeof(buffer));
-  n = recv(socket_desc, buffer, sizeof(buffer), 0);
-  if (n <= 0) {
-    printf("Error: No response from server\n");
-    return -1;
+  if (result == -1) {
+    printf("Error: Connection lost during transfer\n");
+  } else if (result == -3) {
+    printf("Error: Corrupt compressed data from server\n");
+  } else {
+    printf("Decompressed: %ld bytes into %ld\n", stream_size, raw_size);
   }
+  free(stored);
+  free(raw);
 
-  printf("Server response: %s\n", buffer);
+  if (fp == NULL) {
+    return result != 0 ? result : -2;
+  }
+  fclose(fp);
+  return result;
+}
 
-  if (strstr(buffer, "Success!") != NULL) {
-    return 0;
+// Compress a local file into a scratch file before it is sent
+// The request header carries the payload length, so the whole stream has
+// to exist before the first byte goes out.
+// fp - local file
+// file_size - its size
+// stream_size - output, bytes of compressed stream
+// Returns the stream rewound to its start, or NULL to send the file raw
+FILE* compress_local_file(FILE* fp, long file_size, long* stream_size) {
+  FILE* stream = tmpfile();
+
+  if (stream == NULL) {
+    return NULL;
+  }
+  *stream_size = compress_stream(fileno(fp), fileno(stream));
+  if (*stream_size < 0 || !COMPRESS_WORTH(*stream_size, file_size)) {
+    printf("Not compressing, the file doesn't compress enough\n");
+    fclose(stream);
+    return NULL;
   }
 
-  return -1;
+  printf("Compressed: %ld bytes into %ld\n", file_size, *stream_size);
+  rewind(stream);
+  return stream;
 }
 
-//  Execute STOP command
-// socket_desc - connected socket to the server
-int do_stop(int socket_desc) {
-  char buffer[BUFFER_SIZE];
-  int n;
+// Delta being built against a signature
+typedef struct {
+  FILE* out;
+  const unsigned char* data;  // local file
+  size_t literal_start;       // first byte not yet sent
+  uint32_t copy_first;        // pending run of copied blocks
+  uint32_t copy_count;
+  long literal_bytes;
+} delta_out_t;
+
+// Write the pending run of copied blocks
+static void flush_copy(delta_out_t* d) {
+  unsigned char op[9];
+
+  if (d->copy_count == 0) {
+    return;
+  }
+  op[0] = DELTA_OP_COPY;
+  rfs_put_u32(op + 1, d->copy_first);
+  rfs_put_u32(op + 5, d->copy_count);
+  fwrite(op, 1, sizeof(op), d->out);
+  d->copy_count = 0;
+}
 
-  printf("Sending STOP command to server...\n");
+// Write the local bytes from literal_start up to end
+static void flush_literal(delta_out_t* d, size_t end) {
+  unsigned char op[5];
 
-  // Send STOP command
-  strcpy(buffer, "STOP");
-  if (send(socket_desc, buffer, strlen(buffer), 0) < 0) {
-    printf("Error: Unable to send command\n");
-    return -1;
+  if (end == d->literal_start) {
+    return;
   }
+  flush_copy(d);
+  op[0] = DELTA_OP_LITERAL;
+  rfs_put_u32(op + 1, end - d->literal_start);
+  fwrite(op, 1, sizeof(op), d->out);
+  fwrite(d->data + d->literal_start, 1, end - d->literal_start, d->out);
+  d->literal_bytes += end - d->literal_start;
+  d->literal_start = end;
+}
 
-  // Receive response
-  memset(buffer, 0, sizeof(buffer));
-  n = recv(socket_desc, buffer, sizeof(buffer), 0);
-  if (n > 0) {
-    printf("Server response: %s\n", buffer);
+// Record a matching block at offset pos of the local file
+static void add_copy(delta_out_t* d, size_t pos, uint32_t block) {
+  flush_literal(d, pos);
+  if (d->copy_count > 0 && d->copy_first + d->copy_count == block) {
+    d->copy_count++;
+    return;
   }
-
-  return 0;
+  flush_copy(d);
+  d->copy_first = block;
+  d->copy_count = 1;
 }
 
-/**
- * Main function
- */
-int main(int argc, char* argv[]) {
-  int socket_desc;
-  char* host = DEFAULT_HOST;
-  int port = DEFAULT_PORT;
-  int opt;
-
-  // Parse command line options
-  while ((opt = getopt(argc, argv, "h:p:")) != -1) {
-    switch (opt) {
-      case 'h':
-        host = optarg;
-        break;
-      case 'p':
-        port = atoi(optarg);
-        break;
-      default:
-        return 1;
+// Find a signature block matching the local window at data
+// sig - signature entries, next/heads - weak checksum hash chains
+static long find_block(const unsigned char* sig, const int* heads,
+                       const int* next, uint32_t weak,
+                       const unsigned char* data, size_t len) {
+  unsigned char strong[DELTA_STRONG_SIZE];
+  int computed = 0;
+
+  for (int i = heads[weak & 0xffff]; i >= 0; i = next[i]) {
+    const unsigned char* entry = sig + (size_t)i * DELTA_SIG_ENTRY_SIZE;
+    if (rfs_get_u32(entry) != weak) {
+      continue;
+    }
+    if (!computed) {
+      delta_strong(data, len, strong);
+      computed = 1;
+    }
+    if (memcmp(entry + 4, strong, DELTA_STRONG_SIZE) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Build the delta of a local file against a signature into out
+// data/size - local file contents
+// sig/sig_len - signature payload from the server
+// Returns the number of literal bytes, or -1 if the signature is broken
+long build_delta(const unsigned char* data, size_t size,
+                 const unsigned char* sig, size_t sig_len, FILE* out) {
+  if (sig_len < DELTA_SIG_HEADER_SIZE) {
+    return -1;
+  }
+
+  uint32_t block_size = rfs_get_u32(sig);
+  uint32_t count = rfs_get_u32(sig + 4);
+  delta_base_t base;
+  delta_get_base(sig + 8, &base);
+  const unsigned char* entries = sig + DELTA_SIG_HEADER_SIZE;
+
+  if (block_size == 0 ||
+      sig_len != DELTA_SIG_HEADER_SIZE + (size_t)count * DELTA_SIG_ENTRY_SIZE) {
+    return -1;
+  }
+
+  // Hash chains over the low 16 bits of the weak checksum
+  int* heads = malloc(65536 * sizeof(int));
+  int* next = malloc((count > 0 ? count : 1) * sizeof(int));
+  if (heads == NULL || next == NULL) {
+    free(heads);
+    free(next);
+    return -1;
+  }
+  memset(heads, 0xff, 65536 * sizeof(int));
+  for (int i = count - 1; i >= 0; i--) {
+    uint32_t weak = rfs_get_u32(entries + (size_t)i * DELTA_SIG_ENTRY_SIZE);
+    next[i] = heads[weak & 0xffff];
+    heads[weak & 0xffff] = i;
+  }
+
+  // The last base block may be short, it can only match at the very end
+  uint32_t last_len = base.size % block_size;
+
+  // Header: base, block size, new size and hash of the new file
+  unsigned char header[DELTA_HEADER_SIZE];
+  delta_put_base(header, &base);
+  rfs_put_u32(header + DELTA_BASE_SIZE, block_size);
+  rfs_put_u64(header + DELTA_BASE_SIZE + 4, size);
+  sha256(data, size, header + DELTA_BASE_SIZE + 12);
+  fwrite(header, 1, sizeof(header), out);
+
+  delta_out_t d = {out, data, 0, 0, 0, 0};
+  size_t pos = 0;
+  uint32_t weak = 0;
+  int have_weak = 0;
+
+  while (pos + block_size <= size) {
+    if (!have_weak) {
+      weak = delta_weak(data + pos, block_size);
+      have_weak = 1;
+    }
+
+    long block = find_block(entries, heads, next, weak, data + pos,
+                            block_size);
+    // A full window can't match the short last block
+    if (block >= 0 && !(last_len > 0 && (uint32_t)block == count - 1)) {
+      add_copy(&d, pos, block);
+      pos += block_size;
+      d.literal_start = pos;
+      have_weak = 0;
+      continue;
+    }
+
+    if (pos + block_size < size) {
+      weak = delta_roll(weak, data[pos], data[pos + block_size], block_size);
+    }
+    pos++;
+  }
+
+  // Try the tail against the short last block
+  if (last_len > 0 && size - d.literal_start >= last_len) {
+    size_t tail = size - last_len;
+    const unsigned char* entry = entries + (size_t)(count - 1) *
+                                               DELTA_SIG_ENTRY_SIZE;
+    unsigned char strong[DELTA_STRONG_SIZE];
+
+    if (delta_weak(data + tail, last_len) == rfs_get_u32(entry)) {
+      delta_strong(data + tail, last_len, strong);
+      if (memcmp(entry + 4, strong, DELTA_STRONG_SIZE) == 0) {
+        add_copy(&d, tail, count - 1);
+        d.literal_start = size;
+      }
+    }
+  }
+
+  flush_literal(&d, size);
+  flush_copy(&d);
+
+  free(heads);
+  free(next);
+  return d.literal_bytes;
+}
+
+// Upload a file as a delta against the server's current copy
+// socket_desc - connected socket to the server
+// local_path - path to local file to send
+// remote_path - path of the file on the server
+// Returns 0 on success, -1 on error, DELTA_FALLBACK if the whole file has
+// to be sent instead (no remote copy, or it changed meanwhile)
+int do_delta_write(int socket_desc, const char* local_path,
+                   const char* remote_path) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+  unsigned char* sig = NULL;
+  unsigned char* data = MAP_FAILED;
+  FILE* delta = NULL;
+  int result = DELTA_FALLBACK;
+
+  // Ask for the signature of the current remote file
+  size_t len =
+      rfs_build_request((unsigned char*)buffer, RFS_OP_SIG, 1, remote_path, 0);
+  if (send_all(socket_desc, buffer, len) < 0 ||
+      recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("Error: No response from server\n");
+    return -1;
+  }
+  if (reply.opcode != RFS_OP_DATA) {
+    printf("No remote copy to diff against, sending the whole file\n");
+    return DELTA_FALLBACK;
+  }
+
+  size_t sig_len = reply.payload_len;
+  sig = malloc(sig_len > 0 ? sig_len : 1);
+  if (sig == NULL || recv_all(socket_desc, sig, sig_len) < 0) {
+    printf("Error: Failed to receive signature\n");
+    free(sig);
+    return -1;
+  }
+
+  int fd = open(local_path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    // Nothing to map, a plain WRITE is just as small
+    goto out;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    goto out;
+  }
+
+  delta = tmpfile();
+  if (delta == NULL) {
+    goto out;
+  }
+  long literal = build_delta(data, st.st_size, sig, sig_len, delta);
+  if (literal < 0) {
+    printf("Error: Bad signature from server\n");
+    goto out;
+  }
+
+  long delta_size = ftell(delta);
+  printf("Delta: %ld bytes (%ld literal) instead of %ld\n", delta_size,
+         literal, (long)st.st_size);
+  rewind(delta);
+
+  // Send the delta as a DELTA request, streamed like a WRITE
+  len = rfs_build_request((unsigned char*)buffer, RFS_OP_DELTA, 1, remote_path,
+                          delta_size);
+  if (send_all(socket_desc, buffer, len) < 0) {
+    result = -1;
+    goto out;
+  }
+  for (long sent = 0; sent < delta_size;) {
+    size_t n = fread(buffer, 1, sizeof(buffer), delta);
+    if (n == 0 || send_all(socket_desc, buffer, n) < 0) {
+      printf("Error: Failed to send delta\n");
+      result = -1;
+      goto out;
+    }
+    sent += n;
+  }
+
+  if (recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("Error: No response from server\n");
+    result = -1;
+    goto out;
+  }
+  printf("Server response: %s\n", buffer);
+  result = (reply.opcode == RFS_OP_OK) ? 0 : DELTA_FALLBACK;
+
+out:
+  if (delta != NULL) {
+    fclose(delta);
+  }
+  if (data != MAP_FAILED) {
+    munmap(data, st.st_size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(sig);
+  return result;
+}
+
+// Name the upload session of a local file
+// The same file going to the same place gets the same token, so running
+// the command again after a failure resumes the session on the server.
+// local_path/remote_path - what is being uploaded where
+// st - stat of the local file
+// token - output, UPLOAD_TOKEN_SIZE bytes
+void upload_token(const char* local_path, const char* remote_path,
+                  const struct stat* st, unsigned char* token) {
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  unsigned char fields[16];
+  sha256_ctx_t ctx;
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, remote_path, strlen(remote_path) + 1);
+  sha256_update(&ctx, local_path, strlen(local_path) + 1);
+  rfs_put_u64(fields, st->st_size);
+  rfs_put_u64(fields + 8, st->st_mtime);
+  sha256_update(&ctx, fields, sizeof(fields));
+  sha256_final(&ctx, digest);
+  memcpy(token, digest, UPLOAD_TOKEN_SIZE);
+}
+
+// Count transferred bytes and print the progress line
+// progress - shared by every stream of the transfer
+// n - bytes just moved
+void progress_add(progress_t* progress, long n) {
+  pthread_mutex_lock(&progress->mutex);
+  progress->done += n;
+  if (progress->total > 0) {
+    printf("\rProgress: %ld/%ld bytes (%d%%)", progress->done,
+           progress->total, (int)((progress->done * 100) / progress->total));
+    fflush(stdout);
+  }
+  pthread_mutex_unlock(&progress->mutex);
+}
+
+// Send one WRITE_RANGE of an upload session and wait for its reply
+// socket_desc - connected socket to the server
+// queue - transfer the range belongs to
+// job - range of the local file to send
+// Returns 0 on success, -1 if the server refused it, TRANSFER_LOST if
+// the connection broke
+int send_range_request(int socket_desc, range_queue_t* queue,
+                       range_job_t* job) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+  long done = 0;
+
+  size_t header = rfs_build_request((unsigned char*)buffer,
+                                    RFS_OP_WRITE_RANGE, 1, queue->remote_path,
+                                    UPLOAD_HEADER_SIZE + job->len);
+  memcpy(buffer + header, queue->token, UPLOAD_TOKEN_SIZE);
+  rfs_put_u64((unsigned char*)buffer + header + UPLOAD_TOKEN_SIZE,
+              job->offset);
+  header += UPLOAD_HEADER_SIZE;
+
+  while (1) {
+    size_t to_read = sizeof(buffer) - header;
+    if (job->len - done < (long)to_read) {
+      to_read = job->len - done;
+    }
+
+    ssize_t bytes_read = 0;
+    if (to_read > 0) {
+      bytes_read = pread(queue->fd, buffer + header, to_read,
+                         job->offset + done);
+      if (bytes_read <= 0) {
+        printf("\nError: Failed to read local file\n");
+        return -1;
+      }
+    }
+
+    if (send_all(socket_desc, buffer, header + bytes_read) < 0) {
+      printf("\nError: Connection lost during transfer\n");
+      progress_add(&queue->progress, -done);
+      return TRANSFER_LOST;
+    }
+    done += bytes_read;
+    header = 0;
+    progress_add(&queue->progress, bytes_read);
+
+    if (done >= job->len) {
+      break;
+    }
+  }
+
+  if (recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("\nError: Connection lost during transfer\n");
+    progress_add(&queue->progress, -done);
+    return TRANSFER_LOST;
+  }
+  if (reply.opcode != RFS_OP_OK) {
+    printf("\nServer error: %s\n", buffer);
+    return -1;
+  }
+  job->done = job->len;
+  return 0;
+}
+
+// Fetch the rest of one range with GET_RANGE into the local file
+// socket_desc - connected socket to the server
+// queue - transfer the range belongs to, a total of -1 is learnt from the
+//         reply and the range clipped to the file
+// job - range of the remote file, continued from job->done
+// Returns 0 on success, -1 on error, TRANSFER_LOST if the connection broke
+int recv_range_request(int socket_desc, range_queue_t* queue,
+                       range_job_t* job) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+
+  size_t len = rfs_build_request((unsigned char*)buffer, RFS_OP_GET_RANGE, 1,
+                                 queue->remote_path, 16);
+  rfs_put_u64((unsigned char*)buffer + len, job->offset + job->done);
+  rfs_put_u64((unsigned char*)buffer + len + 8, job->len - job->done);
+  if (send_all(socket_desc, buffer, len + 16) < 0 ||
+      recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("\nError: Connection lost during transfer\n");
+    return TRANSFER_LOST;
+  }
+  if (reply.opcode != RFS_OP_DATA) {
+    printf("\nServer error: %s\n", buffer);
+    return -1;
+  }
+
+  // Every range has to come from the same file
+  unsigned char total[8];
+  if (reply.payload_len < 8 ||
+      recv_all(socket_desc, total, sizeof(total)) < 0) {
+    printf("\nError: Connection lost during transfer\n");
+    return TRANSFER_LOST;
+  }
+  if (queue->total < 0) {
+    queue->total = rfs_get_u64(total);
+    job->len = job->done + reply.payload_len - 8;
+  }
+  if ((long)rfs_get_u64(total) != queue->total ||
+      (long)reply.payload_len - 8 != job->len - job->done) {
+    printf("\nError: File changed on the server during transfer\n");
+    return -1;
+  }
+
+  while (job->done < job->len) {
+    size_t to_recv = sizeof(buffer);
+    if (job->len - job->done < (long)to_recv) {
+      to_recv = job->len - job->done;
+    }
+
+    ssize_t n = recv(socket_desc, buffer, to_recv, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      printf("\nError: Connection lost during transfer\n");
+      return TRANSFER_LOST;
+    }
+    if (pwrite(queue->fd, buffer, n,
+               job->offset + job->done - queue->file_base) != n) {
+      printf("\nError: Cannot write local file\n");
+      return -1;
+    }
+    job->done += n;
+    progress_add(&queue->progress, n);
+  }
+  return 0;
+}
+
+// Cut offset..offset+len into jobs of at most job_size bytes
+// Returns 0, or -1 if out of memory
+int add_range_jobs(range_queue_t* queue, long offset, long len,
+                   long job_size) {
+  while (len > 0) {
+    if (queue->count == queue->capacity) {
+      int capacity = queue->capacity ? queue->capacity * 2 : 16;
+      range_job_t* grown = realloc(queue->jobs, capacity * sizeof(range_job_t));
+      if (grown == NULL) {
+        return -1;
+      }
+      queue->jobs = grown;
+      queue->capacity = capacity;
+    }
+
+    range_job_t* job = &queue->jobs[queue->count++];
+    job->offset = offset;
+    job->len = len < job_size ? len : job_size;
+    job->done = 0;
+    offset += job->len;
+    len -= job->len;
+  }
+  return 0;
+}
+
+// Size of the jobs a transfer of len bytes is cut into
+// Several jobs per stream, so a stream that finishes early takes over
+// work from the slow ones.
+long range_job_size(long len) {
+  if (streams <= 1) {
+    return LONG_MAX;
+  }
+  long size = len / (streams * 4);
+  if (size < PARALLEL_MIN_RANGE) {
+    size = PARALLEL_MIN_RANGE;
+  }
+  if (size > PARALLEL_MAX_RANGE) {
+    size = PARALLEL_MAX_RANGE;
+  }
+  return size;
+}
+
+// Take the next job nobody has started, NULL once they are all taken or
+// a stream has failed
+range_job_t* take_range_job(range_queue_t* queue) {
+  range_job_t* job = NULL;
+
+  pthread_mutex_lock(&queue->mutex);
+  if (queue->result == 0 && queue->next < queue->count) {
+    job = &queue->jobs[queue->next++];
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return job;
+}
+
+// Run jobs from the queue on one connection until there are none left
+// With -R a broken connection is reopened and the job carries on.
+// socket_desc - connected socket, or -1 to open one
+// Returns 0, or the result of the job that failed
+int run_range_jobs(range_queue_t* queue, int socket_desc) {
+  int own_socket = socket_desc < 0;
+  range_job_t* job;
+  int result = 0;
+
+  while (result == 0 && (job = take_range_job(queue)) != NULL) {
+    for (int attempt = 0;; attempt++) {
+      if (socket_desc < 0) {
+        socket_desc = connect_to_server(queue->host, queue->port);
+        own_socket = 1;
+      }
+      result = TRANSFER_LOST;
+      if (socket_desc >= 0) {
+        result = (queue->opcode == RFS_OP_WRITE_RANGE)
+                     ? send_range_request(socket_desc, queue, job)
+                     : recv_range_request(socket_desc, queue, job);
+      }
+      if (result != TRANSFER_LOST || !use_resume ||
+          attempt == RESUME_RETRIES) {
+        break;
+      }
+
+      // Start over on a fresh connection
+      if (own_socket && socket_desc >= 0) {
+        close(socket_desc);
+      }
+      socket_desc = -1;
+      sleep(1);
+    }
+  }
+
+  if (own_socket && socket_desc >= 0) {
+    close(socket_desc);
+  }
+
+  if (result != 0) {
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->result == 0) {
+      queue->result = result;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+  }
+  return result;
+}
+
+// Stream thread of a parallel transfer, on its own connection
+// arg - range_queue_t shared by all streams
+void* range_stream(void* arg) {
+  run_range_jobs(arg, -1);
+  return NULL;
+}
+
+// Run every job of the queue, over -j connections in parallel or on
+// socket_desc alone
+// Returns 0, or the result of the first job that failed
+int run_range_queue(range_queue_t* queue, int socket_desc) {
+  pthread_t threads[MAX_STREAMS];
+  int started = 0;
+
+  if (streams <= 1) {
+    return run_range_jobs(queue, socket_desc);
+  }
+
+  printf("Transferring over %d streams...\n", streams);
+  for (int i = 0; i < streams; i++) {
+    if (pthread_create(&threads[i], NULL, range_stream, queue) != 0) {
+      break;
+    }
+    started++;
+  }
+  if (started == 0) {
+    return run_range_jobs(queue, socket_desc);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return queue->result;
+}
+
+// Set up an empty queue for a transfer of remote_path
+void init_range_queue(range_queue_t* queue, const char* host, int port,
+                      int opcode, const char* remote_path, int fd) {
+  memset(queue, 0, sizeof(*queue));
+  queue->host = host;
+  queue->port = port;
+  queue->opcode = opcode;
+  queue->remote_path = remote_path;
+  queue->fd = fd;
+  pthread_mutex_init(&queue->mutex, NULL);
+  pthread_mutex_init(&queue->progress.mutex, NULL);
+}
+
+// Free what a queue holds
+void free_range_queue(range_queue_t* queue) {
+  free(queue->jobs);
+  pthread_mutex_destroy(&queue->mutex);
+  pthread_mutex_destroy(&queue->progress.mutex);
+}
+
+// Upload a file through a resumable session
+// The server says which ranges it already has, only the gaps are sent
+// (split across -j connections), then COMMIT turns the session into the
+// file.
+// socket_desc - connected socket to the server
+// local_path - path to local file to send
+// remote_path - path to save the file on the server
+// Returns 0, -1 on error, or TRANSFER_LOST if trying again may finish it
+int do_resumable_write(int socket_desc, const char* local_path,
+                       const char* remote_path) {
+  char buffer[BUFFER_SIZE];
+  unsigned char token[UPLOAD_TOKEN_SIZE];
+  rfs_header_t reply;
+  range_queue_t queue;
+  struct stat st;
+  int result = -1;
+
+  int fd = open(local_path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("Error: Cannot open local file '%s'\n", local_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  upload_token(local_path, remote_path, &st, token);
+
+  // Open the session, the reply lists the ranges already on the server
+  size_t len = rfs_build_request((unsigned char*)buffer, RFS_OP_UPLOAD, 1,
+                                 remote_path, UPLOAD_HEADER_SIZE);
+  memcpy(buffer + len, token, UPLOAD_TOKEN_SIZE);
+  rfs_put_u64((unsigned char*)buffer + len + UPLOAD_TOKEN_SIZE, st.st_size);
+  if (send_all(socket_desc, buffer, len + UPLOAD_HEADER_SIZE) < 0 ||
+      recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("Error: No response from server\n");
+    close(fd);
+    return TRANSFER_LOST;
+  }
+  if (reply.opcode != RFS_OP_DATA) {
+    printf("Server error: %s\n", buffer);
+    close(fd);
+    return -1;
+  }
+
+  unsigned char* ranges = malloc(reply.payload_len + 1);
+  if (ranges == NULL || reply.payload_len < 12 ||
+      recv_all(socket_desc, ranges, reply.payload_len) < 0) {
+    printf("Error: Bad reply from server\n");
+    free(ranges);
+    close(fd);
+    return TRANSFER_LOST;
+  }
+  uint32_t count = rfs_get_u32(ranges + 8);
+  if (reply.payload_len < 12 + (uint64_t)count * 16) {
+    count = 0;
+  }
+
+  init_range_queue(&queue, current_host, current_port, RFS_OP_WRITE_RANGE,
+                   remote_path, fd);
+  queue.token = token;
+  queue.progress.total = st.st_size;
+
+  long have = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    have += rfs_get_u64(ranges + 20 + i * 16);
+  }
+  if (have > 0) {
+    printf("Resuming upload: %ld of %ld bytes already on the server\n", have,
+           (long)st.st_size);
+  }
+  queue.progress.done = have;
+
+  // Queue every gap between the ranges the server has
+  long job_size = range_job_size(st.st_size - have);
+  long pos = 0;
+  for (uint32_t i = 0; i <= count; i++) {
+    long next = (i < count) ? (long)rfs_get_u64(ranges + 12 + i * 16)
+                            : st.st_size;
+    if (pos < next && add_range_jobs(&queue, pos, next - pos, job_size) != 0) {
+      printf("Error: Out of memory\n");
+      goto out;
+    }
+    if (next > pos) {
+      pos = next;
+    }
+    if (i < count && next + (long)rfs_get_u64(ranges + 20 + i * 16) > pos) {
+      pos = next + rfs_get_u64(ranges + 20 + i * 16);
+    }
+  }
+
+  printf("Transferring...\n");
+  result = run_range_queue(&queue, socket_desc);
+  printf("\n");
+  if (result != 0) {
+    goto out;
+  }
+
+  len = rfs_build_request((unsigned char*)buffer, RFS_OP_COMMIT, 1,
+                          remote_path, UPLOAD_TOKEN_SIZE);
+  memcpy(buffer + len, token, UPLOAD_TOKEN_SIZE);
+  if (send_all(socket_desc, buffer, len + UPLOAD_TOKEN_SIZE) < 0 ||
+      recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("Error: No response from server\n");
+    result = TRANSFER_LOST;
+    goto out;
+  }
+  printf("Server response: %s\n", buffer);
+  result = (reply.opcode == RFS_OP_OK) ? 0 : -1;
+
+out:
+  free_range_queue(&queue);
+  free(ranges);
+  close(fd);
+  return result;
+}
+
+// Fetch a range of a file over -j connections in parallel
+// The first piece comes over socket_desc and tells the size of the file,
+// the rest is cut into jobs that the streams write into the local file
+// at their offsets. If the transfer fails the local file is cut back to
+// the part that arrived without gaps, so -R can continue it.
+// socket_desc - connected socket to the server
+// remote_path - path to file on the server
+// local_path - path to save the file locally
+// offset/length - range of the remote file, length 0 to the end
+// have - bytes of the range already in the local file
+// Returns 0, -1 on error, or TRANSFER_LOST
+int do_parallel_get(int socket_desc, const char* remote_path,
+                    const char* local_path, long offset, long length,
+                    long have) {
+  char dir_path[MAX_PATH];
+  range_queue_t queue;
+
+  get_directory_path(local_path, dir_path);
+  if (strlen(dir_path) > 0 && create_directories(dir_path) != 0) {
+    printf("Error: Cannot create local directory '%s'\n", dir_path);
+    return -1;
+  }
+  int fd = open(local_path, O_WRONLY | O_CREAT | (have > 0 ? 0 : O_TRUNC),
+                0644);
+  if (fd < 0) {
+    printf("Error: Cannot create local file '%s'\n", local_path);
+    return -1;
+  }
+
+  init_range_queue(&queue, current_host, current_port, RFS_OP_GET_RANGE,
+                   remote_path, fd);
+  queue.file_base = offset - have;
+  queue.total = -1;
+
+  // The first piece comes back with the size of the file
+  range_job_t first = {offset, PARALLEL_MIN_RANGE, 0};
+  if (length > 0 && length < first.len) {
+    first.len = length;
+  }
+  int result = recv_range_request(socket_desc, &queue, &first);
+  if (result != 0) {
+    goto out;
+  }
+
+  long end = queue.total;
+  if (length > 0 && offset + length < end) {
+    end = offset + length;
+  }
+  printf("File size: %ld bytes, receiving %ld from offset %ld\n",
+         queue.total, end - offset, offset);
+  queue.progress.total = end - offset;
+
+  if (add_range_jobs(&queue, first.offset + first.len,
+                     end - first.offset - first.len,
+                     range_job_size(end - offset)) != 0) {
+    printf("Error: Out of memory\n");
+    result = -1;
+    goto out;
+  }
+  result = run_range_queue(&queue, socket_desc);
+  printf("\n");
+  if (result == 0) {
+    printf("File saved successfully: %s\n", local_path);
+  }
+
+out:
+  if (result != 0) {
+    // Keep only what arrived without a gap
+    long contiguous = first.done;
+    for (int i = 0; i < queue.count && first.done == first.len; i++) {
+      contiguous += queue.jobs[i].done;
+      if (queue.jobs[i].done < queue.jobs[i].len) {
+        break;
+      }
+    }
+    if (ftruncate(fd, have + contiguous) != 0) {
+      printf("Error: Cannot truncate local file '%s'\n", local_path);
+    }
+  }
+  free_range_queue(&queue);
+  close(fd);
+  return result;
+}
+//  Execute WRITE command ,send a local file to the server
+// socket_desc - connected socket to the server
+// local_path - path to local file to send
+// remote_path - path to save the file on the server
+int do_write(int socket_desc, const char* local_path, const char* remote_path) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+  FILE* fp;
+  long file_size;
+
+  if (strlen(remote_path) >= MAX_PATH) {
+    printf("Error: Remote path too long\n");
+    return -1;
+  }
+
+  // Check if local file exists and get its size
+  file_size = get_file_size(local_path);
+  if (file_size < 0) {
+    printf("Error: Cannot access local file '%s'\n", local_path);
+    return -1;
+  }
+
+  // Open local file for reading
+  fp = fopen(local_path, "rb");
+  if (fp == NULL) {
+    printf("Error: Cannot open local file '%s'\n", local_path);
+    return -1;
+  }
+
+  printf("Sending file: %s (%ld bytes)\n", local_path, file_size);
+  printf("Remote path: %s\n", remote_path);
+
+  if (use_resume || streams > 1) {
+    fclose(fp);
+    return do_resumable_write(socket_desc, local_path, remote_path);
+  }
+
+  // Try sending only what changed first
+  if (use_delta) {
+    int delta_result = do_delta_write(socket_desc, local_path, remote_path);
+    if (delta_result != DELTA_FALLBACK) {
+      fclose(fp);
+      return delta_result;
+    }
+  }
+
+  // With -z the compressed stream goes out instead, if it is smaller
+  int flags = use_checksum ? RFS_FLAG_CHECKSUM : 0;
+  if (use_compress && file_size > 0) {
+    long stream_size;
+    FILE* stream = compress_local_file(fp, file_size, &stream_size);
+    if (stream != NULL) {
+      fclose(fp);
+      fp = stream;
+      file_size = stream_size;
+      flags = RFS_FLAG_COMPRESS;  // checksums only cover plain WRITEs
+    }
+  }
+
+  printf("Transferring...\n");
+  int result = send_write_request(socket_desc, 1, fp, file_size, remote_path,
+                                  flags, 1);
+  fclose(fp);
+  if (result < 0) {
+    return -1;
+  }
+
+  // Receive final response
+  if (recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) == 0) {
+    printf("Server response: %s\n", buffer);
+    if (reply.opcode == RFS_OP_OK) {
+      return 0;
+    }
+    if (reply.opcode == RFS_OP_BUSY) {
+      return SERVER_BUSY;
+    }
+  }
+
+  return -1;
+}
+
+// Execute GET command , retrieve a file from the server
+// With -o/-l only that range is fetched; with -R whatever the local file
+// already holds is kept and only the rest is fetched and appended.
+// socket_desc - connected socket to the server
+// remote_path - path to file on the server
+// local_path - path to save the file locally
+// Returns 0, -1 on error, or TRANSFER_LOST if trying again may finish it
+int do_get(int socket_desc, const char* remote_path, const char* local_path) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+  long file_size;
+  long offset = get_offset;
+  long length = get_length;
+  size_t len;
+  int ranged;
+
+  if (strlen(remote_path) >= MAX_PATH) {
+    printf("Error: Remote path too long\n");
+    return -1;
+  }
+
+  printf("Requesting file: %s\n", remote_path);
+  printf("Local path: %s\n", local_path);
+
+  long have = use_resume ? get_file_size(local_path) : 0;
+  if (have > 0) {
+    if (length > 0 && have >= length) {
+      printf("File already complete: %s\n", local_path);
+      return 0;
+    }
+    printf("Resuming download after %ld bytes\n", have);
+    offset += have;
+    if (length > 0) {
+      length -= have;
+    }
+  } else {
+    have = 0;
+  }
+
+  if (streams > 1) {
+    return do_parallel_get(socket_desc, remote_path, local_path, offset,
+                           length, have);
+  }
+
+  // Send GET request with remote path, a range goes as GET_RANGE
+  ranged = offset > 0 || length > 0 || use_resume;
+  if (ranged) {
+    len = rfs_build_request((unsigned char*)buffer, RFS_OP_GET_RANGE, 1,
+                            remote_path, 16);
+    rfs_put_u64((unsigned char*)buffer + len, offset);
+    rfs_put_u64((unsigned char*)buffer + len + 8, length);
+    len += 16;
+  } else {
+    len = rfs_build_request((unsigned char*)buffer, RFS_OP_GET, 1, remote_path,
+                            0);
+    // Only asks, the server decides whether the reply is compressed and
+    // whether it has a checksum to send
+    rfs_set_flags((unsigned char*)buffer,
+                  (use_compress ? RFS_FLAG_COMPRESS : 0) |
+                      (use_checksum ? RFS_FLAG_CHECKSUM : 0));
+  }
+  if (send_all(socket_desc, buffer, len) < 0) {
+    printf("Error: Unable to send command\n");
+    return -1;
+  }
+
+  // Receive DATA header or error
+  if (recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("Error: No response from server\n");
+    return -1;
+  }
+
+  // Check for error
+  if (reply.opcode == RFS_OP_ERROR) {
+    printf("Server error: %s\n", buffer);
+    return -1;
+  }
+  if (reply.opcode == RFS_OP_BUSY) {
+    printf("Server response: %s\n", buffer);
+    return SERVER_BUSY;
+  }
+
+  if (reply.opcode != RFS_OP_DATA) {
+    printf("Error: Unexpected response: %s\n", rfs_opcode_name(reply.opcode));
+    return -1;
+  }
+
+  file_size = reply.payload_len;
+  if (ranged) {
+    // A range reply starts with the size of the whole file
+    unsigned char total[8];
+    if (file_size < 8 || recv_all(socket_desc, total, sizeof(total)) < 0) {
+      printf("Error: Connection lost during transfer\n");
+      return TRANSFER_LOST;
+    }
+    file_size -= 8;
+    printf("File size: %ld bytes, receiving %ld from offset %ld\n",
+           (long)rfs_get_u64(total), file_size, offset);
+  } else if (reply.flags & RFS_FLAG_COMPRESS) {
+    printf("File size: %ld bytes compressed\n", file_size);
+  } else if (reply.flags & RFS_FLAG_CHECKSUM) {
+    printf("File size: %ld bytes, with a checksum\n",
+           file_size - CHECKSUM_SIZE);
+  } else {
+    printf("File size: %ld bytes\n", file_size);
+  }
+
+  printf("Receiving...\n");
+  int result;
+  if (reply.flags & RFS_FLAG_COMPRESS) {
+    result = recv_compressed_payload(socket_desc, local_path, file_size, 1);
+  } else {
+    result = recv_file_payload(socket_desc, local_path, file_size,
+                               reply.flags & RFS_FLAG_CHECKSUM, have > 0, 1);
+  }
+  if (result == -1) {
+    return TRANSFER_LOST;
+  }
+  if (result != 0) {
+    return -1;
+  }
+
+  printf("File saved successfully: %s\n", local_path);
+  return 0;
+}
+
+//  Execute RM command - delete a file or directory on the server
+// socket_desc - connected socket to the server
+// remote_path - path to file or directory to delete
+// flags - RFS_FLAG_LOCAL to delete a cluster node's own copy
+int do_rm(int socket_desc, const char* remote_path, int flags) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+
+  if (strlen(remote_path) >= MAX_PATH) {
+    printf("Error: Remote path too long\n");
+    return -1;
+  }
+
+  printf("Deleting: %s\n", remote_path);
+
+  size_t len =
+      rfs_build_request((unsigned char*)buffer, RFS_OP_RM, 1, remote_path, 0);
+  rfs_set_flags((unsigned char*)buffer, flags);
+  if (send_all(socket_desc, buffer, len) < 0) {
+    printf("Error: Unable to send command\n");
+    return -1;
+  }
+
+  // Receive response
+  if (recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("Error: No response from server\n");
+    return -1;
+  }
+
+  printf("Server response: %s\n", buffer);
+
+  if (reply.opcode == RFS_OP_OK) {
+    return 0;
+  }
+
+  return -1;
+}
+
+//  Execute STOP command
+// socket_desc - connected socket to the server
+int do_stop(int socket_desc) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+
+  printf("Sending STOP command to server...\n");
+
+  // Send STOP command
+  size_t len =
+      rfs_build_request((unsigned char*)buffer, RFS_OP_STOP, 1, "", 0);
+  if (send_all(socket_desc, buffer, len) < 0) {
+    printf("Error: Unable to send command\n");
+    return -1;
+  }
+
+  // Receive response
+  if (recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) == 0) {
+    printf("Server response: %s\n", buffer);
+  }
+
+  return 0;
+}
+
+// Execute STATS command, print the server's metrics
+// socket_desc - connected socket to the server
+int do_stats(int socket_desc) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+
+  size_t len =
+      rfs_build_request((unsigned char*)buffer, RFS_OP_STATS, 1, "", 0);
+  if (send_all(socket_desc, buffer, len) < 0) {
+    printf("Error: Unable to send command\n");
+    return -1;
+  }
+
+  if (recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0) {
+    printf("Error: No response from server\n");
+    return -1;
+  }
+  if (reply.opcode != RFS_OP_DATA) {
+    printf("Server error: %s\n", buffer);
+    return -1;
+  }
+
+  for (uint64_t left = reply.payload_len; left > 0;) {
+    size_t want = left < sizeof(buffer) ? left : sizeof(buffer);
+    if (recv_all(socket_desc, buffer, want) < 0) {
+      printf("Error: Connection lost during transfer\n");
+      return -1;
+    }
+    fwrite(buffer, 1, want, stdout);
+    left -= want;
+  }
+  return 0;
+}
+
+// Default local path for a GET, the last component of the remote path
+// remote_path - path on the server
+// local_path - output buffer of MAX_PATH bytes
+void default_local_path(const char* remote_path, char* local_path) {
+  const char* filename = strrchr(remote_path, '/');
+  if (filename != NULL) {
+    filename++;
+  } else {
+    filename = remote_path;
+  }
+  snprintf(local_path, MAX_PATH, "%s", filename);
+}
+
+// Add a command to a growing array of batch commands
+// cmds/count/capacity - the array, its length and allocated size
+// Returns 0, or -1 if out of memory
+int append_batch_cmd(batch_cmd_t** cmds, int* count, int* capacity,
+                     const batch_cmd_t* cmd) {
+  if (*count == *capacity) {
+    int grown_capacity = *capacity ? *capacity * 2 : 64;
+    batch_cmd_t* grown = realloc(*cmds, grown_capacity * sizeof(batch_cmd_t));
+    if (grown == NULL) {
+      printf("Error: Out of memory\n");
+      return -1;
+    }
+    *cmds = grown;
+    *capacity = grown_capacity;
+  }
+  (*cmds)[(*count)++] = *cmd;
+  return 0;
+}
+
+// Read batch commands, one "WRITE local [remote]", "GET remote [local]"
+// or "RM remote" per line. Blank lines and lines starting with # are
+// skipped.
+// fp - open batch file
+// count - output number of commands, -1 on error
+// Returns a malloc'd array of commands (NULL if there are none)
+batch_cmd_t* load_batch(FILE* fp, int* count) {
+  char line[3 * MAX_PATH];
+  char command[16];
+  char first[MAX_PATH];
+  char second[MAX_PATH];
+  batch_cmd_t* cmds = NULL;
+  int capacity = 0;
+  int line_no = 0;
+
+  *count = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line_no++;
+
+    int fields = sscanf(line, "%15s %511s %511s", command, first, second);
+    if (fields < 1 || command[0] == '#') {
+      continue;
+    }
+
+    batch_cmd_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+
+    if (strcmp(command, "WRITE") == 0 && fields >= 2) {
+      cmd.opcode = RFS_OP_WRITE;
+      snprintf(cmd.local_path, MAX_PATH, "%s", first);
+      snprintf(cmd.remote_path, MAX_PATH, "%s", fields == 3 ? second : first);
+    } else if (strcmp(command, "GET") == 0 && fields >= 2) {
+      cmd.opcode = RFS_OP_GET;
+      snprintf(cmd.remote_path, MAX_PATH, "%s", first);
+      if (fields == 3) {
+        snprintf(cmd.local_path, MAX_PATH, "%s", second);
+      } else {
+        default_local_path(first, cmd.local_path);
+      }
+    } else if (strcmp(command, "RM") == 0 && fields >= 2) {
+      cmd.opcode = RFS_OP_RM;
+      snprintf(cmd.remote_path, MAX_PATH, "%s", first);
+    } else {
+      printf("Error: Invalid batch command on line %d\n", line_no);
+      free(cmds);
+      *count = -1;
+      return NULL;
+    }
+
+    if (append_batch_cmd(&cmds, count, &capacity, &cmd) != 0) {
+      free(cmds);
+      *count = -1;
+      return NULL;
+    }
+  }
+
+  return cmds;
+}
+
+// Batch sender thread, pipelines every request without waiting for replies
+// arg - batch_t shared with the receiving side
+void* batch_sender(void* arg) {
+  batch_t* batch = arg;
+  char buffer[RFS_HEADER_SIZE + MAX_PATH];
+
+  for (int i = 0; i < batch->count; i++) {
+    batch_cmd_t* cmd = &batch->cmds[i];
+    uint32_t request_id = i + 1;
+
+    // Keep a bounded number of requests in flight
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->sent - batch->done >= MAX_PIPELINE && !batch->failed) {
+      pthread_cond_wait(&batch->cond, &batch->mutex);
+    }
+    int failed = batch->failed;
+    pthread_mutex_unlock(&batch->mutex);
+    if (failed) {
+      break;
+    }
+
+    FILE* fp = NULL;
+    long file_size = 0;
+
+    if (cmd->opcode == RFS_OP_WRITE) {
+      file_size = get_file_size(cmd->local_path);
+      fp = (file_size >= 0) ? fopen(cmd->local_path, "rb") : NULL;
+      if (fp == NULL) {
+        printf("[%u] WRITE %s: Error: Cannot open local file '%s'\n",
+               request_id, cmd->remote_path, cmd->local_path);
+        cmd->status = -1;
+        continue;
+      }
+    }
+
+    pthread_mutex_lock(&batch->mutex);
+    batch->sent++;
+    pthread_cond_broadcast(&batch->cond);
+    pthread_mutex_unlock(&batch->mutex);
+
+    int result;
+    if (cmd->opcode == RFS_OP_WRITE) {
+      result = send_write_request(batch->socket_desc, request_id, fp,
+                                  file_size, cmd->remote_path,
+                                  use_checksum ? RFS_FLAG_CHECKSUM : 0, 0);
+      fclose(fp);
+    } else {
+      size_t len = rfs_build_request((unsigned char*)buffer, cmd->opcode,
+                                     request_id, cmd->remote_path, 0);
+      if (use_checksum && cmd->opcode == RFS_OP_GET) {
+        rfs_set_flags((unsigned char*)buffer, RFS_FLAG_CHECKSUM);
+      }
+      result = send_all(batch->socket_desc, buffer, len);
+    }
+
+    if (result < 0) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&batch->mutex);
+  batch->sender_finished = 1;
+  pthread_cond_broadcast(&batch->cond);
+  pthread_mutex_unlock(&batch->mutex);
+
+  return NULL;
+}
+
+// Run commands over one connection, pipelined
+// Requests are sent by a separate thread while this one reads the replies
+// and matches them to their commands by request id.
+// socket_desc - connected socket to the server
+// cmds/count - commands to run, freed here
+int run_batch(int socket_desc, batch_cmd_t* cmds, int count) {
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+  batch_t batch;
+  pthread_t sender;
+
+  printf("Running %d commands in one session...\n", count);
+
+  memset(&batch, 0, sizeof(batch));
+  batch.socket_desc = socket_desc;
+  batch.cmds = cmds;
+  batch.count = count;
+  pthread_mutex_init(&batch.mutex, NULL);
+  pthread_cond_init(&batch.cond, NULL);
+
+  if (pthread_create(&sender, NULL, batch_sender, &batch) != 0) {
+    printf("Error: Unable to start sender thread\n");
+    free(cmds);
+    return -1;
+  }
+
+  while (1) {
+    // Wait until a reply is due or everything has been answered
+    pthread_mutex_lock(&batch.mutex);
+    while (!batch.sender_finished && batch.done == batch.sent) {
+      pthread_cond_wait(&batch.cond, &batch.mutex);
+    }
+    int finished = batch.sender_finished && batch.done == batch.sent;
+    pthread_mutex_unlock(&batch.mutex);
+    if (finished) {
+      break;
+    }
+
+    if (recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) < 0 ||
+        reply.request_id < 1 || reply.request_id > (uint32_t)count) {
+      printf("Error: Connection lost during batch\n");
+      break;
+    }
+
+    batch_cmd_t* cmd = &cmds[reply.request_id - 1];
+    const char* name = rfs_opcode_name(cmd->opcode);
+
+    if (reply.opcode == RFS_OP_DATA) {
+      int result = recv_file_payload(socket_desc, cmd->local_path,
+                                     reply.payload_len,
+                                     reply.flags & RFS_FLAG_CHECKSUM, 0, 0);
+      if (result == -1) {
+        break;
+      }
+      cmd->status = (result == 0) ? 1 : -1;
+      if (result == 0) {
+        printf("[%u] GET %s: saved to %s (%lu bytes)\n", reply.request_id,
+               cmd->remote_path, cmd->local_path,
+               (unsigned long)reply.payload_len -
+                   (reply.flags & RFS_FLAG_CHECKSUM ? CHECKSUM_SIZE : 0));
+      }
+    } else {
+      cmd->status = (reply.opcode == RFS_OP_OK) ? 1 : -1;
+      printf("[%u] %s %s: %s\n", reply.request_id, name, cmd->remote_path,
+             buffer);
+    }
+
+    pthread_mutex_lock(&batch.mutex);
+    batch.done++;
+    pthread_cond_broadcast(&batch.cond);
+    pthread_mutex_unlock(&batch.mutex);
+  }
+
+  // Unblock the sender if the connection went away under it
+  pthread_mutex_lock(&batch.mutex);
+  batch.failed = 1;
+  pthread_cond_broadcast(&batch.cond);
+  pthread_mutex_unlock(&batch.mutex);
+  shutdown(socket_desc, SHUT_RDWR);
+  pthread_join(sender, NULL);
+
+  int succeeded = 0;
+  for (int i = 0; i < count; i++) {
+    if (cmds[i].status == 1) {
+      succeeded++;
+    }
+  }
+  printf("Batch complete: %d succeeded, %d failed\n", succeeded,
+         count - succeeded);
+
+  free(cmds);
+  pthread_mutex_destroy(&batch.mutex);
+  pthread_cond_destroy(&batch.cond);
+  return (succeeded == count) ? 0 : -1;
+}
+
+// Run commands, split between the nodes that own their paths
+// Each node gets its own pipelined session; for a single server this is
+// run_batch() on socket_desc.
+// socket_desc - connected socket to the server
+// cmds/count - commands to run, freed here
+int run_routed_batch(int socket_desc, batch_cmd_t* cmds, int count) {
+  char node_host[RING_ADDR_MAX];
+  int node_port;
+  int result = 0;
+
+  if (cluster_ring == NULL) {
+    return run_batch(socket_desc, cmds, count);
+  }
+
+  for (int n = 0; n < cluster_ring->count; n++) {
+    batch_cmd_t* part = NULL;
+    int part_count = 0;
+    int capacity = 0;
+
+    for (int i = 0; i < count; i++) {
+      if (ring_owner(cluster_ring, cmds[i].remote_path) == n &&
+          append_batch_cmd(&part, &part_count, &capacity, &cmds[i]) != 0) {
+        result = -1;
+      }
+    }
+    if (part_count == 0) {
+      free(part);
+      continue;
+    }
+
+    ring_split_addr(cluster_ring->nodes[n], node_host, &node_port);
+    int node_socket = connect_to_server(node_host, node_port);
+    if (node_socket < 0) {
+      printf("Error: %d commands for %s not run\n", part_count,
+             cluster_ring->nodes[n]);
+      free(part);
+      result = -1;
+      continue;
+    }
+    if (run_batch(node_socket, part, part_count) != 0) {
+      result = -1;
+    }
+    close(node_socket);
+  }
+
+  free(cmds);
+  return result;
+}
+
+// Execute a batch of commands from a file over one connection
+// socket_desc - connected socket to the server
+// batch_path - file of commands, or "-" for stdin
+int do_batch(int socket_desc, const char* batch_path) {
+  int count;
+
+  FILE* fp = (strcmp(batch_path, "-") == 0) ? stdin : fopen(batch_path, "r");
+  if (fp == NULL) {
+    printf("Error: Cannot open batch file '%s'\n", batch_path);
+    return -1;
+  }
+
+  batch_cmd_t* cmds = load_batch(fp, &count);
+  if (fp != stdin) {
+    fclose(fp);
+  }
+  if (count < 0) {
+    return -1;
+  }
+  return run_routed_batch(socket_desc, cmds, count);
+}
+
+// Queue a WRITE for every file under a local directory
+// local_dir - directory to walk
+// remote_dir - where its contents go on the server
+// cmds/count/capacity - growing array of commands
+// Returns 0, or -1 on error
+int collect_local_tree(const char* local_dir, const char* remote_dir,
+                       batch_cmd_t** cmds, int* count, int* capacity) {
+  char local_path[MAX_PATH];
+  char remote_path[MAX_PATH];
+  struct dirent* entry;
+  struct stat st;
+  int result = 0;
+
+  DIR* dir = opendir(local_dir);
+  if (dir == NULL) {
+    printf("Error: Cannot read local directory '%s'\n", local_dir);
+    return -1;
+  }
+
+  while (result == 0 && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (snprintf(local_path, MAX_PATH, "%s/%s", local_dir, entry->d_name) >=
+            MAX_PATH ||
+        snprintf(remote_path, MAX_PATH, "%s/%s", remote_dir, entry->d_name) >=
+            MAX_PATH) {
+      printf("Error: Path too long under '%s'\n", local_dir);
+      continue;
+    }
+    if (stat(local_path, &st) != 0) {
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      result = collect_local_tree(local_path, remote_path, cmds, count,
+                                  capacity);
+    } else if (S_ISREG(st.st_mode)) {
+      batch_cmd_t cmd;
+      memset(&cmd, 0, sizeof(cmd));
+      cmd.opcode = RFS_OP_WRITE;
+      snprintf(cmd.local_path, MAX_PATH, "%s", local_path);
+      snprintf(cmd.remote_path, MAX_PATH, "%s", remote_path);
+      result = append_batch_cmd(cmds, count, capacity, &cmd);
+    }
+  }
+
+  closedir(dir);
+  return result;
+}
+
+// Execute WRITE -r, upload a directory tree over one connection (one per
+// node in a cluster)
+// socket_desc - connected socket to the server
+// local_dir - directory to upload
+// remote_dir - path of the directory on the server
+int do_write_tree(int socket_desc, const char* local_dir,
+                  const char* remote_dir) {
+  batch_cmd_t* cmds = NULL;
+  int count = 0;
+  int capacity = 0;
+
+  if (collect_local_tree(local_dir, remote_dir, &cmds, &count, &capacity) !=
+      0) {
+    free(cmds);
+    return -1;
+  }
+  return run_routed_batch(socket_desc, cmds, count);
+}
+
+// Send a LIST and hand every entry of the reply to a callback
+// The entries arrive in DATA frames until an OK ends the listing.
+// socket_desc - connected socket to the server
+// remote_dir - directory to list, "" for the root
+// flags - RFS_FLAG_RECURSIVE for the whole tree
+// callback - called with type, size, mtime and relative name of an entry
+// arg - passed through to the callback
+int list_remote(int socket_desc, const char* remote_dir, int flags,
+                int (*callback)(int type, long size, long mtime,
+                                const char* name, void* arg),
+                void* arg) {
+  unsigned char buffer[BUFFER_SIZE];
+  char name[MAX_PATH];
+  rfs_header_t reply;
+  int result = 0;
+
+  size_t len = rfs_build_request(buffer, RFS_OP_LIST, 1, remote_dir, 0);
+  rfs_set_flags(buffer, flags);
+  if (send_all(socket_desc, buffer, len) < 0) {
+    printf("Error: Unable to send command\n");
+    return -1;
+  }
+
+  while (1) {
+    if (recv_reply(socket_desc, &reply, (char*)buffer, sizeof(buffer)) < 0) {
+      printf("Error: Connection lost during listing\n");
+      return -1;
+    }
+    if (reply.opcode == RFS_OP_OK) {
+      return result;
+    }
+    if (reply.opcode != RFS_OP_DATA) {
+      printf("Server error: %s\n", buffer);
+      return -1;
+    }
+    if (reply.payload_len > sizeof(buffer) ||
+        recv_all(socket_desc, buffer, reply.payload_len) < 0) {
+      printf("Error: Bad listing from server\n");
+      return -1;
+    }
+
+    // Entries never span frames
+    size_t pos = 0;
+    while (pos + RFS_ENTRY_HEADER_SIZE <= reply.payload_len) {
+      unsigned char* entry = buffer + pos;
+      size_t name_len = (entry[17] << 8) | entry[18];
+      if (name_len >= MAX_PATH ||
+          pos + RFS_ENTRY_HEADER_SIZE + name_len > reply.payload_len) {
+        printf("Error: Bad listing from server\n");
+        return -1;
+      }
+      memcpy(name, entry + RFS_ENTRY_HEADER_SIZE, name_len);
+      name[name_len] = '\0';
+      if (callback(entry[0], rfs_get_u64(entry + 1), rfs_get_u64(entry + 9),
+                   name, arg) != 0) {
+        result = -1;
+      }
+      pos += RFS_ENTRY_HEADER_SIZE + name_len;
+    }
+  }
+}
+
+// Print one entry of a listing
+int print_entry(int type, long size, long mtime, const char* name,
+                void* arg) {
+  char when[32];
+  time_t t = mtime;
+
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+  if (type == RFS_ENTRY_DIR) {
+    printf("d %12s  %s  %s/\n", "-", when, name);
+  } else {
+    printf("%c %12ld  %s  %s\n", type, size, when, name);
+  }
+  return 0;
+}
+
+// An entry of a listing gathered from the nodes of a cluster
+typedef struct {
+  int type;
+  long size;
+  long mtime;
+  char* name;
+} list_entry_t;
+
+typedef struct {
+  list_entry_t* entries;
+  int count;
+  int capacity;
+} merged_list_t;
+
+// Keep an entry of one node's listing for merging
+int collect_entry(int type, long size, long mtime, const char* name,
+                  void* arg) {
+  merged_list_t* list = arg;
+
+  if (list->count == list->capacity) {
+    int grown_capacity = list->capacity ? list->capacity * 2 : 64;
+    list_entry_t* grown =
+        realloc(list->entries, grown_capacity * sizeof(list_entry_t));
+    if (grown == NULL) {
+      return -1;
+    }
+    list->entries = grown;
+    list->capacity = grown_capacity;
+  }
+  list_entry_t* entry = &list->entries[list->count];
+  entry->name = strdup(name);
+  if (entry->name == NULL) {
+    return -1;
+  }
+  entry->type = type;
+  entry->size = size;
+  entry->mtime = mtime;
+  list->count++;
+  return 0;
+}
+
+// By name, so a directory still comes before its contents
+int compare_entries(const void* a, const void* b) {
+  const list_entry_t* x = a;
+  const list_entry_t* y = b;
+  int order = strcmp(x->name, y->name);
+
+  return order != 0 ? order : x->type - y->type;
+}
+
+// LIST every node of the cluster and hand the merged entries to a callback
+// A directory exists on each node holding files under it and is passed
+// on once; nodes that don't have remote_dir at all don't count as errors
+// as long as one of them does.
+// remote_dir/flags/callback/arg - as for list_remote()
+int list_cluster(const char* remote_dir, int flags,
+                 int (*callback)(int type, long size, long mtime,
+                                 const char* name, void* arg),
+                 void* arg) {
+  char node_host[RING_ADDR_MAX];
+  int node_port;
+  merged_list_t list;
+  int listed = 0;
+  int result = 0;
+
+  memset(&list, 0, sizeof(list));
+  for (int n = 0; n < cluster_ring->count; n++) {
+    ring_split_addr(cluster_ring->nodes[n], node_host, &node_port);
+    int socket_desc = connect_to_server(node_host, node_port);
+    if (socket_desc < 0) {
+      result = -1;
+      continue;
+    }
+    if (list_remote(socket_desc, remote_dir, flags, collect_entry, &list) ==
+        0) {
+      listed++;
+    }
+    close(socket_desc);
+  }
+
+  qsort(list.entries, list.count, sizeof(list_entry_t), compare_entries);
+  for (int i = 0; i < list.count; i++) {
+    list_entry_t* entry = &list.entries[i];
+    if (i == 0 || compare_entries(entry, entry - 1) != 0) {
+      if (callback(entry->type, entry->size, entry->mtime, entry->name,
+                   arg) != 0) {
+        result = -1;
+      }
+    }
+  }
+  for (int i = 0; i < list.count; i++) {
+    free(list.entries[i].name);
+  }
+  free(list.entries);
+  return listed > 0 ? result : -1;
+}
+
+// Execute LIST command, print the entries of a remote directory
+// socket_desc - connected socket to the server
+// remote_dir - directory to list, "" for the root
+int do_list(int socket_desc, const char* remote_dir) {
+  int flags = recursive ? RFS_FLAG_RECURSIVE : 0;
+
+  if (cluster_ring != NULL) {
+    return list_cluster(remote_dir, flags, print_entry, NULL);
+  }
+  return list_remote(socket_desc, remote_dir, flags, print_entry, NULL);
+}
+
+// Execute RM on every node of the cluster
+// Each node removes its own copy, wherever the path belongs now, so a
+// directory goes from all of them. Succeeds if any node removed it.
+// remote_path - path to file or directory to delete
+int rm_cluster(const char* remote_path) {
+  char node_host[RING_ADDR_MAX];
+  int node_port;
+  int removed = 0;
+
+  for (int n = 0; n < cluster_ring->count; n++) {
+    ring_split_addr(cluster_ring->nodes[n], node_host, &node_port);
+    int socket_desc = connect_to_server(node_host, node_port);
+    if (socket_desc < 0) {
+      continue;
+    }
+    if (do_rm(socket_desc, remote_path, RFS_FLAG_LOCAL) == 0) {
+      removed++;
+    }
+    close(socket_desc);
+  }
+  printf("Removed from %d of %d nodes\n", removed, cluster_ring->count);
+  return removed > 0 ? 0 : -1;
+}
+
+// Where GET -r puts the files a listing names
+typedef struct {
+  const char* remote_dir;
+  const char* local_dir;
+  batch_cmd_t* cmds;
+  int count;
+  int capacity;
+} tree_get_t;
+
+// Queue a GET for a file of the listing, create its directories
+int add_tree_entry(int type, long size, long mtime, const char* name,
+                   void* arg) {
+  tree_get_t* tree = arg;
+  batch_cmd_t cmd;
+
+  memset(&cmd, 0, sizeof(cmd));
+  if (snprintf(cmd.local_path, MAX_PATH, "%s/%s", tree->local_dir, name) >=
+          MAX_PATH ||
+      snprintf(cmd.remote_path, MAX_PATH, "%s/%s", tree->remote_dir, name) >=
+          MAX_PATH) {
+    printf("Error: Path too long '%s'\n", name);
+    return -1;
+  }
+
+  if (type == RFS_ENTRY_DIR) {
+    return create_directories(cmd.local_path);
+  }
+  if (type != RFS_ENTRY_FILE) {
+    return 0;  // old versions stay on the server
+  }
+  cmd.opcode = RFS_OP_GET;
+  return append_batch_cmd(&tree->cmds, &tree->count, &tree->capacity, &cmd);
+}
+
+// Execute GET -r, download a directory tree over one connection (one per
+// node in a cluster)
+// socket_desc - connected socket to the server
+// remote_dir - directory on the server
+// local_dir - where to put it locally
+int do_get_tree(int socket_desc, const char* remote_dir,
+                const char* local_dir) {
+  tree_get_t tree;
+
+  memset(&tree, 0, sizeof(tree));
+  tree.remote_dir = remote_dir;
+  tree.local_dir = local_dir;
+
+  if (create_directories(local_dir) != 0) {
+    printf("Error: Cannot create local directory '%s'\n", local_dir);
+    return -1;
+  }
+  int result = cluster_ring != NULL
+                   ? list_cluster(remote_dir, RFS_FLAG_RECURSIVE,
+                                  add_tree_entry, &tree)
+                   : list_remote(socket_desc, remote_dir, RFS_FLAG_RECURSIVE,
+                                 add_tree_entry, &tree);
+  if (result != 0) {
+    free(tree.cmds);
+    return -1;
+  }
+  return run_routed_batch(socket_desc, tree.cmds, tree.count);
+}
+
+// Run a WRITE or GET, reconnecting and resuming it if -R is set
+// In a cluster it goes to the node that owns the path, as far as the
+// cached ring knows; a MOVED reply or a node that is gone refreshes it.
+// host/port - server to connect to
+// opcode - RFS_OP_WRITE or RFS_OP_GET
+// local_path/remote_path - file to transfer
+int run_with_retries(const char* host, int port, int opcode,
+                     const char* local_path, const char* remote_path) {
+  char node_host[RING_ADDR_MAX];
+  int node_port;
+  int result = TRANSFER_LOST;
+  int busy_attempts = 0;
+  int moves = 0;
+
+  // A tree is spread over every node, so it needs the ring up front
+  if (recursive) {
+    refresh_ring(host, port, NULL);
+  } else {
+    load_ring_cache(host, port);
+  }
+  route_path(host, port, remote_path, node_host, &node_port);
+  int on_replica = opcode == RFS_OP_GET && !recursive &&
+                   cluster_ring == NULL && read_replicas != NULL &&
+                   pick_replica(node_host, &node_port);
+  current_host = node_host;
+  current_port = node_port;
+  for (int attempt = 0;; attempt++) {
+    moved_to[0] = '\0';
+    int socket_desc = connect_to_server(current_host, current_port);
+    if (socket_desc >= 0) {
+      if (opcode == RFS_OP_WRITE) {
+        result = recursive ? do_write_tree(socket_desc, local_path, remote_path)
+                           : do_write(socket_desc, local_path, remote_path);
+      } else {
+        result = recursive ? do_get_tree(socket_desc, remote_path, local_path)
+                           : do_get(socket_desc, remote_path, local_path);
+      }
+      close(socket_desc);
+    }
+
+    // A replica that is down or behind leaves the GET to the primary
+    if (on_replica && result != 0) {
+      printf("Replica %s:%d failed, reading from %s:%d\n", current_host,
+             current_port, host, port);
+      on_replica = 0;
+      snprintf(node_host, sizeof(node_host), "%s", host);
+      current_port = node_port = port;
+      attempt--;
+      continue;
+    }
+
+    // Another node owns the path, or the owner the ring named is gone
+    if (!recursive && moves < MOVED_RETRIES && result != 0 &&
+        (moved_to[0] != '\0' || (socket_desc < 0 && cluster_ring != NULL))) {
+      moves++;
+      char owner[RING_ADDR_MAX];
+      snprintf(owner, sizeof(owner), "%s", moved_to);
+      if (refresh_ring(host, port, owner[0] ? owner : NULL) == 0) {
+        route_path(host, port, remote_path, node_host, &node_port);
+      }
+      if (owner[0] != '\0') {
+        // The node that answered knows better than a ring being changed
+        printf("%s is on %s, retrying there\n", remote_path, owner);
+        ring_split_addr(owner, node_host, &node_port);
+      }
+      current_port = node_port;
+      attempt--;
+      continue;
+    }
+
+    // Turned away, come back later, at least as late as the server said
+    if (result == SERVER_BUSY && busy_attempts < BUSY_RETRIES) {
+      printf("Server busy, retrying (attempt %d of %d)...\n",
+             busy_attempts + 1, BUSY_RETRIES);
+      backoff(busy_attempts++, busy_retry_ms);
+      attempt--;
+      continue;
+    }
+    if (result != TRANSFER_LOST || !use_resume || attempt == RESUME_RETRIES) {
+      return result;
+    }
+    printf("Connection lost, resuming (attempt %d of %d)...\n", attempt + 1,
+           RESUME_RETRIES);
+    sleep(1);
+  }
+}
+
+// Execute RING command, print the nodes of the cluster or replace them
+// A new list goes to every node of the old and the new ring, each one
+// then hands off the files it no longer owns.
+// host/port - server given on the command line
+// nodes - new node list, NULL to print the current one
+int do_ring(const char* host, int port, const char* nodes) {
+  unsigned char request[RFS_HEADER_SIZE + RING_TEXT_MAX];
+  char text[RING_TEXT_MAX];
+  char node_host[RING_ADDR_MAX];
+  char buffer[BUFFER_SIZE];
+  rfs_header_t reply;
+  int node_port;
+
+  if (refresh_ring(host, port, NULL) != 0) {
+    return -1;
+  }
+  if (nodes == NULL) {
+    if (cluster_ring == NULL) {
+      printf("Not in a cluster\n");
+      return 0;
+    }
+    ring_format(cluster_ring, text, sizeof(text));
+    printf("%s", text);
+    return 0;
+  }
+
+  ring_t* ring = ring_parse(nodes);
+  if (ring == NULL) {
+    printf("Error: Malformed node list '%s'\n", nodes);
+    return -1;
+  }
+  size_t text_len = ring_format(ring, text, sizeof(text));
+
+  // New members first, then the old ones that are leaving
+  char targets[2 * RING_MAX_NODES][RING_ADDR_MAX];
+  int count = 0;
+  for (int n = 0; n < ring->count; n++) {
+    snprintf(targets[count++], RING_ADDR_MAX, "%s", ring->nodes[n]);
+  }
+  for (int n = 0; cluster_ring != NULL && n < cluster_ring->count; n++) {
+    if (ring_find(ring, cluster_ring->nodes[n]) < 0) {
+      snprintf(targets[count++], RING_ADDR_MAX, "%s", cluster_ring->nodes[n]);
+    }
+  }
+
+  int updated = 0;
+  for (int n = 0; n < count; n++) {
+    ring_split_addr(targets[n], node_host, &node_port);
+    int socket_desc = connect_to_server(node_host, node_port);
+    if (socket_desc < 0) {
+      continue;
+    }
+    size_t len = rfs_build_request(request, RFS_OP_RING, 1, "", text_len);
+    memcpy(request + len, text, text_len);
+    if (send_all(socket_desc, request, len + text_len) == 0 &&
+        recv_reply(socket_desc, &reply, buffer, sizeof(buffer)) == 0) {
+      printf("%s: %s\n", targets[n], buffer);
+      if (reply.opcode == RFS_OP_OK) {
+        updated++;
+      }
+    }
+    close(socket_desc);
+  }
+  printf("Ring set on %d of %d nodes\n", updated, count);
+
+  free(cluster_ring);
+  cluster_ring = ring;
+  save_ring_cache(host, port);
+  return updated == count ? 0 : -1;
+}
+
+#ifndef RFS_BENCH
+/**
+ * Main function
+ */
+int main(int argc, char* argv[]) {
+  int socket_desc;
+  char* host = DEFAULT_HOST;
+  int port = DEFAULT_PORT;
+  int opt;
+
+  // Parse command line options
+  while ((opt = getopt(argc, argv, "h:p:dRo:l:j:rzS:c")) != -1) {
+    switch (opt) {
+      case 'd':
+        use_delta = 1;
+        break;
+      case 'z':
+        use_compress = 1;
+        break;
+      case 'c':
+        use_checksum = 1;
+        break;
+      case 'R':
+        use_resume = 1;
+        break;
+      case 'o':
+        get_offset = atol(optarg);
+        break;
+      case 'l':
+        get_length = atol(optarg);
+        break;
+      case 'r':
+        recursive = 1;
+        break;
+      case 'j':
+        streams = atoi(optarg);
+        if (streams < 1 || streams > MAX_STREAMS) {
+          printf("Error: -j takes 1 to %d streams\n", MAX_STREAMS);
+          return 1;
+        }
+        break;
+      case 'h':
+        host = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'S':
+        read_replicas = optarg;
+        break;
+      default:
+        return 1;
     }
   }
 
@@ -438,13 +2823,8 @@ int main(int argc, char* argv[]) {
       remote_path = local_path;
     }
 
-    socket_desc = connect_to_server(host, port);
-    if (socket_desc < 0) {
-      return 1;
-    }
-
-    int result = do_write(socket_desc, local_path, remote_path);
-    close(socket_desc);
+    int result = run_with_retries(host, port, RFS_OP_WRITE, local_path,
+                                  remote_path);
     return (result == 0) ? 0 : 1;
   }
   // Handle GET command
@@ -461,44 +2841,94 @@ int main(int argc, char* argv[]) {
     if (optind + 2 < argc) {
       local_path = argv[optind + 2];
     } else {
-      const char* filename = strrchr(remote_path, '/');
-      if (filename != NULL) {
-        filename++;
-      } else {
-        filename = remote_path;
-      }
-      strncpy(default_local, filename, MAX_PATH - 1);
-      default_local[MAX_PATH - 1] = '\0';
+      default_local_path(remote_path, default_local);
       local_path = default_local;
     }
 
+    int result =
+        run_with_retries(host, port, RFS_OP_GET, local_path, remote_path);
+    return (result == 0) ? 0 : 1;
+  }
+  // Handle RM command
+  else if (strcmp(command, "RM") == 0) {
+    if (optind + 1 >= argc) {
+      printf("Error: RM requires remote-path\n\n");
+      return 1;
+    }
+
+    char* remote_path = argv[optind + 1];
+
+    // A directory has a part on every node
+    load_current_ring(host, port);
+    if (cluster_ring != NULL) {
+      return (rm_cluster(remote_path) == 0) ? 0 : 1;
+    }
+
     socket_desc = connect_to_server(host, port);
     if (socket_desc < 0) {
       return 1;
     }
 
-    int result = do_get(socket_desc, remote_path, local_path);
+    moved_to[0] = '\0';
+    int result = do_rm(socket_desc, remote_path, 0);
     close(socket_desc);
+
+    // The server turned out to be a cluster node
+    if (result != 0 && moved_to[0] != '\0' &&
+        refresh_ring(host, port, moved_to) == 0 && cluster_ring != NULL) {
+      result = rm_cluster(remote_path);
+    }
     return (result == 0) ? 0 : 1;
   }
-  // Handle RM command
-  else if (strcmp(command, "RM") == 0) {
+  // Handle LIST command
+  else if (strcmp(command, "LIST") == 0) {
+    const char* remote_dir = (optind + 1 < argc) ? argv[optind + 1] : "";
+
+    load_current_ring(host, port);
+    socket_desc = connect_to_server(host, port);
+    if (socket_desc < 0) {
+      return 1;
+    }
+
+    int result = do_list(socket_desc, remote_dir);
+    close(socket_desc);
+    return (result == 0) ? 0 : 1;
+  }
+  // Handle BATCH command
+  else if (strcmp(command, "BATCH") == 0) {
     if (optind + 1 >= argc) {
-      printf("Error: RM requires remote-path\n\n");
+      printf("Error: BATCH requires batch-file (or - for stdin)\n\n");
       return 1;
     }
 
-    char* remote_path = argv[optind + 1];
+    load_current_ring(host, port);
+    socket_desc = connect_to_server(host, port);
+    if (socket_desc < 0) {
+      return 1;
+    }
 
+    int result = do_batch(socket_desc, argv[optind + 1]);
+    close(socket_desc);
+    return (result == 0) ? 0 : 1;
+  }
+  // Handle STATS command
+  else if (strcmp(command, "STATS") == 0) {
     socket_desc = connect_to_server(host, port);
     if (socket_desc < 0) {
       return 1;
     }
 
-    int result = do_rm(socket_desc, remote_path);
+    int result = do_stats(socket_desc);
     close(socket_desc);
     return (result == 0) ? 0 : 1;
   }
+  // Handle RING command
+  else if (strcmp(command, "RING") == 0) {
+    const char* nodes = (optind + 1 < argc) ? argv[optind + 1] : NULL;
+
+    int result = do_ring(host, port, nodes);
+    return (result == 0) ? 0 : 1;
+  }
   // Handle STOP command
   else if (strcmp(command, "STOP") == 0) {
     socket_desc = connect_to_server(host, port);
@@ -515,4 +2945,5 @@ int main(int argc, char* argv[]) {
     printf("Error: Unknown command '%s'\n\n", command);
     return 1;
   }
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,38 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+/*
+ * Client commands, shared by rfs and rfs-bench
+ *
+ * Each command runs on a connected socket and prints what it does to
+ * stdout. client.c is built without its main() for rfs-bench
+ * (RFS_BENCH), which drives these calls from many threads at once.
+ */
+
+/**
+ * Connect to the server
+ * @param host - server hostname or IP
+ * @param port - server port
+ * @return the connected socket, or -1
+ */
+int connect_to_server(const char* host, int port);
+
+/**
+ * Send a local file to the server
+ * @param socket_desc - connected socket
+ * @param local_path - file to send
+ * @param remote_path - where the server stores it
+ * @return 0, or -1 on error
+ */
+int do_write(int socket_desc, const char* local_path, const char* remote_path);
+
+/**
+ * Fetch a file from the server
+ * @param socket_desc - connected socket
+ * @param remote_path - file on the server
+ * @param local_path - where to save it
+ * @return 0, -1 on error, or 2 if the connection dropped mid transfer
+ */
+int do_get(int socket_desc, const char* remote_path, const char* local_path);
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * cluster.c -- Path ownership and rebalancing between cluster nodes
+ */
+
+#include "cluster.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "peer.h"
+#include "server.h"
+
+char cluster_self[RING_ADDR_MAX] = "";
+
+// The ring requests are routed by. Lookups read it without a lock, so a
+// ring that gets replaced is never freed; membership changes are rare.
+static ring_t* current_ring = NULL;
+
+static pthread_mutex_t rebalance_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rebalance_cond = PTHREAD_COND_INITIALIZER;
+static int rebalance_pending = 0;
+static int rebalance_started = 0;
+
+static void* rebalance_thread(void* arg);
+
+static ring_t* get_ring(void) {
+  return __atomic_load_n(&current_ring, __ATOMIC_ACQUIRE);
+}
+
+int cluster_enabled(void) {
+  return get_ring() != NULL;
+}
+
+const char* cluster_owner(const char* path) {
+  ring_t* ring = get_ring();
+
+  if (ring == NULL) {
+    return NULL;
+  }
+  const char* owner = ring->nodes[ring_owner(ring, path)];
+  return strcmp(owner, cluster_self) == 0 ? NULL : owner;
+}
+
+size_t cluster_format(char* buf, size_t size) {
+  ring_t* ring = get_ring();
+
+  if (ring == NULL) {
+    if (size > 0) {
+      buf[0] = '\0';
+    }
+    return 0;
+  }
+  return ring_format(ring, buf, size);
+}
+
+// Replace CLUSTER_FILE with the ring's membership
+static int save_ring(const ring_t* ring) {
+  char text[RING_TEXT_MAX];
+  char temp[MAX_PATH];
+
+  size_t len = ring_format(ring, text, sizeof(text));
+  snprintf(temp, sizeof(temp), "%s.tmp", CLUSTER_FILE);
+  FILE* fp = fopen(temp, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  if (fwrite(text, 1, len, fp) != len) {
+    fclose(fp);
+    unlink(temp);
+    return -1;
+  }
+  if (fclose(fp) != 0 || rename(temp, CLUSTER_FILE) != 0) {
+    unlink(temp);
+    return -1;
+  }
+  return 0;
+}
+
+// Read the saved membership, NULL if there is none
+static ring_t* load_ring(void) {
+  char text[RING_TEXT_MAX];
+  FILE* fp = fopen(CLUSTER_FILE, "r");
+
+  if (fp == NULL) {
+    return NULL;
+  }
+  size_t len = fread(text, 1, sizeof(text) - 1, fp);
+  fclose(fp);
+  text[len] = '\0';
+  return ring_parse(text);
+}
+
+// Publish a ring and have the rebalance thread look at every file
+static void install_ring(ring_t* ring) {
+  __atomic_store_n(&current_ring, ring, __ATOMIC_RELEASE);
+  if (ring_find(ring, cluster_self) < 0) {
+    log_warn("%s is not in the ring, all of its files move away",
+             cluster_self);
+  }
+
+  // The thread starts with the first ring, from -N or a RING request
+  pthread_mutex_lock(&rebalance_mutex);
+  if (!rebalance_started) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, rebalance_thread, NULL) == 0) {
+      pthread_detach(tid);
+      rebalance_started = 1;
+    } else {
+      log_error("Failed to create rebalance thread");
+    }
+  }
+  rebalance_pending = 1;
+  pthread_cond_signal(&rebalance_cond);
+  pthread_mutex_unlock(&rebalance_mutex);
+}
+
+int cluster_set(const char* text) {
+  ring_t* ring = ring_parse(text);
+
+  if (ring == NULL) {
+    return -1;
+  }
+  if (save_ring(ring) != 0) {
+    log_error("Can't save the ring to %s", CLUSTER_FILE);
+  }
+  install_ring(ring);
+  log_info("Ring changed, %d nodes", ring->count);
+  return ring->count;
+}
+
+// Move a file and its versions to the node that owns it now
+// @param owner - "host:port" of the new owner
+// @param path - remote path of the file
+// @param full_path - where it is under ROOT_DIR
+// @return 0 once moved and removed here, -1 to try again later
+static int handoff_file(const char* owner, const char* path,
+                        const char* full_path) {
+  struct stat before;
+  struct stat after;
+
+  int fd = open(full_path, O_RDONLY);
+  if (fd < 0) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  int sock = peer_connect(owner);
+  if (sock < 0 || fstat(fd, &before) != 0) {
+    log_warn("  Handoff of %s: can't reach %s", path, owner);
+    if (sock >= 0) {
+      close(sock);
+    }
+    close(fd);
+    return -1;
+  }
+
+  // Oldest first, so the new owner numbers them as they were here
+  int latest = load_latest_version(full_path);
+  int r = 0;
+  for (int version = 1; version <= latest && r == 0; version++) {
+    int sent = peer_send_version(sock, path, full_path, version,
+                                 RFS_FLAG_HANDOFF);
+    if (sent < 0 || (sent == 1 && peer_recv_reply(sock, path) != RFS_OP_OK)) {
+      r = -1;
+    }
+  }
+  if (r == 0 &&
+      (peer_send_file(sock, path, RFS_FLAG_HANDOFF, fd, before.st_size) != 0 ||
+       peer_recv_reply(sock, path) != RFS_OP_OK)) {
+    r = -1;
+  }
+  close(sock);
+  close(fd);
+  if (r != 0) {
+    return -1;
+  }
+
+  // The copy here goes under the file's lock, like a RM. A WRITE that was
+  // already running when the ring changed may hold it or have put a new
+  // file in place meanwhile; either way it is left for the next pass.
+  file_lock_t* lock = get_file_lock(full_path);
+  if (lock == NULL) {
+    return -1;
+  }
+  if (!try_file_lock(lock, LOCK_EXCLUSIVE)) {
+    put_file_lock(lock);
+    return -1;
+  }
+  if (stat(full_path, &after) != 0 || after.st_ino != before.st_ino ||
+      after.st_mtime != before.st_mtime || after.st_size != before.st_size) {
+    r = -1;
+  } else {
+    remove_file_and_versions(full_path);
+    replicate_rm(path);
+  }
+  unlock_file(lock, LOCK_EXCLUSIVE);
+  put_file_lock(lock);
+  if (r != 0) {
+    return -1;
+  }
+  metrics_add(METRIC_HANDOFFS, 1);
+  log_info("  Handed off %s to %s", path, owner);
+  return 0;
+}
+
+// Hand off everything under a directory this node doesn't own
+// @param ring - ring of this pass
+// @param dir - remote path of the directory, "" for the root
+// @return files that could not be moved
+static int rebalance_dir(const ring_t* ring, const char* dir) {
+  char full_dir[MAX_PATH];
+  char path[MAX_PATH];
+  char full_path[MAX_PATH];
+  struct dirent* entry;
+  struct stat st;
+  int left = 0;
+
+  snprintf(full_dir, sizeof(full_dir), "%s/%s", ROOT_DIR, dir);
+  DIR* d = opendir(full_dir);
+  if (d == NULL) {
+    return 0;
+  }
+
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        (dir[0] == '\0' && strcmp(entry->d_name, META_NAME) == 0)) {
+      continue;
+    }
+    if (snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] ? "/" : "",
+                 entry->d_name) >= (int)sizeof(path) ||
+        snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_DIR, path) >=
+            (int)sizeof(full_path) ||
+        lstat(full_path, &st) != 0) {
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      left += rebalance_dir(ring, path);
+    } else if (S_ISREG(st.st_mode) && !is_version_file(full_path)) {
+      const char* owner = ring->nodes[ring_owner(ring, path)];
+      if (strcmp(owner, cluster_self) != 0 &&
+          handoff_file(owner, path, full_path) != 0) {
+        left++;
+      }
+    }
+  }
+
+  closedir(d);
+  return left;
+}
+
+// Rebalance thread, runs a pass whenever the ring changes and keeps
+// retrying while files are left over
+static void* rebalance_thread(void* arg) {
+  (void)arg;
+
+  while (1) {
+    pthread_mutex_lock(&rebalance_mutex);
+    while (!rebalance_pending) {
+      pthread_cond_wait(&rebalance_cond, &rebalance_mutex);
+    }
+    rebalance_pending = 0;
+    pthread_mutex_unlock(&rebalance_mutex);
+
+    sleep(REBALANCE_GRACE_S);
+
+    ring_t* ring = get_ring();
+    log_info("Rebalancing for a ring of %d nodes", ring->count);
+    int left = rebalance_dir(ring, "");
+    if (left == 0) {
+      log_info("Rebalance done");
+      continue;
+    }
+
+    log_warn("Rebalance left %d files, trying again in %d s", left,
+             REBALANCE_RETRY_S);
+    sleep(REBALANCE_RETRY_S);
+    pthread_mutex_lock(&rebalance_mutex);
+    rebalance_pending = 1;
+    pthread_mutex_unlock(&rebalance_mutex);
+  }
+
+  return NULL;
+}
+
+int cluster_init(const char* nodes) {
+  ring_t* ring;
+
+  if (nodes != NULL) {
+    ring = ring_parse(nodes);
+    if (ring == NULL) {
+      return -1;
+    }
+    if (save_ring(ring) != 0) {
+      printf("Can't save the ring to %s\n", CLUSTER_FILE);
+    }
+  } else {
+    ring = load_ring();
+    if (ring == NULL) {
+      return 0;
+    }
+  }
+
+  install_ring(ring);
+  return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+
+#include "ring.h"
+
+/*
+ * Cluster mode (server -N host:port,host:port,... -A host:port)
+ *
+ * Several servers, each with its own ROOT_DIR, split the paths between
+ * them with the consistent hash ring in ring.h. -A names this node the
+ * way it appears in the list (127.0.0.1:<port> by default). A request
+ * for a path this node doesn't own is answered with MOVED and the
+ * owner's address; rfs keeps a copy of the ring and sends each request
+ * straight to the owner, and only asks for the ring again when a node
+ * answers MOVED or can't be reached. LIST and RM of a directory go to
+ * every node, each answers for its own part of the tree.
+ *
+ * The membership is kept in CLUSTER_FILE, so a restarted node comes back
+ * with the ring it had. A RING request with a new list replaces it on
+ * the node it is sent to (rfs RING sends it to every old and new node).
+ *
+ * When the ring changes, a rebalance thread waits REBALANCE_GRACE_S for
+ * requests that started under the old ring to finish, then walks
+ * ROOT_DIR and hands every file this node no longer owns to its new
+ * owner: its versions oldest first, then the file itself, as WRITEs with
+ * RFS_FLAG_HANDOFF, and removes the local copies once all of them are
+ * acknowledged. A handed off file or version never replaces one the new
+ * owner already has; that copy is either the same one from an earlier
+ * attempt or newer, written by a client after the ring changed. Files
+ * that could not be moved (the owner is down, or it still has the old
+ * ring and answers MOVED) are tried again every REBALANCE_RETRY_S.
+ *
+ * A node left out of the new list moves all of its files away, which is
+ * how a node is drained before it is shut down.
+ */
+
+#define CLUSTER_FILE ROOT_DIR "/" META_NAME "/ring"
+#define REBALANCE_GRACE_S 2
+#define REBALANCE_RETRY_S 5
+
+// Set by the -A flag, this node's entry in the ring
+extern char cluster_self[RING_ADDR_MAX];
+
+/**
+ * Join the cluster, if there is one to join
+ * @param nodes - node list from -N, saved to CLUSTER_FILE; NULL to use
+ *                the saved one, if there is one
+ * @return 0, or -1 if the list is malformed
+ */
+int cluster_init(const char* nodes);
+
+// 1 if the server is part of a cluster
+
+int cluster_enabled(void);
+
+/**
+ * Who serves a path
+ * @param path - remote path of a request
+ * @return NULL if this node owns it (always when not in a cluster),
+ *         else the owner's "host:port"
+ */
+const char* cluster_owner(const char* path);
+
+/**
+ * Replace the membership and move files to their new owners
+ * @param text - node list, see ring_parse()
+ * @return number of nodes, or -1 if the list is malformed
+ */
+int cluster_set(const char* text);
+
+// Write the membership as text, empty when not in a cluster; returns the
+// length
+
+size_t cluster_format(char* buf, size_t size);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * compress.c -- LZ4 block compression for compressed transfers
+ *
+ * A small greedy LZ4 compressor: one hash table of 4 byte sequences per
+ * block, no chains, so it runs at close to memcpy speed and leaves the
+ * ratio to what text and logs give anyway. Its output is plain LZ4 block
+ * format and any LZ4 decoder reads it.
+ */
+
+#include "compress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+#define HASH_LOG 14
+#define MIN_MATCH 4
+#define LAST_LITERALS 5  // a block always ends in this many literals
+#define MF_LIMIT 12      // no match starts closer than this to the end
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Append the 255, 255, ..., rest continuation of a long length
+static unsigned char* put_length(unsigned char* op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+// Append one sequence: token, literals, then the match if there is one
+// @param op - output position, room already checked
+// @param literals - literal bytes and their count
+// @param offset - distance back to the match, 0 for the final literals
+// @param match_len - bytes matched beyond MIN_MATCH
+static unsigned char* put_sequence(unsigned char* op,
+                                   const unsigned char* literals,
+                                   size_t literal_len, size_t offset,
+                                   size_t match_len) {
+  unsigned char* token = op++;
+
+  if (literal_len >= 15) {
+    *token = 15 << 4;
+    op = put_length(op, literal_len - 15);
+  } else {
+    *token = literal_len << 4;
+  }
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+
+  if (offset == 0) {
+    return op;
+  }
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (match_len >= 15) {
+    *token |= 15;
+    op = put_length(op, match_len - 15);
+  } else {
+    *token |= match_len;
+  }
+  return op;
+}
+
+// Worst case bytes of a sequence, so put_sequence never runs past cap
+static size_t sequence_bound(size_t literal_len, size_t match_len) {
+  return 1 + literal_len + literal_len / 255 + 1 + 2 + match_len / 255 + 1;
+}
+
+size_t compress_block(const unsigned char* src, size_t len, unsigned char* dst,
+                      size_t cap) {
+  uint16_t table[1 << HASH_LOG];  // block offsets, blocks are <= 64 KB
+  const unsigned char* ip = src;
+  const unsigned char* anchor = src;
+  const unsigned char* end = src + len;
+  unsigned char* op = dst;
+  unsigned char* op_end = dst + cap;
+
+  memset(table, 0, sizeof(table));
+
+  if (len > MF_LIMIT) {
+    const unsigned char* mf_limit = end - MF_LIMIT;
+    const unsigned char* match_limit = end - LAST_LITERALS;
+    unsigned int misses = 0;
+
+    while (ip < mf_limit) {
+      uint32_t seq = read32(ip);
+      uint32_t h = hash4(seq);
+      const unsigned char* ref = src + table[h];
+      table[h] = ip - src;
+
+      if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+        // Step faster through data that keeps missing
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      // Grow the match backwards into the pending literals, then forwards
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const unsigned char* m = ip + MIN_MATCH;
+      const unsigned char* r = ref + MIN_MATCH;
+      while (m < match_limit && *m == *r) {
+        m++;
+        r++;
+      }
+
+      size_t literal_len = ip - anchor;
+      size_t match_len = m - ip - MIN_MATCH;
+      if (sequence_bound(literal_len, match_len) > (size_t)(op_end - op)) {
+        return 0;
+      }
+      op = put_sequence(op, anchor, literal_len, ip - ref, match_len);
+
+      ip = m;
+      anchor = ip;
+      if (ip < mf_limit) {
+        table[hash4(read32(ip - 2))] = ip - 2 - src;
+      }
+    }
+  }
+
+  size_t literal_len = end - anchor;
+  if (sequence_bound(literal_len, 0) > (size_t)(op_end - op)) {
+    return 0;
+  }
+  op = put_sequence(op, anchor, literal_len, 0, 0);
+  return op - dst;
+}
+
+// Read the continuation bytes of a long length
+static int get_length(const unsigned char** ip, const unsigned char* end,
+                      size_t* len) {
+  unsigned char b;
+
+  do {
+    if (*ip >= end) {
+      return -1;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+int decompress_block(const unsigned char* src, size_t len, unsigned char* dst,
+                     size_t raw_len) {
+  const unsigned char* ip = src;
+  const unsigned char* end = src + len;
+  unsigned char* op = dst;
+  unsigned char* op_end = dst + raw_len;
+
+  while (ip < end) {
+    unsigned char token = *ip++;
+
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && get_length(&ip, end, &literal_len) != 0) {
+      return -1;
+    }
+    if (literal_len > (size_t)(end - ip) ||
+        literal_len > (size_t)(op_end - op)) {
+      return -1;
+    }
+    memcpy(op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+
+    // The last sequence has no match
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) {
+      return -1;
+    }
+
+    size_t match_len = token & 15;
+    if (match_len == 15 && get_length(&ip, end, &match_len) != 0) {
+      return -1;
+    }
+    match_len += MIN_MATCH;
+    if (match_len > (size_t)(op_end - op)) {
+      return -1;
+    }
+
+    // Byte by byte, a match may overlap the bytes it is producing
+    const unsigned char* ref = op - offset;
+    for (size_t i = 0; i < match_len; i++) {
+      op[i] = ref[i];
+    }
+    op += match_len;
+  }
+
+  return op == op_end ? 0 : -1;
+}
+
+int compress_get_header(const unsigned char* buf, uint32_t* raw_len,
+                        uint32_t* stored_len) {
+  *raw_len = rfs_get_u32(buf);
+  *stored_len = rfs_get_u32(buf + 4);
+
+  if (*raw_len == 0 || *raw_len > COMPRESS_BLOCK_SIZE || *stored_len == 0 ||
+      *stored_len > *raw_len) {
+    return -1;
+  }
+  return 0;
+}
+
+// Write all of buf to a file
+static int write_all(int fd, const unsigned char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+long compress_stream(int fd, int out_fd) {
+  unsigned char* in = malloc(COMPRESS_BLOCK_SIZE);
+  unsigned char* out =
+      malloc(COMPRESS_BLOCK_HEADER + COMPRESS_BOUND(COMPRESS_BLOCK_SIZE));
+  long total = 0;
+  off_t offset = 0;
+  int misses = 0;
+  int skip = 0;
+
+  if (in == NULL || out == NULL) {
+    free(in);
+    free(out);
+    return -1;
+  }
+
+  while (1) {
+    ssize_t n = pread(fd, in, COMPRESS_BLOCK_SIZE, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      total = -1;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    offset += n;
+
+    // Blocks that don't shrink are stored, and a run of them means the
+    // data is incompressible, so stop trying for a while
+    size_t stored = 0;
+    if (skip > 0) {
+      skip--;
+    } else {
+      stored = compress_block(in, n, out + COMPRESS_BLOCK_HEADER,
+                              COMPRESS_BOUND(COMPRESS_BLOCK_SIZE));
+      if (stored == 0 || stored >= (size_t)n) {
+        stored = 0;
+        if (++misses == COMPRESS_GIVE_UP) {
+          misses = 0;
+          skip = COMPRESS_SKIP_BLOCKS;
+        }
+      } else {
+        misses = 0;
+      }
+    }
+    if (stored == 0) {
+      memcpy(out + COMPRESS_BLOCK_HEADER, in, n);
+      stored = n;
+    }
+
+    rfs_put_u32(out, n);
+    rfs_put_u32(out + 4, stored);
+    if (write_all(out_fd, out, COMPRESS_BLOCK_HEADER + stored) != 0) {
+      total = -1;
+      break;
+    }
+    total += COMPRESS_BLOCK_HEADER + stored;
+  }
+
+  free(in);
+  free(out);
+  return total;
+}
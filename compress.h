@@ -0,0 +1,76 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Block compression for WRITE and GET
+ *
+ * A request sent with RFS_FLAG_COMPRESS carries its file as a compressed
+ * stream instead of raw bytes, and a GET asking for it gets a DATA reply
+ * with RFS_FLAG_COMPRESS set if the server chose to compress. A server
+ * that doesn't compress just answers without the flag.
+ *
+ * The stream is a run of blocks of at most COMPRESS_BLOCK_SIZE bytes of
+ * the file, until the payload ends:
+ *
+ *   u32 raw_len, u32 stored_len, stored_len bytes
+ *
+ * A block with stored_len == raw_len is stored as is, anything shorter is
+ * in the LZ4 block format. Blocks that don't shrink are stored, and after
+ * COMPRESS_GIVE_UP of those in a row the next COMPRESS_SKIP_BLOCKS aren't
+ * tried at all, so incompressible data costs next to no CPU. All integers
+ * are big endian.
+ */
+
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+#define COMPRESS_BLOCK_HEADER 8
+#define COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+#define COMPRESS_GIVE_UP 4
+#define COMPRESS_SKIP_BLOCKS 64
+
+// A stream is only worth sending if it saves at least 1/16 of the file
+#define COMPRESS_WORTH(stored, raw) ((stored) < (raw) - (raw) / 16)
+
+/**
+ * Compress one block in the LZ4 block format
+ * @param src - data to compress
+ * @param len - its length, at most COMPRESS_BLOCK_SIZE
+ * @param dst - output buffer
+ * @param cap - its size
+ * @return compressed length, or 0 if it didn't fit in cap
+ */
+size_t compress_block(const unsigned char* src, size_t len, unsigned char* dst,
+                      size_t cap);
+
+/**
+ * Decompress one LZ4 block
+ * @param src - compressed data
+ * @param len - its length
+ * @param dst - output buffer of raw_len bytes
+ * @param raw_len - exact length the block must decompress to
+ * @return 0 on success, -1 if the block is corrupt
+ */
+int decompress_block(const unsigned char* src, size_t len, unsigned char* dst,
+                     size_t raw_len);
+
+/**
+ * Decode and check a block header
+ * @param buf - COMPRESS_BLOCK_HEADER bytes
+ * @param raw_len - output, bytes of the file in the block
+ * @param stored_len - output, bytes that follow the header
+ * @return 0, or -1 if the lengths are impossible
+ */
+int compress_get_header(const unsigned char* buf, uint32_t* raw_len,
+                        uint32_t* stored_len);
+
+/**
+ * Write the compressed stream of a file
+ * @param fd - file to compress, read with pread from the start
+ * @param out_fd - where the stream goes, written at its current offset
+ * @return bytes of stream written, or -1 on a read or write error
+ */
+long compress_stream(int fd, int out_fd);
+
+#endif
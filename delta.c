@@ -0,0 +1,148 @@
+/*
+ * delta.c -- Checksums and signatures for rsync style delta uploads
+ */
+
+#include "delta.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+// Pick the block size for a file
+// @param file_size - size of the file being signed
+uint32_t delta_block_size(uint64_t file_size) {
+  uint32_t block_size = DELTA_MIN_BLOCK;
+
+  while ((uint64_t)block_size * DELTA_MAX_BLOCKS < file_size) {
+    block_size *= 2;
+  }
+  return block_size;
+}
+
+// Weak checksum: a is the byte sum, b the sum of the running a values,
+// each kept to 16 bits so the window can be rolled in O(1)
+uint32_t delta_weak(const unsigned char* buf, size_t len) {
+  uint32_t a = 0;
+  uint32_t b = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    a += buf[i];
+    b += (uint32_t)(len - i) * buf[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+// Move the window one byte to the right
+// @param weak - checksum of the old window
+// @param out - byte leaving on the left
+// @param in - byte entering on the right
+// @param len - window length
+uint32_t delta_roll(uint32_t weak, unsigned char out, unsigned char in,
+                    size_t len) {
+  uint32_t a = weak & 0xffff;
+  uint32_t b = weak >> 16;
+
+  a = (a - out + in) & 0xffff;
+  b = (b - (uint32_t)len * out + a) & 0xffff;
+  return a | (b << 16);
+}
+
+void delta_strong(const unsigned char* buf, size_t len, unsigned char* out) {
+  unsigned char digest[SHA256_DIGEST_SIZE];
+
+  sha256(buf, len, digest);
+  memcpy(out, digest, DELTA_STRONG_SIZE);
+}
+
+void delta_put_base(unsigned char* buf, const delta_base_t* base) {
+  rfs_put_u64(buf, base->ino);
+  rfs_put_u64(buf + 8, base->mtime_ns);
+  rfs_put_u64(buf + 16, base->size);
+}
+
+void delta_get_base(const unsigned char* buf, delta_base_t* base) {
+  base->ino = rfs_get_u64(buf);
+  base->mtime_ns = rfs_get_u64(buf + 8);
+  base->size = rfs_get_u64(buf + 16);
+}
+
+// Write all of buf to a file
+static int write_all(int fd, const unsigned char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Sign a file block by block into out_fd
+// @param fd - file to sign
+// @param base - identity of the file, base->size bytes are signed
+// @param out_fd - signature output
+int delta_write_signature(int fd, const delta_base_t* base, int out_fd) {
+  uint32_t block_size = delta_block_size(base->size);
+  uint32_t count = (base->size + block_size - 1) / block_size;
+  unsigned char header[DELTA_SIG_HEADER_SIZE];
+  unsigned char block[64 * 1024];
+  unsigned char entries[DELTA_SIG_ENTRY_SIZE * 64];
+  size_t entries_len = 0;
+
+  // Blocks above 64 KB are read in pieces, only the checksums need them
+  rfs_put_u32(header, block_size);
+  rfs_put_u32(header + 4, count);
+  delta_put_base(header + 8, base);
+  if (write_all(out_fd, header, sizeof(header)) != 0) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t start = (uint64_t)i * block_size;
+    uint64_t len = base->size - start < block_size ? base->size - start
+                                                    : block_size;
+    sha256_ctx_t ctx;
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    sha256_init(&ctx);
+    for (uint64_t done = 0; done < len;) {
+      size_t want = len - done < sizeof(block) ? len - done : sizeof(block);
+      ssize_t n = pread(fd, block, want, start + done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return -1;
+      }
+      for (ssize_t j = 0; j < n; j++) {
+        a += block[j];
+        b += (uint32_t)(len - done - j) * block[j];
+      }
+      sha256_update(&ctx, block, n);
+      done += n;
+    }
+
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    sha256_final(&ctx, digest);
+    rfs_put_u32(entries + entries_len, (a & 0xffff) | (b << 16));
+    memcpy(entries + entries_len + 4, digest, DELTA_STRONG_SIZE);
+    entries_len += DELTA_SIG_ENTRY_SIZE;
+
+    if (entries_len == sizeof(entries)) {
+      if (write_all(out_fd, entries, entries_len) != 0) {
+        return -1;
+      }
+      entries_len = 0;
+    }
+  }
+
+  return write_all(out_fd, entries, entries_len);
+}
@@ -0,0 +1,84 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * rsync style delta uploads
+ *
+ * 1. The client sends SIG for the remote path. The server cuts its current
+ *    file into fixed size blocks and answers with a DATA frame:
+ *
+ *      u32 block_size, u32 block_count, base (see delta_base_t)
+ *      block_count x { u32 weak checksum, DELTA_STRONG_SIZE bytes SHA-256 }
+ *
+ * 2. The client slides a window over its local file, looking up the weak
+ *    rolling checksum at every offset and confirming hits with the strong
+ *    hash. It then sends DELTA, whose payload is:
+ *
+ *      base (copied from the signature), u32 block_size, u64 new_size,
+ *      32 bytes SHA-256 of the new file
+ *      then ops until the payload ends:
+ *        'C' u32 first_block u32 block_count  copy blocks of the base
+ *        'L' u32 length, length bytes         literal data
+ *
+ * 3. The server rebuilds the file from its base plus the literals, checks
+ *    the size and SHA-256 and commits it like a WRITE. If the file changed
+ *    since the signature was taken the DELTA fails and the client falls
+ *    back to a full WRITE.
+ *
+ * All integers are big endian.
+ */
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCKS 65536
+#define DELTA_STRONG_SIZE 16
+#define DELTA_BASE_SIZE 24
+#define DELTA_SIG_HEADER_SIZE (8 + DELTA_BASE_SIZE)
+#define DELTA_SIG_ENTRY_SIZE (4 + DELTA_STRONG_SIZE)
+#define DELTA_HEADER_SIZE (DELTA_BASE_SIZE + 12 + SHA256_DIGEST_SIZE)
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_LITERAL 'L'
+
+// Identifies the exact file a signature was taken from
+typedef struct {
+  uint64_t ino;
+  uint64_t mtime_ns;
+  uint64_t size;
+} delta_base_t;
+
+// Block size used for a file, grows so there are at most DELTA_MAX_BLOCKS
+
+uint32_t delta_block_size(uint64_t file_size);
+
+// rsync weak checksum of a block
+
+uint32_t delta_weak(const unsigned char* buf, size_t len);
+
+// Slide the weak checksum one byte: drop out, add in
+
+uint32_t delta_roll(uint32_t weak, unsigned char out, unsigned char in,
+                    size_t len);
+
+// Strong hash of a block, the first DELTA_STRONG_SIZE bytes of SHA-256
+
+void delta_strong(const unsigned char* buf, size_t len, unsigned char* out);
+
+// Encode and decode a base
+
+void delta_put_base(unsigned char* buf, const delta_base_t* base);
+void delta_get_base(const unsigned char* buf, delta_base_t* base);
+
+/**
+ * Write the signature of a file
+ * @param fd - file to sign, read with pread
+ * @param base - identity of that file
+ * @param out_fd - where the signature goes
+ * @return 0 on success, -1 on a read or write error
+ */
+int delta_write_signature(int fd, const delta_base_t* base, int out_fd);
+
+#endif
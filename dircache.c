@@ -0,0 +1,96 @@
+/*
+ * dircache.c -- Cache of directories known to exist
+ *
+ * WRITE calls create_directories for every file, and without the cache
+ * that is a mkdir() per path component each time. Directories are only
+ * ever removed by RM, which empties the whole cache, so an entry never
+ * outlives its directory.
+ */
+
+#include "dircache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lockmgr.h"
+
+dir_shard_t dir_shards[DIR_CACHE_SHARDS];
+
+void dir_cache_init(void) {
+  for (int i = 0; i < DIR_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&dir_shards[i].mutex, NULL);
+  }
+}
+
+// Free every entry of a shard, its mutex held
+static void clear_shard(dir_shard_t* shard) {
+  for (int b = 0; b < DIR_CACHE_BUCKETS; b++) {
+    dir_entry_t* entry = shard->buckets[b];
+    while (entry != NULL) {
+      dir_entry_t* next = entry->next;
+      free(entry);
+      entry = next;
+    }
+    shard->buckets[b] = NULL;
+  }
+  shard->count = 0;
+  shard->generation++;
+}
+
+int dir_cache_lookup(const char* path, uint64_t* generation) {
+  uint64_t hash = hash_path(path);
+  dir_shard_t* shard = &dir_shards[hash % DIR_CACHE_SHARDS];
+  int found = 0;
+
+  pthread_mutex_lock(&shard->mutex);
+  for (dir_entry_t* entry = shard->buckets[(hash >> 8) % DIR_CACHE_BUCKETS];
+       entry != NULL; entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+      found = 1;
+      break;
+    }
+  }
+  *generation = shard->generation;
+  pthread_mutex_unlock(&shard->mutex);
+  return found;
+}
+
+// Add a directory, unless the cache was emptied since it was looked up
+// @param path - directory that exists
+// @param generation - from the dir_cache_lookup that missed it
+void dir_cache_insert(const char* path, uint64_t generation) {
+  uint64_t hash = hash_path(path);
+  dir_shard_t* shard = &dir_shards[hash % DIR_CACHE_SHARDS];
+  size_t len = strlen(path);
+
+  dir_entry_t* entry = malloc(sizeof(dir_entry_t) + len + 1);
+  if (entry == NULL) {
+    return;
+  }
+  entry->hash = hash;
+  memcpy(entry->path, path, len + 1);
+
+  pthread_mutex_lock(&shard->mutex);
+  if (shard->generation != generation) {
+    // An RM ran in between, the directory may be gone again
+    pthread_mutex_unlock(&shard->mutex);
+    free(entry);
+    return;
+  }
+  if (shard->count >= DIR_CACHE_SHARD_MAX) {
+    clear_shard(shard);
+  }
+  dir_entry_t** bucket = &shard->buckets[(hash >> 8) % DIR_CACHE_BUCKETS];
+  entry->next = *bucket;
+  *bucket = entry;
+  shard->count++;
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void dir_cache_invalidate(void) {
+  for (int i = 0; i < DIR_CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&dir_shards[i].mutex);
+    clear_shard(&dir_shards[i]);
+    pthread_mutex_unlock(&dir_shards[i].mutex);
+  }
+}
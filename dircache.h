@@ -0,0 +1,49 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define DIR_CACHE_SHARDS 16
+#define DIR_CACHE_BUCKETS 256
+#define DIR_CACHE_SHARD_MAX 4096  // a full shard is emptied and starts over
+
+// A directory known to exist
+typedef struct dir_entry {
+  uint64_t hash;
+  struct dir_entry* next;
+  char path[];
+} dir_entry_t;
+
+// One shard of the cache, a fixed size chained hash table with its mutex
+// The generation changes whenever the shard is emptied, so a directory
+// found missing before an RM is never cached after it.
+typedef struct {
+  pthread_mutex_t mutex;
+  dir_entry_t* buckets[DIR_CACHE_BUCKETS];
+  size_t count;
+  uint64_t generation;
+} dir_shard_t;
+
+// Initialize the directory cache
+
+void dir_cache_init(void);
+
+/**
+ * Check whether a directory is known to exist
+ * @param path - directory path
+ * @param generation - output, pass it to dir_cache_insert after creating
+ *                     the directory
+ * @return 1 if it is cached, 0 otherwise
+ */
+int dir_cache_lookup(const char* path, uint64_t* generation);
+
+// Remember a directory that was just created or found to exist
+
+void dir_cache_insert(const char* path, uint64_t generation);
+
+// Forget every directory, after one has been removed
+
+void dir_cache_invalidate(void);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * durability.c -- fsync policies and the group commit thread
+ */
+
+#define _GNU_SOURCE
+
+#include "durability.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+
+int durability_mode = DURABILITY_OFF;
+long sync_window_us = SYNC_WINDOW_DEFAULT_US;
+
+// Commits waiting for the next batch, linked through conn->next
+static conn_t* sync_head = NULL;
+static conn_t* sync_tail = NULL;
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+
+// fsync a directory, making the names in it durable
+static int sync_directory(const char* dir_path) {
+  int fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+
+  if (fd < 0) {
+    return -1;
+  }
+  int r = fsync(fd);
+  close(fd);
+  return r;
+}
+
+int sync_parent(const char* filepath) {
+  char dir_path[MAX_PATH];
+
+  get_directory_path(filepath, dir_path);
+  return sync_directory(dir_path);
+}
+
+void sync_enqueue(conn_t* conn) {
+  conn->sync_error = 0;
+  conn->next = NULL;
+
+  pthread_mutex_lock(&sync_mutex);
+  if (sync_tail != NULL) {
+    sync_tail->next = conn;
+  } else {
+    sync_head = conn;
+  }
+  sync_tail = conn;
+  pthread_cond_signal(&sync_cond);
+  pthread_mutex_unlock(&sync_mutex);
+}
+
+// Make one batch durable, conn->next links it
+static void sync_batch(conn_t* batch) {
+  char dir_path[MAX_PATH];
+  char other_path[MAX_PATH];
+
+#ifdef __linux__
+  // Queue writeback of every file before waiting on any of them
+  for (conn_t* conn = batch; conn != NULL; conn = conn->next) {
+    if (conn->fd >= 0) {
+      sync_file_range(conn->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+  }
+#endif
+  for (conn_t* conn = batch; conn != NULL; conn = conn->next) {
+    if (conn->fd >= 0 && fdatasync(conn->fd) != 0) {
+      conn->sync_error = 1;
+    }
+  }
+
+  // One fsync per directory of a renamed upload; a connection earlier in
+  // the batch with the same directory already covered it
+  for (conn_t* conn = batch; conn != NULL; conn = conn->next) {
+    if (conn->fd >= 0) {
+      continue;
+    }
+    get_directory_path(conn->full_path, dir_path);
+
+    conn_t* first = batch;
+    for (; first != conn; first = first->next) {
+      if (first->fd >= 0) {
+        continue;
+      }
+      get_directory_path(first->full_path, other_path);
+      if (strcmp(dir_path, other_path) == 0) {
+        break;
+      }
+    }
+    if (first != conn) {
+      conn->sync_error |= first->sync_error & 2;
+      continue;
+    }
+    if (sync_directory(dir_path) != 0) {
+      conn->sync_error |= 2;
+    }
+  }
+}
+
+// Group commit thread, flushes whatever queued up while the last batch
+// was being synced, plus what arrives within the window
+static void* sync_thread(void* arg) {
+  (void)arg;
+
+  while (1) {
+    pthread_mutex_lock(&sync_mutex);
+    while (sync_head == NULL) {
+      pthread_cond_wait(&sync_cond, &sync_mutex);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+
+    if (sync_window_us > 0) {
+      struct timespec window = {sync_window_us / 1000000,
+                                (sync_window_us % 1000000) * 1000};
+      while (nanosleep(&window, &window) != 0 && errno == EINTR) {
+      }
+    }
+
+    pthread_mutex_lock(&sync_mutex);
+    conn_t* batch = sync_head;
+    sync_head = sync_tail = NULL;
+    pthread_mutex_unlock(&sync_mutex);
+
+    sync_batch(batch);
+
+    // submit_connection reuses the next link, so step past it first
+    while (batch != NULL) {
+      conn_t* conn = batch;
+      batch = conn->next;
+      submit_connection(conn);
+    }
+  }
+
+  return NULL;
+}
+
+int sync_init(void) {
+  pthread_t tid;
+
+  if (durability_mode != DURABILITY_GROUP) {
+    return 0;
+  }
+  if (pthread_create(&tid, NULL, sync_thread, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+/*
+ * When a WRITE is acknowledged (server -s MODE)
+ *
+ *   off    as soon as the file is renamed into place, the data reaches
+ *          the disk whenever the kernel writes it back
+ *   file   the worker fdatasync()s the upload before it is renamed into
+ *          place, and fsync()s the directory after, so a crash leaves
+ *          the old file or the new one and an acknowledged one stays
+ *   group  the same two steps, but each time the connection is parked
+ *          and one sync thread flushes every connection that arrived
+ *          within the latency window together; each directory is
+ *          fsync()ed once per batch
+ *
+ * A grouped batch first starts writeback on all of its files and only
+ * then waits for each, so the disk sees the whole batch at once and the
+ * filesystem can fold the flushes into one journal commit. Chunk files
+ * and recipes are synced by the worker that writes them, in either mode.
+ */
+
+#define DURABILITY_OFF 0
+#define DURABILITY_FILE 1
+#define DURABILITY_GROUP 2
+#define SYNC_WINDOW_DEFAULT_US 1000
+
+struct conn;
+
+// Set by the -s flag
+extern int durability_mode;
+
+// Set by the -w flag, how long a batch waits for more commits
+extern long sync_window_us;
+
+// Start the group commit thread when durability_mode is DURABILITY_GROUP
+
+int sync_init(void);
+
+/**
+ * fsync the directory a file is in, making its name durable
+ * @param filepath - path of the file
+ * @return 0, or -1 if the directory could not be synced
+ */
+int sync_parent(const char* filepath);
+
+/**
+ * Hand a WRITE to the group commit thread, for DURABILITY_GROUP
+ * The thread fdatasync()s conn->fd when it is open, an upload not yet
+ * renamed into place or a pack segment, or else fsync()s the directory
+ * of conn->full_path. The connection is parked and resubmitted once its
+ * batch is durable, with conn->sync_error set if it could not be synced.
+ * @param conn - connection to sync
+ */
+void sync_enqueue(struct conn* conn);
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * filecache.c -- LRU cache of small files for GET
+ *
+ * A few small files tend to take most of the GETs. Serving them from
+ * memory skips the lock queue, stat(), open() and the page cache copy;
+ * the reply goes out with one writev(). Memory is bounded by a byte
+ * budget, and an entry evicted while a GET is still sending it is freed
+ * when that GET lets go of it. Big files can be shared the same way as
+ * mappings, see file_cache_map_large.
+ */
+
+#include "filecache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "lockmgr.h"
+#include "metrics.h"
+
+size_t file_cache_budget = (size_t)FILE_CACHE_DEFAULT_MB << 20;
+int file_cache_map_large = 0;
+
+file_shard_t file_shards[FILE_CACHE_SHARDS];
+
+void file_cache_init(void) {
+  for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&file_shards[i].mutex, NULL);
+  }
+}
+
+static int cache_enabled(void) {
+  return file_cache_budget > 0 || file_cache_map_large;
+}
+
+static void free_entry(file_entry_t* entry) {
+  if (entry->mapped) {
+    munmap(entry->data, entry->size);
+  }
+  free(entry);
+}
+
+static file_shard_t* shard_of(uint64_t hash) {
+  return &file_shards[hash % FILE_CACHE_SHARDS];
+}
+
+static file_entry_t** bucket_of(file_shard_t* shard, uint64_t hash) {
+  return &shard->buckets[(hash >> 8) % FILE_CACHE_BUCKETS];
+}
+
+// Find an entry in its shard, mutex held
+static file_entry_t* find_entry(file_shard_t* shard, uint64_t hash,
+                                const char* path) {
+  for (file_entry_t* entry = *bucket_of(shard, hash); entry != NULL;
+       entry = entry->next) {
+    if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void lru_unlink(file_shard_t* shard, file_entry_t* entry) {
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    shard->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    shard->lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(file_shard_t* shard, file_entry_t* entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = shard->lru_head;
+  if (shard->lru_head != NULL) {
+    shard->lru_head->lru_prev = entry;
+  } else {
+    shard->lru_tail = entry;
+  }
+  shard->lru_head = entry;
+}
+
+// Take an entry out of the table and drop the table's reference, mutex
+// held; it is freed now unless a GET is still sending it
+static void remove_entry(file_shard_t* shard, file_entry_t* entry) {
+  file_entry_t** link = bucket_of(shard, entry->hash);
+
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+  lru_unlink(shard, entry);
+  if (entry->mapped) {
+    shard->maps--;
+  } else {
+    shard->bytes -= entry->size;
+  }
+
+  if (--entry->refs == 0) {
+    free_entry(entry);
+  }
+}
+
+// Least recently used mapping of a shard, mutex held
+static file_entry_t* oldest_mapping(file_shard_t* shard) {
+  file_entry_t* entry = shard->lru_tail;
+
+  while (entry != NULL && !entry->mapped) {
+    entry = entry->lru_prev;
+  }
+  return entry;
+}
+
+// Least recently used copied file of a shard, mutex held
+static file_entry_t* oldest_copy(file_shard_t* shard) {
+  file_entry_t* entry = shard->lru_tail;
+
+  while (entry != NULL && entry->mapped) {
+    entry = entry->lru_prev;
+  }
+  return entry;
+}
+
+// Fill a new entry with a copy of the file, or a mapping of a big one
+// @return 0, or -1 if the file can't be read (or isn't worth caching)
+static int load_entry(file_entry_t* entry, int fd) {
+  size_t done = 0;
+
+  if (entry->size > FILE_CACHE_MAX_FILE ||
+      entry->size > file_cache_budget / FILE_CACHE_SHARDS) {
+    if (!file_cache_map_large || entry->size <= FILE_CACHE_MAX_FILE) {
+      return -1;
+    }
+    void* map = mmap(NULL, entry->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      return -1;
+    }
+    madvise(map, entry->size, MADV_SEQUENTIAL);
+    entry->data = map;
+    entry->mapped = 1;
+    return 0;
+  }
+
+  while (done < entry->size) {
+    ssize_t n = pread(fd, entry->data + done, entry->size - done, done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+file_entry_t* file_cache_lookup(const char* path, uint64_t* generation) {
+  *generation = 0;
+  if (!cache_enabled()) {
+    return NULL;
+  }
+
+  uint64_t hash = hash_path(path);
+  file_shard_t* shard = shard_of(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  file_entry_t* entry = find_entry(shard, hash, path);
+  if (entry != NULL) {
+    entry->refs++;
+    lru_unlink(shard, entry);
+    lru_push(shard, entry);
+  }
+  *generation = shard->generation;
+  pthread_mutex_unlock(&shard->mutex);
+  metrics_add(
+      entry != NULL ? METRIC_FILE_CACHE_HITS : METRIC_FILE_CACHE_MISSES, 1);
+  return entry;
+}
+
+file_entry_t* file_cache_insert(const char* path, int fd, size_t size,
+                                uint64_t generation) {
+  size_t shard_budget = file_cache_budget / FILE_CACHE_SHARDS;
+  size_t len = strlen(path);
+
+  if (!cache_enabled()) {
+    return NULL;
+  }
+
+  // Read or map the file before taking the shard mutex; the copy of a
+  // small file lives right after the entry
+  int copy = size <= FILE_CACHE_MAX_FILE && size <= shard_budget;
+  file_entry_t* entry = malloc(sizeof(file_entry_t) + len + 1 +
+                               (copy ? size : 0));
+  if (entry == NULL) {
+    return NULL;
+  }
+  entry->hash = hash_path(path);
+  entry->size = size;
+  entry->mapped = 0;
+  entry->has_checksum = checksum_load(fd, &entry->checksum) == 0;
+  entry->data = (unsigned char*)entry->path + len + 1;
+  memcpy(entry->path, path, len + 1);
+
+  if (load_entry(entry, fd) != 0) {
+    free(entry);
+    return NULL;
+  }
+
+  file_shard_t* shard = shard_of(entry->hash);
+
+  pthread_mutex_lock(&shard->mutex);
+
+  // The file was read without its lock, and a commit or RM in the shard
+  // since the lookup means it may be the old version
+  if (shard->generation != generation) {
+    pthread_mutex_unlock(&shard->mutex);
+    free_entry(entry);
+    return NULL;
+  }
+
+  // Another GET of the same file got here first
+  file_entry_t* existing = find_entry(shard, entry->hash, path);
+  if (existing != NULL) {
+    existing->refs++;
+    pthread_mutex_unlock(&shard->mutex);
+    free_entry(entry);
+    return existing;
+  }
+
+  if (entry->mapped) {
+    while (shard->maps >= FILE_CACHE_SHARD_MAPS) {
+      remove_entry(shard, oldest_mapping(shard));
+    }
+    shard->maps++;
+  } else {
+    while (shard->bytes + size > shard_budget && shard->bytes > 0) {
+      remove_entry(shard, oldest_copy(shard));
+    }
+    shard->bytes += size;
+  }
+
+  file_entry_t** bucket = bucket_of(shard, entry->hash);
+  entry->next = *bucket;
+  *bucket = entry;
+  lru_push(shard, entry);
+  entry->refs = 2;
+
+  pthread_mutex_unlock(&shard->mutex);
+  return entry;
+}
+
+void file_cache_release(file_entry_t* entry) {
+  file_shard_t* shard = shard_of(entry->hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  int unused = --entry->refs == 0;
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (unused) {
+    free_entry(entry);
+  }
+}
+
+void file_cache_invalidate(const char* path) {
+  if (!cache_enabled()) {
+    return;
+  }
+
+  uint64_t hash = hash_path(path);
+  file_shard_t* shard = shard_of(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  shard->generation++;
+  file_entry_t* entry = find_entry(shard, hash, path);
+  if (entry != NULL) {
+    remove_entry(shard, entry);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
@@ -0,0 +1,99 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cache of small, hot files for GET
+ *
+ * A GET that hits the cache is answered from memory without the file
+ * lock or a single filesystem call. WRITE and RM drop the entry under the
+ * exclusive lock, which also changes the shard's generation, and a GET
+ * only adds the file it opened if the generation it saw on its miss is
+ * still current. So a cached copy is always the committed file, even
+ * though GETs read files without the lock.
+ *
+ * The byte budget is split evenly over the shards and each shard evicts
+ * its least recently used entries to stay inside its part.
+ *
+ * With file_cache_map_large, files too big to copy are mmap()ed instead
+ * and every GET of the file sends from the one shared mapping. Mappings
+ * don't count against the budget, only FILE_CACHE_SHARD_MAPS of them are
+ * kept per shard. A mapping of a file that has been replaced or removed
+ * stays valid (commits rename, nothing is changed in place) and is
+ * unmapped when its last GET is done with it.
+ */
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 1024
+#define FILE_CACHE_DEFAULT_MB 64
+#define FILE_CACHE_MAX_FILE (1 << 20)  // bigger files are sent from disk
+#define FILE_CACHE_SHARD_MAPS 8
+
+// A cached file, kept alive by its references while GETs send it
+typedef struct file_entry {
+  uint64_t hash;
+  struct file_entry* next;  // hash chain
+  struct file_entry* lru_prev;
+  struct file_entry* lru_next;
+  int refs;  // one for the table while cached, one per GET sending it
+  int mapped;  // data is an mmap() of the file, not a copy
+  int has_checksum;   // the file was written with one
+  uint32_t checksum;  // its CRC32C, see checksum.h
+  size_t size;
+  unsigned char* data;
+  char path[];
+} file_entry_t;
+
+// One shard of the cache, a chained hash table plus its LRU list
+typedef struct {
+  pthread_mutex_t mutex;
+  file_entry_t* buckets[FILE_CACHE_BUCKETS];
+  file_entry_t* lru_head;  // most recently used
+  file_entry_t* lru_tail;
+  size_t bytes;  // of copied files
+  int maps;
+  uint64_t generation;  // changes whenever an entry is invalidated
+} file_shard_t;
+
+// Set by the -m flag, total bytes the cache may hold, 0 turns it off
+extern size_t file_cache_budget;
+
+// Set by the -M flag, big files are served from shared mappings
+extern int file_cache_map_large;
+
+// Initialize the file cache
+
+void file_cache_init(void);
+
+/**
+ * Find a cached file
+ * @param path - full file path
+ * @param generation - output on a miss, pass it to file_cache_insert
+ * @return the entry with a reference for the caller, or NULL
+ */
+file_entry_t* file_cache_lookup(const char* path, uint64_t* generation);
+
+/**
+ * Read a file into the cache
+ * @param path - full file path
+ * @param fd - the file, opened after the lookup that missed it
+ * @param size - its size, files over the limit are mapped or not cached
+ * @param generation - from that lookup, nothing is cached if the file
+ *                     may have been replaced since
+ * @return the entry with a reference for the caller, or NULL
+ */
+file_entry_t* file_cache_insert(const char* path, int fd, size_t size,
+                                uint64_t generation);
+
+// Drop a reference from lookup or insert
+
+void file_cache_release(file_entry_t* entry);
+
+// Forget a file that is being replaced or removed, its lock held
+
+void file_cache_invalidate(const char* path);
+
+#endif
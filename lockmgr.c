@@ -0,0 +1,257 @@
+/*
+ * lockmgr.c -- Sharded per-file lock manager
+ *
+ * Paths hash to one of LOCK_SHARDS shards, each a chained hash table
+ * behind its own mutex, so lookups are O(1) and operations on different
+ * files rarely touch the same mutex. Entries are created on first use and
+ * freed when the last reference is dropped.
+ */
+
+#include "lockmgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "server.h"
+
+// Global file lock table
+lock_shard_t lock_shards[LOCK_SHARDS];
+
+// init lock table
+int init_file_locks(void) {
+  for (int i = 0; i < LOCK_SHARDS; i++) {
+    pthread_mutex_init(&lock_shards[i].mutex, NULL);
+    lock_shards[i].bucket_count = LOCK_SHARD_BUCKETS;
+    lock_shards[i].count = 0;
+    lock_shards[i].buckets = calloc(LOCK_SHARD_BUCKETS, sizeof(file_lock_t*));
+    if (lock_shards[i].buckets == NULL) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Hash a path, FNV-1a
+// @param path - string to hash
+uint64_t hash_path(const char* path) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Double a shard's bucket array once chains get long
+// @param shard - shard to grow, its mutex held
+static void grow_shard(lock_shard_t* shard) {
+  size_t new_count = shard->bucket_count * 2;
+  file_lock_t** buckets = calloc(new_count, sizeof(file_lock_t*));
+  if (buckets == NULL) {
+    // Keep the old table, chains just get longer
+    return;
+  }
+
+  for (size_t i = 0; i < shard->bucket_count; i++) {
+    file_lock_t* lock = shard->buckets[i];
+    while (lock != NULL) {
+      file_lock_t* next = lock->next;
+      size_t b = (lock->hash >> 8) & (new_count - 1);
+      lock->next = buckets[b];
+      buckets[b] = lock;
+      lock = next;
+    }
+  }
+
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->bucket_count = new_count;
+}
+
+// Get or create a lock entry for a specific file, with a reference
+// @param filepath - Full path to the file
+file_lock_t* get_file_lock(const char* filepath) {
+  uint64_t hash = hash_path(filepath);
+  lock_shard_t* shard = &lock_shards[hash % LOCK_SHARDS];
+
+  pthread_mutex_lock(&shard->mutex);
+
+  // Check if lock already exists for this file
+  size_t b = (hash >> 8) & (shard->bucket_count - 1);
+  for (file_lock_t* lock = shard->buckets[b]; lock; lock = lock->next) {
+    if (lock->hash == hash && strcmp(lock->filepath, filepath) == 0) {
+      lock->refcount++;
+      pthread_mutex_unlock(&shard->mutex);
+      return lock;
+    }
+  }
+
+  // Create new lock
+  size_t len = strlen(filepath);
+  file_lock_t* lock = calloc(1, sizeof(file_lock_t) + len + 1);
+  if (lock == NULL) {
+    pthread_mutex_unlock(&shard->mutex);
+    return NULL;
+  }
+  memcpy(lock->filepath, filepath, len + 1);
+  lock->hash = hash;
+  lock->refcount = 1;
+  lock->shard = shard;
+
+  if (shard->count >= shard->bucket_count * 2) {
+    grow_shard(shard);
+    b = (hash >> 8) & (shard->bucket_count - 1);
+  }
+  lock->next = shard->buckets[b];
+  shard->buckets[b] = lock;
+  shard->count++;
+
+  pthread_mutex_unlock(&shard->mutex);
+  return lock;
+}
+
+// Drop a reference, the entry is unlinked and freed when it was the last
+// @param lock - lock entry from get_file_lock
+void put_file_lock(file_lock_t* lock) {
+  lock_shard_t* shard = lock->shard;
+
+  pthread_mutex_lock(&shard->mutex);
+
+  if (--lock->refcount > 0) {
+    pthread_mutex_unlock(&shard->mutex);
+    return;
+  }
+
+  // Owners and waiters hold references, so nobody can be using it now
+  file_lock_t** link = &shard->buckets[(lock->hash >> 8) &
+                                       (shard->bucket_count - 1)];
+  while (*link != lock) {
+    link = &(*link)->next;
+  }
+  *link = lock->next;
+  shard->count--;
+
+  pthread_mutex_unlock(&shard->mutex);
+  free(lock);
+}
+
+// Take a file lock for a connection, or queue it behind the current owners
+// @param lock - lock entry from get_file_lock
+// @param conn - connection asking for the lock
+// @param mode - LOCK_SHARED or LOCK_EXCLUSIVE
+int acquire_file_lock(file_lock_t* lock, conn_t* conn, int mode) {
+  int granted;
+
+  pthread_mutex_lock(&lock->shard->mutex);
+
+  // Nobody may jump the queue, otherwise readers could starve a writer
+  if (mode == LOCK_SHARED) {
+    granted = !lock->writer && lock->wait_head == NULL;
+  } else {
+    granted = !lock->writer && lock->readers == 0 && lock->wait_head == NULL;
+  }
+
+  if (granted) {
+    if (mode == LOCK_SHARED) {
+      lock->readers++;
+    } else {
+      lock->writer = 1;
+    }
+    conn->lock_held = mode;
+    pthread_mutex_unlock(&lock->shard->mutex);
+    metrics_add(METRIC_LOCKS_TAKEN, 1);
+    return 1;
+  }
+
+  // Park the connection, unlock_file resumes it once it owns the lock
+  conn->lock_wanted = mode;
+  conn->lock_wait_start = metrics_now_us();
+  conn->next = NULL;
+  if (lock->wait_tail != NULL) {
+    lock->wait_tail->next = conn;
+  } else {
+    lock->wait_head = conn;
+  }
+  lock->wait_tail = conn;
+
+  pthread_mutex_unlock(&lock->shard->mutex);
+  metrics_add(METRIC_LOCK_WAITS, 1);
+  return 0;
+}
+
+// Take a file lock if nobody holds it or waits for it, never queueing
+// @param lock - lock entry from get_file_lock
+// @param mode - LOCK_SHARED or LOCK_EXCLUSIVE
+int try_file_lock(file_lock_t* lock, int mode) {
+  int granted;
+
+  pthread_mutex_lock(&lock->shard->mutex);
+  if (mode == LOCK_SHARED) {
+    granted = !lock->writer && lock->wait_head == NULL;
+  } else {
+    granted = !lock->writer && lock->readers == 0 && lock->wait_head == NULL;
+  }
+  if (granted && mode == LOCK_SHARED) {
+    lock->readers++;
+  } else if (granted) {
+    lock->writer = 1;
+  }
+  pthread_mutex_unlock(&lock->shard->mutex);
+
+  if (granted) {
+    metrics_add(METRIC_LOCKS_TAKEN, 1);
+  }
+  return granted;
+}
+
+// Give up a file lock, ownership passes straight to the next waiter, or
+// to every reader at the front of the queue
+// @param lock - lock entry currently held by the caller
+// @param mode - mode the caller holds it in
+void unlock_file(file_lock_t* lock, int mode) {
+  conn_t* woken = NULL;
+  conn_t** woken_tail = &woken;
+
+  pthread_mutex_lock(&lock->shard->mutex);
+
+  if (mode == LOCK_SHARED) {
+    lock->readers--;
+  } else {
+    lock->writer = 0;
+  }
+
+  while (lock->wait_head != NULL && !lock->writer) {
+    conn_t* waiter = lock->wait_head;
+
+    if (waiter->lock_wanted == LOCK_EXCLUSIVE && lock->readers > 0) {
+      break;
+    }
+
+    lock->wait_head = waiter->next;
+    if (lock->wait_head == NULL) {
+      lock->wait_tail = NULL;
+    }
+    if (waiter->lock_wanted == LOCK_SHARED) {
+      lock->readers++;
+    } else {
+      lock->writer = 1;
+    }
+    waiter->lock_held = waiter->lock_wanted;
+
+    waiter->next = NULL;
+    *woken_tail = waiter;
+    woken_tail = &waiter->next;
+  }
+
+  pthread_mutex_unlock(&lock->shard->mutex);
+
+  // submit_connection reuses the next link, so step past it first
+  uint64_t now = woken != NULL ? metrics_now_us() : 0;
+  while (woken != NULL) {
+    conn_t* waiter = woken;
+    woken = waiter->next;
+    metrics_add(METRIC_LOCK_WAIT_US, now - waiter->lock_wait_start);
+    submit_connection(waiter);
+  }
+}
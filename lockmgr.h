@@ -0,0 +1,84 @@
+#ifndef LOCKMGR_H
+#define LOCKMGR_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define LOCK_SHARDS 64
+#define LOCK_SHARD_BUCKETS 64
+
+// Lock modes, readers share a file while writers get it to themselves
+#define LOCK_NONE 0
+#define LOCK_SHARED 1
+#define LOCK_EXCLUSIVE 2
+
+struct conn;
+struct lock_shard;
+
+// Structure for per-file locking
+// The lock is owned by a connection rather than a thread, because a
+// connection can be resumed on a different worker after every event.
+// Entries are refcounted and freed once nobody references them.
+// Waiters queue in arrival order, so a writer is not starved by a steady
+// stream of readers.
+typedef struct file_lock {
+  uint64_t hash;
+  int refcount;
+  int readers;  // connections holding the lock shared
+  int writer;   // one connection holds it exclusive
+  struct conn* wait_head;
+  struct conn* wait_tail;
+  struct lock_shard* shard;
+  struct file_lock* next;  // hash chain
+  char filepath[];
+} file_lock_t;
+
+// One shard of the lock table, a chained hash table with its own mutex
+typedef struct lock_shard {
+  pthread_mutex_t mutex;
+  file_lock_t** buckets;
+  size_t bucket_count;
+  size_t count;
+} lock_shard_t;
+
+// Initialize file lock table
+
+int init_file_locks(void);
+
+/**
+ * Get (creating if needed) the lock entry for a file and take a reference
+ * @param filepath - Full path to the file
+ * @return Pointer to lock entry, or NULL if out of memory
+ */
+file_lock_t* get_file_lock(const char* filepath);
+
+// Drop a reference from get_file_lock, freeing the entry once unused
+
+void put_file_lock(file_lock_t* lock);
+
+/**
+ * Take a file lock for a connection without blocking the worker
+ * @param lock - lock entry from get_file_lock
+ * @param conn - connection asking for the lock
+ * @param mode - LOCK_SHARED or LOCK_EXCLUSIVE
+ * @return 1 if the lock was taken, 0 if conn was queued behind the owners
+ */
+int acquire_file_lock(file_lock_t* lock, struct conn* conn, int mode);
+
+/**
+ * Take a file lock only if it is free, for a thread with no connection
+ * @param lock - lock entry from get_file_lock
+ * @param mode - LOCK_SHARED or LOCK_EXCLUSIVE
+ * @return 1 if the lock was taken, 0 if someone holds or waits for it
+ */
+int try_file_lock(file_lock_t* lock, int mode);
+
+// Give up a file lock, handing it to the next queued connection(s)
+
+void unlock_file(file_lock_t* lock, int mode);
+
+// Hash a path, FNV-1a
+
+uint64_t hash_path(const char* path);
+
+#endif
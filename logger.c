@@ -0,0 +1,172 @@
+/*
+ * logger.c -- Lock-free log ring and the thread that writes it out
+ *
+ * The ring is a bounded multi-producer queue: a producer claims a slot
+ * by advancing the head with a compare-and-swap, fills it and publishes
+ * it through the slot's sequence number; the single consumer takes slots
+ * in order as their sequence numbers say they are full.
+ */
+
+#include "logger.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+int log_level = LOG_INFO;
+
+// One line; seq is its position when free, position + 1 when full
+typedef struct {
+  uint64_t seq;
+  int len;
+  char text[LOG_LINE];
+} log_slot_t;
+
+static log_slot_t ring[LOG_RING];
+static uint64_t head = 0;  // next position a producer claims
+static uint64_t tail = 0;  // next position the consumer reads
+
+// Only one drainer at a time, the thread or log_flush
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The thread sleeps here when the ring is empty
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int sleeping = 0;
+
+int log_parse_level(const char* name) {
+  static const char* names[] = {"error", "warn", "info", "debug"};
+
+  if (strcmp(name, "off") == 0) {
+    return LOG_OFF;
+  }
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -2;
+}
+
+void log_write(const char* fmt, ...) {
+  uint64_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  log_slot_t* slot;
+
+  // Claim the slot at head, unless the consumer hasn't freed it yet
+  while (1) {
+    slot = &ring[pos & (LOG_RING - 1)];
+    int64_t lag = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+                            pos);
+    if (lag == 0) {
+      if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (lag < 0) {
+      // Still holds the line from a lap ago, the ring is full
+      metrics_add(METRIC_LOG_DROPPED, 1);
+      return;
+    } else {
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(slot->text, LOG_LINE, fmt, args);
+  va_end(args);
+  slot->len = len < 0 ? 0 : len >= LOG_LINE ? LOG_LINE - 1 : len;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  // Pairs with the fence in log_thread, one side always sees the other
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&wake_mutex);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_mutex);
+  }
+}
+
+// Is the slot at tail full
+static int ready(void) {
+  log_slot_t* slot = &ring[tail & (LOG_RING - 1)];
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == tail + 1;
+}
+
+// Write out every full slot, drain_mutex held
+// @return how many lines were written
+static int drain(void) {
+  int lines = 0;
+
+  while (ready()) {
+    log_slot_t* slot = &ring[tail & (LOG_RING - 1)];
+    fwrite(slot->text, 1, slot->len, stdout);
+    if (slot->len == 0 || slot->text[slot->len - 1] != '\n') {
+      fputc('\n', stdout);
+    }
+    __atomic_store_n(&slot->seq, tail + LOG_RING, __ATOMIC_RELEASE);
+    tail++;
+    lines++;
+  }
+  if (lines > 0) {
+    fflush(stdout);
+  }
+  return lines;
+}
+
+static void* log_thread(void* arg) {
+  (void)arg;
+
+  while (1) {
+    pthread_mutex_lock(&drain_mutex);
+    int lines = drain();
+    pthread_mutex_unlock(&drain_mutex);
+    if (lines > 0) {
+      continue;
+    }
+
+    // Say we are going to sleep, then look once more, so a line queued
+    // in between either is seen here or sees sleeping and signals
+    pthread_mutex_lock(&wake_mutex);
+    __atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&drain_mutex);
+    int empty = !ready();
+    pthread_mutex_unlock(&drain_mutex);
+    if (empty) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += 1;
+      pthread_cond_timedwait(&wake_cond, &wake_mutex, &until);
+    }
+    __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wake_mutex);
+  }
+
+  return NULL;
+}
+
+int log_init(void) {
+  pthread_t tid;
+
+  for (uint64_t i = 0; i < LOG_RING; i++) {
+    ring[i].seq = i;
+  }
+  if (pthread_create(&tid, NULL, log_thread, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+void log_flush(void) {
+  pthread_mutex_lock(&drain_mutex);
+  drain();
+  pthread_mutex_unlock(&drain_mutex);
+}
@@ -0,0 +1,62 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/*
+ * Asynchronous, leveled server log
+ *
+ * A log call formats its line into a slot of a lock-free ring and
+ * returns; one logger thread writes the lines out to stdout in batches.
+ * Request handling never waits for the terminal or a pipe. A line whose
+ * level is above log_level costs one comparison, nothing is formatted.
+ * When the ring is full the line is dropped and counted
+ * (rfs_log_dropped_total) instead of making the caller wait.
+ *
+ *   error  something failed on the server side
+ *   warn   a client misbehaved or went away mid request
+ *   info   one line per request and its outcome (the default)
+ *   debug  connections and the details of every transfer
+ */
+
+#define LOG_OFF -1
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+#define LOG_RING 4096  // slots, a power of two
+#define LOG_LINE 240   // longest line kept, longer ones are cut
+
+// Set by the -l flag
+extern int log_level;
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_at(level, ...)          \
+  do {                              \
+    if ((level) <= log_level) {     \
+      log_write(__VA_ARGS__);       \
+    }                               \
+  } while (0)
+
+/**
+ * Level named on the command line
+ * @param name - off, error, warn, info or debug
+ * @return its LOG_* value, or -2 if there is no such level
+ */
+int log_parse_level(const char* name);
+
+// Start the logger thread
+
+int log_init(void);
+
+// Queue a printf style line, use the log_* macros instead
+
+void log_write(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Write out everything queued so far, before the server exits
+
+void log_flush(void);
+
+#endif
@@ -0,0 +1,866 @@
+/*
+ * metaindex.c -- Memory-mapped index of the files under ROOT_DIR
+ *
+ * Slots are probed linearly from the hash of their path. A removed entry
+ * leaves a deleted slot behind for probes to go on past; the table is
+ * rewritten once live and deleted slots pass META_MAX_LOAD percent.
+ * The entries of a directory are a doubly linked list through their
+ * slots, headed by the directory's slot (by the header for ROOT_DIR).
+ * Links are slot numbers plus one, so 0 is the end of a list.
+ */
+
+#define _GNU_SOURCE
+
+#include "metaindex.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#define META_MAGIC 0x52465349  // "RFSI"
+#define META_FORMAT 1
+#define META_HEADER_SIZE 4096
+#define META_INITIAL_NAMES (1 << 20)
+
+// Slot states
+#define SLOT_FREE 0
+#define SLOT_LIVE 1
+#define SLOT_DELETED 2
+
+// ROOT_DIR, as the directory an entry is in
+#define ROOT_SLOT -2
+
+typedef struct {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t clean;       // synced by a STOP and unchanged since
+  uint32_t root_child;  // first entry right under ROOT_DIR
+  uint64_t slots;       // a power of two
+  uint64_t count;       // live slots
+  uint64_t used;        // live and deleted slots
+  uint64_t names_len;   // bytes of the names file in use
+} meta_header_t;
+
+// 64 bytes
+typedef struct {
+  uint64_t hash;      // hash_path() of the path
+  uint64_t name_off;  // where the path is in the names file
+  uint64_t size;
+  uint64_t mtime;
+  uint32_t latest;
+  uint32_t crc;
+  uint32_t child;  // first entry of a directory
+  uint32_t next;   // entries of the same directory
+  uint32_t prev;
+  uint16_t name_len;
+  uint8_t state;
+  uint8_t type;
+  uint8_t location;
+  uint8_t has_crc;
+  uint8_t unused[6];
+} meta_slot_t;
+
+// A mapped pair of index and names files
+typedef struct {
+  int fd;
+  int names_fd;
+  unsigned char* map;
+  size_t map_len;
+  meta_header_t* header;
+  meta_slot_t* slots;
+  char* names;
+  size_t names_cap;
+} meta_file_t;
+
+static meta_file_t current = {-1, -1, NULL, 0, NULL, NULL, NULL, 0};
+static pthread_rwlock_t meta_lock;
+static int closed = 0;
+
+// Normalize a remote path into a key: no empty or "." components
+// @param key - output buffer of MAX_PATH bytes
+static int make_key(const char* path, char* key) {
+  size_t len = 0;
+  const char* p = path;
+
+  while (*p != '\0') {
+    const char* end = strchr(p, '/');
+    size_t part = end != NULL ? (size_t)(end - p) : strlen(p);
+
+    if (part > 0 && !(part == 1 && p[0] == '.')) {
+      if (len + part + 2 > MAX_PATH) {
+        return -1;
+      }
+      if (len > 0) {
+        key[len++] = '/';
+      }
+      memcpy(key + len, p, part);
+      len += part;
+    }
+    if (end == NULL) {
+      break;
+    }
+    p = end + 1;
+  }
+  key[len] = '\0';
+  return 0;
+}
+
+static void unmap_files(meta_file_t* f) {
+  if (f->map != NULL) {
+    munmap(f->map, f->map_len);
+  }
+  if (f->names != NULL) {
+    munmap(f->names, f->names_cap);
+  }
+  if (f->fd >= 0) {
+    close(f->fd);
+  }
+  if (f->names_fd >= 0) {
+    close(f->names_fd);
+  }
+  f->fd = f->names_fd = -1;
+  f->map = NULL;
+  f->names = NULL;
+}
+
+// Map an index and its names, whatever their contents
+static int map_files(meta_file_t* f, int fd, int names_fd) {
+  struct stat st;
+  struct stat names_st;
+
+  f->fd = fd;
+  f->names_fd = names_fd;
+  if (fstat(fd, &st) != 0 || fstat(names_fd, &names_st) != 0 ||
+      st.st_size < META_HEADER_SIZE || names_st.st_size == 0) {
+    return -1;
+  }
+  f->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (f->map == MAP_FAILED) {
+    f->map = NULL;
+    return -1;
+  }
+  f->map_len = st.st_size;
+  f->names = mmap(NULL, names_st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  names_fd, 0);
+  if (f->names == MAP_FAILED) {
+    f->names = NULL;
+    return -1;
+  }
+  f->names_cap = names_st.st_size;
+  f->header = (meta_header_t*)f->map;
+  f->slots = (meta_slot_t*)(f->map + META_HEADER_SIZE);
+  return 0;
+}
+
+// Is a mapped index one a STOP left behind
+static int valid_index(const meta_file_t* f) {
+  const meta_header_t* h = f->header;
+
+  return h->magic == META_MAGIC && h->format == META_FORMAT &&
+         h->clean == 1 && h->slots > 0 && (h->slots & (h->slots - 1)) == 0 &&
+         f->map_len == META_HEADER_SIZE + h->slots * sizeof(meta_slot_t) &&
+         h->count <= h->used && h->used < h->slots &&
+         h->names_len <= f->names_cap;
+}
+
+// Create an empty index, dirty until a STOP
+static int create_files(meta_file_t* f, uint64_t slots, size_t names_cap,
+                        const char* path, const char* names_path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int names_fd = open(names_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0 || names_fd < 0 ||
+      ftruncate(fd, META_HEADER_SIZE + slots * sizeof(meta_slot_t)) != 0 ||
+      ftruncate(names_fd, names_cap) != 0 ||
+      map_files(f, fd, names_fd) != 0) {
+    if (fd >= 0 && f->fd != fd) {
+      close(fd);
+    }
+    if (names_fd >= 0 && f->names_fd != names_fd) {
+      close(names_fd);
+    }
+    unmap_files(f);
+    return -1;
+  }
+  f->header->magic = META_MAGIC;
+  f->header->format = META_FORMAT;
+  f->header->slots = slots;
+  return 0;
+}
+
+// Slot of a key, or -1
+static long find_slot(const meta_file_t* f, const char* key) {
+  uint64_t hash = hash_path(key);
+  size_t len = strlen(key);
+  uint64_t mask = f->header->slots - 1;
+
+  for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+    const meta_slot_t* s = &f->slots[i];
+    if (s->state == SLOT_FREE) {
+      return -1;
+    }
+    if (s->state == SLOT_LIVE && s->hash == hash && s->name_len == len &&
+        memcmp(f->names + s->name_off, key, len) == 0) {
+      return i;
+    }
+  }
+}
+
+// Copy the path of a slot out as a string
+static void slot_key(const meta_file_t* f, const meta_slot_t* s, char* key) {
+  memcpy(key, f->names + s->name_off, s->name_len);
+  key[s->name_len] = '\0';
+}
+
+// Slot of the directory an entry is in, ROOT_SLOT for ROOT_DIR
+static long parent_slot(const meta_file_t* f, const char* key) {
+  char parent[MAX_PATH];
+  const char* slash = strrchr(key, '/');
+
+  if (slash == NULL) {
+    return ROOT_SLOT;
+  }
+  snprintf(parent, sizeof(parent), "%.*s", (int)(slash - key), key);
+  long slot = find_slot(f, parent);
+  return slot >= 0 ? slot : ROOT_SLOT;
+}
+
+static uint32_t* first_child(meta_file_t* f, long dir) {
+  return dir == ROOT_SLOT ? &f->header->root_child : &f->slots[dir].child;
+}
+
+static void link_slot(meta_file_t* f, long slot, long dir) {
+  uint32_t* head = first_child(f, dir);
+  meta_slot_t* s = &f->slots[slot];
+
+  s->prev = 0;
+  s->next = *head;
+  if (*head != 0) {
+    f->slots[*head - 1].prev = slot + 1;
+  }
+  *head = slot + 1;
+}
+
+static void unlink_slot(meta_file_t* f, long slot, long dir) {
+  meta_slot_t* s = &f->slots[slot];
+
+  if (s->prev != 0) {
+    f->slots[s->prev - 1].next = s->next;
+  } else {
+    *first_child(f, dir) = s->next;
+  }
+  if (s->next != 0) {
+    f->slots[s->next - 1].prev = s->prev;
+  }
+}
+
+// Keep a path in the names file
+// @param off - output, where it went
+static int append_name(meta_file_t* f, const char* key, size_t len,
+                       uint64_t* off) {
+  uint64_t end = f->header->names_len;
+
+  if (end + len > f->names_cap) {
+    size_t cap = f->names_cap * 2;
+    while (cap < end + len) {
+      cap *= 2;
+    }
+    if (ftruncate(f->names_fd, cap) != 0) {
+      return -1;
+    }
+    char* grown = mremap(f->names, f->names_cap, cap, MREMAP_MAYMOVE);
+    if (grown == MAP_FAILED) {
+      return -1;
+    }
+    f->names = grown;
+    f->names_cap = cap;
+  }
+  memcpy(f->names + end, key, len);
+  *off = end;
+  f->header->names_len = end + len;
+  return 0;
+}
+
+// Give a key that has no slot one, linked into its directory
+// There must be a free slot, see reserve_slot().
+static long insert_slot(meta_file_t* f, const char* key, int type) {
+  uint64_t hash = hash_path(key);
+  size_t len = strlen(key);
+  uint64_t mask = f->header->slots - 1;
+  uint64_t off;
+
+  if (append_name(f, key, len, &off) != 0) {
+    return -1;
+  }
+  uint64_t i = hash & mask;
+  while (f->slots[i].state == SLOT_LIVE) {
+    i = (i + 1) & mask;
+  }
+
+  meta_slot_t* s = &f->slots[i];
+  if (s->state == SLOT_FREE) {
+    f->header->used++;
+  }
+  memset(s, 0, sizeof(*s));
+  s->hash = hash;
+  s->name_off = off;
+  s->name_len = len;
+  s->state = SLOT_LIVE;
+  s->type = type;
+  f->header->count++;
+  link_slot(f, i, parent_slot(f, key));
+  return i;
+}
+
+// Rewrite the index into a new pair of files with room to spare, which
+// also drops the deleted slots and the paths of removed entries
+static int grow_index(void) {
+  char key[MAX_PATH];
+  meta_file_t f = {-1, -1, NULL, 0, NULL, NULL, NULL, 0};
+  uint64_t slots = current.header->slots;
+
+  while ((current.header->count + 1) * 100 * 2 >= slots * META_MAX_LOAD) {
+    slots *= 2;
+  }
+  if (create_files(&f, slots, current.names_cap, META_INDEX_FILE ".tmp",
+                   META_NAMES_FILE ".tmp") != 0) {
+    return -1;
+  }
+
+  uint64_t mask = slots - 1;
+  for (uint64_t i = 0; i < current.header->slots; i++) {
+    const meta_slot_t* s = &current.slots[i];
+    if (s->state != SLOT_LIVE) {
+      continue;
+    }
+    uint64_t j = s->hash & mask;
+    while (f.slots[j].state == SLOT_LIVE) {
+      j = (j + 1) & mask;
+    }
+    meta_slot_t* d = &f.slots[j];
+    *d = *s;
+    d->name_off = f.header->names_len;
+    d->child = d->next = d->prev = 0;
+    memcpy(f.names + d->name_off, current.names + s->name_off, s->name_len);
+    f.header->names_len += s->name_len;
+    f.header->count++;
+    f.header->used++;
+  }
+
+  // Linked once every directory has its new slot
+  for (uint64_t j = 0; j < slots; j++) {
+    if (f.slots[j].state == SLOT_LIVE) {
+      slot_key(&f, &f.slots[j], key);
+      link_slot(&f, j, parent_slot(&f, key));
+    }
+  }
+
+  if (rename(META_NAMES_FILE ".tmp", META_NAMES_FILE) != 0 ||
+      rename(META_INDEX_FILE ".tmp", META_INDEX_FILE) != 0) {
+    unmap_files(&f);
+    unlink(META_NAMES_FILE ".tmp");
+    unlink(META_INDEX_FILE ".tmp");
+    return -1;
+  }
+  unmap_files(&current);
+  current = f;
+  log_info("Metadata index grown to %llu slots",
+           (unsigned long long)slots);
+  return 0;
+}
+
+// Make sure the next insert_slot() has a slot, meta_lock held alone
+static int reserve_slot(void) {
+  if ((current.header->used + 1) * 100 <
+      current.header->slots * META_MAX_LOAD) {
+    return 0;
+  }
+  return grow_index();
+}
+
+// Set the mtime of the directory an entry is in, it just changed
+static void touch_parent(const char* key, uint64_t now) {
+  long dir = parent_slot(&current, key);
+
+  if (dir >= 0) {
+    current.slots[dir].mtime = now;
+  }
+}
+
+// Slot of a key, added along with the directories above it if it has
+// none; valid until the next insert
+// @param touch - set the mtime of directories that gain an entry
+static long find_or_add(const char* key, int type, uint64_t now, int touch) {
+  char dir[MAX_PATH];
+  long slot = find_slot(&current, key);
+
+  if (slot >= 0) {
+    return slot;
+  }
+  for (const char* p = strchr(key, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    snprintf(dir, sizeof(dir), "%.*s", (int)(p - key), key);
+    if (find_slot(&current, dir) >= 0) {
+      continue;
+    }
+    if (reserve_slot() != 0 ||
+        (slot = insert_slot(&current, dir, RFS_ENTRY_DIR)) < 0) {
+      return -1;
+    }
+    current.slots[slot].mtime = now;
+    if (touch) {
+      touch_parent(dir, now);
+    }
+  }
+  if (reserve_slot() != 0) {
+    return -1;
+  }
+  return insert_slot(&current, key, type);
+}
+
+// Add or replace an entry, meta_lock held alone
+static int put_entry(const char* key, const meta_info_t* info, int touch) {
+  uint64_t now = time(NULL);
+
+  if (closed) {
+    return 0;
+  }
+  long slot = find_or_add(key, info->type, now, touch);
+  if (slot < 0) {
+    return -1;
+  }
+  meta_slot_t* s = &current.slots[slot];
+  s->type = info->type;
+  s->size = info->size;
+  s->mtime = info->mtime;
+  if (info->latest >= 0) {
+    s->latest = info->latest;
+  }
+  s->crc = info->crc;
+  s->has_crc = info->has_crc;
+  s->location = info->location;
+  if (touch) {
+    touch_parent(key, now);
+  }
+  return 0;
+}
+
+static void remove_slot(long slot, const char* key) {
+  unlink_slot(&current, slot, parent_slot(&current, key));
+  current.slots[slot].state = SLOT_DELETED;
+  current.header->count--;
+}
+
+// Is a slot a version of a file, path.vN with N up to the file's latest
+static int is_version_slot(const meta_slot_t* s) {
+  char base[MAX_PATH];
+
+  slot_key(&current, s, base);
+  char* dot = strrchr(base, '.');
+  if (dot == NULL || dot[1] != 'v' || dot[2] == '\0' ||
+      strspn(dot + 2, "0123456789") != strlen(dot + 2)) {
+    return 0;
+  }
+  int version = atoi(dot + 2);
+  *dot = '\0';
+  long slot = find_slot(&current, base);
+  return slot >= 0 && current.slots[slot].type == RFS_ENTRY_FILE &&
+         version <= (int)current.slots[slot].latest;
+}
+
+int meta_get(const char* path, meta_info_t* info) {
+  char key[MAX_PATH];
+
+  memset(info, 0, sizeof(*info));
+  if (current.header == NULL || make_key(path, key) != 0) {
+    return -1;
+  }
+  if (key[0] == '\0') {
+    info->type = RFS_ENTRY_DIR;
+    return 0;
+  }
+
+  pthread_rwlock_rdlock(&meta_lock);
+  long slot = find_slot(&current, key);
+  if (slot >= 0) {
+    const meta_slot_t* s = &current.slots[slot];
+    info->type = s->type;
+    info->size = s->size;
+    info->mtime = s->mtime;
+    info->latest = s->latest;
+    info->crc = s->crc;
+    info->has_crc = s->has_crc;
+    info->location = s->location;
+  }
+  pthread_rwlock_unlock(&meta_lock);
+  return slot >= 0 ? 0 : -1;
+}
+
+int meta_put(const char* path, const meta_info_t* info) {
+  char key[MAX_PATH];
+
+  if (current.header == NULL || make_key(path, key) != 0 || key[0] == '\0') {
+    return -1;
+  }
+  pthread_rwlock_wrlock(&meta_lock);
+  int result = put_entry(key, info, 1);
+  pthread_rwlock_unlock(&meta_lock);
+  if (result != 0) {
+    log_error("error occured!: Failed to update the metadata index for %s",
+              key);
+  }
+  return result;
+}
+
+void meta_set_latest(const char* path, int latest) {
+  char key[MAX_PATH];
+
+  if (current.header == NULL || make_key(path, key) != 0) {
+    return;
+  }
+  pthread_rwlock_wrlock(&meta_lock);
+  long slot = closed ? -1 : find_slot(&current, key);
+  if (slot >= 0) {
+    current.slots[slot].latest = latest;
+  }
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+int meta_save_version(const char* path, int version) {
+  char key[MAX_PATH];
+  char version_key[MAX_PATH];
+  uint64_t now = time(NULL);
+  int result = 0;
+
+  if (current.header == NULL || make_key(path, key) != 0 ||
+      snprintf(version_key, sizeof(version_key), "%s.v%d", key, version) >=
+          (int)sizeof(version_key)) {
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&meta_lock);
+  long slot = closed ? -1 : find_slot(&current, key);
+  if (slot >= 0) {
+    meta_slot_t file = current.slots[slot];
+    long copy = find_or_add(version_key, RFS_ENTRY_FILE, now, 1);
+    if (copy >= 0) {
+      meta_slot_t* s = &current.slots[copy];
+      s->type = RFS_ENTRY_FILE;
+      s->size = file.size;
+      s->mtime = file.mtime;
+      s->latest = 0;
+      s->crc = file.crc;
+      s->has_crc = file.has_crc;
+      s->location = file.location;
+      // The insert may have moved the file to a new table
+      current.slots[find_slot(&current, key)].latest = version;
+      touch_parent(key, now);
+    } else {
+      result = -1;
+    }
+  }
+  pthread_rwlock_unlock(&meta_lock);
+  return result;
+}
+
+void meta_remove(const char* path) {
+  char key[MAX_PATH];
+  char version_key[MAX_PATH];
+
+  if (current.header == NULL || make_key(path, key) != 0 || key[0] == '\0') {
+    return;
+  }
+
+  pthread_rwlock_wrlock(&meta_lock);
+  long slot = closed ? -1 : find_slot(&current, key);
+  // A directory goes only once it is empty
+  if (slot >= 0 && current.slots[slot].child == 0) {
+    int latest = current.slots[slot].type == RFS_ENTRY_FILE
+                     ? (int)current.slots[slot].latest
+                     : 0;
+    remove_slot(slot, key);
+    for (int version = 1; version <= latest; version++) {
+      // A name too long for a key has no entry
+      if (snprintf(version_key, sizeof(version_key), "%s.v%d", key,
+                   version) >= (int)sizeof(version_key)) {
+        break;
+      }
+      if ((slot = find_slot(&current, version_key)) >= 0) {
+        remove_slot(slot, version_key);
+      }
+    }
+    touch_parent(key, time(NULL));
+  }
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+int meta_list(const char* dir, unsigned char** entries, size_t* len) {
+  char key[MAX_PATH];
+  unsigned char* buf = NULL;
+  size_t cap = 0;
+  int result = 0;
+
+  *entries = NULL;
+  *len = 0;
+  if (current.header == NULL || make_key(dir, key) != 0) {
+    return 0;
+  }
+  size_t skip = key[0] != '\0' ? strlen(key) + 1 : 0;
+
+  pthread_rwlock_rdlock(&meta_lock);
+  long slot = key[0] != '\0' ? find_slot(&current, key) : ROOT_SLOT;
+  if (slot == -1 || (slot >= 0 && current.slots[slot].type != RFS_ENTRY_DIR)) {
+    pthread_rwlock_unlock(&meta_lock);
+    return 0;
+  }
+
+  for (uint32_t n = *first_child(&current, slot); n != 0;
+       n = current.slots[n - 1].next) {
+    const meta_slot_t* s = &current.slots[n - 1];
+    size_t name_len = s->name_len - skip;
+    if (*len + RFS_ENTRY_HEADER_SIZE + name_len > cap) {
+      size_t grown_cap = cap > 0 ? cap * 2 : 16 * 1024;
+      unsigned char* grown = realloc(buf, grown_cap);
+      if (grown == NULL) {
+        result = -1;
+        break;
+      }
+      buf = grown;
+      cap = grown_cap;
+    }
+
+    unsigned char* p = buf + *len;
+    int is_dir = s->type == RFS_ENTRY_DIR;
+    p[0] = is_dir                ? RFS_ENTRY_DIR
+           : is_version_slot(s) ? RFS_ENTRY_VERSION
+                                 : RFS_ENTRY_FILE;
+    rfs_put_u64(p + 1, is_dir ? 0 : s->size);
+    rfs_put_u64(p + 9, s->mtime);
+    p[17] = name_len >> 8;
+    p[18] = name_len & 0xff;
+    memcpy(p + RFS_ENTRY_HEADER_SIZE, current.names + s->name_off + skip,
+           name_len);
+    *len += RFS_ENTRY_HEADER_SIZE + name_len;
+  }
+  pthread_rwlock_unlock(&meta_lock);
+
+  if (result != 0 || *len == 0) {
+    free(buf);
+    *len = 0;
+    return result;
+  }
+  *entries = buf;
+  return 0;
+}
+
+size_t meta_count(void) {
+  pthread_rwlock_rdlock(&meta_lock);
+  size_t count = current.header != NULL ? current.header->count : 0;
+  pthread_rwlock_unlock(&meta_lock);
+  return count;
+}
+
+void meta_close(void) {
+  if (current.header == NULL) {
+    return;
+  }
+  pthread_rwlock_wrlock(&meta_lock);
+  if (!closed && msync(current.names, current.names_cap, MS_SYNC) == 0 &&
+      msync(current.map, current.map_len, MS_SYNC) == 0) {
+    current.header->clean = 1;
+    msync(current.map, META_HEADER_SIZE, MS_SYNC);
+  }
+  closed = 1;
+  pthread_rwlock_unlock(&meta_lock);
+}
+
+// Add an entry found while rebuilding
+static int rebuild_entry(const char* key, const meta_info_t* info) {
+  pthread_rwlock_wrlock(&meta_lock);
+  int result = put_entry(key, info, 0);
+  pthread_rwlock_unlock(&meta_lock);
+  return result;
+}
+
+// Index the versions of a file that are only recipes in the chunk store
+// The others are files of their own, found by the walk.
+static int rebuild_chunked_versions(const char* path, const char* full_path,
+                                    int latest) {
+  char version_path[MAX_PATH];
+  char version_key[MAX_PATH];
+  char suffix[16];
+  char recipe[MAX_PATH];
+  struct stat st;
+  meta_info_t info;
+  int r = 0;
+
+  for (int version = 1; r == 0 && version <= latest; version++) {
+    snprintf(suffix, sizeof(suffix), ".v%d", version);
+    if (snprintf(version_path, sizeof(version_path), "%s%s", full_path,
+                 suffix) >= (int)sizeof(version_path) ||
+        snprintf(version_key, sizeof(version_key), "%s%s", path, suffix) >=
+            (int)sizeof(version_key) ||
+        access(version_path, F_OK) == 0 ||
+        get_recipe_path(full_path, suffix, recipe) != 0 ||
+        stat(recipe, &st) != 0) {
+      continue;
+    }
+    long size = recipe_size(recipe);
+    if (size < 0) {
+      continue;
+    }
+    memset(&info, 0, sizeof(info));
+    info.type = RFS_ENTRY_FILE;
+    info.size = size;
+    info.mtime = st.st_mtime;
+    info.location = META_CHUNKED;
+    r = rebuild_entry(version_key, &info);
+  }
+  return r;
+}
+
+// Index a directory under ROOT_DIR and everything below it
+static int rebuild_dir(const char* dir) {
+  char full_dir[MAX_PATH];
+  char path[MAX_PATH];
+  char full_path[MAX_PATH];
+  char recipe[MAX_PATH];
+  unsigned char value[CHECKSUM_SIZE];
+  struct dirent* entry;
+  struct stat st;
+  meta_info_t info;
+  int r = 0;
+
+  snprintf(full_dir, sizeof(full_dir), "%s/%s", ROOT_DIR, dir);
+  DIR* d = opendir(full_dir);
+  if (d == NULL) {
+    return 0;
+  }
+
+  while (r == 0 && (entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        (dir[0] == '\0' && strcmp(entry->d_name, META_NAME) == 0)) {
+      continue;
+    }
+    if (snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] ? "/" : "",
+                 entry->d_name) >= (int)sizeof(path) ||
+        snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_DIR, path) >=
+            (int)sizeof(full_path) ||
+        lstat(full_path, &st) != 0) {
+      continue;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.mtime = st.st_mtime;
+    if (S_ISDIR(st.st_mode)) {
+      info.type = RFS_ENTRY_DIR;
+      r = rebuild_entry(path, &info);
+      if (r == 0) {
+        r = rebuild_dir(path);
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      info.type = RFS_ENTRY_FILE;
+      info.size = st.st_size;
+      info.latest = load_latest_version(full_path);
+      if (lgetxattr(full_path, CHECKSUM_XATTR, value, sizeof(value)) ==
+          (ssize_t)sizeof(value)) {
+        info.crc = rfs_get_u32(value);
+        info.has_crc = 1;
+      }
+      info.location =
+          get_recipe_path(full_path, CURRENT_RECIPE, recipe) == 0 &&
+                  access(recipe, F_OK) == 0
+              ? META_CHUNKED
+              : META_PLAIN;
+      r = rebuild_entry(path, &info);
+      if (r == 0) {
+        r = rebuild_chunked_versions(path, full_path, info.latest);
+      }
+    }
+  }
+
+  closedir(d);
+  return r;
+}
+
+// Index the files and versions of the pack segments
+static int rebuild_packs(void) {
+  char key[MAX_PATH];
+  meta_info_t info;
+  size_t len;
+  int r = 0;
+
+  unsigned char* entries = pack_list("", 1, &len);
+  for (size_t off = 0; r == 0 && off < len;) {
+    const unsigned char* p = entries + off;
+    size_t name_len = (p[17] << 8) | p[18];
+    off += RFS_ENTRY_HEADER_SIZE + name_len;
+
+    memcpy(key, p + RFS_ENTRY_HEADER_SIZE, name_len);
+    key[name_len] = '\0';
+    memset(&info, 0, sizeof(info));
+    info.type = RFS_ENTRY_FILE;
+    long size = pack_stat(key, &info.mtime, &info.crc, &info.latest);
+    if (size < 0) {
+      continue;
+    }
+    info.size = size;
+    info.has_crc = 1;
+    info.location = META_PACKED;
+    r = rebuild_entry(key, &info);
+  }
+  free(entries);
+  return r;
+}
+
+int meta_init(void) {
+  pthread_rwlockattr_t attr;
+
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&meta_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+
+  // A clean index is used as it is; it is dirty from now on
+  int fd = open(META_INDEX_FILE, O_RDWR);
+  int names_fd = open(META_NAMES_FILE, O_RDWR);
+  if (fd >= 0 && names_fd >= 0) {
+    if (map_files(&current, fd, names_fd) == 0 && valid_index(&current)) {
+      current.header->clean = 0;
+      if (msync(current.map, META_HEADER_SIZE, MS_SYNC) == 0) {
+        return 0;
+      }
+    }
+    unmap_files(&current);
+  } else {
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (names_fd >= 0) {
+      close(names_fd);
+    }
+  }
+
+  // A crash during the rebuild just leaves another dirty index
+  unlink(META_INDEX_FILE ".tmp");
+  unlink(META_NAMES_FILE ".tmp");
+  if (create_files(&current, META_INITIAL_SLOTS, META_INITIAL_NAMES,
+                   META_INDEX_FILE, META_NAMES_FILE) != 0) {
+    return -1;
+  }
+  if (rebuild_dir("") != 0 || rebuild_packs() != 0) {
+    return -1;
+  }
+  return 1;
+}
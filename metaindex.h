@@ -0,0 +1,109 @@
+#ifndef METAINDEX_H
+#define METAINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Persistent metadata index of everything under ROOT_DIR
+ *
+ * Every file, version and directory has an entry with its size, mtime,
+ * latest version, checksum and where its contents are kept. The entries
+ * are slots of an open addressing hash table in META_INDEX_FILE, mapped
+ * into memory, and their paths are kept in META_NAMES_FILE. Each slot
+ * also links the entries of a directory together, so LIST is answered
+ * from the index without readdir() or a stat() per entry, and the
+ * latest version of a file without opening its manifest.
+ *
+ * Entries change under the file's lock, in the same step as the file
+ * itself: a WRITE's commit, a version being saved, a RM. The table grows
+ * by writing a new pair of files and renaming them over the old ones.
+ *
+ * The files are not synced as they change. A STOP syncs them and marks
+ * the index clean; a server that starts with a clean index maps it and
+ * is ready at once, whatever the number of files. One that finds it
+ * missing or left dirty by a crash builds it again by walking ROOT_DIR
+ * and the pack segments, which the manifests, checksum attributes and
+ * packs on disk always describe completely. Files must not be changed
+ * under ROOT_DIR by hand while the index is clean; removing
+ * META_INDEX_FILE makes the next start rebuild it.
+ */
+
+#define META_INDEX_FILE ROOT_DIR "/" META_NAME "/index"
+#define META_NAMES_FILE ROOT_DIR "/" META_NAME "/index.names"
+#define META_INITIAL_SLOTS (1 << 16)
+#define META_MAX_LOAD 70  // percent of slots in use before the table grows
+
+// Where a file's contents are kept
+#define META_PLAIN 0    // a file of its own under ROOT_DIR
+#define META_CHUNKED 1  // that and a recipe, or just the recipe for a version
+#define META_PACKED 2   // a pack segment, see pack.h
+
+typedef struct {
+  int type;         // RFS_ENTRY_FILE or RFS_ENTRY_DIR
+  uint64_t size;    // 0 for a directory
+  uint64_t mtime;
+  int latest;       // latest version; -1 keeps the old one in meta_put()
+  uint32_t crc;     // CRC32C of the contents, when has_crc is set
+  int has_crc;
+  int location;     // META_*
+} meta_info_t;
+
+/**
+ * Map the index, or build it again from the tree
+ * @return 0 if it was loaded, 1 if it was rebuilt, -1 on error
+ */
+int meta_init(void);
+
+// Number of entries
+
+size_t meta_count(void);
+
+// Sync the index and mark it clean, for STOP; it can't change after
+
+void meta_close(void);
+
+/**
+ * Look up a remote path
+ * @param path - remote path, "" for ROOT_DIR itself
+ * @param info - output, its entry
+ * @return 0, or -1 if there is nothing there
+ */
+int meta_get(const char* path, meta_info_t* info);
+
+/**
+ * Add or replace the entry of a file, with its missing directories
+ * @param path - remote path of a file or version
+ * @param info - its entry
+ * @return 0, or -1 if the index can't grow
+ */
+int meta_put(const char* path, const meta_info_t* info);
+
+// Record a file's latest version, if it has an entry
+
+void meta_set_latest(const char* path, int latest);
+
+/**
+ * Copy a file's entry to its version path.vN, for a version saved by a
+ * rename or a pack LINK, and make it the latest
+ * @param path - remote path of the file
+ * @param version - the new version
+ * @return 0, or -1 if the index can't grow
+ */
+int meta_save_version(const char* path, int version);
+
+// Remove an entry, and a file's versions with it
+
+void meta_remove(const char* path);
+
+/**
+ * List the entries right inside a directory as LIST entries, see
+ * protocol.h, named relative to it
+ * @param dir - remote path of the directory
+ * @param entries - output, a malloc()ed buffer, NULL if there are none
+ * @param len - output, bytes of entries
+ * @return 0, or -1 if there is no memory
+ */
+int meta_list(const char* dir, unsigned char** entries, size_t* len);
+
+#endif
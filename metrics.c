@@ -0,0 +1,259 @@
+/*
+ * metrics.c -- Per-thread counters and latency histograms
+ */
+
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "protocol.h"
+
+// One thread's counters, only ever written by that thread
+typedef struct metrics_block {
+  uint64_t counters[METRIC_COUNT];
+  uint64_t requests[METRIC_OPS];
+  uint64_t errors[METRIC_OPS];
+  uint64_t latency_us[METRIC_OPS];  // sum
+  uint64_t buckets[METRIC_OPS][METRIC_BUCKETS];
+  uint64_t accepts[METRIC_REACTORS];
+  struct metrics_block* next;
+} metrics_block_t;
+
+// Every thread's block, newest first; only ever pushed to
+static metrics_block_t* blocks = NULL;
+static pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread metrics_block_t* local_block = NULL;
+
+// Names and help of the plain counters, in enum order
+static const char* counter_names[METRIC_COUNT][2] = {
+    {"rfs_bytes_received_total", "Bytes read from client sockets"},
+    {"rfs_bytes_sent_total", "Bytes written to client sockets"},
+    {"rfs_connections_total", "Connections accepted"},
+    {"rfs_connections_closed_total", "Connections closed"},
+    {"rfs_locks_taken_total", "File locks granted without waiting"},
+    {"rfs_lock_waits_total", "File locks that had to wait"},
+    {"rfs_lock_wait_microseconds_total", "Time spent waiting for locks"},
+    {"rfs_file_cache_hits_total", "GETs answered from the file cache"},
+    {"rfs_file_cache_misses_total", "GETs that missed the file cache"},
+    {"rfs_snapshot_hits_total", "GETs of an already open snapshot"},
+    {"rfs_snapshot_misses_total", "GETs that had to open the file"},
+    {"rfs_log_dropped_total", "Log lines dropped, the log was full"},
+    {"rfs_busy_total", "Requests and connections turned away with BUSY"},
+    {"rfs_moved_total", "Requests answered MOVED, another node owns them"},
+    {"rfs_handoff_files_total", "Files handed off to their new owner"},
+    {"rfs_replicated_total", "WRITEs and RMs acknowledged by a replica"},
+    {"rfs_checksum_errors_total", "WRITEs whose data failed its checksum"},
+    {"rfs_packed_writes_total", "Small WRITEs appended to a pack segment"},
+    {"rfs_pack_compactions_total", "Pack segments compacted away"},
+};
+
+uint64_t metrics_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The calling thread's block, created on first use
+// @return the block, or NULL if it could not be allocated
+static metrics_block_t* get_block(void) {
+  if (local_block == NULL) {
+    metrics_block_t* block = calloc(1, sizeof(metrics_block_t));
+    if (block == NULL) {
+      return NULL;
+    }
+    pthread_mutex_lock(&blocks_mutex);
+    block->next = blocks;
+    blocks = block;
+    pthread_mutex_unlock(&blocks_mutex);
+    local_block = block;
+  }
+  return local_block;
+}
+
+// Add to a counter of the calling thread's block; STATS reads it from
+// another thread, so the store has to be one the reader can't tear
+static void bump(uint64_t* counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t* counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void metrics_add(int metric, uint64_t n) {
+  metrics_block_t* block = get_block();
+  if (block != NULL) {
+    bump(&block->counters[metric], n);
+  }
+}
+
+void metrics_reactor_accept(int reactor) {
+  metrics_block_t* block = get_block();
+  if (block != NULL && reactor >= 0 && reactor < METRIC_REACTORS) {
+    bump(&block->accepts[reactor], 1);
+  }
+}
+
+void metrics_request(int opcode, int failed, uint64_t us) {
+  metrics_block_t* block = get_block();
+  if (block == NULL || opcode < 0 || opcode >= METRIC_OPS) {
+    return;
+  }
+
+  int bucket = 0;
+  while (bucket < METRIC_BUCKETS - 1 && us > (1ULL << bucket)) {
+    bucket++;
+  }
+  bump(&block->requests[opcode], 1);
+  if (failed) {
+    bump(&block->errors[opcode], 1);
+  }
+  bump(&block->latency_us[opcode], us);
+  bump(&block->buckets[opcode][bucket], 1);
+}
+
+// Growing text buffer for metrics_format
+typedef struct {
+  char* data;
+  size_t len;
+  size_t capacity;
+  int failed;
+} text_t;
+
+static void append(text_t* text, const char* fmt, ...) {
+  va_list args;
+
+  while (!text->failed) {
+    size_t room = text->capacity - text->len;
+    va_start(args, fmt);
+    int n = vsnprintf(text->data + text->len, room, fmt, args);
+    va_end(args);
+    if (n < 0) {
+      text->failed = 1;
+    } else if ((size_t)n < room) {
+      text->len += n;
+      return;
+    } else {
+      size_t capacity = text->capacity * 2 + n;
+      char* grown = realloc(text->data, capacity);
+      if (grown == NULL) {
+        text->failed = 1;
+      } else {
+        text->data = grown;
+        text->capacity = capacity;
+      }
+    }
+  }
+}
+
+char* metrics_format(size_t* len) {
+  metrics_block_t total = {{0}};
+  text_t text = {malloc(4096), 0, 4096, 0};
+
+  if (text.data == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&blocks_mutex);
+  metrics_block_t* first = blocks;
+  pthread_mutex_unlock(&blocks_mutex);
+
+  for (metrics_block_t* block = first; block != NULL; block = block->next) {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      total.counters[i] += load(&block->counters[i]);
+    }
+    for (int op = 0; op < METRIC_OPS; op++) {
+      total.requests[op] += load(&block->requests[op]);
+      total.errors[op] += load(&block->errors[op]);
+      total.latency_us[op] += load(&block->latency_us[op]);
+      for (int b = 0; b < METRIC_BUCKETS; b++) {
+        total.buckets[op][b] += load(&block->buckets[op][b]);
+      }
+    }
+    for (int r = 0; r < METRIC_REACTORS; r++) {
+      total.accepts[r] += load(&block->accepts[r]);
+    }
+  }
+
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    append(&text, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+           counter_names[i][0], counter_names[i][1], counter_names[i][0],
+           counter_names[i][0], (unsigned long long)total.counters[i]);
+  }
+  // The two can be read in either order, don't let a gauge go negative
+  uint64_t opened = total.counters[METRIC_CONNECTIONS_OPENED];
+  uint64_t closed = total.counters[METRIC_CONNECTIONS_CLOSED];
+  append(&text,
+         "# HELP rfs_connections_active Connections currently open\n"
+         "# TYPE rfs_connections_active gauge\nrfs_connections_active %llu\n",
+         (unsigned long long)(opened > closed ? opened - closed : 0));
+
+  append(&text,
+         "# HELP rfs_reactor_connections_total Connections accepted, by "
+         "event loop\n"
+         "# TYPE rfs_reactor_connections_total counter\n");
+  for (int r = 0; r < METRIC_REACTORS; r++) {
+    if (total.accepts[r] > 0) {
+      append(&text, "rfs_reactor_connections_total{reactor=\"%d\"} %llu\n",
+             r, (unsigned long long)total.accepts[r]);
+    }
+  }
+
+  append(&text,
+         "# HELP rfs_requests_total Requests by opcode\n"
+         "# TYPE rfs_requests_total counter\n");
+  for (int op = 0; op < METRIC_OPS; op++) {
+    if (total.requests[op] > 0) {
+      append(&text, "rfs_requests_total{op=\"%s\"} %llu\n",
+             rfs_opcode_name(op), (unsigned long long)total.requests[op]);
+    }
+  }
+  append(&text,
+         "# HELP rfs_request_errors_total Requests that failed, by opcode\n"
+         "# TYPE rfs_request_errors_total counter\n");
+  for (int op = 0; op < METRIC_OPS; op++) {
+    if (total.requests[op] > 0) {
+      append(&text, "rfs_request_errors_total{op=\"%s\"} %llu\n",
+             rfs_opcode_name(op), (unsigned long long)total.errors[op]);
+    }
+  }
+
+  append(&text,
+         "# HELP rfs_request_duration_microseconds Request latency\n"
+         "# TYPE rfs_request_duration_microseconds histogram\n");
+  for (int op = 0; op < METRIC_OPS; op++) {
+    if (total.requests[op] == 0) {
+      continue;
+    }
+    const char* name = rfs_opcode_name(op);
+    uint64_t count = 0;
+    for (int b = 0; b < METRIC_BUCKETS - 1; b++) {
+      count += total.buckets[op][b];
+      append(&text,
+             "rfs_request_duration_microseconds_bucket{op=\"%s\",le=\"%llu\"}"
+             " %llu\n",
+             name, 1ULL << b, (unsigned long long)count);
+    }
+    append(&text,
+           "rfs_request_duration_microseconds_bucket{op=\"%s\",le=\"+Inf\"} "
+           "%llu\n"
+           "rfs_request_duration_microseconds_sum{op=\"%s\"} %llu\n"
+           "rfs_request_duration_microseconds_count{op=\"%s\"} %llu\n",
+           name, (unsigned long long)total.requests[op], name,
+           (unsigned long long)total.latency_us[op], name,
+           (unsigned long long)total.requests[op]);
+  }
+
+  if (text.failed) {
+    free(text.data);
+    return NULL;
+  }
+  *len = text.len;
+  return text.data;
+}
@@ -0,0 +1,77 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Server metrics, read with the STATS command
+ *
+ * Every thread counts into a block of its own, so recording a sample is
+ * a couple of plain stores into memory no other thread writes: no lock,
+ * no atomic read-modify-write, no shared cache line. Blocks are created
+ * the first time a thread records something and live until the server
+ * exits. STATS adds all blocks up; it may see a sample in one counter
+ * before another, which is fine for monitoring.
+ *
+ * Request latency is kept per opcode as a histogram with power of two
+ * buckets: bucket i counts requests that took at most 2^i microseconds
+ * and more than 2^(i-1), like the le label it is exported with, the last
+ * one everything slower.
+ */
+
+#define METRIC_OPS 16      // opcodes tracked, RFS_OP_* below this
+#define METRIC_BUCKETS 26  // up to 2^25 us, about 33 s
+#define METRIC_REACTORS 64  // event loops tracked, see reactor.h
+
+// Plain counters
+enum {
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_CONNECTIONS_OPENED,
+  METRIC_CONNECTIONS_CLOSED,
+  METRIC_LOCKS_TAKEN,  // granted at once
+  METRIC_LOCK_WAITS,   // parked behind another connection
+  METRIC_LOCK_WAIT_US,
+  METRIC_FILE_CACHE_HITS,
+  METRIC_FILE_CACHE_MISSES,
+  METRIC_SNAPSHOT_HITS,
+  METRIC_SNAPSHOT_MISSES,
+  METRIC_LOG_DROPPED,
+  METRIC_BUSY,  // requests and connections turned away
+  METRIC_MOVED,             // requests for another node's files
+  METRIC_HANDOFFS,          // files moved to their new owner
+  METRIC_REPLICATED,        // WRITEs and RMs acknowledged by a replica
+  METRIC_CHECKSUM_ERRORS,   // WRITEs that arrived corrupted
+  METRIC_PACKED_WRITES,     // small WRITEs appended to a pack segment
+  METRIC_PACK_COMPACTIONS,  // pack segments compacted away
+  METRIC_COUNT
+};
+
+// Monotonic clock in microseconds
+
+uint64_t metrics_now_us(void);
+
+// Add to a counter
+
+void metrics_add(int metric, uint64_t n);
+
+// Count a connection accepted by a reactor
+
+void metrics_reactor_accept(int reactor);
+
+/**
+ * Record a finished request
+ * @param opcode - its RFS_OP_*
+ * @param failed - it was answered with an ERROR or its connection broke
+ * @param us - microseconds from reading its header to the last reply
+ */
+void metrics_request(int opcode, int failed, uint64_t us);
+
+/**
+ * Write all metrics in the Prometheus text format
+ * @return a malloc()ed string, its length in len, or NULL out of memory
+ */
+char* metrics_format(size_t* len);
+
+#endif
@@ -0,0 +1,1382 @@
+/*
+ * pack.c -- Small files appended to log structured pack segments
+ *
+ * Every entry of the index owns two pieces of segment space: the header
+ * and path of the record that made it current, and the data it points
+ * at (a LINK moves the data of the file to its version, so data is only
+ * ever owned by one entry). When an entry is replaced or removed, both
+ * are added to the dead bytes of their segments, which is what decides
+ * when a segment is compacted.
+ */
+
+#define _GNU_SOURCE
+
+#include "pack.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "server.h"
+
+#define PACK_MAGIC 0x52465350  // "RFSP"
+#define PACK_HEADER_SIZE 52
+#define PACK_READ_SIZE (1 << 20)
+
+// Record types
+#define PACK_PUT 'p'
+#define PACK_LINK 'l'
+#define PACK_DEL 'd'
+
+// Record flags
+#define PACK_FLAG_VERSION 0x1  // a saved version, path.vN
+#define PACK_FLAG_CARRIED 0x2  // a DEL copied forward by a compaction
+
+int pack_enabled = 0;
+
+// One record, as written to or read from a segment
+typedef struct {
+  int type;
+  int flags;
+  uint32_t len;
+  uint32_t crc;
+  uint64_t seq;
+  uint64_t mtime;
+  uint32_t latest;
+  uint32_t link_segment;
+  uint64_t link_offset;
+  size_t key_len;
+  char key[MAX_PATH];
+} pack_record_t;
+
+// Hash chain link, first member of entries and directories
+typedef struct pack_node {
+  uint64_t hash;
+  struct pack_node* next;
+  const char* key;
+} pack_node_t;
+
+// Chained hash table that doubles when it fills up
+typedef struct {
+  pack_node_t** buckets;
+  size_t size;  // power of two
+  size_t count;
+} pack_table_t;
+
+struct pack_dir;
+
+// A packed file or version
+typedef struct pack_entry {
+  pack_node_t node;
+  struct pack_dir* dir;  // NULL while deleted
+  struct pack_entry* dir_prev;
+  struct pack_entry* dir_next;
+  uint64_t seq;
+  uint64_t mtime;
+  uint32_t segment;  // where the data is
+  uint64_t offset;
+  uint32_t len;
+  uint32_t crc;
+  uint32_t latest;          // versions saved so far
+  uint32_t record_segment;  // record that made it current
+  uint32_t record_len;      // its header and path
+  int flags;
+  int owns_data;  // len bytes at offset are charged to this entry
+  int deleted;    // a DEL won, only while loading
+  char path[];
+} pack_entry_t;
+
+// The packed entries right inside one directory
+typedef struct pack_dir {
+  pack_node_t node;
+  pack_entry_t* head;
+  size_t count;
+  char path[];
+} pack_dir_t;
+
+typedef struct {
+  int fd;
+  uint64_t size;
+  uint64_t dead;
+} pack_segment_t;
+
+// Sequential reader of a segment
+typedef struct {
+  int fd;
+  uint64_t size;
+  unsigned char* buf;
+  uint64_t start;  // offset of buf[0] in the segment
+  size_t len;
+} pack_reader_t;
+
+// Guards everything below; GETs share it, commits take it alone
+static pthread_rwlock_t pack_lock;
+static pack_table_t entries;
+static pack_table_t dirs;
+static size_t packed_files = 0;
+static pack_segment_t** segments = NULL;  // by number, 0 is never used
+static uint32_t segment_cap = 0;
+static uint32_t active = 0;
+static uint64_t next_seq = 1;
+
+static pthread_mutex_t compact_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static int compact_wanted = 0;
+
+// Turn a remote path into its key, without empty or "." components
+// @return 0, or -1 if it is too long
+static int make_key(const char* path, char* key) {
+  size_t len = 0;
+  const char* p = path;
+
+  while (*p != '\0') {
+    const char* end = strchr(p, '/');
+    size_t part = end != NULL ? (size_t)(end - p) : strlen(p);
+
+    if (part > 0 && !(part == 1 && p[0] == '.')) {
+      if (len + part + 2 > MAX_PATH) {
+        return -1;
+      }
+      if (len > 0) {
+        key[len++] = '/';
+      }
+      memcpy(key + len, p, part);
+      len += part;
+    }
+    if (end == NULL) {
+      break;
+    }
+    p = end + 1;
+  }
+  key[len] = '\0';
+  return 0;
+}
+
+static pack_node_t* table_find(pack_table_t* table, const char* key,
+                               uint64_t hash) {
+  if (table->size == 0) {
+    return NULL;
+  }
+  for (pack_node_t* node = table->buckets[hash & (table->size - 1)];
+       node != NULL; node = node->next) {
+    if (node->hash == hash && strcmp(node->key, key) == 0) {
+      return node;
+    }
+  }
+  return NULL;
+}
+
+static int table_insert(pack_table_t* table, pack_node_t* node) {
+  if (table->count >= table->size) {
+    size_t size = table->size > 0 ? table->size * 2 : 1024;
+    pack_node_t** buckets = calloc(size, sizeof(pack_node_t*));
+    if (buckets == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < table->size; i++) {
+      pack_node_t* next;
+      for (pack_node_t* n = table->buckets[i]; n != NULL; n = next) {
+        next = n->next;
+        n->next = buckets[n->hash & (size - 1)];
+        buckets[n->hash & (size - 1)] = n;
+      }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
+  }
+
+  pack_node_t** bucket = &table->buckets[node->hash & (table->size - 1)];
+  node->next = *bucket;
+  *bucket = node;
+  table->count++;
+  return 0;
+}
+
+static void table_remove(pack_table_t* table, pack_node_t* node) {
+  pack_node_t** link = &table->buckets[node->hash & (table->size - 1)];
+
+  while (*link != node) {
+    link = &(*link)->next;
+  }
+  *link = node->next;
+  table->count--;
+}
+
+static pack_entry_t* find_entry(const char* key) {
+  return (pack_entry_t*)table_find(&entries, key, hash_path(key));
+}
+
+// Directory part of a key, "" at the top
+static void key_dir(const char* key, char* dir) {
+  const char* slash = strrchr(key, '/');
+  size_t len = slash != NULL ? (size_t)(slash - key) : 0;
+
+  memcpy(dir, key, len);
+  dir[len] = '\0';
+}
+
+static pack_dir_t* find_dir(const char* dir) {
+  return (pack_dir_t*)table_find(&dirs, dir, hash_path(dir));
+}
+
+// Put an entry into its directory's list, making it visible
+static int attach_entry(pack_entry_t* entry) {
+  char path[MAX_PATH];
+
+  key_dir(entry->path, path);
+  pack_dir_t* dir = find_dir(path);
+  if (dir == NULL) {
+    dir = calloc(1, sizeof(pack_dir_t) + strlen(path) + 1);
+    if (dir == NULL) {
+      return -1;
+    }
+    strcpy(dir->path, path);
+    dir->node.hash = hash_path(path);
+    dir->node.key = dir->path;
+    if (table_insert(&dirs, &dir->node) != 0) {
+      free(dir);
+      return -1;
+    }
+  }
+
+  entry->dir = dir;
+  entry->dir_prev = NULL;
+  entry->dir_next = dir->head;
+  if (dir->head != NULL) {
+    dir->head->dir_prev = entry;
+  }
+  dir->head = entry;
+  dir->count++;
+  packed_files++;
+  return 0;
+}
+
+static void detach_entry(pack_entry_t* entry) {
+  pack_dir_t* dir = entry->dir;
+
+  if (dir == NULL) {
+    return;
+  }
+  if (entry->dir_prev != NULL) {
+    entry->dir_prev->dir_next = entry->dir_next;
+  } else {
+    dir->head = entry->dir_next;
+  }
+  if (entry->dir_next != NULL) {
+    entry->dir_next->dir_prev = entry->dir_prev;
+  }
+  entry->dir = NULL;
+  packed_files--;
+
+  if (--dir->count == 0) {
+    table_remove(&dirs, &dir->node);
+    free(dir);
+  }
+}
+
+// Add a live entry for a key
+static pack_entry_t* new_entry(const char* key) {
+  pack_entry_t* entry = calloc(1, sizeof(pack_entry_t) + strlen(key) + 1);
+
+  if (entry == NULL) {
+    return NULL;
+  }
+  strcpy(entry->path, key);
+  entry->node.hash = hash_path(key);
+  entry->node.key = entry->path;
+  if (table_insert(&entries, &entry->node) != 0) {
+    free(entry);
+    return NULL;
+  }
+  if (attach_entry(entry) != 0) {
+    table_remove(&entries, &entry->node);
+    free(entry);
+    return NULL;
+  }
+  return entry;
+}
+
+static void free_entry(pack_entry_t* entry) {
+  detach_entry(entry);
+  table_remove(&entries, &entry->node);
+  free(entry);
+}
+
+static pack_segment_t* segment_of(uint32_t number) {
+  return number < segment_cap ? segments[number] : NULL;
+}
+
+static void add_dead(uint32_t number, uint64_t bytes) {
+  pack_segment_t* seg = segment_of(number);
+
+  if (seg != NULL) {
+    seg->dead += bytes;
+  }
+}
+
+// Count what an entry holds as dead, it is being replaced or removed
+static void drop_charges(pack_entry_t* entry) {
+  if (entry->deleted) {
+    return;
+  }
+  add_dead(entry->record_segment, entry->record_len);
+  if (entry->owns_data) {
+    add_dead(entry->segment, entry->len);
+  }
+}
+
+static int compact_due(uint32_t number) {
+  pack_segment_t* seg = segment_of(number);
+
+  return seg != NULL && seg->size > 0 &&
+         seg->dead * 100 >= seg->size * PACK_COMPACT_PERCENT;
+}
+
+static void wake_compaction(void) {
+  pthread_mutex_lock(&compact_mutex);
+  compact_wanted = 1;
+  pthread_cond_signal(&compact_cond);
+  pthread_mutex_unlock(&compact_mutex);
+}
+
+static void segment_path(uint32_t number, char* path) {
+  snprintf(path, MAX_PATH, "%s/%08u.pack", PACK_DIR, number);
+}
+
+// Open a segment and give it its slot
+// @param number - segment number
+// @param create - make a new, empty one
+static pack_segment_t* open_segment(uint32_t number, int create) {
+  char path[MAX_PATH];
+
+  if (number >= segment_cap) {
+    uint32_t cap = segment_cap > 0 ? segment_cap : 64;
+    while (cap <= number) {
+      cap *= 2;
+    }
+    pack_segment_t** grown = realloc(segments, cap * sizeof(pack_segment_t*));
+    if (grown == NULL) {
+      return NULL;
+    }
+    memset(grown + segment_cap, 0,
+           (cap - segment_cap) * sizeof(pack_segment_t*));
+    segments = grown;
+    segment_cap = cap;
+  }
+
+  pack_segment_t* seg = calloc(1, sizeof(pack_segment_t));
+  if (seg == NULL) {
+    return NULL;
+  }
+  segment_path(number, path);
+  seg->fd = open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+  if (seg->fd < 0) {
+    free(seg);
+    return NULL;
+  }
+  seg->size = create ? 0 : (uint64_t)lseek(seg->fd, 0, SEEK_END);
+  segments[number] = seg;
+  return seg;
+}
+
+// Start a new active segment, pack_lock held alone
+static int roll_segment(void) {
+  if (open_segment(active + 1, 1) == NULL) {
+    log_error("error occured!: Cannot create pack segment %u", active + 1);
+    return -1;
+  }
+  active++;
+
+  // Its name must survive a crash before anything in it is acknowledged
+  if (durability_mode != DURABILITY_OFF) {
+    int fd = open(PACK_DIR, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+  log_debug("  New pack segment %u", active);
+  return 0;
+}
+
+static uint32_t header_crc(const unsigned char* p, size_t key_len) {
+  uint32_t crc = checksum_update(0, p, 48);
+  return checksum_update(crc, p + PACK_HEADER_SIZE, key_len);
+}
+
+// Start a record for a key, with the next sequence number
+static void init_record(pack_record_t* rec, int type, const char* key) {
+  memset(rec, 0, offsetof(pack_record_t, key));
+  rec->type = type;
+  rec->seq = next_seq++;
+  rec->key_len = strlen(key);
+  memcpy(rec->key, key, rec->key_len + 1);
+}
+
+// Write a record's header and path
+// @return bytes written
+static size_t encode_record(const pack_record_t* rec, unsigned char* p) {
+  rfs_put_u32(p, PACK_MAGIC);
+  p[4] = rec->type;
+  p[5] = rec->flags;
+  p[6] = rec->key_len >> 8;
+  p[7] = rec->key_len & 0xff;
+  rfs_put_u32(p + 8, rec->len);
+  rfs_put_u32(p + 12, rec->crc);
+  rfs_put_u64(p + 16, rec->seq);
+  rfs_put_u64(p + 24, rec->mtime);
+  rfs_put_u32(p + 32, rec->latest);
+  rfs_put_u32(p + 36, rec->link_segment);
+  rfs_put_u64(p + 40, rec->link_offset);
+  memcpy(p + PACK_HEADER_SIZE, rec->key, rec->key_len);
+  rfs_put_u32(p + 48, header_crc(p, rec->key_len));
+  return PACK_HEADER_SIZE + rec->key_len;
+}
+
+// Append records to the active segment, pack_lock held alone
+// @param iov - the records, written with one pwritev()
+// @param segment - output, segment they went to
+// @param offset - output, where the first one starts
+static int append_records(struct iovec* iov, int count, uint32_t* segment,
+                          uint64_t* offset) {
+  size_t total = 0;
+
+  for (int i = 0; i < count; i++) {
+    total += iov[i].iov_len;
+  }
+  if (segments[active]->size > 0 &&
+      segments[active]->size + total > PACK_SEGMENT_SIZE &&
+      roll_segment() != 0) {
+    return -1;
+  }
+
+  pack_segment_t* seg = segments[active];
+  ssize_t n = pwritev(seg->fd, iov, count, seg->size);
+  if (n != (ssize_t)total) {
+    // Whatever made it is overwritten by the next append
+    log_error("error occured!: Cannot write pack segment %u", active);
+    return -1;
+  }
+  *segment = active;
+  *offset = seg->size;
+  seg->size += total;
+  return 0;
+}
+
+// Point an entry at a PUT record, the data following its path
+static void set_put_location(pack_entry_t* entry, const pack_record_t* rec,
+                             uint32_t segment, uint64_t offset) {
+  entry->seq = rec->seq;
+  entry->mtime = rec->mtime;
+  entry->len = rec->len;
+  entry->crc = rec->crc;
+  entry->latest = rec->latest;
+  entry->flags = rec->flags;
+  entry->segment = segment;
+  entry->offset = offset + PACK_HEADER_SIZE + rec->key_len;
+  entry->record_segment = segment;
+  entry->record_len = PACK_HEADER_SIZE + rec->key_len;
+  entry->owns_data = 1;
+}
+
+// Hand a file's data to the entry of its new version, after the LINK
+// @param entry - the file, replaced or removed by the caller next
+// @param link - the LINK record
+// @param segment - where the LINK was written
+static int link_version(pack_entry_t* entry, const pack_record_t* link,
+                        uint32_t segment) {
+  pack_entry_t* version = find_entry(link->key);
+
+  if (version != NULL) {
+    drop_charges(version);
+  } else if ((version = new_entry(link->key)) == NULL) {
+    return -1;
+  }
+  version->seq = link->seq;
+  version->mtime = entry->mtime;
+  version->len = entry->len;
+  version->crc = entry->crc;
+  version->latest = 0;
+  version->flags = PACK_FLAG_VERSION;
+  version->segment = entry->segment;
+  version->offset = entry->offset;
+  version->record_segment = segment;
+  version->record_len = PACK_HEADER_SIZE + link->key_len;
+  version->owns_data = entry->owns_data;
+
+  add_dead(entry->record_segment, entry->record_len);
+  entry->owns_data = 0;
+  return 0;
+}
+
+// Start a LINK saving a file's data as version n
+static int init_link(pack_record_t* rec, const pack_entry_t* entry,
+                     int version) {
+  char key[MAX_PATH];
+
+  if (snprintf(key, sizeof(key), "%s.v%d", entry->path, version) >=
+      (int)sizeof(key)) {
+    return -1;
+  }
+  init_record(rec, PACK_LINK, key);
+  rec->flags = PACK_FLAG_VERSION;
+  rec->len = entry->len;
+  rec->crc = entry->crc;
+  rec->mtime = entry->mtime;
+  rec->link_segment = entry->segment;
+  rec->link_offset = entry->offset;
+  return 0;
+}
+
+size_t pack_count(void) {
+  pthread_rwlock_rdlock(&pack_lock);
+  size_t count = packed_files;
+  pthread_rwlock_unlock(&pack_lock);
+  return count;
+}
+
+int pack_segment_count(void) {
+  int count = 0;
+
+  pthread_rwlock_rdlock(&pack_lock);
+  for (uint32_t n = 0; n < segment_cap; n++) {
+    count += segments[n] != NULL;
+  }
+  pthread_rwlock_unlock(&pack_lock);
+  return count;
+}
+
+int pack_contains(const char* path) {
+  char key[MAX_PATH];
+
+  if (make_key(path, key) != 0) {
+    return 0;
+  }
+  pthread_rwlock_rdlock(&pack_lock);
+  int found = find_entry(key) != NULL;
+  pthread_rwlock_unlock(&pack_lock);
+  return found;
+}
+
+int pack_put(const char* path, const void* data, uint32_t len, uint32_t crc,
+             int* sync_fd) {
+  char key[MAX_PATH];
+  unsigned char link_buf[PACK_HEADER_SIZE + MAX_PATH];
+  unsigned char put_buf[PACK_HEADER_SIZE + MAX_PATH];
+  pack_record_t link;
+  pack_record_t put;
+  struct iovec iov[3];
+  int count = 0;
+  int version = 0;
+  uint32_t segment;
+  uint64_t offset;
+
+  if (make_key(path, key) != 0 || len > PACK_MAX_FILE) {
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&pack_lock);
+  pack_entry_t* entry = find_entry(key);
+  if (entry != NULL) {
+    version = entry->latest + 1;
+    if (init_link(&link, entry, version) != 0) {
+      pthread_rwlock_unlock(&pack_lock);
+      return -1;
+    }
+    iov[count].iov_base = link_buf;
+    iov[count++].iov_len = encode_record(&link, link_buf);
+  }
+
+  init_record(&put, PACK_PUT, key);
+  put.len = len;
+  put.crc = crc;
+  put.mtime = time(NULL);
+  put.latest = version;
+  iov[count].iov_base = put_buf;
+  iov[count++].iov_len = encode_record(&put, put_buf);
+  iov[count].iov_base = (void*)data;
+  iov[count++].iov_len = len;
+
+  if (append_records(iov, count, &segment, &offset) != 0) {
+    pthread_rwlock_unlock(&pack_lock);
+    return -1;
+  }
+
+  size_t link_len = entry != NULL ? iov[0].iov_len : 0;
+  if (entry != NULL && link_version(entry, &link, segment) != 0) {
+    entry = NULL;
+  } else if (entry == NULL) {
+    entry = new_entry(key);
+  }
+  if (entry == NULL) {
+    // Out of memory: the log has it, the index finds it after a restart
+    pthread_rwlock_unlock(&pack_lock);
+    return -1;
+  }
+  set_put_location(entry, &put, segment, offset + link_len);
+
+  if (sync_fd != NULL) {
+    *sync_fd = dup(segments[segment]->fd);
+  }
+  pthread_rwlock_unlock(&pack_lock);
+  return version;
+}
+
+int pack_save_version(const char* path) {
+  char key[MAX_PATH];
+  unsigned char link_buf[PACK_HEADER_SIZE + MAX_PATH];
+  unsigned char del_buf[PACK_HEADER_SIZE + MAX_PATH];
+  pack_record_t link;
+  pack_record_t del;
+  struct iovec iov[2];
+  uint32_t segment;
+  uint64_t offset;
+
+  if (make_key(path, key) != 0) {
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&pack_lock);
+  pack_entry_t* entry = find_entry(key);
+  if (entry == NULL) {
+    pthread_rwlock_unlock(&pack_lock);
+    return 0;
+  }
+
+  int version = entry->latest + 1;
+  if (init_link(&link, entry, version) != 0) {
+    pthread_rwlock_unlock(&pack_lock);
+    return -1;
+  }
+  init_record(&del, PACK_DEL, key);
+  iov[0].iov_base = link_buf;
+  iov[0].iov_len = encode_record(&link, link_buf);
+  iov[1].iov_base = del_buf;
+  iov[1].iov_len = encode_record(&del, del_buf);
+
+  if (append_records(iov, 2, &segment, &offset) != 0 ||
+      link_version(entry, &link, segment) != 0) {
+    pthread_rwlock_unlock(&pack_lock);
+    return -1;
+  }
+  add_dead(segment, iov[1].iov_len);
+  free_entry(entry);
+  pthread_rwlock_unlock(&pack_lock);
+  return version;
+}
+
+long pack_read(const char* path, void* buf, uint32_t* crc) {
+  char key[MAX_PATH];
+
+  if (make_key(path, key) != 0) {
+    return -1;
+  }
+
+  pthread_rwlock_rdlock(&pack_lock);
+  pack_entry_t* entry = find_entry(key);
+  if (entry == NULL || entry->len > PACK_MAX_FILE) {
+    pthread_rwlock_unlock(&pack_lock);
+    return -1;
+  }
+  long len = entry->len;
+  *crc = entry->crc;
+  ssize_t n = pread(segments[entry->segment]->fd, buf, len, entry->offset);
+  pthread_rwlock_unlock(&pack_lock);
+
+  if (n != len || checksum_update(0, buf, len) != *crc) {
+    return -2;
+  }
+  return len;
+}
+
+long pack_stat(const char* path, uint64_t* mtime, uint32_t* crc, int* latest) {
+  char key[MAX_PATH];
+
+  if (make_key(path, key) != 0) {
+    return -1;
+  }
+
+  pthread_rwlock_rdlock(&pack_lock);
+  pack_entry_t* entry = find_entry(key);
+  long len = entry != NULL ? (long)entry->len : -1;
+  if (entry != NULL) {
+    *mtime = entry->mtime;
+    *crc = entry->crc;
+    *latest = entry->latest;
+  }
+  pthread_rwlock_unlock(&pack_lock);
+  return len;
+}
+
+// Is a key one of base's versions, base.vN
+static int is_version_of(const char* key, const char* base, size_t base_len) {
+  return strncmp(key, base, base_len) == 0 && key[base_len] == '.' &&
+         key[base_len + 1] == 'v' && key[base_len + 2] != '\0' &&
+         strspn(key + base_len + 2, "0123456789") ==
+             strlen(key + base_len + 2);
+}
+
+int pack_remove(const char* path) {
+  char key[MAX_PATH];
+  char dir_path[MAX_PATH];
+  uint32_t segment;
+  uint64_t offset;
+
+  if (make_key(path, key) != 0) {
+    return 0;
+  }
+  size_t key_len = strlen(key);
+
+  pthread_rwlock_wrlock(&pack_lock);
+  key_dir(key, dir_path);
+  pack_dir_t* dir = find_dir(dir_path);
+  if (dir == NULL) {
+    pthread_rwlock_unlock(&pack_lock);
+    return 0;
+  }
+
+  // The file and its versions share its directory
+  pack_entry_t** victims = malloc(dir->count * sizeof(pack_entry_t*));
+  unsigned char* buf = malloc(dir->count * (PACK_HEADER_SIZE + MAX_PATH));
+  if (victims == NULL || buf == NULL) {
+    free(victims);
+    free(buf);
+    pthread_rwlock_unlock(&pack_lock);
+    return -1;
+  }
+  size_t count = 0;
+  size_t len = 0;
+  for (pack_entry_t* e = dir->head; e != NULL; e = e->dir_next) {
+    if (strcmp(e->path, key) == 0 || is_version_of(e->path, key, key_len)) {
+      pack_record_t del;
+      init_record(&del, PACK_DEL, e->path);
+      len += encode_record(&del, buf + len);
+      victims[count++] = e;
+    }
+  }
+
+  int result = 0;
+  if (count > 0) {
+    struct iovec iov = {buf, len};
+    result = append_records(&iov, 1, &segment, &offset) == 0 ? 1 : -1;
+  }
+
+  // A DEL is only there to hide older records, it is dead from the start
+  int due = 0;
+  if (result == 1) {
+    add_dead(segment, len);
+    due = compact_due(segment);
+  }
+  for (size_t i = 0; result == 1 && i < count; i++) {
+    drop_charges(victims[i]);
+    due |= compact_due(victims[i]->record_segment) ||
+           compact_due(victims[i]->segment);
+    free_entry(victims[i]);
+  }
+  pthread_rwlock_unlock(&pack_lock);
+
+  free(victims);
+  free(buf);
+  if (due) {
+    wake_compaction();
+  }
+  return result;
+}
+
+size_t pack_dir_count(const char* dir) {
+  char key[MAX_PATH];
+
+  if (make_key(dir, key) != 0) {
+    return 0;
+  }
+  pthread_rwlock_rdlock(&pack_lock);
+  pack_dir_t* found = find_dir(key);
+  size_t count = found != NULL ? found->count : 0;
+  pthread_rwlock_unlock(&pack_lock);
+  return count;
+}
+
+// Append the LIST entries of one directory's packed files
+// @param skip - bytes of each path before the name relative to the LIST
+static int list_dir_entries(pack_dir_t* dir, size_t skip, unsigned char** buf,
+                            size_t* len, size_t* cap) {
+  for (pack_entry_t* e = dir->head; e != NULL; e = e->dir_next) {
+    size_t name_len = strlen(e->path) - skip;
+    if (*len + RFS_ENTRY_HEADER_SIZE + name_len > *cap) {
+      size_t grown_cap = *cap > 0 ? *cap * 2 : 64 * 1024;
+      unsigned char* grown = realloc(*buf, grown_cap);
+      if (grown == NULL) {
+        return -1;
+      }
+      *buf = grown;
+      *cap = grown_cap;
+    }
+
+    unsigned char* p = *buf + *len;
+    p[0] = (e->flags & PACK_FLAG_VERSION) ? RFS_ENTRY_VERSION : RFS_ENTRY_FILE;
+    rfs_put_u64(p + 1, e->len);
+    rfs_put_u64(p + 9, e->mtime);
+    p[17] = name_len >> 8;
+    p[18] = name_len & 0xff;
+    memcpy(p + RFS_ENTRY_HEADER_SIZE, e->path + skip, name_len);
+    *len += RFS_ENTRY_HEADER_SIZE + name_len;
+  }
+  return 0;
+}
+
+unsigned char* pack_list(const char* dir, int recursive, size_t* len) {
+  char key[MAX_PATH];
+  unsigned char* buf = NULL;
+  size_t cap = 0;
+  int failed = 0;
+
+  *len = 0;
+  if (make_key(dir, key) != 0) {
+    return NULL;
+  }
+  size_t key_len = strlen(key);
+  size_t skip = key_len > 0 ? key_len + 1 : 0;
+
+  pthread_rwlock_rdlock(&pack_lock);
+  if (!recursive) {
+    pack_dir_t* found = find_dir(key);
+    if (found != NULL) {
+      failed = list_dir_entries(found, skip, &buf, len, &cap);
+    }
+  } else {
+    for (size_t i = 0; i < dirs.size && !failed; i++) {
+      for (pack_node_t* n = dirs.buckets[i]; n != NULL && !failed;
+           n = n->next) {
+        pack_dir_t* d = (pack_dir_t*)n;
+        if (key_len == 0 || strcmp(d->path, key) == 0 ||
+            (strncmp(d->path, key, key_len) == 0 && d->path[key_len] == '/')) {
+          failed = list_dir_entries(d, skip, &buf, len, &cap);
+        }
+      }
+    }
+  }
+  pthread_rwlock_unlock(&pack_lock);
+
+  if (failed || *len == 0) {
+    free(buf);
+    *len = 0;
+    return NULL;
+  }
+  return buf;
+}
+
+// Bytes of a segment at off, read in if they aren't buffered
+static const unsigned char* reader_peek(pack_reader_t* r, uint64_t off,
+                                        size_t n) {
+  if (off >= r->start && off + n <= r->start + r->len) {
+    return r->buf + (off - r->start);
+  }
+  ssize_t got = pread(r->fd, r->buf, PACK_READ_SIZE, off);
+  if (got < (ssize_t)n) {
+    return NULL;
+  }
+  r->start = off;
+  r->len = got;
+  return r->buf;
+}
+
+// Parse the record at off
+// @return its length with the data, 0 at the end or at a torn record
+static uint64_t read_record(pack_reader_t* r, uint64_t off,
+                            pack_record_t* rec) {
+  if (off + PACK_HEADER_SIZE > r->size) {
+    return 0;
+  }
+  const unsigned char* p = reader_peek(r, off, PACK_HEADER_SIZE);
+  if (p == NULL || rfs_get_u32(p) != PACK_MAGIC) {
+    return 0;
+  }
+  size_t key_len = (p[6] << 8) | p[7];
+  if (key_len == 0 || key_len >= MAX_PATH ||
+      (p = reader_peek(r, off, PACK_HEADER_SIZE + key_len)) == NULL ||
+      rfs_get_u32(p + 48) != header_crc(p, key_len)) {
+    return 0;
+  }
+
+  rec->type = p[4];
+  rec->flags = p[5];
+  rec->len = rfs_get_u32(p + 8);
+  rec->crc = rfs_get_u32(p + 12);
+  rec->seq = rfs_get_u64(p + 16);
+  rec->mtime = rfs_get_u64(p + 24);
+  rec->latest = rfs_get_u32(p + 32);
+  rec->link_segment = rfs_get_u32(p + 36);
+  rec->link_offset = rfs_get_u64(p + 40);
+  rec->key_len = key_len;
+  memcpy(rec->key, p + PACK_HEADER_SIZE, key_len);
+  rec->key[key_len] = '\0';
+  if (rec->type != PACK_PUT && rec->type != PACK_LINK &&
+      rec->type != PACK_DEL) {
+    return 0;
+  }
+
+  uint64_t total = PACK_HEADER_SIZE + key_len;
+  if (rec->type == PACK_PUT) {
+    total += rec->len;
+  }
+  return off + total <= r->size ? total : 0;
+}
+
+// Replay one record into the index, only the newest of a path counts
+static int load_record(uint32_t number, uint64_t off,
+                       const pack_record_t* rec) {
+  pack_entry_t* entry = find_entry(rec->key);
+  uint32_t record_len = PACK_HEADER_SIZE + rec->key_len;
+
+  if (entry != NULL && entry->seq > rec->seq) {
+    add_dead(number, record_len + (rec->type == PACK_PUT ? rec->len : 0));
+    return 0;
+  }
+
+  if (rec->type == PACK_DEL) {
+    // The entry stays as a tombstone, older records must not bring it
+    // back
+    if (entry == NULL && (entry = new_entry(rec->key)) == NULL) {
+      return -1;
+    }
+    drop_charges(entry);
+    detach_entry(entry);
+    entry->deleted = 1;
+    entry->seq = rec->seq;
+    if (!(rec->flags & PACK_FLAG_CARRIED)) {
+      add_dead(number, record_len);
+    }
+    return 0;
+  }
+
+  // The data a LINK names was its file's, now it is the version's
+  if (rec->type == PACK_LINK) {
+    char base[MAX_PATH];
+    snprintf(base, sizeof(base), "%s", rec->key);
+    char* dot = strrchr(base, '.');
+    if (dot != NULL) {
+      *dot = '\0';
+      pack_entry_t* file = find_entry(base);
+      if (file != NULL && !file->deleted && file->owns_data &&
+          file->segment == rec->link_segment &&
+          file->offset == rec->link_offset) {
+        file->owns_data = 0;
+      }
+    }
+  }
+
+  if (entry == NULL) {
+    if ((entry = new_entry(rec->key)) == NULL) {
+      return -1;
+    }
+  } else if (entry->deleted) {
+    if (attach_entry(entry) != 0) {
+      return -1;
+    }
+    entry->deleted = 0;
+  } else {
+    drop_charges(entry);
+  }
+
+  set_put_location(entry, rec, number, off);
+  if (rec->type == PACK_LINK) {
+    entry->segment = rec->link_segment;
+    entry->offset = rec->link_offset;
+  }
+  return 0;
+}
+
+// Read a segment into the index
+// @param last - it is the active one, a torn end is cut off
+static int load_segment(uint32_t number, int last) {
+  pack_segment_t* seg = segments[number];
+  pack_reader_t reader = {seg->fd, seg->size, malloc(PACK_READ_SIZE), 0, 0};
+  pack_record_t rec;
+  uint64_t off = 0;
+  uint64_t len;
+
+  if (reader.buf == NULL) {
+    return -1;
+  }
+  while ((len = read_record(&reader, off, &rec)) > 0) {
+    if (load_record(number, off, &rec) != 0) {
+      free(reader.buf);
+      return -1;
+    }
+    if (rec.seq >= next_seq) {
+      next_seq = rec.seq + 1;
+    }
+    off += len;
+  }
+  free(reader.buf);
+
+  if (off < seg->size) {
+    log_warn("Pack segment %u: %llu torn bytes at offset %llu dropped",
+             number, (unsigned long long)(seg->size - off),
+             (unsigned long long)off);
+    if (last && ftruncate(seg->fd, off) == 0) {
+      seg->size = off;
+    } else {
+      seg->dead += seg->size - off;
+    }
+  }
+  return 0;
+}
+
+static int compare_numbers(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Free the tombstones of loading, and entries whose data is gone
+static void finish_loading(void) {
+  for (size_t i = 0; i < entries.size; i++) {
+    pack_node_t* next;
+    for (pack_node_t* n = entries.buckets[i]; n != NULL; n = next) {
+      pack_entry_t* entry = (pack_entry_t*)n;
+      next = n->next;
+      if (!entry->deleted && segment_of(entry->segment) == NULL) {
+        log_warn("Packed file %s lost its data in segment %u", entry->path,
+                 entry->segment);
+        drop_charges(entry);
+      } else if (!entry->deleted) {
+        continue;
+      }
+      free_entry(entry);
+    }
+  }
+}
+
+// Does an entry hold anything in a segment
+static int entry_uses(const pack_entry_t* entry, uint32_t number) {
+  return !entry->deleted &&
+         (entry->record_segment == number || entry->segment == number);
+}
+
+// Copy a live entry out of a segment being compacted, as a PUT with the
+// same sequence number
+static int move_entry(const char* key, uint32_t number) {
+  unsigned char head[PACK_HEADER_SIZE + MAX_PATH];
+  unsigned char data[PACK_MAX_FILE];
+  pack_record_t put;
+  uint32_t segment;
+  uint64_t offset;
+  int result = 0;
+
+  pthread_rwlock_wrlock(&pack_lock);
+  pack_entry_t* entry = find_entry(key);
+  if (entry == NULL || !entry_uses(entry, number)) {
+    pthread_rwlock_unlock(&pack_lock);
+    return 0;
+  }
+
+  memset(&put, 0, offsetof(pack_record_t, key));
+  put.type = PACK_PUT;
+  put.flags = entry->flags;
+  put.len = entry->len;
+  put.crc = entry->crc;
+  put.seq = entry->seq;
+  put.mtime = entry->mtime;
+  put.latest = entry->latest;
+  put.key_len = strlen(key);
+  memcpy(put.key, key, put.key_len + 1);
+
+  struct iovec iov[2] = {{head, encode_record(&put, head)}, {data, put.len}};
+  if (put.len > sizeof(data) ||
+      pread(segments[entry->segment]->fd, data, put.len, entry->offset) !=
+          (ssize_t)put.len ||
+      append_records(iov, 2, &segment, &offset) != 0) {
+    result = -1;
+  } else {
+    drop_charges(entry);
+    set_put_location(entry, &put, segment, offset);
+  }
+  pthread_rwlock_unlock(&pack_lock);
+  return result;
+}
+
+// Keys of the entries that still hold anything in a segment
+// @return a malloc()ed array of strdup()ed keys, count in count
+static char** keys_using(uint32_t number, size_t* count) {
+  char** keys = NULL;
+  size_t cap = 0;
+
+  *count = 0;
+  pthread_rwlock_rdlock(&pack_lock);
+  for (size_t i = 0; i < entries.size; i++) {
+    for (pack_node_t* n = entries.buckets[i]; n != NULL; n = n->next) {
+      if (!entry_uses((pack_entry_t*)n, number)) {
+        continue;
+      }
+      if (*count == cap) {
+        cap = cap > 0 ? cap * 2 : 256;
+        char** grown = realloc(keys, cap * sizeof(char*));
+        if (grown == NULL) {
+          break;
+        }
+        keys = grown;
+      }
+      if ((keys[*count] = strdup(n->key)) != NULL) {
+        (*count)++;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&pack_lock);
+  return keys;
+}
+
+// Copy the DELs of a segment being compacted forward, while an older
+// segment may hold a record they delete
+static int carry_deletes(uint32_t number) {
+  pack_record_t rec;
+  uint64_t off = 0;
+  uint64_t len;
+  int older = 0;
+  int result = 0;
+
+  pthread_rwlock_rdlock(&pack_lock);
+  for (uint32_t n = 1; n < number; n++) {
+    older |= segments[n] != NULL;
+  }
+  pack_reader_t reader = {segments[number]->fd, segments[number]->size,
+                          NULL, 0, 0};
+  pthread_rwlock_unlock(&pack_lock);
+  if (!older) {
+    return 0;
+  }
+
+  reader.buf = malloc(PACK_READ_SIZE);
+  unsigned char* batch = malloc(PACK_READ_SIZE);
+  size_t batch_len = 0;
+  if (reader.buf == NULL || batch == NULL) {
+    free(reader.buf);
+    free(batch);
+    return -1;
+  }
+
+  while (result == 0) {
+    len = read_record(&reader, off, &rec);
+    if (len == 0 || batch_len + PACK_HEADER_SIZE + MAX_PATH > PACK_READ_SIZE) {
+      if (batch_len > 0) {
+        struct iovec iov = {batch, batch_len};
+        uint32_t segment;
+        uint64_t at;
+        pthread_rwlock_wrlock(&pack_lock);
+        result = append_records(&iov, 1, &segment, &at);
+        pthread_rwlock_unlock(&pack_lock);
+        batch_len = 0;
+      }
+      if (len == 0) {
+        break;
+      }
+    }
+    off += len;
+
+    // Not counted as dead, a segment of them alone is never due
+    if (rec.type == PACK_DEL) {
+      rec.flags |= PACK_FLAG_CARRIED;
+      batch_len += encode_record(&rec, batch + batch_len);
+    }
+  }
+  free(reader.buf);
+  free(batch);
+  return result;
+}
+
+// Move everything live out of a segment, then delete it
+static int compact_segment(uint32_t number) {
+  char path[MAX_PATH];
+  int carried = 0;
+
+  pthread_rwlock_rdlock(&pack_lock);
+  uint32_t first = active;
+  pthread_rwlock_unlock(&pack_lock);
+
+  while (1) {
+    size_t count;
+    char** keys = keys_using(number, &count);
+    int result = 0;
+
+    for (size_t i = 0; i < count; i++) {
+      if (result == 0) {
+        result = move_entry(keys[i], number);
+      }
+      free(keys[i]);
+    }
+    free(keys);
+    if (result != 0) {
+      return -1;
+    }
+    if (count > 0) {
+      continue;
+    }
+
+    if (!carried) {
+      if (carry_deletes(number) != 0) {
+        return -1;
+      }
+      carried = 1;
+    }
+
+    // The copies must be on disk before the only other copy goes
+    pthread_rwlock_rdlock(&pack_lock);
+    for (uint32_t n = first; n <= active; n++) {
+      if (segments[n] != NULL && fdatasync(segments[n]->fd) != 0) {
+        result = -1;
+      }
+    }
+    pthread_rwlock_unlock(&pack_lock);
+    if (result != 0) {
+      return -1;
+    }
+
+    // A LINK may have named data in it since the keys were collected
+    pthread_rwlock_wrlock(&pack_lock);
+    int used = 0;
+    for (size_t i = 0; i < entries.size && !used; i++) {
+      for (pack_node_t* n = entries.buckets[i]; n != NULL && !used;
+           n = n->next) {
+        used = entry_uses((pack_entry_t*)n, number);
+      }
+    }
+    if (!used) {
+      pack_segment_t* seg = segments[number];
+      segments[number] = NULL;
+      close(seg->fd);
+      segment_path(number, path);
+      unlink(path);
+      free(seg);
+    }
+    pthread_rwlock_unlock(&pack_lock);
+
+    if (!used) {
+      metrics_add(METRIC_PACK_COMPACTIONS, 1);
+      log_info("Compacted pack segment %u", number);
+      return 0;
+    }
+  }
+}
+
+// A segment that is due, sealed first if it is the active one
+// @return its number, 0 if none is due
+static uint32_t due_segment(void) {
+  uint32_t found = 0;
+
+  pthread_rwlock_wrlock(&pack_lock);
+  for (uint32_t n = 1; n < segment_cap && found == 0; n++) {
+    if (compact_due(n) && (n != active || roll_segment() == 0)) {
+      found = n;
+    }
+  }
+  pthread_rwlock_unlock(&pack_lock);
+  return found;
+}
+
+// Compaction thread, woken by RMs that leave a segment mostly dead
+static void* compact_thread(void* arg) {
+  (void)arg;
+
+  while (1) {
+    pthread_mutex_lock(&compact_mutex);
+    while (!compact_wanted) {
+      pthread_cond_wait(&compact_cond, &compact_mutex);
+    }
+    compact_wanted = 0;
+    pthread_mutex_unlock(&compact_mutex);
+
+    uint32_t number;
+    while ((number = due_segment()) != 0) {
+      if (compact_segment(number) != 0) {
+        log_warn("Compaction of pack segment %u failed, tried again after "
+                 "the next RM",
+                 number);
+        break;
+      }
+    }
+  }
+  return NULL;
+}
+
+int pack_init(void) {
+  pthread_rwlockattr_t attr;
+  uint32_t* numbers = NULL;
+  size_t count = 0;
+  size_t cap = 0;
+  struct dirent* entry;
+  pthread_t tid;
+
+  // Commits must not starve behind a stream of GETs
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&pack_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+
+  if (create_directories(PACK_DIR) != 0) {
+    return -1;
+  }
+  DIR* dir = opendir(PACK_DIR);
+  if (dir == NULL) {
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    unsigned int number;
+    int end = 0;
+    if (sscanf(entry->d_name, "%u.pack%n", &number, &end) != 1 ||
+        entry->d_name[end] != '\0' || end == 0 || number == 0) {
+      continue;
+    }
+    if (count == cap) {
+      cap = cap > 0 ? cap * 2 : 64;
+      uint32_t* grown = realloc(numbers, cap * sizeof(uint32_t));
+      if (grown == NULL) {
+        free(numbers);
+        closedir(dir);
+        return -1;
+      }
+      numbers = grown;
+    }
+    numbers[count++] = number;
+  }
+  closedir(dir);
+  qsort(numbers, count, sizeof(uint32_t), compare_numbers);
+
+  for (size_t i = 0; i < count; i++) {
+    if (open_segment(numbers[i], 0) == NULL ||
+        load_segment(numbers[i], i == count - 1) != 0) {
+      free(numbers);
+      return -1;
+    }
+    active = numbers[i];
+  }
+  free(numbers);
+  finish_loading();
+
+  if (count == 0 && roll_segment() != 0) {
+    return -1;
+  }
+
+  if (pthread_create(&tid, NULL, compact_thread, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(tid);
+
+  for (uint32_t n = 1; n < segment_cap; n++) {
+    if (compact_due(n)) {
+      wake_compaction();
+      break;
+    }
+  }
+  return 0;
+}
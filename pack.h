@@ -0,0 +1,132 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Small files packed into append-only segments (server -P)
+ *
+ * A WRITE of a file up to PACK_MAX_FILE bytes doesn't get an inode of
+ * its own: the file is appended to the active segment under PACK_DIR,
+ * and an index in memory maps its path to where the data is. The commit
+ * is one pwritev() and a GET one pread(), with no temp file, rename() or
+ * version manifest. Directories are still made as usual, so LIST and RM
+ * of a directory treat packed files like any other.
+ *
+ * A segment is a log of records:
+ *
+ *   u32 magic, u8 type, u8 flags, u16 path length, u32 data length,
+ *   u32 CRC32C of the data, u64 sequence number, u64 mtime,
+ *   u32 latest version, u32 segment and u64 offset of linked data,
+ *   u32 CRC32C of the header and path, path, data (PUT only)
+ *
+ * A PUT carries a file. When a packed file is overwritten, a LINK names
+ * its old data as the next version, path.vN, without copying it, and
+ * the PUT of the new contents follows in the same write. RM appends a
+ * DEL for the file and one for each of its versions. At startup the
+ * segments are read in order and for every path the record with the
+ * highest sequence number wins; a torn record at the end of the last
+ * segment is cut off.
+ *
+ * RM leaves dead records behind. Once PACK_COMPACT_PERCENT of a segment
+ * is dead, a compaction thread copies what is still live into the
+ * active segment, keeping the sequence numbers, syncs it and deletes the
+ * old one. A DEL is carried forward while an older segment may still
+ * hold what it deleted.
+ *
+ * A path that is a plain file stays one, even when rewritten small; a
+ * packed file rewritten too big becomes a plain file, its packed data
+ * the next version. Packed files are never chunked, kept compressed,
+ * handed off or replicated, so -P is refused in a cluster or with
+ * replicas. The packs are loaded without -P too, their files stay
+ * readable.
+ */
+
+#define PACK_DIR ROOT_DIR "/" META_NAME "/packs"
+#define PACK_MAX_FILE 4096
+#define PACK_SEGMENT_SIZE (64 << 20)
+#define PACK_COMPACT_PERCENT 50
+
+// Set by the -P flag, small WRITEs are packed when on
+extern int pack_enabled;
+
+// Load the segments into the index and start the compaction thread
+
+int pack_init(void);
+
+// Number of packed files and versions
+
+size_t pack_count(void);
+
+// Number of segments on disk
+
+int pack_segment_count(void);
+
+// 1 if a remote path is a packed file or version
+
+int pack_contains(const char* path);
+
+/**
+ * Pack a file, the current contents becoming its next version
+ * @param path - remote path of the file
+ * @param data - its contents
+ * @param len - bytes of contents, up to PACK_MAX_FILE
+ * @param crc - CRC32C of the contents
+ * @param sync_fd - output, a dup() of the segment to sync the commit
+ *                  through, or NULL when no sync is wanted
+ * @return the version the old contents were saved as, 0 if the file is
+ *         new, -1 on error
+ */
+int pack_put(const char* path, const void* data, uint32_t len, uint32_t crc,
+             int* sync_fd);
+
+/**
+ * Keep a packed file's contents as its next version only, for a file
+ * that is about to become a plain file
+ * @param path - remote path of the file
+ * @return the version it was saved as, 0 if it isn't packed, -1 on error
+ */
+int pack_save_version(const char* path);
+
+/**
+ * Read a packed file or version
+ * @param path - remote path
+ * @param buf - output, at least PACK_MAX_FILE bytes
+ * @param crc - output, CRC32C of the contents
+ * @return its length, -1 if it isn't packed, -2 if the data is corrupt
+ */
+long pack_read(const char* path, void* buf, uint32_t* crc);
+
+/**
+ * Look up a packed file or version without reading it
+ * @param path - remote path
+ * @param mtime - output, when it was written
+ * @param crc - output, CRC32C of the contents
+ * @param latest - output, its latest version, 0 for a version
+ * @return its length, -1 if it isn't packed
+ */
+long pack_stat(const char* path, uint64_t* mtime, uint32_t* crc, int* latest);
+
+/**
+ * Remove a packed file with all of its packed versions, or one version
+ * @param path - remote path
+ * @return 1 if anything was removed, 0 if nothing is packed there, -1 if
+ *         the segment can't be written
+ */
+int pack_remove(const char* path);
+
+// Number of packed files and versions right inside a directory
+
+size_t pack_dir_count(const char* dir);
+
+/**
+ * List the packed files of a directory as LIST entries, see protocol.h
+ * @param dir - remote path of the directory
+ * @param recursive - include its subdirectories
+ * @param len - output, bytes of entries
+ * @return a malloc()ed buffer, or NULL if there are none or no memory
+ */
+unsigned char* pack_list(const char* dir, int recursive, size_t* len);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * peer.c -- Requests one server sends to another
+ */
+
+#include "peer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server.h"
+
+int peer_connect(const char* addr) {
+  char host[RING_ADDR_MAX];
+  char port_text[8];
+  struct addrinfo hints;
+  struct addrinfo* res;
+  int port;
+
+  if (ring_split_addr(addr, host, &port) != 0) {
+    return -1;
+  }
+  snprintf(port_text, sizeof(port_text), "%d", port);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port_text, &hints, &res) != 0) {
+    return -1;
+  }
+
+  int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (sock >= 0) {
+    struct timeval timeout = {PEER_TIMEOUT_S, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, res->ai_addr, res->ai_addrlen) != 0) {
+      close(sock);
+      sock = -1;
+    }
+  }
+  freeaddrinfo(res);
+  return sock;
+}
+
+// Send a whole file descriptor's worth of payload
+static int send_fd(int sock, int fd, uint64_t len) {
+  off_t offset = 0;
+
+  while ((uint64_t)offset < len) {
+    size_t want = len - offset < SENDFILE_CHUNK ? len - offset : SENDFILE_CHUNK;
+    ssize_t n = sendfile(sock, fd, &offset, want);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int peer_send_file(int sock, const char* path, int flags, int fd,
+                   uint64_t len) {
+  unsigned char request[RFS_HEADER_SIZE + MAX_PATH];
+
+  size_t n = rfs_build_request(request, RFS_OP_WRITE, 1, path, len);
+  rfs_set_flags(request, flags);
+  if (send_all(sock, request, n) < 0 || send_fd(sock, fd, len) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Send a version that only exists as a chunk recipe
+static int send_recipe(int sock, const char* path, int flags,
+                       const recipe_t* recipe) {
+  unsigned char request[RFS_HEADER_SIZE + MAX_PATH];
+
+  size_t n = rfs_build_request(request, RFS_OP_WRITE, 1, path, recipe->size);
+  rfs_set_flags(request, flags);
+  if (send_all(sock, request, n) < 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < recipe->count; i++) {
+    int fd = chunk_open(&recipe->chunks[i]);
+    if (fd < 0) {
+      return -1;
+    }
+    int r = send_fd(sock, fd, recipe->chunks[i].len);
+    close(fd);
+    if (r != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int peer_send_version(int sock, const char* path, const char* full_path,
+                      int version, int flags) {
+  char version_path[MAX_PATH];
+  char version_full[MAX_PATH];
+  char recipe_path[MAX_PATH];
+  struct stat st;
+
+  snprintf(version_path, sizeof(version_path), "%s.v%d", path, version);
+  snprintf(version_full, sizeof(version_full), "%s.v%d", full_path, version);
+
+  int fd = open(version_full, O_RDONLY);
+  if (fd >= 0) {
+    int r = fstat(fd, &st) == 0
+                ? peer_send_file(sock, version_path, flags, fd, st.st_size)
+                : -1;
+    close(fd);
+    return r == 0 ? 1 : -1;
+  }
+  if (get_recipe_path(version_full, "", recipe_path) != 0) {
+    return 0;
+  }
+  recipe_t* recipe = recipe_load(recipe_path);
+  if (recipe == NULL) {
+    return 0;  // removed, the numbering just has a gap
+  }
+  int r = send_recipe(sock, version_path, flags, recipe);
+  recipe_free(recipe);
+  return r == 0 ? 1 : -1;
+}
+
+int peer_send_request(int sock, int opcode, const char* path, int flags) {
+  unsigned char request[RFS_HEADER_SIZE + MAX_PATH];
+
+  size_t n = rfs_build_request(request, opcode, 1, path, 0);
+  rfs_set_flags(request, flags);
+  return send_all(sock, request, n) < 0 ? -1 : 0;
+}
+
+int peer_recv_reply(int sock, const char* path) {
+  unsigned char frame[RFS_HEADER_SIZE];
+  char msg[256];
+  rfs_header_t hdr;
+
+  if (recv_all(sock, frame, sizeof(frame)) < 0 ||
+      rfs_decode_header(frame, &hdr) != 0) {
+    log_warn("  %s: no reply", path);
+    return -1;
+  }
+  size_t kept = hdr.payload_len < sizeof(msg) - 1 ? hdr.payload_len
+                                                  : sizeof(msg) - 1;
+  if (recv_all(sock, msg, kept) < 0) {
+    return -1;
+  }
+  msg[kept] = '\0';
+  for (uint64_t left = hdr.payload_len - kept; left > 0;) {
+    char discard[256];
+    size_t want = left < sizeof(discard) ? left : sizeof(discard);
+    if (recv_all(sock, discard, want) < 0) {
+      return -1;
+    }
+    left -= want;
+  }
+
+  if (hdr.opcode != RFS_OP_OK) {
+    log_warn("  %s: %s %s", path, rfs_opcode_name(hdr.opcode),
+             hdr.opcode == RFS_OP_BUSY ? "" : msg);
+  }
+  return hdr.opcode;
+}
@@ -0,0 +1,73 @@
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdint.h>
+
+/*
+ * Requests one server sends to another
+ *
+ * Cluster nodes hand files to each other (cluster.h) and a primary
+ * streams its commits to its replicas (replica.h) with the same WRITE
+ * and RM requests a client sends, marked with RFS_FLAG_HANDOFF or
+ * RFS_FLAG_REPLICA. They run from the server's own background threads on
+ * blocking sockets, never from a worker, and every send and receive
+ * times out after PEER_TIMEOUT_S so a hung peer can't stall them.
+ *
+ * A file goes out with sendfile() straight from ROOT_DIR. A version that
+ * only exists as a chunk recipe is sent chunk by chunk from the chunk
+ * store and arrives as a plain file.
+ */
+
+#define PEER_TIMEOUT_S 30
+
+/**
+ * Connect to another server
+ * @param addr - its "host:port"
+ * @return the connected socket, or -1
+ */
+int peer_connect(const char* addr);
+
+/**
+ * Send a WRITE with the contents of an open file
+ * @param sock - connected socket
+ * @param path - remote path the file is written to
+ * @param flags - RFS_FLAG_* of the request
+ * @param fd - file to send, from its start
+ * @param len - bytes to send
+ * @return 0, or -1 if the connection broke
+ */
+int peer_send_file(int sock, const char* path, int flags, int fd,
+                   uint64_t len);
+
+/**
+ * Send a WRITE with a saved version of a file, if it still exists
+ * @param sock - connected socket
+ * @param path - remote path of the file
+ * @param full_path - the file under ROOT_DIR
+ * @param version - version to send, written to path.vN
+ * @param flags - RFS_FLAG_* of the request
+ * @return 1 if it was sent, 0 if there is no such version, -1 if the
+ *         connection broke
+ */
+int peer_send_version(int sock, const char* path, const char* full_path,
+                      int version, int flags);
+
+/**
+ * Send a request that carries no payload
+ * @param sock - connected socket
+ * @param opcode - RFS_OP_RM
+ * @param path - remote path
+ * @param flags - RFS_FLAG_* of the request
+ * @return 0, or -1 if the connection broke
+ */
+int peer_send_request(int sock, int opcode, const char* path, int flags);
+
+/**
+ * Wait for the reply to one request, logging it unless it is OK
+ * @param sock - connected socket
+ * @param path - remote path of the request, for the log
+ * @return the reply's RFS_OP_*, or -1 if the connection broke
+ */
+int peer_recv_reply(int sock, const char* path);
+
+#endif
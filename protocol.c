@@ -0,0 +1,205 @@
+/*
+ * protocol.c -- Binary framing shared by the server and rfs
+ */
+
+#include "protocol.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Store a 64 bit value in network byte order
+void rfs_put_u64(unsigned char* buf, uint64_t value) {
+  for (int i = 7; i >= 0; i--) {
+    buf[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+// Load a 64 bit value stored in network byte order
+uint64_t rfs_get_u64(const unsigned char* buf) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+// Store a 32 bit value in network byte order
+void rfs_put_u32(unsigned char* buf, uint32_t value) {
+  uint32_t net = htonl(value);
+  memcpy(buf, &net, 4);
+}
+
+// Load a 32 bit value stored in network byte order
+uint32_t rfs_get_u32(const unsigned char* buf) {
+  uint32_t net;
+  memcpy(&net, buf, 4);
+  return ntohl(net);
+}
+
+// Encode a header into its wire format
+// @param hdr - header to encode
+// @param buf - output buffer of at least RFS_HEADER_SIZE bytes
+void rfs_encode_header(const rfs_header_t* hdr, unsigned char* buf) {
+  uint32_t magic = htonl(RFS_MAGIC);
+  uint16_t flags = htons(hdr->flags);
+  uint32_t path_len = htonl(hdr->path_len);
+  uint32_t request_id = htonl(hdr->request_id);
+
+  memcpy(buf, &magic, 4);
+  buf[4] = RFS_VERSION;
+  buf[5] = hdr->opcode;
+  memcpy(buf + 6, &flags, 2);
+  memcpy(buf + 8, &path_len, 4);
+  memcpy(buf + 12, &request_id, 4);
+  rfs_put_u64(buf + 16, hdr->payload_len);
+}
+
+// Decode a header from its wire format
+// @param buf - RFS_HEADER_SIZE bytes received from the peer
+// @param hdr - output header
+int rfs_decode_header(const unsigned char* buf, rfs_header_t* hdr) {
+  uint32_t magic;
+  uint16_t flags;
+  uint32_t path_len;
+  uint32_t request_id;
+
+  memcpy(&magic, buf, 4);
+  if (ntohl(magic) != RFS_MAGIC) {
+    return -1;
+  }
+
+  hdr->version = buf[4];
+  if (hdr->version != RFS_VERSION) {
+    return -1;
+  }
+
+  hdr->opcode = buf[5];
+  memcpy(&flags, buf + 6, 2);
+  memcpy(&path_len, buf + 8, 4);
+  memcpy(&request_id, buf + 12, 4);
+  hdr->flags = ntohs(flags);
+  hdr->path_len = ntohl(path_len);
+  hdr->request_id = ntohl(request_id);
+  hdr->payload_len = rfs_get_u64(buf + 16);
+  return 0;
+}
+
+// Build header + path for a request
+// @param buf - output buffer, RFS_HEADER_SIZE + strlen(path) bytes
+// @param opcode - RFS_OP_* request
+// @param request_id - id the reply will carry
+// @param path - remote path, may be empty
+// @param payload_len - bytes of payload the caller sends after this
+size_t rfs_build_request(unsigned char* buf, int opcode, uint32_t request_id,
+                         const char* path, uint64_t payload_len) {
+  rfs_header_t hdr;
+  size_t path_len = strlen(path);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.opcode = opcode;
+  hdr.request_id = request_id;
+  hdr.path_len = path_len;
+  hdr.payload_len = payload_len;
+
+  rfs_encode_header(&hdr, buf);
+  memcpy(buf + RFS_HEADER_SIZE, path, path_len);
+  return RFS_HEADER_SIZE + path_len;
+}
+
+// Set the flags field of an encoded header
+// @param buf - header from rfs_build_request or rfs_encode_header
+// @param flags - RFS_FLAG_* bits
+void rfs_set_flags(unsigned char* buf, uint16_t flags) {
+  uint16_t net = htons(flags);
+  memcpy(buf + 6, &net, 2);
+}
+
+// Printable name of an opcode
+// @param opcode - RFS_OP_* value
+const char* rfs_opcode_name(int opcode) {
+  switch (opcode) {
+    case RFS_OP_WRITE:
+      return "WRITE";
+    case RFS_OP_GET:
+      return "GET";
+    case RFS_OP_RM:
+      return "RM";
+    case RFS_OP_STOP:
+      return "STOP";
+    case RFS_OP_SIG:
+      return "SIG";
+    case RFS_OP_DELTA:
+      return "DELTA";
+    case RFS_OP_UPLOAD:
+      return "UPLOAD";
+    case RFS_OP_WRITE_RANGE:
+      return "WRITE_RANGE";
+    case RFS_OP_COMMIT:
+      return "COMMIT";
+    case RFS_OP_GET_RANGE:
+      return "GET_RANGE";
+    case RFS_OP_LIST:
+      return "LIST";
+    case RFS_OP_STATS:
+      return "STATS";
+    case RFS_OP_RING:
+      return "RING";
+    case RFS_OP_OK:
+      return "OK";
+    case RFS_OP_ERROR:
+      return "ERROR";
+    case RFS_OP_DATA:
+      return "DATA";
+    case RFS_OP_BUSY:
+      return "BUSY";
+    case RFS_OP_MOVED:
+      return "MOVED";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+// Send all len bytes on a blocking socket
+// @param sock - connected socket
+// @param buf - data to send
+// @param len - number of bytes
+int send_all(int sock, const void* buf, size_t len) {
+  const char* p = buf;
+
+  while (len > 0) {
+    ssize_t sent = send(sock, p, len, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += sent;
+    len -= sent;
+  }
+  return 0;
+}
+
+// Receive exactly len bytes on a blocking socket
+// @param sock - connected socket
+// @param buf - output buffer
+// @param len - number of bytes
+int recv_all(int sock, void* buf, size_t len) {
+  char* p = buf;
+
+  while (len > 0) {
+    ssize_t n = recv(sock, p, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
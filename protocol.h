@@ -0,0 +1,168 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary wire protocol shared by the server and rfs
+ *
+ * Every message starts with a fixed 24 byte header, all fields in network
+ * byte order:
+ *
+ *   0  magic        "RFS1"
+ *   4  version      RFS_VERSION
+ *   5  opcode       RFS_OP_*
+ *   6  flags        RFS_FLAG_*
+ *   8  path_len     bytes of path that follow the header
+ *  12  request_id   chosen by the client, echoed in the reply
+ *  16  payload_len  bytes of payload that follow the path
+ *
+ * A request is header + path + payload, so a WRITE and its data go out
+ * back to back with no handshake. Replies use the same framing: OK and
+ * ERROR carry a text message as payload, DATA carries file contents.
+ *
+ * A connection stays open for as many requests as the client wants to
+ * send. Requests may be pipelined without waiting for replies; the server
+ * answers each one with the request_id it was sent with.
+ *
+ * SIG and DELTA upload only the parts of a file that changed, the formats
+ * of their payloads are described in delta.h.
+ *
+ * UPLOAD, WRITE_RANGE and COMMIT send a file in ranges that may arrive
+ * out of order, over several connections, or after a reconnect; they are
+ * described in upload.h. GET_RANGE reads part of a file:
+ *
+ *   request payload  u64 offset, u64 length (0 reads to the end)
+ *   DATA payload     u64 size of the whole file, then the range's bytes
+ *
+ * LIST is the one request with more than one reply. The entries of the
+ * directory (its whole tree with RFS_FLAG_RECURSIVE, parents before
+ * their contents) stream back in as many DATA frames as they need, and
+ * an OK frame ends the listing. Each entry is
+ *
+ *   u8 type (RFS_ENTRY_*), u64 size, u64 mtime, u16 name length, name
+ *
+ * with the name relative to the listed directory.
+ *
+ * WRITE and GET may compress the file with RFS_FLAG_COMPRESS, see
+ * compress.h.
+ *
+ * BUSY turns a request (or a new connection, with request_id 0) away
+ * because the server or the client is over a limit, see admission.h:
+ *
+ *   payload  u32 milliseconds to wait before retrying, then a message
+ *
+ * STATS has an empty path and is answered with one DATA frame holding
+ * the server's metrics as text.
+ *
+ * In a cluster (see cluster.h) a request for a path another node owns
+ * is answered with MOVED, whose payload is that node's "host:port". RING
+ * with no payload asks for the membership, answered with one DATA frame
+ * (empty if the server isn't in a cluster); RING with a node list as
+ * payload replaces it and starts moving files to their new owners.
+ *
+ * A primary passes its WRITEs and RMs on to its replicas with
+ * RFS_FLAG_REPLICA, see replica.h.
+ *
+ * An uncompressed WRITE with RFS_FLAG_CHECKSUM ends its payload with the
+ * u32 CRC32C of the file (see checksum.h), which the server checks
+ * before committing it. A GET with the flag asks for the checksum: if
+ * the server has one for the file, the DATA frame is flagged too and
+ * ends with it.
+ */
+
+#define RFS_MAGIC 0x52465331
+#define RFS_VERSION 1
+#define RFS_HEADER_SIZE 24
+
+// Request opcodes
+#define RFS_OP_WRITE 1
+#define RFS_OP_GET 2
+#define RFS_OP_RM 3
+#define RFS_OP_STOP 4
+#define RFS_OP_SIG 5    // block signatures of a file, see delta.h
+#define RFS_OP_DELTA 6  // WRITE as a delta against the signed version
+#define RFS_OP_UPLOAD 7       // open or resume an upload session
+#define RFS_OP_WRITE_RANGE 8  // write part of a session's file
+#define RFS_OP_COMMIT 9       // commit a complete session like a WRITE
+#define RFS_OP_GET_RANGE 10   // GET part of a file
+#define RFS_OP_LIST 11        // entries of a directory
+#define RFS_OP_STATS 12       // server metrics, see metrics.h
+#define RFS_OP_RING 13        // cluster membership, see ring.h
+
+// Reply opcodes
+#define RFS_OP_OK 0x80
+#define RFS_OP_ERROR 0x81
+#define RFS_OP_DATA 0x82
+#define RFS_OP_BUSY 0x83  // over a limit, try again later
+#define RFS_OP_MOVED 0x84  // path belongs to another node of the cluster
+
+// Request flags
+#define RFS_FLAG_RECURSIVE 0x1  // LIST the whole tree
+#define RFS_FLAG_COMPRESS 0x2   // WRITE or DATA payload is compressed
+#define RFS_FLAG_LOCAL 0x4      // RM this node's copy, wherever it belongs
+#define RFS_FLAG_HANDOFF 0x8    // WRITE from a node giving the file up
+#define RFS_FLAG_REPLICA 0x10   // WRITE or RM a primary passes on
+#define RFS_FLAG_CHECKSUM 0x20  // payload ends in the file's CRC32C
+
+// LIST entry types
+#define RFS_ENTRY_FILE 'f'
+#define RFS_ENTRY_DIR 'd'
+#define RFS_ENTRY_VERSION 'v'  // saved version of a file, name.vN
+#define RFS_ENTRY_HEADER_SIZE 19
+
+// Decoded message header
+typedef struct {
+  uint8_t version;
+  uint8_t opcode;
+  uint16_t flags;
+  uint32_t path_len;
+  uint32_t request_id;
+  uint64_t payload_len;
+} rfs_header_t;
+
+/**
+ * Encode a header into its wire format
+ * @param hdr - header to encode, magic and version are filled in
+ * @param buf - output buffer of at least RFS_HEADER_SIZE bytes
+ */
+void rfs_encode_header(const rfs_header_t* hdr, unsigned char* buf);
+
+/**
+ * Decode a header from its wire format
+ * @param buf - RFS_HEADER_SIZE bytes received from the peer
+ * @param hdr - output header
+ * @return 0 on success, -1 if the magic or version don't match
+ */
+int rfs_decode_header(const unsigned char* buf, rfs_header_t* hdr);
+
+// Build header + path for a request, returns bytes written to buf
+
+size_t rfs_build_request(unsigned char* buf, int opcode, uint32_t request_id,
+                         const char* path, uint64_t payload_len);
+
+// Set the flags of a request built by rfs_build_request
+
+void rfs_set_flags(unsigned char* buf, uint16_t flags);
+
+// Store and load big endian integers
+
+void rfs_put_u64(unsigned char* buf, uint64_t value);
+uint64_t rfs_get_u64(const unsigned char* buf);
+void rfs_put_u32(unsigned char* buf, uint32_t value);
+uint32_t rfs_get_u32(const unsigned char* buf);
+
+// Printable name of an opcode, for logging
+
+const char* rfs_opcode_name(int opcode);
+
+// Send all len bytes on a blocking socket, returns 0 or -1
+
+int send_all(int sock, const void* buf, size_t len);
+
+// Receive exactly len bytes on a blocking socket, returns 0 or -1
+
+int recv_all(int sock, void* buf, size_t len);
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ * reactor.c -- Listeners, event loops and worker pools
+ */
+
+#define _GNU_SOURCE
+
+#include "reactor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server.h"
+
+int num_reactors = 1;
+
+static reactor_t reactors[MAX_REACTORS];
+
+// CPUs the server may run on, in order, for splitting among reactors
+static int cpu_ids[CPU_SETSIZE];
+static int cpu_count = 0;
+
+static void find_cpus(void) {
+  cpu_set_t set;
+
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpu_ids[cpu_count++] = cpu;
+      }
+    }
+  }
+  if (cpu_count == 0) {
+    cpu_ids[cpu_count++] = 0;
+  }
+}
+
+// Give a reactor its CPUs and workers
+static void place_reactor(reactor_t* reactor) {
+  int i = reactor->id;
+
+  if (num_reactors == 1) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    reactor->cpus = 0;
+    reactor->workers = cores > 0 ? (int)cores : 1;
+  } else if (num_reactors <= cpu_count) {
+    reactor->first_cpu = i * cpu_count / num_reactors;
+    reactor->cpus = (i + 1) * cpu_count / num_reactors - reactor->first_cpu;
+    reactor->workers = reactor->cpus;
+  } else {
+    // More reactors than CPUs, they take turns
+    reactor->first_cpu = i % cpu_count;
+    reactor->cpus = 1;
+    reactor->workers = 1;
+  }
+}
+
+// Pin the calling thread to its reactor's CPUs
+static void pin_thread(const reactor_t* reactor) {
+  cpu_set_t set;
+
+  if (reactor->cpus == 0) {
+    return;
+  }
+  CPU_ZERO(&set);
+  for (int i = 0; i < reactor->cpus; i++) {
+    CPU_SET(cpu_ids[reactor->first_cpu + i], &set);
+  }
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    log_warn("Can't pin reactor %d to its CPUs", reactor->id);
+  }
+}
+
+// Open a reactor's listener and its epoll instance
+static int open_listener(reactor_t* reactor, int port, int backlog) {
+  struct sockaddr_in server_addr;
+  struct epoll_event ev;
+  int opt = 1;
+
+  reactor->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (reactor->listen_fd < 0) {
+    printf("Error while creating socket\n");
+    return -1;
+  }
+
+  // Allow socket address reuse, and with several reactors let all of
+  // their listeners share the port
+  setsockopt(reactor->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (num_reactors > 1) {
+    if (setsockopt(reactor->listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+                   sizeof(opt)) < 0) {
+      printf("Error while sharing the port between reactors\n");
+      return -1;
+    }
+  }
+#ifdef SO_INCOMING_CPU
+  if (reactor->cpus > 0) {
+    int cpu = cpu_ids[reactor->first_cpu];
+    setsockopt(reactor->listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+               sizeof(cpu));
+  }
+#endif
+
+  // Configure server address
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(port);
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+
+  if (bind(reactor->listen_fd, (struct sockaddr*)&server_addr,
+           sizeof(server_addr)) < 0) {
+    printf("Couldn't bind to the port\n");
+    return -1;
+  }
+  if (listen(reactor->listen_fd, backlog) < 0) {
+    printf("Error while listening\n");
+    return -1;
+  }
+
+  // Watch the listener, connections are added as they are accepted
+  reactor->epoll_fd = epoll_create1(0);
+  if (reactor->epoll_fd < 0 || set_nonblocking(reactor->listen_fd) < 0) {
+    printf("Error while creating event loop\n");
+    return -1;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) <
+      0) {
+    printf("Error while creating event loop\n");
+    return -1;
+  }
+
+  // Kept open for the moment the server runs out of descriptors
+  reactor->spare_fd = open("/dev/null", O_RDONLY);
+  return 0;
+}
+
+int reactor_init(int port, int backlog) {
+  if (num_reactors < 1) {
+    num_reactors = 1;
+  } else if (num_reactors > MAX_REACTORS) {
+    num_reactors = MAX_REACTORS;
+  }
+  find_cpus();
+
+  for (int i = 0; i < num_reactors; i++) {
+    reactor_t* reactor = &reactors[i];
+
+    reactor->id = i;
+    reactor->listen_fd = reactor->epoll_fd = reactor->spare_fd = -1;
+    pthread_mutex_init(&reactor->work_mutex, NULL);
+    pthread_cond_init(&reactor->work_cond, NULL);
+    place_reactor(reactor);
+    if (open_listener(reactor, port, backlog) != 0) {
+      reactor_close_listeners();
+      return -1;
+    }
+  }
+  printf("Socket created successfully\n");
+  return 0;
+}
+
+void rearm_connection(conn_t* conn, unsigned int events) {
+  struct epoll_event ev;
+
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = conn;
+  if (epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_MOD, conn->client_sock,
+                &ev) < 0) {
+    log_error("Failed to rearm connection");
+    close_connection(conn);
+  }
+}
+
+void submit_connection(conn_t* conn) {
+  reactor_t* reactor = conn->reactor;
+
+  pthread_mutex_lock(&reactor->work_mutex);
+
+  conn->next = NULL;
+  if (reactor->work_tail != NULL) {
+    reactor->work_tail->next = conn;
+  } else {
+    reactor->work_head = conn;
+  }
+  reactor->work_tail = conn;
+
+  pthread_cond_signal(&reactor->work_cond);
+  pthread_mutex_unlock(&reactor->work_mutex);
+}
+
+// Worker thread, runs connections taken from its reactor's work queue
+// @param arg - the reactor
+static void* worker_thread(void* arg) {
+  reactor_t* reactor = arg;
+
+  pin_thread(reactor);
+  buf_pool_bind(reactor->id);
+  uring_thread_init();
+
+  while (1) {
+    pthread_mutex_lock(&reactor->work_mutex);
+    while (reactor->work_head == NULL) {
+      pthread_cond_wait(&reactor->work_cond, &reactor->work_mutex);
+    }
+
+    conn_t* conn = reactor->work_head;
+    reactor->work_head = conn->next;
+    if (reactor->work_head == NULL) {
+      reactor->work_tail = NULL;
+    }
+    pthread_mutex_unlock(&reactor->work_mutex);
+
+    process_connection(conn);
+  }
+
+  return NULL;
+}
+
+// Event loop, ready connections go to the reactor's workers
+static void run_loop(reactor_t* reactor) {
+  struct epoll_event events[MAX_EVENTS];
+
+  pin_thread(reactor);
+  while (1) {
+    int count = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("Error while waiting for events");
+      return;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.ptr == NULL) {
+        accept_connections(reactor);
+      } else {
+        submit_connection(events[i].data.ptr);
+      }
+    }
+  }
+}
+
+static void* loop_thread(void* arg) {
+  run_loop(arg);
+  // Without its loop the reactor's connections would hang
+  log_error("Event loop of reactor %d stopped", ((reactor_t*)arg)->id);
+  log_flush();
+  exit(1);
+}
+
+int reactor_start(void) {
+  pthread_t tid;
+
+  for (int i = 0; i < num_reactors; i++) {
+    for (int w = 0; w < reactors[i].workers; w++) {
+      if (pthread_create(&tid, NULL, worker_thread, &reactors[i]) != 0) {
+        return -1;
+      }
+      pthread_detach(tid);
+    }
+  }
+  for (int i = 1; i < num_reactors; i++) {
+    if (pthread_create(&tid, NULL, loop_thread, &reactors[i]) != 0) {
+      return -1;
+    }
+    pthread_detach(tid);
+  }
+  return 0;
+}
+
+void reactor_run(void) {
+  run_loop(&reactors[0]);
+}
+
+void reactor_close_listeners(void) {
+  for (int i = 0; i < num_reactors; i++) {
+    if (reactors[i].listen_fd >= 0) {
+      close(reactors[i].listen_fd);
+      reactors[i].listen_fd = -1;
+    }
+  }
+}
+
+int reactor_worker_count(void) {
+  int workers = 0;
+
+  for (int i = 0; i < num_reactors; i++) {
+    workers += reactors[i].workers;
+  }
+  return workers;
+}
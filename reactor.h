@@ -0,0 +1,90 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+
+/*
+ * Event loops, each with its own listener and workers (server -r N)
+ *
+ * A reactor is a listening socket, an epoll instance watching it and the
+ * reactor's idle connections, a work queue and the worker threads taking
+ * from it. A connection stays with the reactor that accepted it for its
+ * whole life: lock owners, the group commit and the throttle hand it back
+ * through conn->reactor, so two reactors never share a queue, a mutex or
+ * an epoll instance.
+ *
+ * With more than one reactor every listener is bound to PORT with
+ * SO_REUSEPORT and the kernel spreads incoming connections over them, so
+ * there is no accept lock either. The online CPUs are split into one
+ * contiguous set per reactor; its event loop and workers are pinned to
+ * that set, one worker per CPU, and SO_INCOMING_CPU asks the kernel to
+ * prefer the listener of the CPU a connection arrived on. Each reactor
+ * also takes its transfer buffers from its own share of the pool, first
+ * touched by its own threads, so memory and caches stay on its node.
+ *
+ * A single reactor (the default) is left unpinned and runs one worker
+ * per core, as the server always did.
+ */
+
+#define MAX_REACTORS 64
+
+struct conn;
+
+// One event loop and its workers
+typedef struct reactor {
+  int id;
+  int listen_fd;
+  int epoll_fd;
+  int spare_fd;     // kept open to accept and reject at EMFILE
+  int first_cpu;    // CPUs first_cpu .. first_cpu + cpus - 1 by the
+  int cpus;         // online order, cpus is 0 when not pinned
+  int workers;
+
+  // Connections ready to run, linked through conn->next
+  struct conn* work_head;
+  struct conn* work_tail;
+  pthread_mutex_t work_mutex;
+  pthread_cond_t work_cond;
+} reactor_t;
+
+// Set by the -r flag
+extern int num_reactors;
+
+/**
+ * Open a listener per reactor and set up their event loops
+ * @param port - port every listener binds to
+ * @param backlog - listen queue of each listener
+ * @return 0, or -1 after printing what failed
+ */
+int reactor_init(int port, int backlog);
+
+// Start every reactor's workers and all event loops but the first, -1 if
+// a thread could not be created
+
+int reactor_start(void);
+
+// Run the first reactor's event loop on the calling thread, only returns
+// if epoll fails
+
+void reactor_run(void);
+
+// Close every listener, for STOP
+
+void reactor_close_listeners(void);
+
+// Number of workers over all reactors
+
+int reactor_worker_count(void);
+
+/**
+ * Watch a connection for its next event
+ * @param conn - connection to rearm
+ * @param events - EPOLLIN or EPOLLOUT
+ */
+void rearm_connection(struct conn* conn, unsigned int events);
+
+// Hand a ready connection to its reactor's workers
+
+void submit_connection(struct conn* conn);
+
+#endif
@@ -0,0 +1,546 @@
+/*
+ * replica.c -- Asynchronous replication to read replicas
+ */
+
+#include "replica.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "peer.h"
+#include "server.h"
+
+enum { EVENT_VERSION, EVENT_FILE, EVENT_RM };
+
+// One request waiting to go to a replica
+typedef struct replica_event {
+  struct replica_event* next;
+  int type;     // EVENT_*
+  int version;  // EVENT_VERSION: the version of path to send
+  char path[];
+} replica_event_t;
+
+// A list of requests, appended at the tail
+typedef struct {
+  replica_event_t* head;
+  replica_event_t* tail;
+  int count;
+} event_list_t;
+
+typedef struct {
+  char addr[RING_ADDR_MAX];
+  int sock;  // kept open between batches, -1 while there is none
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  event_list_t queue;
+  int resync;  // compare whole trees before sending more
+} replica_t;
+
+static replica_t replicas[REPLICA_MAX];
+static int count = 0;
+
+int replica_count(void) {
+  return count;
+}
+
+static void append_event(event_list_t* list, replica_event_t* event) {
+  if (list->tail != NULL) {
+    list->tail->next = event;
+  } else {
+    list->head = event;
+  }
+  list->tail = event;
+  list->count++;
+}
+
+static int add_event(event_list_t* list, int type, const char* path,
+                     int version) {
+  size_t len = strlen(path) + 1;
+  replica_event_t* event = malloc(sizeof(replica_event_t) + len);
+
+  if (event == NULL) {
+    return -1;
+  }
+  event->next = NULL;
+  event->type = type;
+  event->version = version;
+  memcpy(event->path, path, len);
+  append_event(list, event);
+  return 0;
+}
+
+// Take up to REPLICA_BATCH requests off the front of a list
+static int take_batch(event_list_t* list, replica_event_t** batch) {
+  int n = 0;
+
+  while (n < REPLICA_BATCH && list->head != NULL) {
+    batch[n++] = list->head;
+    list->head = list->head->next;
+    list->count--;
+  }
+  if (list->head == NULL) {
+    list->tail = NULL;
+  }
+  return n;
+}
+
+static void free_events(event_list_t* list) {
+  while (list->head != NULL) {
+    replica_event_t* next = list->head->next;
+    free(list->head);
+    list->head = next;
+  }
+  list->tail = NULL;
+  list->count = 0;
+}
+
+// Queue one request for every replica
+static void enqueue(int type, const char* path, int version) {
+  for (int i = 0; i < count; i++) {
+    replica_t* replica = &replicas[i];
+
+    pthread_mutex_lock(&replica->mutex);
+    if (replica->queue.count >= REPLICA_QUEUE_MAX ||
+        add_event(&replica->queue, type, path, version) != 0) {
+      // Too far behind to catch up request by request
+      if (!replica->resync) {
+        log_warn("Replica %s fell %d requests behind, resyncing",
+                 replica->addr, replica->queue.count);
+      }
+      free_events(&replica->queue);
+      replica->resync = 1;
+    }
+    pthread_cond_signal(&replica->cond);
+    pthread_mutex_unlock(&replica->mutex);
+  }
+}
+
+void replicate_write(const char* path, int version) {
+  if (version > 0) {
+    enqueue(EVENT_VERSION, path, version);
+  }
+  enqueue(EVENT_FILE, path, 0);
+}
+
+void replicate_rm(const char* path) {
+  enqueue(EVENT_RM, path, 0);
+}
+
+// Does a later request of the batch send or remove the same file
+static int superseded(replica_event_t** batch, int i, int n) {
+  for (int j = i + 1; j < n; j++) {
+    if (batch[j]->type != EVENT_VERSION &&
+        strcmp(batch[j]->path, batch[i]->path) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Send the current file of a WRITE, as it is now
+// @return 1 if it was sent, 0 if it is gone, -1 if the connection broke
+static int send_current(int sock, const char* path, const char* full_path) {
+  struct stat st;
+
+  int fd = open(full_path, O_RDONLY);
+  if (fd < 0) {
+    return 0;  // removed since, its RM is queued
+  }
+  int r = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    r = peer_send_file(sock, path, RFS_FLAG_REPLICA, fd, st.st_size) == 0
+            ? 1
+            : -1;
+  }
+  close(fd);
+  return r;
+}
+
+// Send a batch pipelined, then collect the replies
+// @return 0 once every request is answered, -1 to send it all again
+static int send_batch(replica_t* replica, replica_event_t** batch, int n) {
+  char full_path[MAX_PATH];
+  int sent = 0;
+  int busy = 0;
+  int r = 0;
+
+  if (replica->sock < 0) {
+    replica->sock = peer_connect(replica->addr);
+    if (replica->sock < 0) {
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < n && r >= 0; i++) {
+    replica_event_t* event = batch[i];
+    if (snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_DIR,
+                 event->path) >= (int)sizeof(full_path)) {
+      continue;
+    }
+    switch (event->type) {
+      case EVENT_VERSION:
+        r = peer_send_version(replica->sock, event->path, full_path,
+                              event->version, RFS_FLAG_REPLICA);
+        break;
+      case EVENT_FILE:
+        r = superseded(batch, i, n)
+                ? 0
+                : send_current(replica->sock, event->path, full_path);
+        break;
+      case EVENT_RM:
+        r = peer_send_request(replica->sock, RFS_OP_RM, event->path,
+                              RFS_FLAG_REPLICA) == 0
+                ? 1
+                : -1;
+        break;
+    }
+    if (r > 0) {
+      sent++;
+    }
+  }
+
+  for (int i = 0; i < sent && r >= 0; i++) {
+    int opcode = peer_recv_reply(replica->sock, replica->addr);
+    if (opcode < 0) {
+      r = -1;
+    } else if (opcode == RFS_OP_BUSY) {
+      busy = 1;
+    }
+  }
+  if (r < 0) {
+    close(replica->sock);
+    replica->sock = -1;
+    return -1;
+  }
+  metrics_add(METRIC_REPLICATED, sent);
+  return busy ? -1 : 0;
+}
+
+// Send a list of requests, batch by batch, however long it takes
+static void send_events(replica_t* replica, event_list_t* list) {
+  replica_event_t* batch[REPLICA_BATCH];
+
+  while (list->head != NULL) {
+    int n = take_batch(list, batch);
+    for (int attempt = 0; send_batch(replica, batch, n) != 0; attempt++) {
+      if (attempt == 0) {
+        log_warn("Replica %s missed a batch, retrying every %d s",
+                 replica->addr, REPLICA_RETRY_S);
+      }
+      sleep(REPLICA_RETRY_S);
+    }
+    for (int i = 0; i < n; i++) {
+      free(batch[i]);
+    }
+  }
+}
+
+// An entry of the replica's listing
+typedef struct {
+  char* name;
+  int type;  // RFS_ENTRY_*
+  uint64_t size;
+  int seen;  // the primary has it too
+} remote_entry_t;
+
+typedef struct {
+  remote_entry_t* entries;
+  size_t count;
+  size_t capacity;
+} remote_tree_t;
+
+static int compare_remote(const void* a, const void* b) {
+  return strcmp(((const remote_entry_t*)a)->name,
+                ((const remote_entry_t*)b)->name);
+}
+
+static remote_entry_t* find_remote(remote_tree_t* tree, const char* name) {
+  remote_entry_t key = {(char*)name, 0, 0, 0};
+
+  return bsearch(&key, tree->entries, tree->count, sizeof(remote_entry_t),
+                 compare_remote);
+}
+
+static void free_tree(remote_tree_t* tree) {
+  for (size_t i = 0; i < tree->count; i++) {
+    free(tree->entries[i].name);
+  }
+  free(tree->entries);
+}
+
+// Add the entries of one DATA frame of a listing
+static int add_remote_entries(remote_tree_t* tree, const unsigned char* buf,
+                              size_t len) {
+  size_t pos = 0;
+
+  while (pos + RFS_ENTRY_HEADER_SIZE <= len) {
+    const unsigned char* entry = buf + pos;
+    size_t name_len = (entry[17] << 8) | entry[18];
+    if (pos + RFS_ENTRY_HEADER_SIZE + name_len > len) {
+      return -1;
+    }
+    if (tree->count == tree->capacity) {
+      size_t capacity = tree->capacity ? tree->capacity * 2 : 256;
+      remote_entry_t* grown =
+          realloc(tree->entries, capacity * sizeof(remote_entry_t));
+      if (grown == NULL) {
+        return -1;
+      }
+      tree->entries = grown;
+      tree->capacity = capacity;
+    }
+    remote_entry_t* remote = &tree->entries[tree->count];
+    remote->name = strndup((const char*)entry + RFS_ENTRY_HEADER_SIZE,
+                           name_len);
+    if (remote->name == NULL) {
+      return -1;
+    }
+    remote->type = entry[0];
+    remote->size = rfs_get_u64(entry + 1);
+    remote->seen = 0;
+    tree->count++;
+    pos += RFS_ENTRY_HEADER_SIZE + name_len;
+  }
+  return 0;
+}
+
+// LIST the replica's whole tree, sorted by name
+static int list_replica(replica_t* replica, remote_tree_t* tree) {
+  unsigned char buf[BUFFER_SIZE];
+  unsigned char frame[RFS_HEADER_SIZE];
+  rfs_header_t hdr;
+
+  if (replica->sock < 0) {
+    replica->sock = peer_connect(replica->addr);
+    if (replica->sock < 0) {
+      return -1;
+    }
+  }
+  if (peer_send_request(replica->sock, RFS_OP_LIST, "",
+                        RFS_FLAG_RECURSIVE) != 0) {
+    return -1;
+  }
+
+  while (1) {
+    if (recv_all(replica->sock, frame, sizeof(frame)) < 0 ||
+        rfs_decode_header(frame, &hdr) != 0 ||
+        (hdr.opcode != RFS_OP_DATA && hdr.opcode != RFS_OP_OK) ||
+        hdr.payload_len > sizeof(buf) ||
+        recv_all(replica->sock, buf, hdr.payload_len) < 0) {
+      return -1;
+    }
+    if (hdr.opcode == RFS_OP_OK) {
+      break;
+    }
+    if (add_remote_entries(tree, buf, hdr.payload_len) != 0) {
+      return -1;
+    }
+  }
+
+  qsort(tree->entries, tree->count, sizeof(remote_entry_t), compare_remote);
+  return 0;
+}
+
+// Queue what it takes to bring the replica's copy of a file up to date
+static int diff_file(remote_tree_t* tree, const char* path,
+                     const char* full_path, const struct stat* st,
+                     event_list_t* list) {
+  char name[MAX_PATH + 16];  // path and a .vN suffix
+  int latest = load_latest_version(full_path);
+  int r = 0;
+
+  remote_entry_t* file = find_remote(tree, path);
+  if (file != NULL) {
+    file->seen = 1;
+  }
+  int stale = file == NULL || file->type != RFS_ENTRY_FILE ||
+              file->size != (uint64_t)st->st_size;
+
+  // Versions the primary never had: the file was removed and written
+  // again here since, its history starts over
+  snprintf(name, sizeof(name), "%s.v%d", path, latest + 1);
+  int diverged = find_remote(tree, name) != NULL;
+  if (diverged) {
+    r |= add_event(list, EVENT_RM, path, 0);
+  }
+
+  for (int version = 1; version <= latest; version++) {
+    snprintf(name, sizeof(name), "%s.v%d", path, version);
+    remote_entry_t* copy = diverged ? NULL : find_remote(tree, name);
+    if (copy != NULL) {
+      copy->seen = 1;
+    } else {
+      r |= add_event(list, EVENT_VERSION, path, version);
+      stale = 1;
+    }
+  }
+  if (stale || diverged) {
+    r |= add_event(list, EVENT_FILE, path, 0);
+  }
+  return r;
+}
+
+// Queue what a directory under ROOT_DIR has that the replica lacks
+static int diff_dir(remote_tree_t* tree, const char* dir,
+                    event_list_t* list) {
+  char full_dir[MAX_PATH];
+  char path[MAX_PATH];
+  char full_path[MAX_PATH];
+  struct dirent* entry;
+  struct stat st;
+  int r = 0;
+
+  snprintf(full_dir, sizeof(full_dir), "%s/%s", ROOT_DIR, dir);
+  DIR* d = opendir(full_dir);
+  if (d == NULL) {
+    return 0;
+  }
+
+  while (r == 0 && (entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        (dir[0] == '\0' && strcmp(entry->d_name, META_NAME) == 0)) {
+      continue;
+    }
+    if (snprintf(path, sizeof(path), "%s%s%s", dir, dir[0] ? "/" : "",
+                 entry->d_name) >= (int)sizeof(path) ||
+        snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_DIR, path) >=
+            (int)sizeof(full_path) ||
+        lstat(full_path, &st) != 0) {
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      remote_entry_t* copy = find_remote(tree, path);
+      if (copy != NULL) {
+        copy->seen = 1;
+      }
+      r = diff_dir(tree, path, list);
+    } else if (S_ISREG(st.st_mode) && !is_version_file(full_path)) {
+      r = diff_file(tree, path, full_path, &st, list);
+    }
+  }
+
+  closedir(d);
+  return r;
+}
+
+// Compare the replica's tree with ROOT_DIR and send only the difference
+// @return 0, or -1 if the replica couldn't be listed
+static int resync_replica(replica_t* replica) {
+  remote_tree_t tree = {NULL, 0, 0};
+  event_list_t list = {NULL, NULL, 0};
+
+  if (list_replica(replica, &tree) != 0) {
+    free_tree(&tree);
+    if (replica->sock >= 0) {
+      close(replica->sock);
+      replica->sock = -1;
+    }
+    return -1;
+  }
+
+  int r = diff_dir(&tree, "", &list);
+  for (size_t i = 0; r == 0 && i < tree.count; i++) {
+    if (!tree.entries[i].seen && tree.entries[i].type == RFS_ENTRY_FILE) {
+      r = add_event(&list, EVENT_RM, tree.entries[i].name, 0);
+    }
+  }
+  free_tree(&tree);
+  if (r != 0) {
+    free_events(&list);
+    return -1;
+  }
+
+  log_info("Replica %s: %d requests to catch up", replica->addr, list.count);
+  send_events(replica, &list);
+  return 0;
+}
+
+// Replica thread, resyncs when asked to and otherwise sends the queue
+static void* replica_thread(void* arg) {
+  replica_t* replica = arg;
+  event_list_t batch;
+
+  while (1) {
+    pthread_mutex_lock(&replica->mutex);
+    while (replica->queue.head == NULL && !replica->resync) {
+      pthread_cond_wait(&replica->cond, &replica->mutex);
+    }
+    int resync = replica->resync;
+    replica->resync = 0;
+
+    // Requests are sent as they were queued, a batch at a time
+    batch.head = batch.tail = NULL;
+    batch.count = 0;
+    while (!resync && batch.count < REPLICA_BATCH &&
+           replica->queue.head != NULL) {
+      replica_event_t* event = replica->queue.head;
+      replica->queue.head = event->next;
+      replica->queue.count--;
+      event->next = NULL;
+      append_event(&batch, event);
+    }
+    if (replica->queue.head == NULL) {
+      replica->queue.tail = NULL;
+    }
+    pthread_mutex_unlock(&replica->mutex);
+
+    if (resync && resync_replica(replica) != 0) {
+      log_warn("Replica %s can't be listed, retrying in %d s", replica->addr,
+               REPLICA_RETRY_S);
+      pthread_mutex_lock(&replica->mutex);
+      replica->resync = 1;
+      pthread_mutex_unlock(&replica->mutex);
+      sleep(REPLICA_RETRY_S);
+    }
+    send_events(replica, &batch);
+  }
+
+  return NULL;
+}
+
+int replica_init(const char* list) {
+  char host[RING_ADDR_MAX];
+  int port;
+  const char* p = list;
+
+  while (*p != '\0') {
+    size_t len = strcspn(p, ", ");
+    if (len > 0) {
+      if (len >= RING_ADDR_MAX || count == REPLICA_MAX) {
+        return -1;
+      }
+      replica_t* replica = &replicas[count];
+      memcpy(replica->addr, p, len);
+      replica->addr[len] = '\0';
+      if (ring_split_addr(replica->addr, host, &port) != 0) {
+        return -1;
+      }
+      count++;
+    }
+    p += len;
+    if (*p != '\0') {
+      p++;
+    }
+  }
+
+  // A replica starts out with whatever it is missing
+  for (int i = 0; i < count; i++) {
+    replica_t* replica = &replicas[i];
+    pthread_t tid;
+
+    replica->sock = -1;
+    replica->resync = 1;
+    pthread_mutex_init(&replica->mutex, NULL);
+    pthread_cond_init(&replica->cond, NULL);
+    if (pthread_create(&tid, NULL, replica_thread, replica) != 0) {
+      return -1;
+    }
+    pthread_detach(tid);
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+/*
+ * Asynchronous replication to read replicas (server -S host:port,...)
+ *
+ * A replica is an ordinary server. The primary answers a WRITE as soon
+ * as it has committed it, and queues it for every replica; a thread per
+ * replica sends the queue on one persistent connection in batches of up
+ * to REPLICA_BATCH requests, all pipelined before the replies are read.
+ *
+ * A commit is replayed as the version it pushed aside, if it saved one,
+ * followed by the file itself as it is when the batch goes out, both as
+ * WRITEs with RFS_FLAG_REPLICA. On the replica a version is only ever
+ * added, never replaced, and raises its file's version manifest, and
+ * the file replaces the current copy without being saved as a version
+ * again, so the replica keeps the primary's numbering. A file written
+ * several times within a batch is sent once. An RM is sent as an RM.
+ * Commits the replica itself receives are passed on to its own -S
+ * replicas, so replicas can be chained.
+ *
+ * When a replica starts being fed, and whenever more than
+ * REPLICA_QUEUE_MAX requests pile up for it, it is resynced: its whole
+ * tree is LISTed and compared with ROOT_DIR, and only what differs is
+ * sent. Versions never change once saved, so a version is missing or
+ * the same; a file is sent if it is missing, has another size, or any
+ * of its versions is missing, and files the primary no longer has are
+ * removed. A replica that can't be reached is tried again every
+ * REPLICA_RETRY_S with the same batch.
+ *
+ * Replicas serve reads that may be a batch behind; rfs -S spreads GETs
+ * over them.
+ */
+
+#define REPLICA_MAX 8
+#define REPLICA_BATCH 64
+#define REPLICA_QUEUE_MAX 65536
+#define REPLICA_RETRY_S 2
+
+/**
+ * Start feeding the replicas
+ * @param list - "host:port" entries separated by commas, from -S
+ * @return 0, or -1 if the list is malformed or too long
+ */
+int replica_init(const char* list);
+
+// Number of replicas being fed
+
+int replica_count(void);
+
+/**
+ * Queue a committed WRITE for every replica
+ * Called under the file's lock, so commits of a file queue in order.
+ * @param path - remote path of the file
+ * @param version - version the commit saved the old file as, 0 if none
+ */
+void replicate_write(const char* path, int version);
+
+// Queue an RM of a file or directory for every replica
+
+void replicate_rm(const char* path);
+
+#endif
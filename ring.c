@@ -0,0 +1,192 @@
+/*
+ * ring.c -- Consistent hash ring of cluster nodes
+ */
+
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// FNV-1a, finished with a mixer so nearby names land far apart
+static uint64_t hash_bytes(const char* data, size_t len, uint64_t h) {
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+// Hash of a path the way the ring sees it: components only, each
+// separated by one '/', and a version suffix dropped
+static uint64_t hash_path_key(const char* path) {
+  uint64_t h = HASH_SEED;
+  const char* p = path;
+  const char* end = path + strlen(path);
+
+  // file.vN belongs with file
+  const char* dot = strrchr(path, '.');
+  const char* slash = strrchr(path, '/');
+  if (dot != NULL && (slash == NULL || dot > slash) && dot[1] == 'v' &&
+      dot[2] != '\0' && strspn(dot + 2, "0123456789") == strlen(dot + 2)) {
+    end = dot;
+  }
+
+  while (p < end) {
+    while (p < end && *p == '/') {
+      p++;
+    }
+    const char* start = p;
+    while (p < end && *p != '/') {
+      p++;
+    }
+    size_t len = p - start;
+    if (len == 0 || (len == 1 && start[0] == '.')) {
+      continue;
+    }
+    h = hash_bytes("/", 1, h);
+    h = hash_bytes(start, len, h);
+  }
+  return mix(h);
+}
+
+static int compare_points(const void* a, const void* b) {
+  const ring_point_t* x = a;
+  const ring_point_t* y = b;
+
+  if (x->hash != y->hash) {
+    return x->hash < y->hash ? -1 : 1;
+  }
+  return x->node - y->node;
+}
+
+static int compare_names(const void* a, const void* b) {
+  return strcmp(a, b);
+}
+
+int ring_split_addr(const char* addr, char* host, int* port) {
+  const char* colon = strrchr(addr, ':');
+
+  if (colon == NULL || colon == addr || colon - addr >= RING_ADDR_MAX ||
+      colon[1] == '\0' ||
+      strspn(colon + 1, "0123456789") != strlen(colon + 1)) {
+    return -1;
+  }
+  *port = atoi(colon + 1);
+  if (*port <= 0 || *port > 65535) {
+    return -1;
+  }
+  memcpy(host, addr, colon - addr);
+  host[colon - addr] = '\0';
+  return 0;
+}
+
+ring_t* ring_parse(const char* text) {
+  ring_t* ring = calloc(1, sizeof(ring_t));
+  char host[RING_ADDR_MAX];
+  int port;
+
+  if (ring == NULL) {
+    return NULL;
+  }
+
+  const char* p = text;
+  while (*p != '\0') {
+    size_t len = strcspn(p, "\n, \t\r");
+    if (len > 0) {
+      if (len >= RING_ADDR_MAX || ring->count == RING_MAX_NODES) {
+        free(ring);
+        return NULL;
+      }
+      char* node = ring->nodes[ring->count];
+      memcpy(node, p, len);
+      node[len] = '\0';
+      if (ring_split_addr(node, host, &port) != 0) {
+        free(ring);
+        return NULL;
+      }
+      if (ring_find(ring, node) < 0) {
+        ring->count++;
+      }
+    }
+    p += len;
+    if (*p != '\0') {
+      p++;
+    }
+  }
+  if (ring->count == 0) {
+    free(ring);
+    return NULL;
+  }
+
+  qsort(ring->nodes, ring->count, RING_ADDR_MAX, compare_names);
+  for (int n = 0; n < ring->count; n++) {
+    uint64_t h = hash_bytes(ring->nodes[n], strlen(ring->nodes[n]), HASH_SEED);
+    for (int v = 0; v < RING_VNODES; v++) {
+      char suffix[16];
+      int len = snprintf(suffix, sizeof(suffix), "#%d", v);
+      ring_point_t* point = &ring->points[n * RING_VNODES + v];
+      point->hash = mix(hash_bytes(suffix, len, h));
+      point->node = n;
+    }
+  }
+  qsort(ring->points, (size_t)ring->count * RING_VNODES,
+        sizeof(ring_point_t), compare_points);
+  return ring;
+}
+
+int ring_owner(const ring_t* ring, const char* path) {
+  uint64_t h = hash_path_key(path);
+  size_t lo = 0;
+  size_t hi = (size_t)ring->count * RING_VNODES;
+
+  // First point at or after the hash
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (ring->points[mid].hash < h) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == (size_t)ring->count * RING_VNODES) {
+    lo = 0;
+  }
+  return ring->points[lo].node;
+}
+
+int ring_find(const ring_t* ring, const char* addr) {
+  for (int n = 0; n < ring->count; n++) {
+    if (strcmp(ring->nodes[n], addr) == 0) {
+      return n;
+    }
+  }
+  return -1;
+}
+
+size_t ring_format(const ring_t* ring, char* buf, size_t size) {
+  size_t len = 0;
+
+  if (size > 0) {
+    buf[0] = '\0';
+  }
+  for (int n = 0; n < ring->count; n++) {
+    int w = snprintf(buf + len, size - len, "%s\n", ring->nodes[n]);
+    if (w < 0 || (size_t)w >= size - len) {
+      break;
+    }
+    len += w;
+  }
+  return len;
+}
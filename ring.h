@@ -0,0 +1,84 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Consistent hash ring of the nodes in a cluster, shared by the server
+ * and rfs
+ *
+ * A node is named by its "host:port". Each node is placed on a 64 bit
+ * ring at RING_VNODES points (hashes of "host:port#i"), and a path
+ * belongs to the first point at or after its own hash, wrapping around.
+ * Adding or removing a node only moves the paths between it and its
+ * neighbours, about 1/N of them, and the virtual points keep the share of
+ * each node close to even.
+ *
+ * A version name (file.vN) hashes like its file, so a file and all its
+ * versions live on the same node. Repeated slashes and "." components
+ * don't change the hash, the same file is reached by either spelling.
+ *
+ * The membership travels as text, one node per line (RING requests and
+ * the ring files of the server and rfs); parsing also takes commas or
+ * spaces. Nodes are sorted, so the same set of nodes always makes the
+ * same ring no matter in which order it was listed.
+ */
+
+#define RING_MAX_NODES 64
+#define RING_VNODES 64
+#define RING_ADDR_MAX 64
+#define RING_TEXT_MAX (RING_MAX_NODES * RING_ADDR_MAX)
+
+// One point of a node on the ring
+typedef struct {
+  uint64_t hash;
+  int node;
+} ring_point_t;
+
+typedef struct {
+  int count;
+  char nodes[RING_MAX_NODES][RING_ADDR_MAX];  // "host:port", sorted
+  ring_point_t points[RING_MAX_NODES * RING_VNODES];  // by hash
+} ring_t;
+
+/**
+ * Build a ring from a list of nodes
+ * @param text - "host:port" entries separated by newlines, commas or
+ *               spaces, duplicates are dropped
+ * @return a malloc()ed ring, or NULL if an entry is malformed or there
+ *         are none or too many
+ */
+ring_t* ring_parse(const char* text);
+
+/**
+ * Node a path belongs to
+ * @param ring - the ring
+ * @param path - remote path, a version name maps to its file
+ * @return index into ring->nodes
+ */
+int ring_owner(const ring_t* ring, const char* path);
+
+/**
+ * Find a node by name
+ * @return its index in ring->nodes, or -1 if it isn't a member
+ */
+int ring_find(const ring_t* ring, const char* addr);
+
+/**
+ * Write the membership as text, one node per line
+ * @return bytes written (no terminator counted), the text is cut short
+ *         if size is too small
+ */
+size_t ring_format(const ring_t* ring, char* buf, size_t size);
+
+/**
+ * Split "host:port"
+ * @param addr - node name
+ * @param host - output, RING_ADDR_MAX bytes
+ * @param port - output
+ * @return 0, or -1 if it isn't host:port
+ */
+int ring_split_addr(const char* addr, char* host, int* port);
+
+#endif
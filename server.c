@@ -1,89 +1,50 @@
 /*
- * server.c -- TCP Socket Server (Multi-threaded File Server)
+ * server.c -- TCP Socket Server (Event-driven File Server)
  *
  * adapted from:
  *   https://www.educative.io/answers/how-to-implement-tcp-sockets-in-c
 
  */
 
+#define _GNU_SOURCE
+
 #include "server.h"
 
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-// Global file lock table
-file_lock_t file_locks[MAX_FILE_LOCKS];
-pthread_mutex_t lock_table_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Global server socket
-int server_socket_desc;
-
-// init lock table
-void init_file_locks(void) {
-  for (int i = 0; i < MAX_FILE_LOCKS; i++) {
-    file_locks[i].filepath[0] = '\0';
-    file_locks[i].in_use = 0;
-    pthread_mutex_init(&file_locks[i].mutex, NULL);
-  }
-}
-
-// Get or create a mutex lock for a specific file
-// @param filepath - Full path to the file
-pthread_mutex_t* get_file_lock(const char* filepath) {
-  pthread_mutex_lock(&lock_table_mutex);
-
-  // Check if lock already exists for this file
-  for (int i = 0; i < MAX_FILE_LOCKS; i++) {
-    if (file_locks[i].in_use && strcmp(file_locks[i].filepath, filepath) == 0) {
-      pthread_mutex_unlock(&lock_table_mutex);
-      return &file_locks[i].mutex;
-    }
-  }
-
-  // Find empty slot and create new lock
-  for (int i = 0; i < MAX_FILE_LOCKS; i++) {
-    if (!file_locks[i].in_use) {
-      strncpy(file_locks[i].filepath, filepath, MAX_PATH - 1);
-      file_locks[i].filepath[MAX_PATH - 1] = '\0';
-      file_locks[i].in_use = 1;
-      pthread_mutex_unlock(&lock_table_mutex);
-      return &file_locks[i].mutex;
-    }
-  }
-
-  pthread_mutex_unlock(&lock_table_mutex);
-  return NULL;
-}
-
-// Release a file lock when file is deleted
-// @param filepath - Full path to the file
-void release_file_lock(const char* filepath) {
-  pthread_mutex_lock(&lock_table_mutex);
-
-  for (int i = 0; i < MAX_FILE_LOCKS; i++) {
-    if (file_locks[i].in_use && strcmp(file_locks[i].filepath, filepath) == 0) {
-      file_locks[i].in_use = 0;
-      file_locks[i].filepath[0] = '\0';
-      break;
-    }
-  }
-
-  pthread_mutex_unlock(&lock_table_mutex);
-}
+// Set by -z, uploads keep a compressed copy that compressed GETs send
+int compress_at_rest = 0;
 
 // Create directories recursively
+// Directories that are known to exist are skipped without a syscall.
 // @param path - directory path to create
 int create_directories(const char* path) {
   char tmp[MAX_PATH];
   char* p = NULL;
   size_t len;
+  uint64_t generation;
+
+  if (dir_cache_lookup(path, &generation)) {
+    return 0;
+  }
 
   snprintf(tmp, sizeof(tmp), "%s", path);
   len = strlen(tmp);
@@ -106,6 +67,7 @@ int create_directories(const char* path) {
     return -1;
   }
 
+  dir_cache_insert(path, generation);
   return 0;
 }
 
@@ -113,8 +75,7 @@ int create_directories(const char* path) {
 // @param filepath - full file path
 // @param dirpath - output buffer for directory path
 void get_directory_path(const char* filepath, char* dirpath) {
-  strncpy(dirpath, filepath, MAX_PATH - 1);
-  dirpath[MAX_PATH - 1] = '\0';
+  snprintf(dirpath, MAX_PATH, "%s", filepath);
 
   char* last_slash = strrchr(dirpath, '/');
   if (last_slash != NULL) {
@@ -124,15 +85,40 @@ void get_directory_path(const char* filepath, char* dirpath) {
   }
 }
 
-// Get the next available version number for a file
+// Build the path of a file's version manifest
+// Manifests mirror the tree under VERSIONS_DIR, so ROOT_DIR/a/b.txt keeps
+// its version count in VERSIONS_DIR/a/b.txt.
+// @param filepath - full file path, starting with ROOT_DIR
+// @param manifest - output buffer of MAX_PATH bytes
+int get_manifest_path(const char* filepath, char* manifest) {
+  size_t root_len = strlen(ROOT_DIR);
+
+  if (strncmp(filepath, ROOT_DIR, root_len) != 0) {
+    return -1;
+  }
+  if (snprintf(manifest, MAX_PATH, "%s%s", VERSIONS_DIR,
+               filepath + root_len) >= MAX_PATH) {
+    return -1;
+  }
+  return 0;
+}
+
+// Remote path of a full path under ROOT_DIR
+static const char* remote_of(const char* filepath) {
+  return filepath + strlen(ROOT_DIR "/");
+}
+
+// Find the latest version number with the old stat() probe, only used for
+// files that were versioned before manifests existed
 // @param filepath - full file path
-int get_next_version(const char* filepath) {
-  int version = 1;
+static int probe_latest_version(const char* filepath) {
+  int version = 0;
   char version_path[MAX_PATH];
   struct stat st;
 
   while (1) {
-    snprintf(version_path, sizeof(version_path), "%s.v%d", filepath, version);
+    snprintf(version_path, sizeof(version_path), "%s.v%d", filepath,
+             version + 1);
     if (stat(version_path, &st) != 0) {
       return version;
     }
@@ -140,491 +126,3809 @@ int get_next_version(const char* filepath) {
   }
 }
 
-// save current file as versioned backeup
+// Read the latest version number of a file from its manifest
 // @param filepath - full file path
-int save_version(const char* filepath) {
-  struct stat st;
-
-  // Check if file exists
-  if (stat(filepath, &st) != 0) {
-    return 0;
+// @return the latest version, 0 if the file has none
+int load_latest_version(const char* filepath) {
+  char manifest[MAX_PATH];
+  char buf[32];
+  meta_info_t info;
+  ssize_t n = -1;
+
+  // The index has it for every file it knows
+  if (strncmp(filepath, ROOT_DIR "/", strlen(ROOT_DIR "/")) == 0 &&
+      meta_get(remote_of(filepath), &info) == 0 &&
+      info.type == RFS_ENTRY_FILE) {
+    return info.latest;
   }
 
-  // Get next version number
-  int version = get_next_version(filepath);
-
-  // Create version filename
-  char version_path[MAX_PATH];
-  snprintf(version_path, sizeof(version_path), "%s.v%d", filepath, version);
-
-  // Rename current file to versioned name
-  if (rename(filepath, version_path) != 0) {
-    printf("  error occured!: Failed to create version backup\n");
-    return -1;
+  if (get_manifest_path(filepath, manifest) == 0) {
+    int fd = open(manifest, O_RDONLY);
+    if (fd >= 0) {
+      n = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+    }
+  }
+  if (n <= 0) {
+    return probe_latest_version(filepath);
   }
 
-  printf("  Saved previous version as: %s\n", version_path);
-  return 0;
+  buf[n] = '\0';
+  return atoi(buf);
 }
 
-// handle write command from client
-// client_sock - client socket descriptor
-// remote_path - path to save the file on the server
-int handle_write_command(int client_sock, const char* remote_path) {
-  char buffer[BUFFER_SIZE];
-  char full_path[MAX_PATH];
+// Record the latest version number of a file in its manifest
+// The new manifest is written next to the old one and renamed over it, so
+// a crash leaves either the old count or the new one.
+// @param filepath - full file path
+// @param version - latest version number
+int store_latest_version(const char* filepath, int version) {
+  char manifest[MAX_PATH];
+  char tmp_path[MAX_PATH];
   char dir_path[MAX_PATH];
-  FILE* fp;
-  long file_size;
-  long bytes_received = 0;
-  int n;
-
-  snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_DIR, remote_path);
-  get_directory_path(full_path, dir_path);
-
-  // Lock for directory creation
-  pthread_mutex_lock(&lock_table_mutex);
-  if (strlen(dir_path) > 0) {
-    if (create_directories(dir_path) != 0) {
-      pthread_mutex_unlock(&lock_table_mutex);
-      strcpy(buffer, "error occured!: Failed to create directory");
-      send(client_sock, buffer, strlen(buffer), 0);
-      return -1;
-    }
-  }
-  pthread_mutex_unlock(&lock_table_mutex);
+  char buf[32];
 
-  strcpy(buffer, "READY");
-  if (send(client_sock, buffer, strlen(buffer), 0) < 0) {
+  if (get_manifest_path(filepath, manifest) != 0 ||
+      snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", manifest) >= MAX_PATH) {
     return -1;
   }
 
-  memset(buffer, 0, sizeof(buffer));
-  n = recv(client_sock, buffer, sizeof(buffer), 0);
-  if (n <= 0) {
+  get_directory_path(manifest, dir_path);
+  if (create_directories(dir_path) != 0) {
     return -1;
   }
-  file_size = atol(buffer);
-  printf("  File size: %ld bytes\n", file_size);
 
-  strcpy(buffer, "SIZE_OK");
-  if (send(client_sock, buffer, strlen(buffer), 0) < 0) {
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
     return -1;
   }
-
-  // Get per-file lock
-  pthread_mutex_t* file_mutex = get_file_lock(full_path);
-  if (file_mutex == NULL) {
-    strcpy(buffer, "error occured!: Server busy");
-    send(client_sock, buffer, strlen(buffer), 0);
+  int len = snprintf(buf, sizeof(buf), "%d\n", version);
+  if (write(fd, buf, len) != len) {
+    close(fd);
+    unlink(tmp_path);
     return -1;
   }
+  close(fd);
 
-  // : Lock this specific file
-  pthread_mutex_lock(file_mutex);
-
-  // Save existing file as a version before overwriting
-  if (save_version(full_path) != 0) {
-    pthread_mutex_unlock(file_mutex);
-    strcpy(buffer, "error occured!: Failed to save version");
-    send(client_sock, buffer, strlen(buffer), 0);
+  if (rename(tmp_path, manifest) != 0) {
     return -1;
   }
+  meta_set_latest(remote_of(filepath), version);
+  return 0;
+}
 
-  fp = fopen(full_path, "wb");
-  if (fp == NULL) {
-    pthread_mutex_unlock(file_mutex);
-    strcpy(buffer, "error occured!: Cannot create file");
-    send(client_sock, buffer, strlen(buffer), 0);
-    return -1;
-  }
+// Forget a file's versions once they have been deleted
+// @param filepath - full file path
+void remove_version_manifest(const char* filepath) {
+  char manifest[MAX_PATH];
 
-  // Receive and write file data
-  while (bytes_received < file_size) {
-    memset(buffer, 0, sizeof(buffer));
-    n = recv(client_sock, buffer, sizeof(buffer), 0);
-    if (n <= 0) {
-      fclose(fp);
-      pthread_mutex_unlock(file_mutex);
-      return -1;
-    }
-    fwrite(buffer, 1, n, fp);
-    bytes_received += n;
+  if (get_manifest_path(filepath, manifest) == 0) {
+    unlink(manifest);
   }
+}
 
-  fclose(fp);
-  pthread_mutex_unlock(file_mutex);
-
-  printf("  File saved: %s\n", full_path);
+// Get the next available version number for a file
+// @param filepath - full file path
+int get_next_version(const char* filepath) {
+  return load_latest_version(filepath) + 1;
+}
 
-  strcpy(buffer, "Success!: File written successfully");
-  send(client_sock, buffer, strlen(buffer), 0);
+// Keep a packed file as a version before it is replaced by a plain one
+// The version stays in the pack; the manifest makes the plain file's
+// versions carry on from it.
+// @param filepath - full file path
+// @return the version it was saved as, 0 if it isn't packed, -1 on error
+static int save_packed_version(const char* filepath) {
+  int version = pack_save_version(remote_of(filepath));
 
-  return 0;
+  if (version > 0 && (store_latest_version(filepath, version) != 0 ||
+                      meta_save_version(remote_of(filepath), version) != 0)) {
+    log_error("  error occured!: Failed to update version manifest");
+    return -1;
+  }
+  if (version > 0) {
+    log_debug("  Saved previous version as: %s.v%d (packed)", filepath,
+              version);
+  }
+  return version;
 }
-// handle get command from client
-// client_sock - client socket descriptor
-// remote_path - path to retrieve the file from the server
-int handle_get_command(int client_sock, const char* remote_path) {
-  char buffer[BUFFER_SIZE];
-  char full_path[MAX_PATH];
-  FILE* fp;
-  long file_size;
-  long bytes_sent = 0;
-  int n;
-  struct stat st;
 
-  snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_DIR, remote_path);
+// save current file as versioned backeup
+// @param filepath - full file path
+// @return the version it was saved as, 0 if there was no file, -1 on error
+int save_version(const char* filepath) {
+  struct stat st;
 
-  // Get per file lock
-  pthread_mutex_t* file_mutex = get_file_lock(full_path);
-  if (file_mutex == NULL) {
-    strcpy(buffer, "error occured!: Server busy");
-    send(client_sock, buffer, strlen(buffer), 0);
-    return -1;
+  // Check if file exists, it may be a packed one
+  if (stat(filepath, &st) != 0) {
+    return save_packed_version(filepath);
   }
 
-  // Lock this specific file
-  pthread_mutex_lock(file_mutex);
+  // Get next version number
+  int version = get_next_version(filepath);
+
+  // Create version filename
+  char version_path[MAX_PATH];
+  snprintf(version_path, sizeof(version_path), "%s.v%d", filepath, version);
 
-  if (stat(full_path, &st) != 0) {
-    pthread_mutex_unlock(file_mutex);
-    snprintf(buffer, sizeof(buffer), "error occured!: File not found '%s'",
-             remote_path);
-    send(client_sock, buffer, strlen(buffer), 0);
+  // A chunked file already has its recipe, which becomes the version and
+  // costs no copy; anything else is renamed to the versioned name
+  char current_recipe[MAX_PATH];
+  char version_recipe[MAX_PATH];
+  int chunked =
+      get_recipe_path(filepath, CURRENT_RECIPE, current_recipe) == 0 &&
+      access(current_recipe, F_OK) == 0;
+
+  if (chunked) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".v%d", version);
+    if (get_recipe_path(filepath, suffix, version_recipe) != 0) {
+      return -1;
+    }
+    if (rename(current_recipe, version_recipe) != 0) {
+      log_error("  error occured!: Failed to create version backup");
+      return -1;
+    }
+  } else if (rename(filepath, version_path) != 0) {
+    log_error("  error occured!: Failed to create version backup");
     return -1;
   }
 
-  if (S_ISDIR(st.st_mode)) {
-    pthread_mutex_unlock(file_mutex);
-    snprintf(buffer, sizeof(buffer), "error occured!: Path is a directory '%s'",
-             remote_path);
-    send(client_sock, buffer, strlen(buffer), 0);
+  if (store_latest_version(filepath, version) != 0) {
+    // Later versions must never overwrite this one, so undo the rename
+    if (chunked) {
+      rename(version_recipe, current_recipe);
+    } else {
+      rename(version_path, filepath);
+    }
+    log_error("  error occured!: Failed to update version manifest");
     return -1;
   }
 
-  file_size = st.st_size;
-
-  fp = fopen(full_path, "rb");
-  if (fp == NULL) {
-    pthread_mutex_unlock(file_mutex);
-    snprintf(buffer, sizeof(buffer), "error occured!: Cannot open file '%s'",
-             remote_path);
-    send(client_sock, buffer, strlen(buffer), 0);
-    return -1;
+  // A chunked version is only its recipe, the old full copy is replaced
+  // when the upload is renamed over it; it is listed all the same
+  if (chunked) {
+    snprintf(version_path, sizeof(version_path), "%s", version_recipe);
   }
+  meta_save_version(remote_of(filepath), version);
 
-  printf("  File size: %ld bytes\n", file_size);
+  log_debug("  Saved previous version as: %s", version_path);
+  return version;
+}
 
-  // Send file size to client
-  snprintf(buffer, sizeof(buffer), "SIZE %ld", file_size);
-  if (send(client_sock, buffer, strlen(buffer), 0) < 0) {
-    fclose(fp);
-    pthread_mutex_unlock(file_mutex);
+// Put a socket into non-blocking mode
+// @param fd - socket descriptor
+int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) {
     return -1;
   }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-  // Wait for READY from client
-  memset(buffer, 0, sizeof(buffer));
-  n = recv(client_sock, buffer, sizeof(buffer), 0);
-  if (n <= 0 || strstr(buffer, "READY") == NULL) {
-    fclose(fp);
-    pthread_mutex_unlock(file_mutex);
-    return -1;
-  }
+// Count bytes received on a connection
+// @param conn - connection they came in on
+// @param n - how many
+static void count_bytes_in(conn_t* conn, uint64_t n) {
+  metrics_add(METRIC_BYTES_IN, n);
+  conn->step_bytes += n;
+}
 
-  // Send file data
-  while (bytes_sent < file_size) {
-    size_t to_read = sizeof(buffer);
-    if (file_size - bytes_sent < (long)to_read) {
-      to_read = file_size - bytes_sent;
-    }
+// Count bytes sent on a connection
+// @param conn - connection they went out on
+// @param n - how many
+static void count_bytes_out(conn_t* conn, uint64_t n) {
+  metrics_add(METRIC_BYTES_OUT, n);
+  conn->step_bytes += n;
+}
 
-    size_t bytes_read = fread(buffer, 1, to_read, fp);
-    if (bytes_read <= 0) {
-      break;
+// Receive until conn->in holds want bytes, keeping what arrived so far
+// @param conn - connection to read from
+// @param want - total number of bytes wanted in conn->in
+// @return 1 once complete, 0 if the client closed, -1 on error, or RECV_AGAIN
+int recv_exact(conn_t* conn, size_t want) {
+  while (conn->in_len < want) {
+    ssize_t n = recv(conn->client_sock, conn->in + conn->in_len,
+                     want - conn->in_len, 0);
+    if (n > 0) {
+      count_bytes_in(conn, n);
+      conn->in_len += n;
+      continue;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return RECV_AGAIN;
     }
+    return -1;
+  }
+  return 1;
+}
 
-    int sent = send(client_sock, buffer, bytes_read, 0);
+// Send as much of the out buffer as the socket accepts
+// @param conn - connection to flush
+// @return 1 once the buffer is empty, 0 if the socket is full, -1 on error
+int flush_output(conn_t* conn) {
+  while (conn->out_off < conn->out_len) {
+    ssize_t sent = send(conn->client_sock, conn->out + conn->out_off,
+                        conn->out_len - conn->out_off, MSG_NOSIGNAL);
     if (sent < 0) {
-      fclose(fp);
-      pthread_mutex_unlock(file_mutex);
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
       return -1;
     }
-    bytes_sent += sent;
+    count_bytes_out(conn, sent);
+    conn->out_off += sent;
   }
 
-  fclose(fp);
-  pthread_mutex_unlock(file_mutex);
-
-  printf("  File sent: %s (%ld bytes)\n", full_path, bytes_sent);
-
-  return 0;
+  conn->out_len = 0;
+  conn->out_off = 0;
+  return 1;
 }
 
-// handle RM command from client
-// client_sock - client socket descriptor
-// remote_path - path to remove on the server
-int handle_rm_command(int client_sock, const char* remote_path) {
-  char buffer[BUFFER_SIZE];
-  char full_path[MAX_PATH];
-  char version_path[MAX_PATH];
-  struct stat st;
-
-  snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_DIR, remote_path);
+// Queue a reply header, the payload (if any) is sent by the handler
+// The reply carries the id of the request being answered.
+// @param conn - connection to reply on
+// @param opcode - RFS_OP_* reply opcode
+// @param payload_len - bytes of payload that follow the header
+// @param next_phase - handler phase to resume, PHASE_DONE or PHASE_CLOSE
+step_result_t conn_send_header(conn_t* conn, int opcode, uint64_t payload_len,
+                               int next_phase) {
+  rfs_header_t hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.opcode = opcode;
+  hdr.request_id = conn->req.request_id;
+  hdr.payload_len = payload_len;
+  rfs_encode_header(&hdr, (unsigned char*)conn->out);
+
+  conn->out_len = RFS_HEADER_SIZE;
+  conn->out_off = 0;
+  conn->phase = next_phase;
+  conn->state = CONN_SENDING;
+  return STEP_CONTINUE;
+}
 
-  // Get per-file lock
-  pthread_mutex_t* file_mutex = get_file_lock(full_path);
-  if (file_mutex == NULL) {
-    strcpy(buffer, "error occured!: Server busy");
-    send(client_sock, buffer, strlen(buffer), 0);
-    return -1;
+// Queue a reply frame carrying a text message
+// @param conn - connection to reply on
+// @param opcode - RFS_OP_OK or RFS_OP_ERROR
+// @param next_phase - handler phase to resume, PHASE_DONE or PHASE_CLOSE
+// @param fmt - printf style message
+step_result_t conn_send(conn_t* conn, int opcode, int next_phase,
+                        const char* fmt, ...) {
+  char* msg = conn->out + RFS_HEADER_SIZE;
+  size_t room = sizeof(conn->out) - RFS_HEADER_SIZE;
+  va_list args;
+
+  va_start(args, fmt);
+  int len = vsnprintf(msg, room, fmt, args);
+  va_end(args);
+
+  if (len < 0) {
+    len = 0;
+  } else if (len >= (int)room) {
+    len = room - 1;
   }
 
-  // Lock this specific file
-  pthread_mutex_lock(file_mutex);
-
-  if (stat(full_path, &st) != 0) {
-    pthread_mutex_unlock(file_mutex);
-    snprintf(buffer, sizeof(buffer), "error occured!: Path not found '%s'",
-             remote_path);
-    send(client_sock, buffer, strlen(buffer), 0);
-    return -1;
+  if (opcode == RFS_OP_ERROR) {
+    conn->request_failed = 1;
   }
+  conn_send_header(conn, opcode, len, next_phase);
+  conn->out_len += len;
+  return STEP_CONTINUE;
+}
 
-  int result;
-
-  if (S_ISDIR(st.st_mode)) {
-    result = rmdir(full_path);
-    if (result != 0) {
-      pthread_mutex_unlock(file_mutex);
-      if (errno == ENOTEMPTY) {
-        snprintf(buffer, sizeof(buffer),
-                 "error occured!: Directory not empty '%s'", remote_path);
-      } else {
-        snprintf(buffer, sizeof(buffer),
-                 "error occured!: Cannot remove directory '%s'", remote_path);
-      }
-      send(client_sock, buffer, strlen(buffer), 0);
-      return -1;
-    }
-    printf("  Directory removed: %s\n", full_path);
-  } else {
-    // Delete main file
-    result = unlink(full_path);
-    if (result != 0) {
-      pthread_mutex_unlock(file_mutex);
-      snprintf(buffer, sizeof(buffer),
-               "error occured!: Cannot remove file '%s'", remote_path);
-      send(client_sock, buffer, strlen(buffer), 0);
-      return -1;
-    }
-    printf("  File removed: %s\n", full_path);
+// Queue a BUSY reply, u32 retry_ms then a message for people
+// @param conn - connection to reply on
+// @param next_phase - PHASE_DONE or PHASE_CLOSE
+// @param retry_ms - how long the client should wait before trying again
+step_result_t conn_send_busy(conn_t* conn, int next_phase, uint32_t retry_ms) {
+  unsigned char* payload = (unsigned char*)conn->out + RFS_HEADER_SIZE;
+  size_t room = sizeof(conn->out) - RFS_HEADER_SIZE - 4;
+
+  int len = snprintf((char*)payload + 4, room,
+                     "Server busy, retry after %u ms", retry_ms);
+  rfs_put_u32(payload, retry_ms);
+  metrics_add(METRIC_BUSY, 1);
+  conn->request_failed = 1;
+
+  conn_send_header(conn, RFS_OP_BUSY, 4 + len, next_phase);
+  conn->out_len += 4 + len;
+  return STEP_CONTINUE;
+}
 
-    // Delete all versions
-    int version = 1;
-    while (1) {
-      snprintf(version_path, sizeof(version_path), "%s.v%d", full_path,
-               version);
-      if (stat(version_path, &st) != 0) {
-        // No more versions
-        break;
-      }
-      if (unlink(version_path) == 0) {
-        printf("  Version removed: %s\n", version_path);
-      }
-      version++;
-    }
+// Drop the file lock held by a connection, if it has one
+// @param conn - connection holding the lock
+void conn_unlock(conn_t* conn) {
+  if (conn->lock_held != LOCK_NONE) {
+    int mode = conn->lock_held;
+    conn->lock_held = LOCK_NONE;
+    unlock_file(conn->lock, mode);
   }
+}
 
-  pthread_mutex_unlock(file_mutex);
-  release_file_lock(full_path);
-
-  snprintf(buffer, sizeof(buffer), "Success!: Removed '%s'", remote_path);
-  send(client_sock, buffer, strlen(buffer), 0);
+// Drop a request's lock and range, and count what is left to drain
+static void abandon_request(conn_t* conn) {
+  conn_unlock(conn);
+  conn->range_active = 0;
+
+  // Bytes already pulled into the pipe count as received, and a WRITE's
+  // checksum is drained with the rest of its payload
+  conn->transferred += conn->pipe_len;
+  conn->pipe_len = 0;
+  conn->file_size += conn->checksum_len;
+  conn->checksum_len = 0;
+}
 
-  return 0;
+// Fail a request whose payload is still arriving
+// The rest of the payload is drained first, so the client (which sends
+// its data without waiting) is reading by the time the error goes out
+// and the next pipelined request starts on a frame boundary.
+// @param conn - connection running the request
+// @param fmt - printf style error message
+step_result_t fail_request(conn_t* conn, const char* fmt, ...) {
+  char msg[BUFFER_SIZE];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, args);
+  va_end(args);
+
+  abandon_request(conn);
+  conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s", msg);
+  conn->state = CONN_DISCARD;
+  return STEP_CONTINUE;
 }
 
-// Handle STOP command from client
-//@param client_sock - Client socket descriptor
+// Turn a request away because the server or its client is over a limit
+// Like fail_request, the payload is drained before BUSY goes out.
+// @param conn - connection running the request
+// @param retry_ms - how long the client should wait before trying again
+step_result_t busy_request(conn_t* conn, uint32_t retry_ms) {
+  abandon_request(conn);
+  conn_send_busy(conn, PHASE_DONE, retry_ms);
+  conn->state = CONN_DISCARD;
+  return STEP_CONTINUE;
+}
 
-void handle_stop_command(int client_sock) {
-  char* msg = "Success!: Server shutting down";
-  send(client_sock, msg, strlen(msg), 0);
-  printf("STOP command received. Shutting down server...\n");
-  close(client_sock);
-  close(server_socket_desc);
-  exit(0);
+// Send a request for a path another node owns to that node
+// @param conn - connection running the request
+// @param owner - "host:port" of the node that owns the path
+step_result_t moved_request(conn_t* conn, const char* owner) {
+  abandon_request(conn);
+  conn_send(conn, RFS_OP_MOVED, PHASE_DONE, "%s", owner);
+  metrics_add(METRIC_MOVED, 1);
+  conn->state = CONN_DISCARD;
+  return STEP_CONTINUE;
 }
 
-// Thread function to handle a single client connection
-// @param arg - Pointer to client_info_t structure
+// Throw away the rest of a failed request's payload, then send the error
+// @param conn - connection in CONN_DISCARD
+step_result_t discard_payload(conn_t* conn) {
+  for (int chunks = 0; conn->transferred < conn->file_size; chunks++) {
+    if (chunks == MAX_CHUNKS_PER_STEP) {
+      return STEP_WAIT_READ;
+    }
 
-void* client_handler(void* arg) {
-  client_info_t* info = (client_info_t*)arg;
-  int client_sock = info->client_sock;
-  char client_message[BUFFER_SIZE];
-  char command[32];
-  char remote_path[MAX_PATH];
+    size_t remaining = conn->file_size - conn->transferred;
+    ssize_t n = recv(conn->client_sock, conn->in,
+                     remaining < sizeof(conn->in) ? remaining
+                                                  : sizeof(conn->in),
+                     0);
+    if (n > 0) {
+      count_bytes_in(conn, n);
+      conn->transferred += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return STEP_WAIT_READ;
+    }
+    return STEP_DONE;
+  }
 
-  printf("Client connected at IP: %s and port: %i\n",
-         inet_ntoa(info->client_addr.sin_addr),
-         ntohs(info->client_addr.sin_port));
+  conn->state = CONN_SENDING;
+  return STEP_CONTINUE;
+}
 
-  memset(client_message, 0, sizeof(client_message));
-  if (recv(client_sock, client_message, sizeof(client_message), 0) < 0) {
-    printf("Couldn't receive command\n");
-    close(client_sock);
-    free(info);
-    return NULL;
+// Let go of the snapshot a GET was sending
+// conn->fd is the snapshot's, so it is only forgotten here, not closed.
+// @param conn - connection that may hold one
+void release_snapshot(conn_t* conn) {
+  if (conn->snapshot != NULL) {
+    if (conn->fd == conn->snapshot->fd) {
+      conn->fd = -1;
+    }
+    snapshot_put(conn->snapshot);
+    conn->snapshot = NULL;
   }
+}
 
-  printf("Received: %s\n", client_message);
-
-  memset(command, 0, sizeof(command));
-  memset(remote_path, 0, sizeof(remote_path));
+// Borrow a transfer buffer from the pool, kept until the request ends
+// @param conn - connection about to move file data
+// @return 0, or -1 if every buffer is in use
+int take_pool_buffer(conn_t* conn) {
+  if (conn->pool_buf < 0) {
+    conn->pool_buf = buf_pool_take();
+    conn->uring_off = 0;
+    conn->uring_len = 0;
+  }
+  return conn->pool_buf >= 0 ? 0 : -1;
+}
 
-  if (sscanf(client_message, "%31s %511s", command, remote_path) < 1) {
-    char* error_msg = "error occured!: Invalid command format";
-    send(client_sock, error_msg, strlen(error_msg), 0);
-    close(client_sock);
-    free(info);
-    return NULL;
+// Give the connection's transfer buffer back
+// @param conn - connection that may hold one
+void release_pool_buffer(conn_t* conn) {
+  if (conn->pool_buf >= 0) {
+    buf_pool_put(conn->pool_buf);
+    conn->pool_buf = -1;
   }
+  conn->zbuf = NULL;
+}
 
-  // Handle WRITE command
-  if (strcmp(command, "WRITE") == 0) {
-    if (strlen(remote_path) == 0) {
-      char* error_msg = "error occured!: Missing remote path";
-      send(client_sock, error_msg, strlen(error_msg), 0);
-    } else {
-      printf("Processing WRITE: %s\n", remote_path);
-      handle_write_command(client_sock, remote_path);
-    }
+// Reset per-request state and go back to reading the next request
+// @param conn - connection whose request has been answered
+step_result_t finish_request(conn_t* conn) {
+  if (conn->request_start != 0) {
+    metrics_request(conn->req.opcode, conn->request_failed,
+                    metrics_now_us() - conn->request_start);
+    conn->request_start = 0;
   }
-  // Handle GET command
-  else if (strcmp(command, "GET") == 0) {
-    if (strlen(remote_path) == 0) {
-      char* error_msg = "error occured!: Missing remote path";
-      send(client_sock, error_msg, strlen(error_msg), 0);
-    } else {
-      printf("Processing GET: %s\n", remote_path);
-      handle_get_command(client_sock, remote_path);
-    }
+  if (conn->in_transfer) {
+    release_transfer();
+    conn->in_transfer = 0;
   }
-  // Handle RM command
-  else if (strcmp(command, "RM") == 0) {
-    if (strlen(remote_path) == 0) {
-      char* error_msg = "error occured!: Missing remote path";
-      send(client_sock, error_msg, strlen(error_msg), 0);
-    } else {
-      printf("Processing RM: %s\n", remote_path);
-      handle_rm_command(client_sock, remote_path);
-    }
+  conn_unlock(conn);
+  release_snapshot(conn);
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  if (conn->base_fd >= 0) {
+    close(conn->base_fd);
+    conn->base_fd = -1;
   }
-  // Handle STOP command
-  else if (strcmp(command, "STOP") == 0) {
-    printf("Processing STOP\n");
-    handle_stop_command(client_sock);
-    free(info);
-    return NULL;
+  discard_temp_file(conn);
+  if (conn->recipe != NULL) {
+    recipe_free(conn->recipe);
+    conn->recipe = NULL;
+    conn->recipe_index = 0;
+    conn->recipe_sent = 0;
   }
-  // Unknown command
-  else {
-    char error_msg[BUFFER_SIZE];
-    snprintf(error_msg, sizeof(error_msg),
-             "error occured!: Unknown command '%s'", command);
-    send(client_sock, error_msg, strlen(error_msg), 0);
+  free_list_walk(conn);
+  release_pool_buffer(conn);
+  free(conn->stats);
+  conn->stats = NULL;
+  conn->zhave = 0;
+  if (conn->cached != NULL) {
+    file_cache_release(conn->cached);
+    conn->cached = NULL;
   }
 
-  close(client_sock);
-  printf("Client disconnected (IP: %s)\n",
-         inet_ntoa(info->client_addr.sin_addr));
-  free(info);
+  if (conn->lock != NULL) {
+    put_file_lock(conn->lock);
+    conn->lock = NULL;
+  }
+  conn->in_len = 0;
+  conn->file_size = 0;
+  conn->transferred = 0;
+  conn->write_offset = 0;
+  conn->pipe_len = 0;
+  conn->write_error = 0;
+  conn->checksum_len = 0;
+  conn->state = CONN_READ_REQUEST;
+
+  // Let other connections run between bursts of pipelined requests
+  if (++conn->requests_this_step >= MAX_REQUESTS_PER_STEP) {
+    return STEP_WAIT_READ;
+  }
+  return STEP_CONTINUE;
+}
 
-  return NULL;
+// Create a temp file for an upload in TMP_DIR
+// Uploads stream into the temp file without holding the file lock; only
+// the rename over the real path at the end happens under the lock.
+// @param conn - connection starting a WRITE, fd and temp_path get set
+int create_temp_file(conn_t* conn) {
+  snprintf(conn->temp_path, sizeof(conn->temp_path), "%s/upload.XXXXXX",
+           TMP_DIR);
+  conn->fd = mkstemp(conn->temp_path);
+  if (conn->fd < 0) {
+    conn->temp_path[0] = '\0';
+    return -1;
+  }
+  fchmod(conn->fd, 0644);
+  return 0;
 }
 
-int main(void) {
-  socklen_t client_size;
-  struct sockaddr_in server_addr, client_addr;
+// Unlink an upload that never got committed
+// @param conn - connection that may still own a temp file
+void discard_temp_file(conn_t* conn) {
+  if (conn->temp_path[0] != '\0') {
+    unlink(conn->temp_path);
+    conn->temp_path[0] = '\0';
+  }
+  if (conn->recipe_temp[0] != '\0') {
+    recipe_remove(conn->recipe_temp);
+    conn->recipe_temp[0] = '\0';
+  }
+  drop_compressed_copy(conn);
+}
 
-  init_file_locks();
+// Chunk a finished upload into the chunk store
+// The recipe waits in TMP_DIR until the upload is committed.
+// @param conn - connection whose temp file holds the whole upload
+int store_upload_chunks(conn_t* conn) {
+  snprintf(conn->recipe_temp, sizeof(conn->recipe_temp), "%s/recipe.XXXXXX",
+           TMP_DIR);
+  int fd = mkstemp(conn->recipe_temp);
+  if (fd < 0) {
+    conn->recipe_temp[0] = '\0';
+    return -1;
+  }
+  close(fd);
 
-  mkdir(ROOT_DIR, 0755);
+  if (chunk_store_file(conn->fd, conn->recipe_temp) != 0) {
+    conn->recipe_temp[0] = '\0';
+    return -1;
+  }
+  return 0;
+}
 
-  server_socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+// Make an upload's recipe the current recipe of its file, lock held
+// @param conn - connection committing a chunked upload
+int install_current_recipe(conn_t* conn) {
+  char recipe[MAX_PATH];
+  char dir_path[MAX_PATH];
 
-  if (server_socket_desc < 0) {
-    printf("Error while creating socket\n");
+  if (get_recipe_path(conn->full_path, CURRENT_RECIPE, recipe) != 0) {
+    return -1;
+  }
+  get_directory_path(recipe, dir_path);
+  if (create_directories(dir_path) != 0 ||
+      rename(conn->recipe_temp, recipe) != 0) {
     return -1;
   }
-  printf("Socket created successfully\n");
+  conn->recipe_temp[0] = '\0';
+  return 0;
+}
+
+// Delete temp files from uploads cut off by a crash or restart
+// Upload sessions are meant to outlive both, they stay until they expire.
+void clean_temp_dir(void) {
+  char path[MAX_PATH];
+  struct dirent* entry;
+  struct stat st;
+  DIR* dir = opendir(TMP_DIR);
+
+  if (dir == NULL) {
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", TMP_DIR, entry->d_name);
+    if (stat(path, &st) == 0 && upload_is_live(entry->d_name, st.st_mtime)) {
+      continue;
+    }
+    unlink(path);
+  }
+  closedir(dir);
+}
+
+// Identify a file the way a signature or compressed copy names it
+// @param st - stat of the file
+// @param base - output
+static void get_file_base(const struct stat* st, delta_base_t* base) {
+  base->ino = st->st_ino;
+  base->mtime_ns =
+      (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+  base->size = st->st_size;
+}
+
+// Build the path of a file's compressed copy
+// Copies mirror the tree under COMPRESSED_DIR like version manifests do.
+// @param filepath - full file path, starting with ROOT_DIR
+// @param path - output buffer of MAX_PATH bytes
+int get_compressed_path(const char* filepath, char* path) {
+  size_t root_len = strlen(ROOT_DIR);
 
-  // Allow socket address reuse
-  int opt = 1;
-  setsockopt(server_socket_desc, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  if (strncmp(filepath, ROOT_DIR, root_len) != 0) {
+    return -1;
+  }
+  if (snprintf(path, MAX_PATH, "%s%s", COMPRESSED_DIR,
+               filepath + root_len) >= MAX_PATH) {
+    return -1;
+  }
+  return 0;
+}
 
-  // Configure server address
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(PORT);
-  server_addr.sin_addr.s_addr = INADDR_ANY;
+// Drop an upload's compressed copy, the upload itself carries on
+// @param conn - connection that may have a copy open
+void drop_compressed_copy(conn_t* conn) {
+  if (conn->compressed_fd >= 0) {
+    close(conn->compressed_fd);
+    conn->compressed_fd = -1;
+  }
+  if (conn->compressed_temp[0] != '\0') {
+    unlink(conn->compressed_temp);
+    conn->compressed_temp[0] = '\0';
+  }
+}
 
-  // Bind socket
-  if (bind(server_socket_desc, (struct sockaddr*)&server_addr,
-           sizeof(server_addr)) < 0) {
-    printf("Couldn't bind to the port\n");
-    close(server_socket_desc);
+// Create the temp file an upload's compressed copy is written to
+// A copy is the base of the file it was made from (see delta_base_t),
+// then its compressed stream; a copy with no stream marks a file that
+// doesn't compress. The base is filled in once the upload is complete.
+// @param conn - connection receiving an upload, compress_at_rest on
+int open_compressed_copy(conn_t* conn) {
+  unsigned char header[DELTA_BASE_SIZE];
+
+  snprintf(conn->compressed_temp, sizeof(conn->compressed_temp),
+           "%s/compressed.XXXXXX", TMP_DIR);
+  conn->compressed_fd = mkstemp(conn->compressed_temp);
+  if (conn->compressed_fd < 0) {
+    conn->compressed_temp[0] = '\0';
     return -1;
   }
+  fchmod(conn->compressed_fd, 0644);
 
-  // Listen for connections
-  if (listen(server_socket_desc, 10) < 0) {
-    printf("Error while listening\n");
-    close(server_socket_desc);
+  memset(header, 0, sizeof(header));
+  if (write(conn->compressed_fd, header, sizeof(header)) != sizeof(header)) {
+    drop_compressed_copy(conn);
     return -1;
   }
+  return 0;
+}
 
-  printf("File Server running on port %d\n", PORT);
-  printf("Per-file locking enabled (max %d files)\n", MAX_FILE_LOCKS);
-  printf("Waiting for connections...\n");
+// Finish the compressed copy of a complete upload
+// A compressed WRITE has already written its blocks to the copy as they
+// arrived; anything else is compressed here. Failing only loses the copy.
+// @param conn - connection whose temp file holds the whole upload
+void store_compressed_copy(conn_t* conn) {
+  unsigned char header[DELTA_BASE_SIZE];
+  delta_base_t base;
+  struct stat st;
 
-  // Main server loop
-  while (1) {
-    client_size = sizeof(client_addr);
-    int client_sock = accept(server_socket_desc, (struct sockaddr*)&client_addr,
-                             &client_size);
+  if (!compress_at_rest) {
+    return;
+  }
+  if (fstat(conn->fd, &st) != 0) {
+    drop_compressed_copy(conn);
+    return;
+  }
 
-    if (client_sock < 0) {
-      printf("Can't accept connection\n");
-      continue;
+  if (conn->compressed_fd < 0) {
+    if (open_compressed_copy(conn) != 0) {
+      return;
     }
-
-    // Allocate client info for the thread
-    client_info_t* client_info = malloc(sizeof(client_info_t));
-    if (client_info == NULL) {
-      printf("Memory allocation failed\n");
-      close(client_sock);
-      continue;
+    long stored = compress_stream(conn->fd, conn->compressed_fd);
+    if (stored < 0) {
+      drop_compressed_copy(conn);
+      return;
     }
+    if (!COMPRESS_WORTH(stored, st.st_size) &&
+        ftruncate(conn->compressed_fd, DELTA_BASE_SIZE) != 0) {
+      drop_compressed_copy(conn);
+      return;
+    }
+  }
 
-    client_info->client_sock = client_sock;
-    client_info->client_addr = client_addr;
+  get_file_base(&st, &base);
+  delta_put_base(header, &base);
+  if (pwrite(conn->compressed_fd, header, sizeof(header), 0) !=
+      sizeof(header)) {
+    drop_compressed_copy(conn);
+    return;
+  }
+  close(conn->compressed_fd);
+  conn->compressed_fd = -1;
+}
 
-    // Create new thread for this client
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, client_handler, client_info) != 0) {
-      printf("Failed to create thread\n");
-      close(client_sock);
-      free(client_info);
-      continue;
-    }
+// Replace a file's compressed copy with the upload's, lock held
+// Without a new copy the old one is removed, it describes the old file.
+// @param conn - connection committing an upload
+void install_compressed_copy(conn_t* conn) {
+  char path[MAX_PATH];
+  char dir_path[MAX_PATH];
 
-    // Detach thread for automatic cleanup
-    pthread_detach(tid);
+  if (get_compressed_path(conn->full_path, path) != 0) {
+    return;
+  }
+  if (conn->compressed_temp[0] == '\0') {
+    unlink(path);
+    return;
   }
 
-  close(server_socket_desc);
-  return 0;
-}
\ No newline at end of file
+  get_directory_path(path, dir_path);
+  if (create_directories(dir_path) != 0 ||
+      rename(conn->compressed_temp, path) != 0) {
+    unlink(path);
+    return;
+  }
+  conn->compressed_temp[0] = '\0';
+}
+
+// Pick the stream a GET with RFS_FLAG_COMPRESS sends
+// The copy stored at WRITE time is used as is if it is of this exact
+// file. Otherwise the file is compressed into an unlinked temp file,
+// and if that gains too little the file goes out raw.
+// @param conn - connection with the file open in conn->fd
+// @param st - stat of that file
+// @param start - output, offset of the stream in the returned file
+// @return the open stream, or -1 to send the file raw
+int open_compressed_get(conn_t* conn, const struct stat* st, long* start) {
+  char path[MAX_PATH];
+  unsigned char header[DELTA_BASE_SIZE];
+  delta_base_t base;
+  delta_base_t stored_base;
+  struct stat copy_st;
+  int fd;
+
+  get_file_base(st, &base);
+  if (get_compressed_path(conn->full_path, path) == 0 &&
+      (fd = open(path, O_RDONLY)) >= 0) {
+    if (pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+        fstat(fd, &copy_st) == 0) {
+      delta_get_base(header, &stored_base);
+      if (memcmp(&base, &stored_base, sizeof(base)) == 0) {
+        if (copy_st.st_size > DELTA_BASE_SIZE) {
+          *start = DELTA_BASE_SIZE;
+          return fd;
+        }
+        // Known not to compress
+        close(fd);
+        return -1;
+      }
+    }
+    close(fd);
+  }
+
+  snprintf(path, sizeof(path), "%s/compress.XXXXXX", TMP_DIR);
+  fd = mkstemp(path);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path);
+
+  long stored = compress_stream(conn->fd, fd);
+  if (stored < 0 || !COMPRESS_WORTH(stored, st->st_size)) {
+    close(fd);
+    return -1;
+  }
+  *start = 0;
+  return fd;
+}
+
+// Should a file transfer go through io_uring
+// Only under -u, and only with a pool buffer; without one the transfer
+// takes the sendfile()/splice() path, which needs none.
+// @param conn - connection about to move file data
+// @return 1 if it does
+static int use_uring(conn_t* conn) {
+  return uring_enabled && take_pool_buffer(conn) == 0;
+}
+
+// recv_file_data through io_uring
+// Each round writes the chunk received last time from one half of the
+// buffer while the next chunk is received into the other half, both in
+// one io_uring_enter(). conn->transferred only counts bytes in the file.
+// @param conn - connection with an open fd, size set and a uring buffer
+static step_result_t recv_file_uring(conn_t* conn) {
+  for (int chunks = 0;; chunks++) {
+    uring_op_t ops[2];
+    int count = 0;
+    long remaining = conn->file_size - conn->transferred - conn->uring_len;
+
+    if (remaining == 0 && conn->uring_len == 0) {
+      return STEP_CONTINUE;
+    }
+    if (chunks >= MAX_CHUNKS_PER_STEP) {
+      return STEP_WAIT_READ;
+    }
+
+    if (conn->uring_len > 0) {
+      ops[count++] = (uring_op_t){URING_WRITE, conn->fd, conn->pool_buf,
+                                  conn->uring_off, conn->uring_len,
+                                  conn->write_offset + conn->transferred, 0, 0};
+    }
+    size_t next_off = conn->uring_off ^ URING_CHUNK;
+    if (remaining > 0) {
+      ops[count++] = (uring_op_t){
+          URING_RECV, conn->client_sock, conn->pool_buf, next_off,
+          remaining < URING_CHUNK ? (size_t)remaining : URING_CHUNK, 0, 0, 0};
+    }
+    if (uring_run(ops, count) != 0) {
+      conn->write_error = 1;
+      return STEP_DONE;
+    }
+
+    int received = ops[count - 1].opcode == URING_RECV ? ops[count - 1].res : 0;
+    if (received > 0) {
+      count_bytes_in(conn, received);
+    }
+    if (ops[0].opcode == URING_WRITE) {
+      // Written or not, these bytes have been received
+      conn->transferred += conn->uring_len;
+      if ((size_t)ops[0].res != conn->uring_len) {
+        conn->uring_len = 0;
+        conn->transferred += received > 0 ? received : 0;
+        conn->write_error = 1;
+        return STEP_DONE;
+      }
+      conn->uring_len = 0;
+    }
+
+    if (remaining == 0 || received == -EINTR) {
+      continue;
+    }
+    if (received > 0) {
+      if (conn->checksum_len > 0) {
+        conn->checksum = checksum_update(
+            conn->checksum, buf_pool_data(conn->pool_buf) + next_off,
+            received);
+      }
+      conn->uring_off = next_off;
+      conn->uring_len = received;
+      continue;
+    }
+    if (received == -EAGAIN || received == -EWOULDBLOCK) {
+      return STEP_WAIT_READ;
+    }
+    // Client closed or failed mid-transfer
+    return STEP_DONE;
+  }
+}
+
+// Receive file data from the client into conn->fd until file_size bytes
+// The data lands at conn->write_offset onwards, 0 unless it is a range.
+// On Linux the data is spliced socket -> pipe -> file so it never enters
+// userspace; otherwise it is received into conn->in and written out.
+// Under -u it goes through io_uring instead, see recv_file_uring(). While
+// checksum_len is set the data is added to conn->checksum on the way.
+// @param conn - connection with an open fd and size set
+// @return STEP_CONTINUE once everything arrived, else a wait or STEP_DONE
+//         (with write_error set if the file could not be written)
+step_result_t recv_file_data(conn_t* conn) {
+  ssize_t n;
+
+  if (use_uring(conn)) {
+    return recv_file_uring(conn);
+  }
+
+  for (int chunks = 0;; chunks++) {
+#ifdef __linux__
+    // Move anything already in the pipe into the file first
+    if (conn->pipe_len > 0) {
+      loff_t offset = conn->write_offset + conn->transferred;
+      n = splice(conn->pipe_fds[0], NULL, conn->fd, &offset, conn->pipe_len,
+                 SPLICE_F_MOVE);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        conn->write_error = 1;
+        return STEP_DONE;
+      }
+      conn->pipe_len -= n;
+      conn->transferred += n;
+      continue;
+    }
+#endif
+
+    if (conn->transferred >= conn->file_size) {
+      return STEP_CONTINUE;
+    }
+    if (chunks >= MAX_CHUNKS_PER_STEP) {
+      return STEP_WAIT_READ;
+    }
+
+    size_t remaining = conn->file_size - conn->transferred;
+
+#ifdef __linux__
+    if (conn->use_splice) {
+      n = splice(conn->client_sock, NULL, conn->pipe_fds[1], NULL,
+                 remaining < SPLICE_PIPE_SIZE ? remaining : SPLICE_PIPE_SIZE,
+                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        // Socket can't be spliced, finish with the copy loop
+        conn->use_splice = 0;
+        continue;
+      }
+      if (n > 0) {
+        count_bytes_in(conn, n);
+        conn->pipe_len += n;
+        continue;
+      }
+    } else
+#endif
+    {
+      n = recv(conn->client_sock, conn->in,
+               remaining < sizeof(conn->in) ? remaining : sizeof(conn->in), 0);
+      if (n > 0) {
+        count_bytes_in(conn, n);
+        if (conn->checksum_len > 0) {
+          conn->checksum = checksum_update(conn->checksum, conn->in, n);
+        }
+        if (pwrite(conn->fd, conn->in, n,
+                   conn->write_offset + conn->transferred) != n) {
+          conn->write_error = 1;
+          return STEP_DONE;
+        }
+        conn->transferred += n;
+        continue;
+      }
+    }
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return STEP_WAIT_READ;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    // Client closed or failed mid-transfer
+    return STEP_DONE;
+  }
+}
+
+// Receive a compressed WRITE until file_size bytes of stream have arrived
+// Each block is collected in conn->zbuf, decompressed and written at
+// conn->out_size; with compress_at_rest the block also goes to the
+// upload's compressed copy unchanged.
+// @param conn - connection with an open fd, size set and out_size 0
+// @return STEP_CONTINUE once everything arrived, else a wait or STEP_DONE
+//         (with write_error set if the file could not be written, the
+//         stream is corrupt or there is no buffer for it)
+step_result_t recv_compressed_data(conn_t* conn) {
+  if (conn->zbuf == NULL) {
+    if (take_pool_buffer(conn) != 0) {
+      conn->write_error = 3;
+      return STEP_DONE;
+    }
+    conn->zbuf = buf_pool_data(conn->pool_buf);
+  }
+  unsigned char* raw = conn->zbuf + COMPRESS_BLOCK_HEADER + COMPRESS_BLOCK_SIZE;
+
+  for (int chunks = 0;; chunks++) {
+    if (conn->zhave == 0 && conn->transferred >= conn->file_size) {
+      return STEP_CONTINUE;
+    }
+    if (chunks >= MAX_CHUNKS_PER_STEP) {
+      return STEP_WAIT_READ;
+    }
+
+    // Header first, then the stored bytes it announces
+    size_t want = conn->zhave < COMPRESS_BLOCK_HEADER
+                      ? COMPRESS_BLOCK_HEADER
+                      : COMPRESS_BLOCK_HEADER + conn->zstored;
+    size_t need = want - conn->zhave;
+    if ((long)need > conn->file_size - conn->transferred) {
+      // Stream ends mid-block
+      conn->write_error = 2;
+      return STEP_DONE;
+    }
+
+    ssize_t n = recv(conn->client_sock, conn->zbuf + conn->zhave, need, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return STEP_WAIT_READ;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // Client closed or failed mid-transfer
+      return STEP_DONE;
+    }
+    count_bytes_in(conn, n);
+    conn->zhave += n;
+    conn->transferred += n;
+    if (conn->zhave < want) {
+      continue;
+    }
+
+    if (want == COMPRESS_BLOCK_HEADER) {
+      if (compress_get_header(conn->zbuf, &conn->zraw, &conn->zstored) != 0) {
+        conn->write_error = 2;
+        return STEP_DONE;
+      }
+      continue;
+    }
+
+    // Whole block in, stored blocks go straight to the file
+    unsigned char* data = conn->zbuf + COMPRESS_BLOCK_HEADER;
+    if (conn->zstored < conn->zraw) {
+      if (decompress_block(data, conn->zstored, raw, conn->zraw) != 0) {
+        conn->write_error = 2;
+        return STEP_DONE;
+      }
+      data = raw;
+    }
+    if (pwrite(conn->fd, data, conn->zraw, conn->out_size) != conn->zraw) {
+      conn->write_error = 1;
+      return STEP_DONE;
+    }
+    conn->out_size += conn->zraw;
+
+    if (conn->compressed_fd >= 0 &&
+        write(conn->compressed_fd, conn->zbuf, want) != (ssize_t)want) {
+      drop_compressed_copy(conn);
+    }
+    conn->zhave = 0;
+  }
+}
+
+// WRITE handler phases
+enum {
+  WRITE_START,
+  WRITE_RECV_DATA,
+  WRITE_RECV_CHECKSUM,
+  WRITE_RECV_SMALL,
+  WRITE_PACK,
+  WRITE_RECV_BLOCKS,
+  DELTA_HEADER,
+  DELTA_OP,
+  DELTA_LITERAL,
+  DELTA_VERIFY,
+  WRITE_STORE,
+  WRITE_STORE_SYNC,
+  WRITE_COMMIT,
+  WRITE_SYNC
+};
+
+// Open the file a DELTA is based on, it is read without the file lock
+// since commits replace files by rename and never change them in place
+// @param conn - connection starting a DELTA
+int open_delta_base(conn_t* conn) {
+  struct stat st;
+
+  conn->base_fd = open(conn->full_path, O_RDONLY);
+  if (conn->base_fd < 0) {
+    return -1;
+  }
+  if (fstat(conn->base_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(conn->base_fd);
+    conn->base_fd = -1;
+    return -1;
+  }
+  get_file_base(&st, &conn->delta_base);
+  return 0;
+}
+
+// Copy blocks of the base into the file being rebuilt
+// @param conn - connection applying a delta
+// @param first - first block to copy
+// @param count - number of blocks
+static int copy_base_blocks(conn_t* conn, uint32_t first, uint32_t count) {
+  uint64_t start = (uint64_t)first * conn->block_size;
+  uint64_t len = (uint64_t)count * conn->block_size;
+
+  if (start >= conn->delta_base.size && len > 0) {
+    return -1;
+  }
+  if (len > conn->delta_base.size - start) {
+    len = conn->delta_base.size - start;
+  }
+  if (conn->out_size + len > conn->new_size) {
+    return -1;
+  }
+
+  loff_t in_off = start;
+  loff_t out_off = conn->out_size;
+  while (len > 0) {
+    ssize_t n = copy_file_range(conn->base_fd, &in_off, conn->fd, &out_off,
+                                len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL)) {
+      // No in-kernel copy here, go through the buffer
+      n = pread(conn->base_fd, conn->in,
+                len < sizeof(conn->in) ? len : sizeof(conn->in), in_off);
+      if (n > 0 && pwrite(conn->fd, conn->in, n, out_off) != n) {
+        return -1;
+      }
+      if (n > 0) {
+        in_off += n;
+        out_off += n;
+      }
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    len -= n;
+  }
+
+  conn->out_size = out_off;
+  return 0;
+}
+
+// Check the rebuilt file hashes to what the client said it should
+static int verify_delta(conn_t* conn) {
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  sha256_ctx_t ctx;
+  off_t offset = 0;
+
+  if (conn->out_size != conn->new_size) {
+    return -1;
+  }
+
+  sha256_init(&ctx);
+  while (1) {
+    ssize_t n = pread(conn->fd, conn->in, sizeof(conn->in), offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    sha256_update(&ctx, conn->in, n);
+    offset += n;
+  }
+  sha256_final(&ctx, digest);
+
+  return memcmp(digest, conn->new_digest, SHA256_DIGEST_SIZE) == 0 ? 0 : -1;
+}
+
+// Rebuild a file from a DELTA payload, see delta.h for the format
+// The ops are parsed as they arrive, so a delta never has to fit in memory.
+// @param conn - connection in one of the DELTA_* phases
+step_result_t apply_delta(conn_t* conn) {
+  int r;
+
+  while (1) {
+    long remaining = conn->file_size - conn->transferred;
+
+    switch (conn->phase) {
+      case DELTA_HEADER: {
+        if (remaining < DELTA_HEADER_SIZE) {
+          return fail_request(conn, "%s", "error occured!: Bad delta");
+        }
+        r = recv_exact(conn, DELTA_HEADER_SIZE);
+        if (r == RECV_AGAIN) {
+          return STEP_WAIT_READ;
+        }
+        if (r <= 0) {
+          return STEP_DONE;
+        }
+        conn->transferred += DELTA_HEADER_SIZE;
+        conn->in_len = 0;
+
+        delta_base_t base;
+        unsigned char* p = (unsigned char*)conn->in;
+        delta_get_base(p, &base);
+        conn->block_size = rfs_get_u32(p + DELTA_BASE_SIZE);
+        conn->new_size = rfs_get_u64(p + DELTA_BASE_SIZE + 4);
+        memcpy(conn->new_digest, p + DELTA_BASE_SIZE + 12,
+               SHA256_DIGEST_SIZE);
+        conn->out_size = 0;
+
+        if (memcmp(&base, &conn->delta_base, sizeof(base)) != 0) {
+          return fail_request(conn, "%s",
+                              "error occured!: File changed since SIG");
+        }
+        if (conn->block_size != delta_block_size(base.size)) {
+          return fail_request(conn, "%s", "error occured!: Bad delta");
+        }
+        log_debug("  Delta: %ld bytes for a %llu byte file", conn->file_size,
+                  (unsigned long long)conn->new_size);
+        conn->phase = DELTA_OP;
+        break;
+      }
+
+      case DELTA_OP: {
+        if (remaining == 0) {
+          conn->phase = DELTA_VERIFY;
+          break;
+        }
+
+        // Op byte and first field, a copy has one more field
+        size_t want = 5;
+        if (conn->in_len > 0 && conn->in[0] == DELTA_OP_COPY) {
+          want = 9;
+        }
+        if (remaining < (long)want) {
+          return fail_request(conn, "%s", "error occured!: Bad delta");
+        }
+        r = recv_exact(conn, want);
+        if (r == RECV_AGAIN) {
+          return STEP_WAIT_READ;
+        }
+        if (r <= 0) {
+          return STEP_DONE;
+        }
+        if (want == 5 && conn->in[0] == DELTA_OP_COPY) {
+          break;
+        }
+        conn->transferred += want;
+        conn->in_len = 0;
+
+        unsigned char* p = (unsigned char*)conn->in;
+        if (p[0] == DELTA_OP_COPY) {
+          if (copy_base_blocks(conn, rfs_get_u32(p + 1),
+                               rfs_get_u32(p + 5)) != 0) {
+            return fail_request(conn, "%s", "error occured!: Bad delta");
+          }
+        } else if (p[0] == DELTA_OP_LITERAL) {
+          conn->literal_left = rfs_get_u32(p + 1);
+          if ((long)conn->literal_left > remaining - 5 ||
+              conn->out_size + conn->literal_left > conn->new_size) {
+            return fail_request(conn, "%s", "error occured!: Bad delta");
+          }
+          conn->phase = DELTA_LITERAL;
+        } else {
+          return fail_request(conn, "%s", "error occured!: Bad delta");
+        }
+        break;
+      }
+
+      case DELTA_LITERAL:
+        for (int chunks = 0; conn->literal_left > 0; chunks++) {
+          if (chunks >= MAX_CHUNKS_PER_STEP) {
+            return STEP_WAIT_READ;
+          }
+          ssize_t n = recv(conn->client_sock, conn->in,
+                           conn->literal_left < sizeof(conn->in)
+                               ? conn->literal_left
+                               : sizeof(conn->in),
+                           0);
+          if (n > 0) {
+            count_bytes_in(conn, n);
+            if (pwrite(conn->fd, conn->in, n, conn->out_size) != n) {
+              conn->transferred += n;
+              conn->literal_left -= n;
+              return fail_request(conn, "%s",
+                                  "error occured!: Failed to write file");
+            }
+            conn->transferred += n;
+            conn->literal_left -= n;
+            conn->out_size += n;
+            continue;
+          }
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_WAIT_READ;
+          }
+          return STEP_DONE;
+        }
+        conn->phase = DELTA_OP;
+        break;
+
+      case DELTA_VERIFY:
+        if (verify_delta(conn) != 0) {
+          return fail_request(conn, "%s",
+                              "error occured!: Delta does not match");
+        }
+        close(conn->base_fd);
+        conn->base_fd = -1;
+        conn->phase = WRITE_STORE;
+        return STEP_CONTINUE;
+
+      default:
+        return STEP_DONE;
+    }
+  }
+}
+
+// SIG handler phases
+enum { SIG_START, SIG_SEND_DATA };
+
+// Send the block signatures of a file for a delta upload
+// Like DELTA's base, the file is read without the lock; the signature
+// names the exact file it was taken from.
+// @param conn - client connection, remote_path and full_path already set
+step_result_t handle_sig_command(conn_t* conn) {
+  char sig_path[MAX_PATH];
+
+  switch (conn->phase) {
+    case SIG_START: {
+      if (open_delta_base(conn) != 0) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: File not found '%s'",
+                         conn->remote_path);
+      }
+
+      // Build the signature in an unlinked temp file and send it from there
+      snprintf(sig_path, sizeof(sig_path), "%s/sig.XXXXXX", TMP_DIR);
+      conn->fd = mkstemp(sig_path);
+      if (conn->fd >= 0) {
+        unlink(sig_path);
+      }
+      if (conn->fd < 0 ||
+          delta_write_signature(conn->base_fd, &conn->delta_base,
+                                conn->fd) != 0) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                         "error occured!: Cannot read file");
+      }
+      close(conn->base_fd);
+      conn->base_fd = -1;
+
+      conn->file_size = lseek(conn->fd, 0, SEEK_END);
+      conn->transferred = 0;
+      conn->use_sendfile = 1;
+
+      log_debug("  Signature: %ld bytes for a %llu byte file", conn->file_size,
+                (unsigned long long)conn->delta_base.size);
+
+      return conn_send_header(conn, RFS_OP_DATA, conn->file_size,
+                              SIG_SEND_DATA);
+    }
+
+    case SIG_SEND_DATA: {
+      step_result_t result = send_file_data(conn);
+      if (result != STEP_CONTINUE) {
+        return result;
+      }
+      return finish_request(conn);
+    }
+  }
+
+  return STEP_DONE;
+}
+
+// Get the pipe recv_file_data splices socket data through
+// It is kept for the whole session; the copy loop is used if it can't be
+// created, or where splice isn't available at all.
+// @param conn - connection about to receive file data
+static void open_splice_pipe(conn_t* conn) {
+#ifdef __linux__
+  if (conn->pipe_fds[0] < 0) {
+    if (pipe2(conn->pipe_fds, O_NONBLOCK) == 0) {
+      fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    } else {
+      conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    }
+  }
+  conn->use_splice = (conn->pipe_fds[0] >= 0);
+#else
+  conn->use_splice = 0;
+#endif
+}
+
+// Which version a handoff or replica WRITE carries, see cluster.h and
+// replica.h
+// @param conn - connection running a WRITE
+// @param base - output, full path of the version's file
+// @return the version number, 0 if it isn't a version's WRITE
+static int handoff_version_of(conn_t* conn, char* base) {
+  const char* dot = strrchr(conn->full_path, '.');
+
+  if (!(conn->req.flags & (RFS_FLAG_HANDOFF | RFS_FLAG_REPLICA)) ||
+      dot == NULL ||
+      strchr(dot, '/') != NULL || dot[1] != 'v' || dot[2] == '\0' ||
+      strspn(dot + 2, "0123456789") != strlen(dot + 2)) {
+    return 0;
+  }
+  snprintf(base, MAX_PATH, "%.*s", (int)(dot - conn->full_path),
+           conn->full_path);
+  return atoi(dot + 2);
+}
+
+// Is there a copy of a handed off file or version here already
+// @param conn - connection committing a handoff, under the file's lock
+static int handoff_exists(conn_t* conn) {
+  char recipe[MAX_PATH];
+  struct stat st;
+
+  return stat(conn->full_path, &st) == 0 ||
+         (get_recipe_path(conn->full_path, "", recipe) == 0 &&
+          access(recipe, F_OK) == 0);
+}
+
+// Record a committed WRITE in the metadata index
+// @param conn - connection that just renamed its upload into place
+// @param chunked - the upload has a recipe too
+static void index_write(conn_t* conn, int chunked) {
+  meta_info_t info;
+  struct stat st;
+
+  if ((conn->fd >= 0 ? fstat(conn->fd, &st) : stat(conn->full_path, &st)) !=
+      0) {
+    return;
+  }
+  memset(&info, 0, sizeof(info));
+  info.type = RFS_ENTRY_FILE;
+  info.size = st.st_size;
+  info.mtime = st.st_mtime;
+  // A handoff or replica may have had the versions before the file
+  info.latest = (conn->req.flags & (RFS_FLAG_HANDOFF | RFS_FLAG_REPLICA))
+                    ? load_latest_version(conn->full_path)
+                    : -1;
+  info.crc = conn->checksum;
+  info.has_crc = conn->req.opcode == RFS_OP_WRITE &&
+                 (conn->req.flags & RFS_FLAG_CHECKSUM) &&
+                 !(conn->req.flags & RFS_FLAG_COMPRESS);
+  info.location = chunked ? META_CHUNKED : META_PLAIN;
+  meta_put(conn->remote_path, &info);
+}
+
+// Does a WRITE go to the pack: a small, plain upload from a client
+// Whether the path is a plain file already is only known under the lock.
+// @param conn - connection starting a WRITE
+static int want_packed_write(conn_t* conn) {
+  long len = conn->file_size;
+
+  if (conn->req.flags & RFS_FLAG_CHECKSUM) {
+    len -= CHECKSUM_SIZE;
+  }
+  return pack_enabled && conn->req.opcode == RFS_OP_WRITE &&
+         !(conn->req.flags &
+           (RFS_FLAG_COMPRESS | RFS_FLAG_HANDOFF | RFS_FLAG_REPLICA)) &&
+         len >= 0 && len <= PACK_MAX_FILE;
+}
+
+// Refuse a WRITE whose data doesn't match the checksum it came with
+// @param conn - connection whose payload has all been received
+static step_result_t fail_checksum(conn_t* conn) {
+  metrics_add(METRIC_CHECKSUM_ERRORS, 1);
+  log_warn("  Checksum mismatch: %s", conn->full_path);
+  return fail_request(conn, "%s",
+                      "error occured!: Checksum mismatch, the file "
+                      "arrived corrupted");
+}
+
+// Commit a small upload held in conn->in as a plain file after all
+// The file lock is kept, WRITE_COMMIT goes on with it.
+// @param conn - connection whose path turned out to be a plain file
+static step_result_t spill_packed_write(conn_t* conn) {
+  if (create_temp_file(conn) != 0 ||
+      write(conn->fd, conn->in, conn->in_len) != (ssize_t)conn->in_len) {
+    return fail_request(conn, "error occured!: Failed to write file");
+  }
+  if (conn->req.flags & RFS_FLAG_CHECKSUM) {
+    checksum_store(conn->fd, conn->checksum);
+  }
+  conn->phase = WRITE_STORE;
+  return STEP_CONTINUE;
+}
+
+// Acknowledge a committed WRITE, once it is durable if asked to
+// A packed file is synced through its segment, still open as conn->fd;
+// a renamed upload's data already is, its directory is synced now.
+// @param conn - connection whose WRITE has been committed
+static step_result_t acknowledge_write(conn_t* conn) {
+  if (durability_mode == DURABILITY_GROUP) {
+    conn->phase = WRITE_SYNC;
+    sync_enqueue(conn);
+    return STEP_WAIT_LOCK;
+  }
+  if (durability_mode == DURABILITY_FILE &&
+      (conn->fd >= 0 ? fdatasync(conn->fd) : sync_parent(conn->full_path)) !=
+          0) {
+    return fail_request(conn, "error occured!: Failed to sync file");
+  }
+  return conn_send(conn, RFS_OP_OK, PHASE_DONE, "%s",
+                   "Success!: File written successfully");
+}
+
+// Is one of the directories a remote path goes through a file
+// A plain file makes the WRITE fail at its rename, a packed one has no
+// inode to stop mkdir() from putting a directory of the same name next
+// to it, so the index is asked.
+// @param remote_path - path of a WRITE
+static int parent_is_file(const char* remote_path) {
+  char dir[MAX_PATH];
+  meta_info_t info;
+
+  for (const char* p = strchr(remote_path, '/'); p != NULL;
+       p = strchr(p + 1, '/')) {
+    snprintf(dir, sizeof(dir), "%.*s", (int)(p - remote_path), remote_path);
+    if (meta_get(dir, &info) == 0 && info.type == RFS_ENTRY_FILE) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// handle write command from client
+// conn - client connection, remote_path, full_path and file_size already set
+step_result_t handle_write_command(conn_t* conn) {
+  char base_path[MAX_PATH];
+  char dir_path[MAX_PATH];
+
+  switch (conn->phase) {
+    case WRITE_START:
+      if (parent_is_file(conn->remote_path)) {
+        return fail_request(conn, "error occured!: Failed to write file");
+      }
+      get_directory_path(conn->full_path, dir_path);
+
+      // mkdir tolerates EEXIST, so racing WRITEs into one directory are fine
+      if (strlen(dir_path) > 0) {
+        if (create_directories(dir_path) != 0) {
+          return fail_request(conn, "%s",
+                              "error occured!: Failed to create directory");
+        }
+      }
+
+      log_debug("  File size: %ld bytes", conn->file_size);
+
+      // A small file is taken into memory whole and packed
+      if (want_packed_write(conn)) {
+        conn->phase = WRITE_RECV_SMALL;
+        return STEP_CONTINUE;
+      }
+
+      // Stream into a temp file, nobody has to wait for the upload
+      if (create_temp_file(conn) != 0) {
+        return fail_request(conn, "error occured!: Cannot create file");
+      }
+
+      // A delta is rebuilt on top of the current file
+      if (conn->req.opcode == RFS_OP_DELTA) {
+        if (open_delta_base(conn) != 0) {
+          return fail_request(conn, "error occured!: File not found '%s'",
+                              conn->remote_path);
+        }
+        conn->phase = DELTA_HEADER;
+        return STEP_CONTINUE;
+      }
+
+      // A compressed stream is unpacked block by block as it arrives
+      if (conn->req.flags & RFS_FLAG_COMPRESS) {
+        if (compress_at_rest) {
+          open_compressed_copy(conn);
+        }
+        conn->out_size = 0;
+        conn->phase = WRITE_RECV_BLOCKS;
+        return STEP_CONTINUE;
+      }
+
+      // The data is checked as it is copied in, so it can't be spliced
+      if (conn->req.flags & RFS_FLAG_CHECKSUM) {
+        if (conn->file_size < CHECKSUM_SIZE) {
+          return fail_request(conn, "%s",
+                              "error occured!: Missing checksum");
+        }
+        conn->file_size -= CHECKSUM_SIZE;
+        conn->checksum_len = CHECKSUM_SIZE;
+        conn->checksum = 0;
+      }
+
+#ifdef __linux__
+      // Reserve the blocks up front so large uploads land contiguously
+      if (conn->file_size > 0 &&
+          fallocate(conn->fd, FALLOC_FL_KEEP_SIZE, 0, conn->file_size) != 0 &&
+          errno == ENOSPC) {
+        return fail_request(conn, "error occured!: Not enough space on server");
+      }
+
+#endif
+
+      if (conn->checksum_len > 0) {
+        conn->use_splice = 0;
+      } else {
+        open_splice_pipe(conn);
+      }
+      conn->phase = WRITE_RECV_DATA;
+      return STEP_CONTINUE;
+
+    case WRITE_RECV_DATA: {
+      step_result_t result = recv_file_data(conn);
+      if (result == STEP_DONE && conn->write_error) {
+        return fail_request(conn, "error occured!: Failed to write file");
+      }
+      if (result != STEP_CONTINUE) {
+        return result;
+      }
+
+      conn->phase = conn->checksum_len > 0 ? WRITE_RECV_CHECKSUM : WRITE_STORE;
+      return STEP_CONTINUE;
+    }
+
+    case WRITE_RECV_CHECKSUM: {
+      int r = recv_exact(conn, CHECKSUM_SIZE);
+      if (r == RECV_AGAIN) {
+        return STEP_WAIT_READ;
+      }
+      if (r <= 0) {
+        return STEP_DONE;
+      }
+      conn->in_len = 0;
+      conn->file_size += CHECKSUM_SIZE;
+      conn->transferred += CHECKSUM_SIZE;
+      conn->checksum_len = 0;
+
+      if (rfs_get_u32((unsigned char*)conn->in) != conn->checksum) {
+        return fail_checksum(conn);
+      }
+
+      // Kept with the file, and with the version it becomes later
+      checksum_store(conn->fd, conn->checksum);
+      conn->phase = WRITE_STORE;
+      return STEP_CONTINUE;
+    }
+
+    case WRITE_RECV_SMALL: {
+      int r = recv_exact(conn, conn->file_size);
+      if (r == RECV_AGAIN) {
+        return STEP_WAIT_READ;
+      }
+      if (r <= 0) {
+        return STEP_DONE;
+      }
+      conn->transferred = conn->file_size;
+
+      // The contents stay in conn->in, in_len bytes of it
+      size_t len = conn->file_size;
+      if (conn->req.flags & RFS_FLAG_CHECKSUM) {
+        len -= CHECKSUM_SIZE;
+      }
+      conn->checksum = checksum_update(0, conn->in, len);
+      if ((conn->req.flags & RFS_FLAG_CHECKSUM) &&
+          rfs_get_u32((unsigned char*)conn->in + len) != conn->checksum) {
+        return fail_checksum(conn);
+      }
+      conn->in_len = len;
+      conn->phase = WRITE_PACK;
+      return STEP_CONTINUE;
+    }
+
+    case WRITE_PACK: {
+      // Same lock as a plain commit, so versions are saved in order
+      if (conn->lock == NULL) {
+        conn->lock = get_file_lock(conn->full_path);
+        if (conn->lock == NULL) {
+          return fail_request(conn, "error occured!: Out of memory");
+        }
+      }
+      if (conn->lock_held == LOCK_NONE &&
+          !acquire_file_lock(conn->lock, conn, LOCK_EXCLUSIVE)) {
+        return STEP_WAIT_LOCK;
+      }
+
+      // A directory, on disk or in the index, can't be packed over; a
+      // name ending in / is one, even though its key has no slash
+      meta_info_t info;
+      struct stat st;
+      size_t path_len = strlen(conn->remote_path);
+      int found = meta_get(conn->remote_path, &info) == 0;
+      if ((path_len > 0 && conn->remote_path[path_len - 1] == '/') ||
+          (found && info.type == RFS_ENTRY_DIR) ||
+          (stat(conn->full_path, &st) == 0 && S_ISDIR(st.st_mode))) {
+        return fail_request(conn, "error occured!: Failed to write file");
+      }
+
+      // A plain file stays one
+      if (found && info.location != META_PACKED) {
+        return spill_packed_write(conn);
+      }
+
+      int saved = pack_put(conn->remote_path, conn->in, conn->in_len,
+                           conn->checksum,
+                           durability_mode != DURABILITY_OFF ? &conn->fd
+                                                             : NULL);
+      if (saved < 0) {
+        return fail_request(conn, "error occured!: Failed to write file");
+      }
+      if (saved > 0) {
+        meta_save_version(conn->remote_path, saved);
+      }
+      info.type = RFS_ENTRY_FILE;
+      info.size = conn->in_len;
+      info.mtime = time(NULL);
+      info.latest = -1;
+      info.crc = conn->checksum;
+      info.has_crc = 1;
+      info.location = META_PACKED;
+      meta_put(conn->remote_path, &info);
+      conn_unlock(conn);
+      metrics_add(METRIC_PACKED_WRITES, 1);
+
+      if (saved > 0) {
+        log_debug("  Saved previous version as: %s.v%d (packed)",
+                  conn->full_path, saved);
+      }
+      log_info("  File packed: %s (%zu bytes)", conn->full_path,
+               conn->in_len);
+      return acknowledge_write(conn);
+    }
+
+    case WRITE_RECV_BLOCKS: {
+      step_result_t result = recv_compressed_data(conn);
+      if (result == STEP_DONE && conn->write_error == 2) {
+        return fail_request(conn, "%s",
+                            "error occured!: Corrupt compressed data");
+      }
+      if (result == STEP_DONE && conn->write_error == 3) {
+        return busy_request(conn, BUSY_RETRY_MS);
+      }
+      if (result == STEP_DONE && conn->write_error) {
+        return fail_request(conn, "error occured!: Failed to write file");
+      }
+      if (result != STEP_CONTINUE) {
+        return result;
+      }
+
+      log_debug("  Decompressed: %ld bytes into %llu", conn->file_size,
+                (unsigned long long)conn->out_size);
+      conn->phase = WRITE_STORE;
+      return STEP_CONTINUE;
+    }
+
+    case DELTA_HEADER:
+    case DELTA_OP:
+    case DELTA_LITERAL:
+    case DELTA_VERIFY:
+      return apply_delta(conn);
+
+    case WRITE_STORE:
+      // A handed off version is kept as it came, a plain file
+      if (handoff_version_of(conn, base_path) > 0) {
+        drop_compressed_copy(conn);
+      } else {
+        // Chunk the upload now, so saving it as a version later is a rename
+        if (chunk_store_enabled && store_upload_chunks(conn) != 0) {
+          return fail_request(conn, "error occured!: Failed to store chunks");
+        }
+        store_compressed_copy(conn);
+      }
+
+      // The data is durable before the rename makes it the file, so a
+      // crash leaves either the old file or the new one there
+      if (durability_mode == DURABILITY_GROUP) {
+        conn->phase = WRITE_STORE_SYNC;
+        sync_enqueue(conn);
+        return STEP_WAIT_LOCK;
+      }
+      if (durability_mode == DURABILITY_FILE && fdatasync(conn->fd) != 0) {
+        return fail_request(conn, "error occured!: Failed to sync file");
+      }
+      close(conn->fd);
+      conn->fd = -1;
+
+      conn->phase = WRITE_COMMIT;
+      return STEP_CONTINUE;
+
+    case WRITE_STORE_SYNC:
+      // Resumed by the group commit thread
+      if (conn->sync_error) {
+        return fail_request(conn, "error occured!: Failed to sync file");
+      }
+      close(conn->fd);
+      conn->fd = -1;
+
+      conn->phase = WRITE_COMMIT;
+      return STEP_CONTINUE;
+
+    case WRITE_COMMIT: {
+      // Get per-file lock, a version's is its file's
+      int version = handoff_version_of(conn, base_path);
+      if (conn->lock == NULL) {
+        conn->lock = get_file_lock(version > 0 ? base_path : conn->full_path);
+        if (conn->lock == NULL) {
+          return fail_request(conn, "error occured!: Out of memory");
+        }
+      }
+
+      // Only the version rotate and rename run under the lock
+      if (conn->lock_held == LOCK_NONE &&
+          !acquire_file_lock(conn->lock, conn, LOCK_EXCLUSIVE)) {
+        return STEP_WAIT_LOCK;
+      }
+
+      // A handoff never replaces a copy that is already here, nor does a
+      // replicated version
+      if (((conn->req.flags & RFS_FLAG_HANDOFF) ||
+           ((conn->req.flags & RFS_FLAG_REPLICA) && version > 0)) &&
+          handoff_exists(conn)) {
+        discard_temp_file(conn);
+        conn_unlock(conn);
+        log_info("  Handoff kept the copy here: %s", conn->full_path);
+        return conn_send(conn, RFS_OP_OK, PHASE_DONE, "%s",
+                         "Success!: Kept the copy already here");
+      }
+
+      // Save existing file as a version before overwriting; a replica
+      // gets the primary's versions sent separately
+      char recipe[MAX_PATH];
+      int saved = 0;
+      if (conn->req.flags & RFS_FLAG_REPLICA) {
+        if (conn->recipe_temp[0] == '\0' &&
+            get_recipe_path(conn->full_path, CURRENT_RECIPE, recipe) == 0) {
+          recipe_remove(recipe);
+        }
+      } else if ((saved = save_version(conn->full_path)) < 0) {
+        return fail_request(conn, "error occured!: Failed to save version");
+      }
+
+      int chunked = conn->recipe_temp[0] != '\0';
+      if (chunked && install_current_recipe(conn) != 0) {
+        return fail_request(conn, "error occured!: Failed to save version");
+      }
+
+      if (rename(conn->temp_path, conn->full_path) != 0) {
+        return fail_request(conn, "error occured!: Failed to write file");
+      }
+      conn->temp_path[0] = '\0';
+      if (version > 0 && version > load_latest_version(base_path) &&
+          store_latest_version(base_path, version) != 0) {
+        return fail_request(conn, "%s",
+                            "error occured!: Failed to save version");
+      }
+      index_write(conn, chunked);
+      snapshot_retire(conn->full_path);
+      file_cache_invalidate(conn->full_path);
+      install_compressed_copy(conn);
+      replicate_write(conn->remote_path, saved);
+      conn_unlock(conn);
+
+      // The recipe's directory, which the old recipe was renamed in too
+      if (chunked && durability_mode != DURABILITY_OFF &&
+          (get_recipe_path(conn->full_path, CURRENT_RECIPE, recipe) != 0 ||
+           sync_parent(recipe) != 0)) {
+        return fail_request(conn, "error occured!: Failed to sync file");
+      }
+
+      log_info("  File saved: %s", conn->full_path);
+      return acknowledge_write(conn);
+    }
+
+    case WRITE_SYNC:
+      // Resumed by the group commit thread
+      if (conn->sync_error) {
+        return fail_request(conn, "error occured!: Failed to sync file");
+      }
+      return conn_send(conn, RFS_OP_OK, PHASE_DONE, "%s",
+                       "Success!: File written successfully");
+  }
+
+  return STEP_DONE;
+}
+
+// Read the fixed fields at the start of a request's payload into conn->in
+// @param conn - connection whose payload is next on the socket
+// @param size - bytes of fields, already checked against the payload
+// @return 1 once they are in, RECV_AGAIN, or 0 / -1 if the client is gone
+static int recv_payload_fields(conn_t* conn, size_t size) {
+  int r = recv_exact(conn, size);
+  if (r == 1) {
+    conn->transferred += size;
+    conn->in_len = 0;
+  }
+  return r;
+}
+
+// Open or resume an upload session and tell the client what it holds
+// @param conn - client connection, remote_path and full_path already set
+step_result_t handle_upload_command(conn_t* conn) {
+  upload_extent_t* extents;
+  size_t count;
+  uint64_t size;
+  uint64_t received = 0;
+
+  if (conn->file_size != UPLOAD_HEADER_SIZE) {
+    return fail_request(conn, "%s", "error occured!: Bad upload request");
+  }
+  int r = recv_payload_fields(conn, UPLOAD_HEADER_SIZE);
+  if (r == RECV_AGAIN) {
+    return STEP_WAIT_READ;
+  }
+  if (r <= 0) {
+    return STEP_DONE;
+  }
+
+  memcpy(conn->token, conn->in, UPLOAD_TOKEN_SIZE);
+  size = rfs_get_u64((unsigned char*)conn->in + UPLOAD_TOKEN_SIZE);
+  if (upload_open(conn->token, size) != 0 ||
+      upload_load(conn->token, &size, &extents, &count) != 0) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                     "error occured!: Cannot open upload");
+  }
+
+  // Send as many ranges as fit in the reply, the client resends the rest
+  size_t room = (sizeof(conn->out) - RFS_HEADER_SIZE - 12) / 16;
+  if (count > room) {
+    count = room;
+  }
+  size_t len = 12 + count * 16;
+
+  conn_send_header(conn, RFS_OP_DATA, len, PHASE_DONE);
+  unsigned char* p = (unsigned char*)conn->out + conn->out_len;
+  rfs_put_u64(p, size);
+  rfs_put_u32(p + 8, count);
+  for (size_t i = 0; i < count; i++) {
+    rfs_put_u64(p + 12 + i * 16, extents[i].offset);
+    rfs_put_u64(p + 20 + i * 16, extents[i].len);
+    received += extents[i].len;
+  }
+  conn->out_len += len;
+  free(extents);
+
+  log_debug("  Upload: %llu of %llu bytes received",
+            (unsigned long long)received, (unsigned long long)size);
+  return STEP_CONTINUE;
+}
+
+// Record how much of a WRITE_RANGE reached the session's data file
+// Runs when the range completes and when its connection drops, so a
+// resumed upload only resends what is really missing.
+// @param conn - connection that may be receiving a range
+void record_upload_range(conn_t* conn) {
+  if (!conn->range_active) {
+    return;
+  }
+  conn->range_active = 0;
+  if (conn->transferred > 0 &&
+      upload_record(conn->token, conn->write_offset, conn->transferred) != 0) {
+    conn->write_error = 1;
+  }
+}
+
+// WRITE_RANGE handler phases
+enum { RANGE_START, RANGE_RECV_DATA };
+
+// Receive one range of an upload session at its offset
+// Ranges don't take the file lock, nothing but the session sees them
+// until COMMIT.
+// @param conn - client connection, remote_path and full_path already set
+step_result_t handle_write_range_command(conn_t* conn) {
+  char data_path[MAX_PATH];
+  char map_path[MAX_PATH];
+  uint64_t size;
+
+  switch (conn->phase) {
+    case RANGE_START: {
+      if (conn->file_size < UPLOAD_HEADER_SIZE) {
+        return fail_request(conn, "%s", "error occured!: Bad range request");
+      }
+      int r = recv_payload_fields(conn, UPLOAD_HEADER_SIZE);
+      if (r == RECV_AGAIN) {
+        return STEP_WAIT_READ;
+      }
+      if (r <= 0) {
+        return STEP_DONE;
+      }
+
+      memcpy(conn->token, conn->in, UPLOAD_TOKEN_SIZE);
+      uint64_t offset = rfs_get_u64((unsigned char*)conn->in +
+                                    UPLOAD_TOKEN_SIZE);
+
+      // The rest of the payload is the range itself
+      conn->file_size -= UPLOAD_HEADER_SIZE;
+      conn->transferred = 0;
+
+      if (upload_size(conn->token, &size) != 0) {
+        return fail_request(conn, "%s", "error occured!: No such upload");
+      }
+      if (offset > size || (uint64_t)conn->file_size > size - offset) {
+        return fail_request(conn, "%s",
+                            "error occured!: Range outside upload");
+      }
+
+      upload_paths(conn->token, data_path, map_path);
+      conn->fd = open(data_path, O_WRONLY);
+      if (conn->fd < 0) {
+        return fail_request(conn, "%s", "error occured!: No such upload");
+      }
+      conn->write_offset = offset;
+      conn->range_active = 1;
+
+      open_splice_pipe(conn);
+      conn->phase = RANGE_RECV_DATA;
+      return STEP_CONTINUE;
+    }
+
+    case RANGE_RECV_DATA: {
+      step_result_t result = recv_file_data(conn);
+      if (result == STEP_DONE && conn->write_error) {
+        record_upload_range(conn);
+        return fail_request(conn, "error occured!: Failed to write file");
+      }
+      if (result != STEP_CONTINUE) {
+        return result;
+      }
+
+      record_upload_range(conn);
+      if (conn->write_error) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                         "error occured!: Failed to record range");
+      }
+      close(conn->fd);
+      conn->fd = -1;
+
+      log_debug("  Range written: %ld bytes at offset %ld", conn->transferred,
+                conn->write_offset);
+
+      return conn_send(conn, RFS_OP_OK, PHASE_DONE, "%s",
+                       "Success!: Range written");
+    }
+  }
+
+  return STEP_DONE;
+}
+
+// Commit an upload session once every range has arrived
+// The session's data file becomes the connection's temp file and goes
+// through the end of the WRITE path, so it is chunked, versioned and
+// renamed into place exactly like a single stream upload.
+// @param conn - client connection, remote_path and full_path already set
+step_result_t handle_commit_command(conn_t* conn) {
+  char data_path[MAX_PATH];
+  char map_path[MAX_PATH];
+  char dir_path[MAX_PATH];
+  upload_extent_t* extents;
+  size_t count;
+  uint64_t size;
+
+  if (conn->file_size != UPLOAD_TOKEN_SIZE) {
+    return fail_request(conn, "%s", "error occured!: Bad commit request");
+  }
+  int r = recv_payload_fields(conn, UPLOAD_TOKEN_SIZE);
+  if (r == RECV_AGAIN) {
+    return STEP_WAIT_READ;
+  }
+  if (r <= 0) {
+    return STEP_DONE;
+  }
+  memcpy(conn->token, conn->in, UPLOAD_TOKEN_SIZE);
+
+  if (upload_load(conn->token, &size, &extents, &count) != 0) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                     "error occured!: No such upload");
+  }
+  int complete = size == 0 || (count == 1 && extents[0].offset == 0 &&
+                               extents[0].len >= size);
+  free(extents);
+  if (!complete) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                     "error occured!: Upload incomplete");
+  }
+
+  if (parent_is_file(conn->remote_path)) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                     "error occured!: Failed to write file");
+  }
+  get_directory_path(conn->full_path, dir_path);
+  if (strlen(dir_path) > 0 && create_directories(dir_path) != 0) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                     "error occured!: Failed to create directory");
+  }
+
+  upload_paths(conn->token, data_path, map_path);
+  conn->fd = open(data_path, O_RDWR);
+  if (conn->fd < 0) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                     "error occured!: No such upload");
+  }
+
+  // The data now belongs to this request, the session is over
+  upload_forget(conn->token);
+  snprintf(conn->temp_path, sizeof(conn->temp_path), "%s", data_path);
+  if (ftruncate(conn->fd, size) != 0) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                     "error occured!: Failed to write file");
+  }
+
+  log_debug("  File size: %llu bytes (uploaded in ranges)",
+            (unsigned long long)size);
+
+  conn->handler = handle_write_command;
+  conn->phase = WRITE_STORE;
+  return STEP_CONTINUE;
+}
+
+// send_file_data through io_uring
+// Each round reads a chunk of the file into the pool buffer and sends it
+// with a linked SEND in one io_uring_enter(); what the socket doesn't
+// take is left in the buffer for the next step.
+// @param conn - connection with an open fd, size set and a uring buffer
+static step_result_t send_file_uring(conn_t* conn) {
+  unsigned char* buf = buf_pool_data(conn->pool_buf);
+
+  int flushed = flush_output(conn);
+  if (flushed < 0) {
+    return STEP_DONE;
+  }
+  if (flushed == 0) {
+    return STEP_WAIT_WRITE;
+  }
+
+  for (int chunks = 0;; chunks++) {
+    if (conn->uring_off < conn->uring_len) {
+      ssize_t sent = send(conn->client_sock, buf + conn->uring_off,
+                          conn->uring_len - conn->uring_off, 0);
+      if (sent < 0 && errno == EINTR) {
+        continue;
+      }
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return STEP_WAIT_WRITE;
+      }
+      if (sent <= 0) {
+        return STEP_DONE;
+      }
+      count_bytes_out(conn, sent);
+      conn->uring_off += sent;
+      continue;
+    }
+    if (conn->transferred >= conn->file_size) {
+      return STEP_CONTINUE;
+    }
+    if (chunks >= MAX_CHUNKS_PER_STEP) {
+      return STEP_WAIT_WRITE;
+    }
+
+    size_t to_read = URING_CHUNK;
+    if (conn->file_size - conn->transferred < (long)to_read) {
+      to_read = conn->file_size - conn->transferred;
+    }
+    uring_op_t ops[2] = {
+        {URING_READ, conn->fd, conn->pool_buf, 0, to_read, conn->transferred,
+         1, 0},
+        {URING_SEND, conn->client_sock, conn->pool_buf, 0, to_read, 0, 0, 0}};
+    if (uring_run(ops, 2) != 0) {
+      return STEP_DONE;
+    }
+
+    if (ops[0].res <= 0) {
+      // File ended early, finish with what was sent
+      conn->file_size = conn->transferred;
+      continue;
+    }
+    conn->transferred += ops[0].res;
+    conn->uring_len = ops[0].res;
+    conn->uring_off = 0;
+
+    // A short read cancels the SEND, the bytes go out next round
+    if (ops[1].res > 0) {
+      count_bytes_out(conn, ops[1].res);
+      conn->uring_off = ops[1].res;
+    } else if (ops[1].res != -EAGAIN && ops[1].res != -EWOULDBLOCK &&
+               ops[1].res != -ECANCELED && ops[1].res != -EINTR) {
+      return STEP_DONE;
+    }
+  }
+}
+
+// Stream conn->fd to the client from conn->transferred up to file_size
+// sendfile() moves the data straight from the page cache to the socket;
+// the pread()+send() loop through conn->out is only used where the kernel
+// or filesystem can't do that. Under -u the data goes through io_uring,
+// see send_file_uring().
+// @param conn - connection with an open fd and size set
+// @return STEP_CONTINUE once everything is sent, else a wait or STEP_DONE
+step_result_t send_file_data(conn_t* conn) {
+  int chunks = 0;
+
+  if (use_uring(conn)) {
+    return send_file_uring(conn);
+  }
+
+#ifdef __linux__
+  while (conn->use_sendfile && conn->transferred < conn->file_size) {
+    if (chunks++ == MAX_CHUNKS_PER_STEP) {
+      return STEP_WAIT_WRITE;
+    }
+
+    size_t to_send = SENDFILE_CHUNK;
+    if (conn->file_size - conn->transferred < (long)to_send) {
+      to_send = conn->file_size - conn->transferred;
+    }
+
+    off_t offset = conn->transferred;
+    ssize_t sent = sendfile(conn->client_sock, conn->fd, &offset, to_send);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return STEP_WAIT_WRITE;
+      }
+      if (errno == EINVAL || errno == ENOSYS) {
+        // Not supported for this file, finish with the copy loop
+        conn->use_sendfile = 0;
+        break;
+      }
+      return STEP_DONE;
+    }
+    if (sent == 0) {
+      // File ended early, finish with what was sent
+      conn->file_size = conn->transferred;
+      break;
+    }
+    count_bytes_out(conn, sent);
+    conn->transferred += sent;
+  }
+#endif
+
+  // Copy loop, yielding after a few chunks
+  for (;; chunks++) {
+    int flushed = flush_output(conn);
+    if (flushed < 0) {
+      return STEP_DONE;
+    }
+    if (flushed == 0) {
+      return STEP_WAIT_WRITE;
+    }
+    if (conn->transferred >= conn->file_size) {
+      return STEP_CONTINUE;
+    }
+    if (chunks >= MAX_CHUNKS_PER_STEP) {
+      return STEP_WAIT_WRITE;
+    }
+
+    size_t to_read = sizeof(conn->out);
+    if (conn->file_size - conn->transferred < (long)to_read) {
+      to_read = conn->file_size - conn->transferred;
+    }
+
+    ssize_t bytes_read = pread(conn->fd, conn->out, to_read, conn->transferred);
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      // File ended early, finish with what was sent
+      conn->file_size = conn->transferred;
+      continue;
+    }
+
+    conn->out_len = bytes_read;
+    conn->out_off = 0;
+    conn->transferred += bytes_read;
+  }
+}
+
+// Send a cached file, the DATA header queued in conn->out and the data
+// go out together, one writev() at a time
+// @param conn - connection with conn->cached set, sending the bytes from
+//               conn->transferred up to file_size
+// @return STEP_CONTINUE once everything is sent, else a wait or STEP_DONE
+step_result_t send_cached_data(conn_t* conn) {
+  file_entry_t* entry = conn->cached;
+
+  for (int chunks = 0;; chunks++) {
+    struct iovec iov[2];
+    int count = 0;
+    size_t header_left = conn->out_len - conn->out_off;
+
+    if (header_left > 0) {
+      iov[count].iov_base = conn->out + conn->out_off;
+      iov[count].iov_len = header_left;
+      count++;
+    }
+    if (conn->transferred < conn->file_size) {
+      size_t to_send = conn->file_size - conn->transferred;
+      iov[count].iov_base = entry->data + conn->transferred;
+      iov[count].iov_len = to_send < SENDFILE_CHUNK ? to_send : SENDFILE_CHUNK;
+      count++;
+    }
+    if (count == 0) {
+      conn->out_len = conn->out_off = 0;
+      return STEP_CONTINUE;
+    }
+    if (chunks >= MAX_CHUNKS_PER_STEP) {
+      return STEP_WAIT_WRITE;
+    }
+
+    ssize_t sent = writev(conn->client_sock, iov, count);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return STEP_WAIT_WRITE;
+    }
+    if (sent <= 0) {
+      return STEP_DONE;
+    }
+    count_bytes_out(conn, sent);
+
+    if ((size_t)sent < header_left) {
+      conn->out_off += sent;
+    } else {
+      conn->out_off = conn->out_len;
+      conn->transferred += sent - header_left;
+    }
+  }
+}
+
+// Find the recipe of a chunked version, for paths ending in .vN
+// @param conn - connection whose remote_path names the version
+// @param recipe - output buffer of MAX_PATH bytes
+int get_version_recipe_path(conn_t* conn, char recipe[]) {
+  const char* dot = strrchr(conn->remote_path, '.');
+
+  if (dot == NULL || dot[1] != 'v' || dot[2] == '\0' ||
+      strspn(dot + 2, "0123456789") != strlen(dot + 2)) {
+    return -1;
+  }
+  return get_recipe_path(conn->full_path, "", recipe);
+}
+
+// GET handler phases
+enum { GET_START, GET_LOCK, GET_SEND_DATA, GET_SEND_CHUNKS, GET_SEND_CACHED };
+
+// Have a GET that asked for it end with the file's checksum
+// Only whole files have one, so never a GET_RANGE.
+// @param conn - connection about to send the DATA header of a GET
+// @param have - 1 if the file has a checksum
+// @param checksum - its CRC32C
+static void want_get_checksum(conn_t* conn, int have, uint32_t checksum) {
+  if (have && (conn->req.flags & RFS_FLAG_CHECKSUM) &&
+      conn->req.opcode == RFS_OP_GET) {
+    conn->checksum_len = CHECKSUM_SIZE;
+    conn->checksum = checksum;
+  }
+}
+
+// Queue the DATA header of a GET, clipping a GET_RANGE to the file
+// A GET_RANGE reply starts with the size of the whole file.
+// @param conn - connection with range_start and range_end requested
+// @param size - size of the file being sent
+// @param next_phase - phase that sends the data
+static step_result_t send_get_header(conn_t* conn, long size, int next_phase) {
+  if (conn->req.opcode != RFS_OP_GET_RANGE) {
+    conn->range_start = 0;
+    conn->range_end = size;
+    conn_send_header(conn, RFS_OP_DATA, size + conn->checksum_len,
+                     next_phase);
+    if (conn->checksum_len > 0) {
+      rfs_set_flags((unsigned char*)conn->out, RFS_FLAG_CHECKSUM);
+    }
+    return STEP_CONTINUE;
+  }
+
+  if (conn->range_start > size) {
+    conn_unlock(conn);
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                     "error occured!: Range outside file '%s'",
+                     conn->remote_path);
+  }
+  if (conn->range_end == 0 || conn->range_end > size) {
+    conn->range_end = size;
+  }
+
+  conn_send_header(conn, RFS_OP_DATA,
+                   8 + conn->range_end - conn->range_start, next_phase);
+  rfs_put_u64((unsigned char*)conn->out + conn->out_len, size);
+  conn->out_len += 8;
+  return STEP_CONTINUE;
+}
+
+// Answer a GET or GET_RANGE from conn->cached
+// The header isn't flushed on its own, it goes out with the data.
+// @param conn - connection holding a reference to the cached file
+static step_result_t start_cached_get(conn_t* conn) {
+  want_get_checksum(conn, conn->cached->has_checksum, conn->cached->checksum);
+  step_result_t result =
+      send_get_header(conn, conn->cached->size, GET_SEND_CACHED);
+  if (conn->phase == GET_SEND_CACHED) {
+    conn->state = CONN_HANDLER;
+    conn->transferred = conn->range_start;
+    conn->file_size = conn->range_end;
+  }
+  return result;
+}
+
+// Close the file a GET was reading, its own fd or its snapshot's
+// @param conn - connection running a GET
+static void close_get_file(conn_t* conn) {
+  release_snapshot(conn);
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+// Answer a GET or GET_RANGE from the open file in conn->fd
+// @param conn - connection with the file open, its snapshot or own fd
+// @param st - stat of that file
+static step_result_t start_file_get(conn_t* conn, const struct stat* st) {
+  log_debug("  File size: %ld bytes", (long)st->st_size);
+
+  // A compressed reply sends the stream instead, flagged so the
+  // client knows to unpack it
+  if ((conn->req.flags & RFS_FLAG_COMPRESS) &&
+      conn->req.opcode == RFS_OP_GET && st->st_size > 0) {
+    long start;
+    int stream_fd = open_compressed_get(conn, st, &start);
+    if (stream_fd >= 0) {
+      close_get_file(conn);
+      conn->fd = stream_fd;
+      conn->range_start = start;
+      conn->range_end = lseek(stream_fd, 0, SEEK_END);
+      conn->transferred = conn->range_start;
+      conn->file_size = conn->range_end;
+      conn->use_sendfile = 1;
+      log_debug("  Compressed: %ld bytes",
+                conn->range_end - conn->range_start);
+
+      conn_send_header(conn, RFS_OP_DATA,
+                       conn->range_end - conn->range_start, GET_SEND_DATA);
+      rfs_set_flags((unsigned char*)conn->out, RFS_FLAG_COMPRESS);
+      return STEP_CONTINUE;
+    }
+  }
+
+  // Small files are read into the cache and sent from there, big
+  // ones too with -M, as one mapping shared by every GET
+  if (!(conn->req.flags & RFS_FLAG_COMPRESS) &&
+      (conn->cached = file_cache_insert(conn->full_path, conn->fd,
+                                        st->st_size,
+                                        conn->cache_generation)) != NULL) {
+    close_get_file(conn);
+    conn_unlock(conn);
+    return start_cached_get(conn);
+  }
+
+  // File size goes out as the DATA frame length, contents follow
+  uint32_t checksum = 0;
+  int has_checksum = checksum_load(conn->fd, &checksum) == 0;
+  want_get_checksum(conn, has_checksum, checksum);
+  step_result_t result = send_get_header(conn, st->st_size, GET_SEND_DATA);
+  conn->transferred = conn->range_start;
+  conn->file_size = conn->range_end;
+  conn->use_sendfile = 1;
+  return result;
+}
+
+// Answer a GET or GET_RANGE of a packed file read into conn->in
+// The whole reply fits in conn->out and goes out in one send.
+// @param conn - connection running the GET
+// @param len - bytes read, or -2 if the data failed its checksum
+// @param checksum - CRC32C of the file
+static step_result_t start_packed_get(conn_t* conn, long len,
+                                      uint32_t checksum) {
+  if (len < 0) {
+    log_warn("  Packed file is corrupt: %s", conn->full_path);
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                     "error occured!: File is corrupt '%s'",
+                     conn->remote_path);
+  }
+  log_debug("  File size: %ld bytes (packed)", len);
+
+  want_get_checksum(conn, 1, checksum);
+  send_get_header(conn, len, PHASE_DONE);
+  if (conn->request_failed) {
+    return STEP_CONTINUE;
+  }
+
+  long n = conn->range_end - conn->range_start;
+  memcpy(conn->out + conn->out_len, conn->in + conn->range_start, n);
+  conn->out_len += n;
+  if (conn->checksum_len > 0) {
+    rfs_put_u32((unsigned char*)conn->out + conn->out_len, checksum);
+    conn->out_len += CHECKSUM_SIZE;
+    conn->checksum_len = 0;
+  }
+  log_info("  File sent: %s (%ld bytes from pack)", conn->full_path, n);
+  return STEP_CONTINUE;
+}
+
+// Send the checksum a GET's DATA frame ends with, if it has one
+// @param conn - connection whose GET has sent all of the file
+static step_result_t finish_get(conn_t* conn) {
+  if (conn->checksum_len == 0) {
+    return finish_request(conn);
+  }
+  rfs_put_u32((unsigned char*)conn->out, conn->checksum);
+  conn->out_len = CHECKSUM_SIZE;
+  conn->out_off = 0;
+  conn->checksum_len = 0;
+  conn->phase = PHASE_DONE;
+  conn->state = CONN_SENDING;
+  return STEP_CONTINUE;
+}
+
+// handle get command from client
+// conn - client connection, remote_path and full_path already set
+step_result_t handle_get_command(conn_t* conn) {
+  struct stat st;
+  uint32_t checksum;
+  long packed;
+
+  switch (conn->phase) {
+    case GET_START:
+      // A range is asked for as offset and length, 0 meaning to the end
+      if (conn->req.opcode == RFS_OP_GET_RANGE) {
+        if (conn->file_size != 16) {
+          return fail_request(conn, "%s", "error occured!: Bad range request");
+        }
+        int r = recv_payload_fields(conn, 16);
+        if (r == RECV_AGAIN) {
+          return STEP_WAIT_READ;
+        }
+        if (r <= 0) {
+          return STEP_DONE;
+        }
+
+        uint64_t offset = rfs_get_u64((unsigned char*)conn->in);
+        uint64_t length = rfs_get_u64((unsigned char*)conn->in + 8);
+        if (offset > LONG_MAX || length > LONG_MAX - offset) {
+          return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                           "error occured!: Bad range request");
+        }
+        conn->range_start = offset;
+        conn->range_end = length > 0 ? (long)(offset + length) : 0;
+        log_debug("  Range: %llu bytes at offset %llu",
+                  (unsigned long long)length, (unsigned long long)offset);
+      }
+
+      // Packed files are read with one pread(), without the lock too
+      packed = pack_read(conn->remote_path, conn->in, &checksum);
+      if (packed != -1) {
+        return start_packed_get(conn, packed, checksum);
+      }
+
+      // Hot files are answered from memory, without taking the lock
+      if (!(conn->req.flags & RFS_FLAG_COMPRESS) &&
+          (conn->cached = file_cache_lookup(conn->full_path,
+                                            &conn->cache_generation)) !=
+              NULL) {
+        return start_cached_get(conn);
+      }
+
+      // Committed files are sent from a snapshot, without the lock too;
+      // old chunked versions, errors and a path caught between the two
+      // renames of a commit take the lock
+      conn->snapshot = snapshot_get(conn->full_path);
+      if (conn->snapshot != NULL) {
+        conn->fd = conn->snapshot->fd;
+        return start_file_get(conn, &conn->snapshot->st);
+      }
+      conn->phase = GET_LOCK;
+      return STEP_CONTINUE;
+
+    case GET_LOCK:
+      // Get per file lock
+      if (conn->lock == NULL) {
+        conn->lock = get_file_lock(conn->full_path);
+        if (conn->lock == NULL) {
+          return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                           "error occured!: Out of memory");
+        }
+      }
+
+      // Readers share the file, only a writer keeps them out
+      if (conn->lock_held == LOCK_NONE &&
+          !acquire_file_lock(conn->lock, conn, LOCK_SHARED)) {
+        return STEP_WAIT_LOCK;
+      }
+
+      if (stat(conn->full_path, &st) != 0) {
+        // Old versions of chunked files only exist as recipes
+        char recipe[MAX_PATH];
+        if (get_version_recipe_path(conn, recipe) == 0 &&
+            (conn->recipe = recipe_load(recipe)) != NULL) {
+          log_debug("  File size: %llu bytes (%zu chunks)",
+                    (unsigned long long)conn->recipe->size,
+                    conn->recipe->count);
+          return send_get_header(conn, conn->recipe->size, GET_SEND_CHUNKS);
+        }
+
+        conn_unlock(conn);
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: File not found '%s'",
+                         conn->remote_path);
+      }
+
+      if (S_ISDIR(st.st_mode)) {
+        conn_unlock(conn);
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: Path is a directory '%s'",
+                         conn->remote_path);
+      }
+
+      conn->fd = open(conn->full_path, O_RDONLY);
+      if (conn->fd < 0) {
+        conn_unlock(conn);
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: Cannot open file '%s'",
+                         conn->remote_path);
+      }
+      return start_file_get(conn, &st);
+
+    case GET_SEND_DATA: {
+      step_result_t result = send_file_data(conn);
+      if (result != STEP_CONTINUE) {
+        return result;
+      }
+
+      close_get_file(conn);
+      conn_unlock(conn);
+
+      log_info("  File sent: %s (%ld bytes)", conn->full_path,
+               conn->transferred - conn->range_start);
+
+      return finish_get(conn);
+    }
+
+    case GET_SEND_CHUNKS:
+      // The chunks are pinned by the recipe, send them one after another;
+      // recipe_sent is where the current chunk starts in the file
+      while (conn->recipe_index < conn->recipe->count &&
+             conn->recipe_sent < conn->range_end) {
+        chunk_ref_t* chunk = &conn->recipe->chunks[conn->recipe_index];
+        long start = conn->recipe_sent;
+        long end = start + chunk->len;
+
+        if (end <= conn->range_start) {
+          conn->recipe_sent = end;
+          conn->recipe_index++;
+          continue;
+        }
+        if (end > conn->range_end) {
+          end = conn->range_end;
+        }
+
+        if (conn->fd < 0) {
+          conn->fd = chunk_open(chunk);
+          if (conn->fd < 0) {
+            // The DATA length is already out, so the stream can't recover
+            return STEP_DONE;
+          }
+          conn->file_size = end - start;
+          conn->transferred =
+              conn->range_start > start ? conn->range_start - start : 0;
+          conn->use_sendfile = 1;
+        }
+
+        step_result_t result = send_file_data(conn);
+        if (result != STEP_CONTINUE) {
+          return result;
+        }
+        if (conn->transferred != end - start) {
+          return STEP_DONE;
+        }
+
+        close(conn->fd);
+        conn->fd = -1;
+        conn->recipe_sent = start + chunk->len;
+        conn->recipe_index++;
+      }
+
+      conn_unlock(conn);
+
+      log_info("  File sent: %s (%ld bytes from chunks)", conn->full_path,
+               conn->range_end - conn->range_start);
+
+      return finish_request(conn);
+
+    case GET_SEND_CACHED: {
+      step_result_t result = send_cached_data(conn);
+      if (result != STEP_CONTINUE) {
+        return result;
+      }
+
+      log_info("  File sent: %s (%ld bytes from %s)", conn->full_path,
+               conn->transferred - conn->range_start,
+               conn->cached->mapped ? "shared mapping" : "cache");
+
+      return finish_get(conn);
+    }
+  }
+
+  return STEP_DONE;
+}
+
+// Does a file name end in .vN and is it a saved version of its base file
+// @param path - full path of a regular file
+int is_version_file(const char* path) {
+  char base[MAX_PATH];
+  const char* dot = strrchr(path, '.');
+
+  if (dot == NULL || dot[1] != 'v' || dot[2] == '\0' ||
+      strspn(dot + 2, "0123456789") != strlen(dot + 2)) {
+    return 0;
+  }
+  snprintf(base, sizeof(base), "%.*s", (int)(dot - path), path);
+  return atoi(dot + 2) <= load_latest_version(base);
+}
+
+// Take a directory of the walk from the index and make it the one read
+// @param walk - LIST in progress, walk->path is the directory's path
+// @return 0, 1 if its path is too long to be listed, -1 if out of memory
+static int push_list_dir(conn_t* conn, list_walk_t* walk) {
+  char dir_path[MAX_PATH];
+
+  if (snprintf(dir_path, sizeof(dir_path), "%s/%s", conn->remote_path,
+               walk->path) >= (int)sizeof(dir_path)) {
+    log_warn("Not listing %s/%s: path too long", conn->remote_path,
+             walk->path);
+    return 1;
+  }
+  list_dir_t* level = calloc(1, sizeof(list_dir_t));
+  if (level == NULL) {
+    return -1;
+  }
+  if (meta_list(dir_path, &level->entries, &level->len) != 0) {
+    free(level);
+    return -1;
+  }
+  level->prefix_len = strlen(walk->path);
+  level->parent = walk->top;
+  walk->top = level;
+  return 0;
+}
+
+// Free the directories of a LIST
+// @param conn - connection that may have a LIST in progress
+void free_list_walk(conn_t* conn) {
+  list_walk_t* walk = conn->list;
+
+  if (walk == NULL) {
+    return;
+  }
+  while (walk->top != NULL) {
+    list_dir_t* parent = walk->top->parent;
+    free(walk->top->entries);
+    free(walk->top);
+    walk->top = parent;
+  }
+  free(walk);
+  conn->list = NULL;
+}
+
+// Read the next entry of the walk into walk->pending
+// @return 1 if there is one, 0 once the walk is over
+static int next_list_entry(conn_t* conn, list_walk_t* walk) {
+  while (walk->top != NULL) {
+    list_dir_t* level = walk->top;
+    walk->path[level->prefix_len] = '\0';
+
+    if (level->off >= level->len) {
+      walk->top = level->parent;
+      free(level->entries);
+      free(level);
+      continue;
+    }
+    const unsigned char* entry = level->entries + level->off;
+    size_t len = (entry[17] << 8) | entry[18];
+    level->off += RFS_ENTRY_HEADER_SIZE + len;
+
+    size_t name_len = level->prefix_len + len;
+    if (name_len >= MAX_PATH - 1) {
+      continue;
+    }
+    memcpy(walk->path + level->prefix_len, entry + RFS_ENTRY_HEADER_SIZE,
+           len);
+    walk->path[name_len] = '\0';
+
+    // Same entry, named relative to the listed directory
+    unsigned char* p = walk->pending;
+    memcpy(p, entry, RFS_ENTRY_HEADER_SIZE);
+    p[17] = name_len >> 8;
+    p[18] = name_len & 0xff;
+    memcpy(p + RFS_ENTRY_HEADER_SIZE, walk->path, name_len);
+    walk->pending_len = RFS_ENTRY_HEADER_SIZE + name_len;
+    walk->entries++;
+
+    // Descend right away, so a directory's contents follow its entry
+    if (entry[0] == RFS_ENTRY_DIR && walk->recursive) {
+      strcat(walk->path, "/");
+      push_list_dir(conn, walk);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// LIST handler phases
+enum { LIST_START, LIST_SEND };
+
+// Stream the entries of a directory, one DATA frame at a time
+// The entries come from the metadata index, read a directory at a time
+// without a file lock; like ls, a listing that races with writes shows
+// each directory as it was when it was read.
+// conn - client connection, remote_path and full_path already set
+step_result_t handle_list_command(conn_t* conn) {
+  meta_info_t info;
+
+  switch (conn->phase) {
+    case LIST_START: {
+      if (meta_get(conn->remote_path, &info) != 0) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: Path not found '%s'",
+                         conn->remote_path);
+      }
+      if (info.type != RFS_ENTRY_DIR) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: Not a directory '%s'",
+                         conn->remote_path);
+      }
+
+      list_walk_t* walk = calloc(1, sizeof(list_walk_t));
+      if (walk == NULL) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                         "error occured!: Out of memory");
+      }
+      conn->list = walk;
+      walk->recursive = (conn->req.flags & RFS_FLAG_RECURSIVE) != 0;
+      if (push_list_dir(conn, walk) != 0) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: Cannot read directory '%s'",
+                         conn->remote_path);
+      }
+      conn->phase = LIST_SEND;
+      return STEP_CONTINUE;
+    }
+
+    case LIST_SEND: {
+      list_walk_t* walk = conn->list;
+      unsigned char* frame = (unsigned char*)conn->out + RFS_HEADER_SIZE;
+      size_t room = sizeof(conn->out) - RFS_HEADER_SIZE;
+      size_t len = 0;
+
+      // Give the worker back now and then on a big tree
+      if (walk->frames++ == MAX_CHUNKS_PER_STEP) {
+        walk->frames = 0;
+        return STEP_WAIT_WRITE;
+      }
+
+      while (walk->pending_len > 0 || next_list_entry(conn, walk)) {
+        if (len + walk->pending_len > room) {
+          break;
+        }
+        memcpy(frame + len, walk->pending, walk->pending_len);
+        len += walk->pending_len;
+        walk->pending_len = 0;
+      }
+
+      if (len > 0) {
+        conn_send_header(conn, RFS_OP_DATA, len, LIST_SEND);
+        conn->out_len += len;
+        return STEP_CONTINUE;
+      }
+
+      log_debug("  Listed %ld entries", walk->entries);
+      return conn_send(conn, RFS_OP_OK, PHASE_DONE,
+                       "Success!: Listed %ld entries", walk->entries);
+    }
+  }
+
+  return STEP_DONE;
+}
+
+// STATS handler phases
+enum { STATS_START, STATS_SEND };
+
+// Send the server's metrics, one DATA frame streamed from conn->stats
+// conn - client connection
+step_result_t handle_stats_command(conn_t* conn) {
+  switch (conn->phase) {
+    case STATS_START:
+      conn->stats = metrics_format(&conn->stats_len);
+      if (conn->stats == NULL) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                         "error occured!: Out of memory");
+      }
+      conn->stats_sent = 0;
+      return conn_send_header(conn, RFS_OP_DATA, conn->stats_len, STATS_SEND);
+
+    case STATS_SEND: {
+      size_t len = conn->stats_len - conn->stats_sent;
+      if (len == 0) {
+        log_debug("  Sent %zu bytes of stats", conn->stats_len);
+        return finish_request(conn);
+      }
+      if (len > sizeof(conn->out)) {
+        len = sizeof(conn->out);
+      }
+      memcpy(conn->out, conn->stats + conn->stats_sent, len);
+      conn->stats_sent += len;
+      conn->out_len = len;
+      conn->out_off = 0;
+      conn->state = CONN_SENDING;
+      return STEP_CONTINUE;
+    }
+  }
+
+  return STEP_DONE;
+}
+
+// handle RING command from client
+// An empty payload asks for the membership, a node list replaces it.
+// @param conn - client connection
+step_result_t handle_ring_command(conn_t* conn) {
+  if (conn->file_size == 0) {
+    char* text = conn->out + RFS_HEADER_SIZE;
+    size_t len = cluster_format(text, sizeof(conn->out) - RFS_HEADER_SIZE);
+    conn_send_header(conn, RFS_OP_DATA, len, PHASE_DONE);
+    conn->out_len += len;
+    return STEP_CONTINUE;
+  }
+
+  if (conn->file_size >= RING_TEXT_MAX) {
+    return fail_request(conn, "%s", "error occured!: Node list too long");
+  }
+  // Same as at startup, packed files would never be handed off
+  if (pack_enabled || pack_count() > 0) {
+    return fail_request(conn, "%s",
+                        "error occured!: Packed files are not handed off, "
+                        "a server with -P or packed files can't join a ring");
+  }
+  int r = recv_payload_fields(conn, conn->file_size);
+  if (r == RECV_AGAIN) {
+    return STEP_WAIT_READ;
+  }
+  if (r <= 0) {
+    return STEP_DONE;
+  }
+  conn->in[conn->file_size] = '\0';
+
+  int nodes = cluster_set(conn->in);
+  if (nodes < 0) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                     "error occured!: Malformed node list");
+  }
+  return conn_send(conn, RFS_OP_OK, PHASE_DONE,
+                   "Success!: Ring set, %d nodes", nodes);
+}
+
+// Delete a file with all of its versions, recipes and compressed copy
+// @param full_path - the file under ROOT_DIR, its lock held by a RM or
+//                   the rebalance thread handing it off
+// @return 0, or -1 if the file itself could not be removed
+int remove_file_and_versions(const char* full_path) {
+  char version_path[MAX_PATH];
+  char recipe[MAX_PATH];
+  char copy_path[MAX_PATH];
+
+  // Delete main file
+  if (unlink(full_path) != 0) {
+    return -1;
+  }
+  log_info("  File removed: %s", full_path);
+  snapshot_retire(full_path);
+  file_cache_invalidate(full_path);
+
+  // Delete all versions, the manifest says how many there are
+  int latest = load_latest_version(full_path);
+  for (int version = 1; version <= latest; version++) {
+    snprintf(version_path, sizeof(version_path), "%s.v%d", full_path,
+             version);
+    snapshot_retire(version_path);
+    file_cache_invalidate(version_path);
+    if (unlink(version_path) == 0) {
+      log_debug("  Version removed: %s", version_path);
+    } else if (get_recipe_path(version_path, "", recipe) == 0 &&
+               recipe_remove(recipe) == 0) {
+      log_debug("  Version removed: %s", recipe);
+    }
+  }
+  if (get_recipe_path(full_path, CURRENT_RECIPE, recipe) == 0) {
+    recipe_remove(recipe);
+  }
+  // A file that was packed before it grew keeps its old versions there
+  pack_remove(remote_of(full_path));
+  meta_remove(remote_of(full_path));
+  remove_version_manifest(full_path);
+  if (get_compressed_path(full_path, copy_path) == 0) {
+    unlink(copy_path);
+  }
+  return 0;
+}
+
+// handle RM command from client
+// conn - client connection, remote_path and full_path already set
+step_result_t handle_rm_command(conn_t* conn) {
+  char recipe[MAX_PATH];
+  struct stat st;
+
+  // Get per-file lock
+  if (conn->lock == NULL) {
+    conn->lock = get_file_lock(conn->full_path);
+    if (conn->lock == NULL) {
+      return conn_send(conn, RFS_OP_ERROR, PHASE_DONE, "%s",
+                       "error occured!: Out of memory");
+    }
+  }
+
+  // Lock this specific file
+  if (conn->lock_held == LOCK_NONE &&
+      !acquire_file_lock(conn->lock, conn, LOCK_EXCLUSIVE)) {
+    return STEP_WAIT_LOCK;
+  }
+
+  if (stat(conn->full_path, &st) != 0) {
+    // Packed files and their versions have no inode of their own
+    int packed = pack_remove(conn->remote_path);
+    if (packed != 0) {
+      conn_unlock(conn);
+      if (packed < 0) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: Cannot remove file '%s'",
+                         conn->remote_path);
+      }
+      meta_remove(conn->remote_path);
+      log_info("  File removed: %s (packed)", conn->full_path);
+      return conn_send(conn, RFS_OP_OK, PHASE_DONE, "Success!: Removed '%s'",
+                       conn->remote_path);
+    }
+
+    // A single old version of a chunked file is just a recipe
+    if (get_version_recipe_path(conn, recipe) == 0 &&
+        recipe_remove(recipe) == 0) {
+      replicate_rm(conn->remote_path);
+      conn_unlock(conn);
+      log_debug("  Version removed: %s", recipe);
+      return conn_send(conn, RFS_OP_OK, PHASE_DONE, "Success!: Removed '%s'",
+                       conn->remote_path);
+    }
+
+    conn_unlock(conn);
+    return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                     "error occured!: Path not found '%s'", conn->remote_path);
+  }
+
+  int result;
+
+  if (S_ISDIR(st.st_mode)) {
+    // Packed files keep their directory busy too
+    if (pack_dir_count(conn->remote_path) > 0) {
+      errno = ENOTEMPTY;
+      result = -1;
+    } else {
+      result = rmdir(conn->full_path);
+    }
+    if (result != 0) {
+      conn_unlock(conn);
+      if (errno == ENOTEMPTY) {
+        return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                         "error occured!: Directory not empty '%s'",
+                         conn->remote_path);
+      }
+      return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                       "error occured!: Cannot remove directory '%s'",
+                       conn->remote_path);
+    }
+    dir_cache_invalidate();
+    meta_remove(conn->remote_path);
+    log_info("  Directory removed: %s", conn->full_path);
+  } else {
+    if (remove_file_and_versions(conn->full_path) != 0) {
+      conn_unlock(conn);
+      return conn_send(conn, RFS_OP_ERROR, PHASE_DONE,
+                       "error occured!: Cannot remove file '%s'",
+                       conn->remote_path);
+    }
+  }
+
+  replicate_rm(conn->remote_path);
+  conn_unlock(conn);
+
+  return conn_send(conn, RFS_OP_OK, PHASE_DONE, "Success!: Removed '%s'",
+                   conn->remote_path);
+}
+
+// Handle STOP command from client
+//@param conn - Client connection that sent STOP
+
+void handle_stop_command(conn_t* conn) {
+  unsigned char frame[RFS_HEADER_SIZE + 64];
+  const char* msg = "Success!: Server shutting down";
+  rfs_header_t hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.opcode = RFS_OP_OK;
+  hdr.request_id = conn->req.request_id;
+  hdr.payload_len = strlen(msg);
+  rfs_encode_header(&hdr, frame);
+  memcpy(frame + RFS_HEADER_SIZE, msg, hdr.payload_len);
+
+  send(conn->client_sock, frame, RFS_HEADER_SIZE + hdr.payload_len,
+       MSG_NOSIGNAL);
+  log_info("STOP command received. Shutting down server...");
+  meta_close();
+  log_flush();
+  close(conn->client_sock);
+  reactor_close_listeners();
+  exit(0);
+}
+
+// Check a client supplied path stays inside ROOT_DIR
+// @param path - remote path from the request
+// @return 1 if the path is acceptable, 0 otherwise
+int valid_remote_path(const char* path) {
+  const char* p = path;
+  int depth = 0;
+
+  while (*p != '\0') {
+    const char* end = strchr(p, '/');
+    size_t len = (end != NULL) ? (size_t)(end - p) : strlen(p);
+
+    if (len == 2 && p[0] == '.' && p[1] == '.') {
+      return 0;
+    }
+    // The server's own bookkeeping lives in ROOT_DIR/.rfs
+    if (depth == 0 && len == strlen(META_NAME) &&
+        strncmp(p, META_NAME, len) == 0) {
+      return 0;
+    }
+    if (len > 1 || (len == 1 && p[0] != '.')) {
+      depth++;
+    }
+    if (end == NULL) {
+      break;
+    }
+    p = end + 1;
+  }
+  return 1;
+}
+
+// Read and dispatch the next request on a connection
+// The header is read first, then the path it announces; any payload is
+// left on the socket for the handler to stream.
+// @param conn - connection waiting for its request
+
+step_result_t read_request(conn_t* conn) {
+  int r;
+
+  if (conn->in_len < RFS_HEADER_SIZE) {
+    r = recv_exact(conn, RFS_HEADER_SIZE);
+    if (r == RECV_AGAIN) {
+      return STEP_WAIT_READ;
+    }
+    if (r < 0) {
+      log_warn("Couldn't receive command");
+    }
+    if (r <= 0) {
+      return STEP_DONE;
+    }
+
+    if (rfs_decode_header((unsigned char*)conn->in, &conn->req) != 0) {
+      return conn_send(conn, RFS_OP_ERROR, PHASE_CLOSE, "%s",
+                       "error occured!: Unsupported protocol version");
+    }
+    if (conn->req.path_len >= MAX_PATH) {
+      return conn_send(conn, RFS_OP_ERROR, PHASE_CLOSE, "%s",
+                       "error occured!: Path too long");
+    }
+  }
+
+  r = recv_exact(conn, RFS_HEADER_SIZE + conn->req.path_len);
+  if (r == RECV_AGAIN) {
+    return STEP_WAIT_READ;
+  }
+  if (r < 0) {
+    log_warn("Couldn't receive command");
+  }
+  if (r <= 0) {
+    return STEP_DONE;
+  }
+
+  memcpy(conn->remote_path, conn->in + RFS_HEADER_SIZE, conn->req.path_len);
+  conn->remote_path[conn->req.path_len] = '\0';
+  conn->in_len = 0;
+  conn->request_start = metrics_now_us();
+  conn->request_failed = 0;
+
+  log_info("Received: %s %s", rfs_opcode_name(conn->req.opcode),
+           conn->remote_path);
+
+  // A truncated path would name some other file
+  if (snprintf(conn->full_path, sizeof(conn->full_path), "%s/%s", ROOT_DIR,
+               conn->remote_path) >= (int)sizeof(conn->full_path)) {
+    return conn_send(conn, RFS_OP_ERROR, PHASE_CLOSE, "%s",
+                     "error occured!: Path too long");
+  }
+  conn->file_size = conn->req.payload_len;
+  conn->transferred = 0;
+
+  // Over its request rate, the client is told when to come back
+  if (conn->req.opcode != RFS_OP_STOP && conn->req.opcode != RFS_OP_STATS &&
+      conn->req.opcode != RFS_OP_RING) {
+    uint32_t retry_ms = client_take_request(conn->client);
+    if (retry_ms > 0) {
+      return busy_request(conn, retry_ms);
+    }
+  }
+
+  switch (conn->req.opcode) {
+    // Handle WRITE command
+    case RFS_OP_WRITE:
+      conn->handler = handle_write_command;
+      break;
+    // Handle GET command
+    case RFS_OP_GET:
+      conn->handler = handle_get_command;
+      break;
+    // Handle RM command
+    case RFS_OP_RM:
+      conn->handler = handle_rm_command;
+      break;
+    // Delta uploads: signatures, then the delta itself
+    case RFS_OP_SIG:
+      conn->handler = handle_sig_command;
+      break;
+    case RFS_OP_DELTA:
+      conn->handler = handle_write_command;
+      break;
+    // Ranged and resumable transfers
+    case RFS_OP_UPLOAD:
+      conn->handler = handle_upload_command;
+      break;
+    case RFS_OP_WRITE_RANGE:
+      conn->handler = handle_write_range_command;
+      break;
+    case RFS_OP_COMMIT:
+      conn->handler = handle_commit_command;
+      break;
+    case RFS_OP_GET_RANGE:
+      conn->handler = handle_get_command;
+      break;
+    // Handle LIST command
+    case RFS_OP_LIST:
+      conn->handler = handle_list_command;
+      break;
+    // Handle STATS command
+    case RFS_OP_STATS:
+      conn->handler = handle_stats_command;
+      break;
+    // Cluster membership
+    case RFS_OP_RING:
+      conn->handler = handle_ring_command;
+      break;
+    // Handle STOP command
+    case RFS_OP_STOP:
+      log_debug("Processing STOP");
+      handle_stop_command(conn);
+      return STEP_DONE;
+    // Unknown command
+    default:
+      return fail_request(conn, "error occured!: Unknown command '%d'",
+                          conn->req.opcode);
+  }
+
+  // GET, RM, SIG, LIST and STATS carry no payload
+  if ((conn->req.opcode == RFS_OP_GET || conn->req.opcode == RFS_OP_RM ||
+       conn->req.opcode == RFS_OP_SIG || conn->req.opcode == RFS_OP_LIST ||
+       conn->req.opcode == RFS_OP_STATS) &&
+      conn->file_size != 0) {
+    return fail_request(conn, "%s", "error occured!: Unexpected payload");
+  }
+  // An empty path lists the root, STATS and RING have none
+  if (strlen(conn->remote_path) == 0 && conn->req.opcode != RFS_OP_LIST &&
+      conn->req.opcode != RFS_OP_STATS && conn->req.opcode != RFS_OP_RING) {
+    return fail_request(conn, "%s", "error occured!: Missing remote path");
+  }
+  if (!valid_remote_path(conn->remote_path)) {
+    return fail_request(conn, "error occured!: Invalid path '%s'",
+                        conn->remote_path);
+  }
+
+  // Requests for another node's files go there; LIST and RM of a
+  // directory are sent to every node, RFS_FLAG_LOCAL marks each part.
+  // A replica keeps whatever its primary sends it.
+  switch (conn->req.opcode) {
+    case RFS_OP_WRITE:
+    case RFS_OP_GET:
+    case RFS_OP_RM:
+    case RFS_OP_SIG:
+    case RFS_OP_DELTA:
+    case RFS_OP_UPLOAD:
+    case RFS_OP_WRITE_RANGE:
+    case RFS_OP_COMMIT:
+    case RFS_OP_GET_RANGE: {
+      const char* owner = cluster_owner(conn->remote_path);
+      if (owner != NULL &&
+          !(conn->req.flags & (RFS_FLAG_LOCAL | RFS_FLAG_REPLICA))) {
+        return moved_request(conn, owner);
+      }
+      break;
+    }
+  }
+
+  // Only so many transfers run at once, the rest retry later
+  switch (conn->req.opcode) {
+    case RFS_OP_WRITE:
+    case RFS_OP_DELTA:
+    case RFS_OP_GET:
+    case RFS_OP_GET_RANGE:
+    case RFS_OP_WRITE_RANGE:
+      if (!admit_transfer()) {
+        return busy_request(conn, BUSY_RETRY_MS);
+      }
+      conn->in_transfer = 1;
+      break;
+  }
+
+  log_debug("Processing %s: %s", rfs_opcode_name(conn->req.opcode),
+            conn->remote_path);
+
+  conn->phase = 0;
+  conn->state = CONN_HANDLER;
+  return STEP_CONTINUE;
+}
+
+// Run a connection's state machine until it has to wait
+// @param conn - connection owned by the calling worker
+void process_connection(conn_t* conn) {
+  step_result_t result;
+
+  conn->requests_this_step = 0;
+
+  do {
+    switch (conn->state) {
+      case CONN_READ_REQUEST:
+        result = read_request(conn);
+        break;
+      case CONN_HANDLER:
+        result = conn->handler(conn);
+        break;
+      case CONN_DISCARD:
+        result = discard_payload(conn);
+        break;
+      case CONN_SENDING: {
+        int flushed = flush_output(conn);
+        if (flushed < 0) {
+          result = STEP_DONE;
+        } else if (flushed == 0) {
+          result = STEP_WAIT_WRITE;
+        } else if (conn->phase == PHASE_CLOSE) {
+          result = STEP_DONE;
+        } else if (conn->phase == PHASE_DONE) {
+          result = finish_request(conn);
+        } else {
+          conn->state = CONN_HANDLER;
+          result = STEP_CONTINUE;
+        }
+        break;
+      }
+      default:
+        result = STEP_DONE;
+        break;
+    }
+  } while (result == STEP_CONTINUE);
+
+  // A client over its bandwidth sits out until it is back under. A parked
+  // connection may already be running on another worker, its bytes are
+  // charged by the step that ends in a wait on the socket.
+  if ((result == STEP_WAIT_READ || result == STEP_WAIT_WRITE) &&
+      conn->step_bytes > 0) {
+    uint64_t pause = client_charge_bytes(conn->client, conn->step_bytes);
+    conn->step_bytes = 0;
+    if (pause > 0) {
+      throttle_connection(conn, pause,
+                          result == STEP_WAIT_READ ? EPOLLIN : EPOLLOUT);
+      return;
+    }
+  }
+
+  // A parked connection belongs to its file lock or the group commit,
+  // don't touch it here
+  switch (result) {
+    case STEP_WAIT_READ:
+      rearm_connection(conn, EPOLLIN);
+      break;
+    case STEP_WAIT_WRITE:
+      rearm_connection(conn, EPOLLOUT);
+      break;
+    case STEP_DONE:
+      close_connection(conn);
+      break;
+    default:
+      break;
+  }
+}
+
+// Close a connection and free everything it still holds
+// @param conn - connection to close
+void close_connection(conn_t* conn) {
+  // A request cut short by the connection counts as failed
+  if (conn->request_start != 0) {
+    metrics_request(conn->req.opcode, 1,
+                    metrics_now_us() - conn->request_start);
+  }
+  metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+  if (conn->in_transfer) {
+    release_transfer();
+  }
+  release_connection(conn->client);
+  record_upload_range(conn);
+  release_snapshot(conn);
+  if (conn->fd >= 0) {
+    close(conn->fd);
+  }
+  if (conn->pipe_fds[0] >= 0) {
+    close(conn->pipe_fds[0]);
+    close(conn->pipe_fds[1]);
+  }
+  conn_unlock(conn);
+  if (conn->lock != NULL) {
+    put_file_lock(conn->lock);
+  }
+  if (conn->base_fd >= 0) {
+    close(conn->base_fd);
+  }
+  discard_temp_file(conn);
+  if (conn->recipe != NULL) {
+    recipe_free(conn->recipe);
+  }
+  free_list_walk(conn);
+  release_pool_buffer(conn);
+  free(conn->stats);
+  if (conn->cached != NULL) {
+    file_cache_release(conn->cached);
+  }
+
+  close(conn->client_sock);
+  log_debug("Client disconnected (IP: %s)",
+            inet_ntoa(conn->client_addr.sin_addr));
+  free(conn);
+}
+
+// Tell a connection the server is full and close it
+// @param client_sock - connection just accepted
+static void reject_connection(int client_sock) {
+  unsigned char frame[RFS_HEADER_SIZE + 64];
+  rfs_header_t hdr;
+
+  char* msg = (char*)frame + RFS_HEADER_SIZE + 4;
+  int len = snprintf(msg, sizeof(frame) - RFS_HEADER_SIZE - 4,
+                     "Server busy, retry after %d ms", BUSY_RETRY_MS);
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.opcode = RFS_OP_BUSY;
+  hdr.payload_len = 4 + len;
+  rfs_encode_header(&hdr, frame);
+  rfs_put_u32(frame + RFS_HEADER_SIZE, BUSY_RETRY_MS);
+
+  // A fresh socket has room for this, it either goes out or nothing does
+  send(client_sock, frame, RFS_HEADER_SIZE + hdr.payload_len,
+       MSG_NOSIGNAL | MSG_DONTWAIT);
+  metrics_add(METRIC_BUSY, 1);
+  close(client_sock);
+}
+
+// Accept every pending connection on a reactor's listener
+// @param reactor - reactor whose listener is readable
+void accept_connections(reactor_t* reactor) {
+  struct sockaddr_in client_addr;
+  socklen_t client_size;
+  struct epoll_event ev;
+
+  while (1) {
+    client_size = sizeof(client_addr);
+    int client_sock = accept(reactor->listen_fd,
+                             (struct sockaddr*)&client_addr, &client_size);
+
+    if (client_sock < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if ((errno == EMFILE || errno == ENFILE) && reactor->spare_fd >= 0) {
+        // Out of descriptors the pending connection would be reported
+        // again and again; free the spare to accept and turn it away
+        close(reactor->spare_fd);
+        client_sock = accept(reactor->listen_fd, NULL, NULL);
+        if (client_sock >= 0) {
+          reject_connection(client_sock);
+        }
+        reactor->spare_fd = open("/dev/null", O_RDONLY);
+        log_warn("Out of file descriptors, turning connections away");
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error("Can't accept connection");
+      }
+      return;
+    }
+
+    client_t* client = admit_connection(client_addr.sin_addr);
+    if (client == NULL) {
+      reject_connection(client_sock);
+      continue;
+    }
+
+    set_nonblocking(client_sock);
+
+    // Allocate connection state, it lives until the connection closes
+    conn_t* conn = calloc(1, sizeof(conn_t));
+    if (conn == NULL) {
+      log_error("Memory allocation failed");
+      release_connection(client);
+      close(client_sock);
+      continue;
+    }
+
+    conn->client_sock = client_sock;
+    conn->reactor = reactor;
+    conn->client = client;
+    conn->client_addr = client_addr;
+    conn->state = CONN_READ_REQUEST;
+    conn->fd = -1;
+    conn->base_fd = -1;
+    conn->compressed_fd = -1;
+    conn->pool_buf = -1;
+    conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    metrics_reactor_accept(reactor->id);
+
+    log_debug("Client connected at IP: %s and port: %i",
+              inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0) {
+      log_error("Failed to watch connection");
+      metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+      release_connection(client);
+      close(client_sock);
+      free(conn);
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  const char* cluster_nodes = NULL;
+  const char* replica_list = NULL;
+  int port = PORT;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "czPm:Mub:s:w:l:C:T:R:B:r:p:N:A:S:")) !=
+         -1) {
+    switch (opt) {
+      case 'c':
+        chunk_store_enabled = 1;
+        break;
+      case 'z':
+        compress_at_rest = 1;
+        break;
+      case 'P':
+        pack_enabled = 1;
+        break;
+      case 'm':
+        file_cache_budget = (size_t)atol(optarg) << 20;
+        break;
+      case 'M':
+        file_cache_map_large = 1;
+        break;
+      case 'u':
+        uring_enabled = 1;
+        break;
+      case 'b':
+        buf_pool_cap = (size_t)atol(optarg) << 20;
+        break;
+      case 's':
+        if (strcmp(optarg, "off") == 0) {
+          durability_mode = DURABILITY_OFF;
+        } else if (strcmp(optarg, "file") == 0) {
+          durability_mode = DURABILITY_FILE;
+        } else if (strcmp(optarg, "group") == 0) {
+          durability_mode = DURABILITY_GROUP;
+        } else {
+          printf("Unknown sync mode: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'w':
+        sync_window_us = atol(optarg);
+        break;
+      case 'l':
+        log_level = log_parse_level(optarg);
+        if (log_level < LOG_OFF) {
+          printf("Unknown log level: %s\n", optarg);
+          return -1;
+        }
+        break;
+      case 'C':
+        max_connections = atoi(optarg);
+        break;
+      case 'T':
+        max_transfers = atoi(optarg);
+        break;
+      case 'R':
+        client_rate = atof(optarg);
+        break;
+      case 'B':
+        client_bandwidth = atof(optarg) * (1 << 20);
+        break;
+      case 'r':
+        num_reactors = atoi(optarg);
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'N':
+        cluster_nodes = optarg;
+        break;
+      case 'A':
+        snprintf(cluster_self, sizeof(cluster_self), "%s", optarg);
+        break;
+      case 'S':
+        replica_list = optarg;
+        break;
+      default:
+        printf("Usage: %s [-c] [-z] [-P] [-m MB] [-M] [-u] [-b MB] "
+               "[-s MODE] [-w US] [-l LEVEL]\n"
+               "       [-C N] [-T N] [-R N] [-B MB] [-r N] [-p PORT] "
+               "[-N LIST] [-A ADDR]\n"
+               "       [-S LIST]\n",
+               argv[0]);
+        printf("  -c  store versions in the deduplicating chunk store\n");
+        printf("  -z  keep files compressed too, for compressed GETs\n");
+        printf("  -P  pack files up to %d KB into append-only segments\n",
+               PACK_MAX_FILE >> 10);
+        printf("  -m  MB of memory for caching small files (default %d)\n",
+               FILE_CACHE_DEFAULT_MB);
+        printf("  -M  serve big files from mappings shared by all GETs\n");
+        printf("  -u  move file data with io_uring in %d KB chunks\n",
+               URING_CHUNK >> 10);
+        printf("  -b  MB of transfer buffers for -u and -z (default %d)\n",
+               BUF_POOL_DEFAULT_MB);
+        printf("  -s  acknowledge WRITEs: off, file (fsync each) or group\n");
+        printf("  -w  microseconds a group commit waits for more (default "
+               "%d)\n",
+               SYNC_WINDOW_DEFAULT_US);
+        printf("  -l  log level: off, error, warn, info (default) or "
+               "debug\n");
+        printf("  -C  connections open at once (default from the file "
+               "limit)\n");
+        printf("  -T  GETs and WRITEs in flight at once, 0 no limit "
+               "(default %d)\n",
+               TRANSFERS_DEFAULT);
+        printf("  -R  requests per second per client address\n");
+        printf("  -B  MB per second per client address\n");
+        printf("  -r  event loops, each with its own listener and workers "
+               "(max %d)\n",
+               MAX_REACTORS);
+        printf("  -p  port to listen on (default %d)\n", PORT);
+        printf("  -N  cluster nodes, host:port,host:port,... (kept in %s)\n",
+               CLUSTER_FILE);
+        printf("  -A  this node's host:port in the list (default "
+               "127.0.0.1:PORT)\n");
+        printf("  -S  replicas to pass WRITEs and RMs on to, "
+               "host:port,...\n");
+        return -1;
+    }
+  }
+
+  if (log_init() != 0) {
+    printf("Failed to create logger thread\n");
+    return -1;
+  }
+  if (admission_init() != 0) {
+    printf("Failed to create throttle thread\n");
+    return -1;
+  }
+  if (init_file_locks() != 0) {
+    printf("Error while creating lock table\n");
+    return -1;
+  }
+  dir_cache_init();
+  file_cache_init();
+  snapshot_init();
+  if (sync_init() != 0) {
+    printf("Failed to create group commit thread\n");
+    return -1;
+  }
+
+  // A client hanging up mid-transfer must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  mkdir(ROOT_DIR, 0755);
+  if (create_directories(TMP_DIR) != 0) {
+    printf("Error while creating %s\n", TMP_DIR);
+    return -1;
+  }
+  clean_temp_dir();
+
+  // Always set up, chunked versions stay readable when -c is turned off
+  if (chunk_store_init() != 0) {
+    printf("Error while creating the chunk store\n");
+    return -1;
+  }
+
+  // Always loaded too, packed files stay readable when -P is turned off
+  if (pack_init() != 0) {
+    printf("Error while loading the pack segments\n");
+    return -1;
+  }
+
+  // Rebuilt from the tree and the packs when a crash left it dirty
+  uint64_t index_start = metrics_now_us();
+  int index_rebuilt = meta_init();
+  if (index_rebuilt < 0) {
+    printf("Error while loading the metadata index\n");
+    return -1;
+  }
+  uint64_t index_us = metrics_now_us() - index_start;
+
+  // Joined once the store is up, a saved ring starts moving files
+  if (cluster_self[0] == '\0') {
+    snprintf(cluster_self, sizeof(cluster_self), "127.0.0.1:%d", port);
+  }
+  if (cluster_init(cluster_nodes) != 0) {
+    printf("Malformed node list: %s\n", cluster_nodes);
+    return -1;
+  }
+  if (replica_list != NULL && replica_init(replica_list) != 0) {
+    printf("Malformed replica list: %s\n", replica_list);
+    return -1;
+  }
+  if (pack_enabled && (cluster_enabled() || replica_count() > 0)) {
+    printf("Packed files are not handed off or replicated, -P can't be "
+           "used in a cluster or with replicas\n");
+    return -1;
+  }
+
+  // Transfer buffers are split between the reactors, decided here
+  if (reactor_init(port, ACCEPT_BACKLOG) != 0) {
+    return -1;
+  }
+  if (buf_pool_init(num_reactors) != 0) {
+    printf("Error while reserving transfer buffers\n");
+    return -1;
+  }
+  if (uring_enabled) {
+    uring_init();
+  }
+  if (reactor_start() != 0) {
+    printf("Failed to create worker thread\n");
+    return -1;
+  }
+
+  printf("File Server running on port %d\n", port);
+  printf("Per-file locking enabled (%d lock shards)\n", LOCK_SHARDS);
+  printf("CRC32C checksums computed with %s\n", checksum_engine());
+  if (chunk_store_enabled) {
+    printf("Chunk store enabled, versions are deduplicated\n");
+  }
+  if (compress_at_rest) {
+    printf("Compressed copies enabled, compressed GETs send them as is\n");
+  }
+  printf("Metadata index of %zu entries %s in %.1f ms\n", meta_count(),
+         index_rebuilt ? "rebuilt from the tree" : "loaded", index_us / 1000.0);
+  if (pack_enabled) {
+    printf("Packing files up to %d KB (%zu packed in %d segments)\n",
+           PACK_MAX_FILE >> 10, pack_count(), pack_segment_count());
+  }
+  if (file_cache_budget > 0) {
+    printf("File cache enabled (%zu MB for files up to %d KB)\n",
+           file_cache_budget >> 20, FILE_CACHE_MAX_FILE >> 10);
+  }
+  if (file_cache_map_large) {
+    printf("Big files are served from shared mappings\n");
+  }
+  printf("Transfer buffers: %d of %d KB\n", buf_pool_count(),
+         BUF_POOL_SIZE >> 10);
+  if (durability_mode == DURABILITY_FILE) {
+    printf("WRITEs are acknowledged once fsync()ed\n");
+  } else if (durability_mode == DURABILITY_GROUP) {
+    printf("WRITEs are acknowledged once group committed (%ld us window)\n",
+           sync_window_us);
+  }
+  printf("Admission: %d connections, %d transfers at once\n",
+         max_connections, max_transfers);
+  if (client_rate > 0 || client_bandwidth > 0) {
+    printf("Per client: %.0f requests/s, %.1f MB/s (0 is no limit)\n",
+           client_rate, client_bandwidth / (1 << 20));
+  }
+  if (num_reactors > 1) {
+    printf("%d event loops on port %d (SO_REUSEPORT), %d worker threads\n",
+           num_reactors, port, reactor_worker_count());
+  } else {
+    printf("Event loop running with %d worker threads\n",
+           reactor_worker_count());
+  }
+  if (cluster_enabled()) {
+    char nodes[RING_TEXT_MAX];
+    size_t len = cluster_format(nodes, sizeof(nodes));
+    int count = 0;
+    for (size_t i = 0; i < len; i++) {
+      count += nodes[i] == '\n';
+    }
+    printf("Cluster: %d nodes, this node is %s\n", count, cluster_self);
+  }
+  if (replica_count() > 0) {
+    printf("Replicating to %d replicas\n", replica_count());
+  }
+  printf("Waiting for connections...\n");
+
+  reactor_run();
+  return 0;
+}
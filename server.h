@@ -1,42 +1,184 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <dirent.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "admission.h"
+#include "bufpool.h"
+#include "checksum.h"
+#include "chunkstore.h"
+#include "cluster.h"
+#include "compress.h"
+#include "delta.h"
+#include "dircache.h"
+#include "durability.h"
+#include "filecache.h"
+#include "lockmgr.h"
+#include "logger.h"
+#include "metaindex.h"
+#include "metrics.h"
+#include "pack.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "replica.h"
+#include "snapshot.h"
+#include "upload.h"
+#include "uring.h"
 
 #define PORT 2000
 #define BUFFER_SIZE 8196
 #define MAX_PATH 512
 #define ROOT_DIR "./server_root"
-#define MAX_FILE_LOCKS 100
+#define META_NAME ".rfs"
+#define TMP_DIR ROOT_DIR "/" META_NAME "/tmp"
+#define VERSIONS_DIR ROOT_DIR "/" META_NAME "/versions"
+#define COMPRESSED_DIR ROOT_DIR "/" META_NAME "/compressed"
+#define MAX_EVENTS 64
+#define MAX_CHUNKS_PER_STEP 16
+#define MAX_REQUESTS_PER_STEP 32
+#define SENDFILE_CHUNK (1 << 20)
+#define SPLICE_PIPE_SIZE (1 << 20)
 
-// Structure for per-file locking
-typedef struct {
-  char filepath[MAX_PATH];
-  pthread_mutex_t mutex;
-  int in_use;
-} file_lock_t;
+// Result of running one step of a connection's state machine
+typedef enum {
+  STEP_CONTINUE,    // state advanced, keep running
+  STEP_WAIT_READ,   // wait until the socket is readable
+  STEP_WAIT_WRITE,  // wait until the socket is writable
+  STEP_WAIT_LOCK,   // parked on a file lock or a group commit, resumed
+                    // by whoever finishes with it
+  STEP_DONE         // connection finished, close it
+} step_result_t;
+
+// Connection level states, handler specific progress lives in phase
+typedef enum {
+  CONN_READ_REQUEST,  // waiting for a request header and path
+  CONN_HANDLER,       // running the command handler
+  CONN_DISCARD,       // draining the payload of a failed request
+  CONN_SENDING        // flushing out buffer, then back to the handler
+} conn_state_t;
+
+// Phase values for conn_send: the request is finished once the reply is
+// out and the next one is read, or the connection is closed
+#define PHASE_DONE -1
+#define PHASE_CLOSE -2
 
-// Structure to pass client information to handler thread
+// recv_exact result when the socket has nothing to read yet
+#define RECV_AGAIN -2
+
+// One directory of a LIST walk, its entries as the index had them
+typedef struct list_dir {
+  unsigned char* entries;  // see meta_list()
+  size_t len;
+  size_t off;         // next entry to send
+  size_t prefix_len;  // its path relative to the listed directory, in path
+  struct list_dir* parent;
+} list_dir_t;
+
+// LIST in progress, the walk resumes where the last frame ended
 typedef struct {
+  list_dir_t* top;
+  char path[MAX_PATH];  // relative path of the directory being read
+  int recursive;
+  long entries;
+  int frames;  // DATA frames sent in this step
+  unsigned char pending[RFS_ENTRY_HEADER_SIZE + MAX_PATH];
+  size_t pending_len;  // entry that didn't fit in the last frame
+} list_walk_t;
+
+// Per-connection state, resumed by whichever worker picks it up
+typedef struct conn {
   int client_sock;
   struct sockaddr_in client_addr;
-} client_info_t;
+  reactor_t* reactor;  // accepted it and runs it until it closes
+  conn_state_t state;
+  int phase;
+  step_result_t (*handler)(struct conn* conn);
+
+  rfs_header_t req;
+  uint64_t request_start;  // when its header was read, 0 between requests
+  int request_failed;      // an ERROR reply went out
+  char remote_path[MAX_PATH];
+  char full_path[MAX_PATH];
+  char temp_path[MAX_PATH];  // upload in progress, renamed over full_path
+  char recipe_temp[MAX_PATH];  // chunk recipe of that upload
+
+  int base_fd;  // file a DELTA or SIG works against
+  delta_base_t delta_base;
+  uint32_t block_size;
+  uint64_t new_size;
+  unsigned char new_digest[SHA256_DIGEST_SIZE];
+  uint64_t out_size;  // bytes of the new file rebuilt so far
+  uint32_t literal_left;
+
+  recipe_t* recipe;  // chunked version being sent by GET
+  size_t recipe_index;
+  long recipe_sent;
+
+  unsigned char token[UPLOAD_TOKEN_SIZE];  // upload session of the request
+  long write_offset;  // where the received data goes in conn->fd
+  int range_active;   // WRITE_RANGE data is arriving, record it on close
+  long range_start;   // GET_RANGE bounds within the file
+  long range_end;
+
+  list_walk_t* list;  // LIST in progress
+  file_entry_t* cached;  // cached file a GET is sending
+  uint64_t cache_generation;  // of the file cache lookup that missed
+  snapshot_t* snapshot;  // version a GET is sending, conn->fd is its fd
+  char* stats;  // STATS text being sent
+  size_t stats_len;
+  size_t stats_sent;
+
+  unsigned char* zbuf;  // block of a compressed WRITE, in pool_buf
+  size_t zhave;
+  uint32_t zraw;
+  uint32_t zstored;
+  char compressed_temp[MAX_PATH];  // compressed copy of the upload
+  int compressed_fd;
+
+  char in[BUFFER_SIZE];
+  size_t in_len;
+  char out[BUFFER_SIZE];
+  size_t out_len;
+  size_t out_off;
+
+  int fd;
+  int use_sendfile;
+  int use_splice;
+  int pipe_fds[2];
+  size_t pipe_len;
+  int pool_buf;       // transfer buffer from the pool, -1 if none
+  size_t uring_off;   // where the pending bytes of an io_uring transfer start
+  size_t uring_len;   // end of them on GET, count of them on WRITE
+  int write_error;  // 1 if the file can't be written, 2 if data is corrupt,
+                    // 3 if there is no buffer for it
+  int sync_error;   // set by the group commit if the WRITE isn't durable
+  long file_size;
+  long transferred;
+  int checksum_len;   // CHECKSUM_SIZE while a checksum follows the data
+  uint32_t checksum;  // CRC32C of a WRITE so far, or the one a GET sends
 
-// Initialize file lock table
+  file_lock_t* lock;
+  int lock_held;    // LOCK_NONE, LOCK_SHARED or LOCK_EXCLUSIVE
+  int lock_wanted;  // mode asked for while queued on the lock
+  uint64_t lock_wait_start;  // when it was queued
 
-void init_file_locks(void);
+  int requests_this_step;
+  uint64_t step_bytes;  // moved on the socket in this step
 
-/**
- * Get or create a mutex lock for a specific file
- * @param filepath - Full path to the file
- * @return Pointer to mutex, or NULL if lock table is full
- */
-pthread_mutex_t* get_file_lock(const char* filepath);
+  client_t* client;  // address it connected from, for the token buckets
+  int in_transfer;   // counted by admit_transfer
+  uint64_t throttle_until;  // parked by throttle_connection until then
+  unsigned int throttle_events;
 
-// Release a file lock when file is deleted
+  struct conn* next;  // work queue or lock wait list link
+} conn_t;
 
-void release_file_lock(const char* filepath);
+// Set by the -z flag, files are also kept compressed for GET
+extern int compress_at_rest;
 
 // Create directories recursively
 
@@ -46,32 +188,243 @@ int create_directories(const char* path);
 
 void get_directory_path(const char* filepath, char* dirpath);
 
+// Map a file to the manifest recording its versions
+
+int get_manifest_path(const char* filepath, char* manifest);
+
+// Latest version number of a file, 0 if it has no versions
+
+int load_latest_version(const char* filepath);
+
+// Record the latest version number of a file
+
+int store_latest_version(const char* filepath, int version);
+
+// Drop a file's version manifest
+
+void remove_version_manifest(const char* filepath);
+
+// Does a file name end in .vN and is it a saved version of its base file
+
+int is_version_file(const char* path);
+
+// Delete a file with all of its versions, recipes and compressed copy
+
+int remove_file_and_versions(const char* full_path);
+
 // Get the next available version number for a file
 
 int get_next_version(const char* filepath);
 
-// Save current file as a versioned backup before overwriting
+// Save current file as a versioned backup before overwriting; returns the
+// version it was saved as, 0 if there was no file
 
 int save_version(const char* filepath);
 
-// Handle WRITE command from client
+// Map a file to its compressed copy under COMPRESSED_DIR
+
+int get_compressed_path(const char* filepath, char* path);
+
+// Start the compressed copy of an upload
+
+int open_compressed_copy(conn_t* conn);
+
+// Remove an upload's compressed copy, if it has one
+
+void drop_compressed_copy(conn_t* conn);
+
+// Finish an upload's compressed copy, compressing the file if needed
+
+void store_compressed_copy(conn_t* conn);
+
+// Make an upload's compressed copy the one GET sends
+
+void install_compressed_copy(conn_t* conn);
+
+// Find or build the compressed stream a compressed GET sends
+
+int open_compressed_get(conn_t* conn, const struct stat* st, long* start);
+
+// Open a fresh temp file for an upload
+
+int create_temp_file(conn_t* conn);
+
+// Remove a connection's unfinished upload, if it has one
+
+void discard_temp_file(conn_t* conn);
+
+// Chunk a finished upload into the chunk store
+
+int store_upload_chunks(conn_t* conn);
+
+// Make an upload's recipe the current recipe of its file
+
+int install_current_recipe(conn_t* conn);
+
+// Remove uploads left behind by a previous run, keeping live sessions
+
+void clean_temp_dir(void);
+
+// Receive an upload into an open file, zero-copy where the kernel allows
+
+step_result_t recv_file_data(conn_t* conn);
+
+// Receive a compressed upload and decompress it into an open file
+
+step_result_t recv_compressed_data(conn_t* conn);
+
+// Open the current file a delta will be applied to
+
+int open_delta_base(conn_t* conn);
+
+// Rebuild an upload from a DELTA payload
+
+step_result_t apply_delta(conn_t* conn);
+
+// Handle SIG command from client
+
+step_result_t handle_sig_command(conn_t* conn);
+
+// Handle WRITE (and DELTA) command from client
+
+step_result_t handle_write_command(conn_t* conn);
 
-int handle_write_command(int client_sock, const char* remote_path);
+// Handle UPLOAD command from client
 
-// Handle GET command from client
+step_result_t handle_upload_command(conn_t* conn);
 
-int handle_get_command(int client_sock, const char* remote_path);
+// Handle WRITE_RANGE command from client
+
+step_result_t handle_write_range_command(conn_t* conn);
+
+// Record the part of a WRITE_RANGE that made it into the session
+
+void record_upload_range(conn_t* conn);
+
+// Handle COMMIT command from client
+
+step_result_t handle_commit_command(conn_t* conn);
+
+// Send a cached file to the client with its DATA header
+
+step_result_t send_cached_data(conn_t* conn);
+
+// Stream an open file to the client, zero-copy where the kernel allows
+
+step_result_t send_file_data(conn_t* conn);
+
+// Find the recipe of a chunked version named by the request path
+
+int get_version_recipe_path(conn_t* conn, char recipe[]);
+
+// Handle GET (and GET_RANGE) command from client
+
+step_result_t handle_get_command(conn_t* conn);
+
+// Handle LIST command from client
+
+step_result_t handle_list_command(conn_t* conn);
+
+// Close the directories of a finished or abandoned LIST
+
+void free_list_walk(conn_t* conn);
 
 // Handle RM command from client
 
-int handle_rm_command(int client_sock, const char* remote_path);
+step_result_t handle_rm_command(conn_t* conn);
+
+// Handle STATS command from client
+
+step_result_t handle_stats_command(conn_t* conn);
+
+// Handle RING command from client
+
+step_result_t handle_ring_command(conn_t* conn);
 
 // Handle STOP command from client
 
-void handle_stop_command(int client_sock);
+void handle_stop_command(conn_t* conn);
+
+// Put a socket into non-blocking mode
+
+int set_nonblocking(int fd);
+
+// Receive until the input buffer holds want bytes
+
+int recv_exact(conn_t* conn, size_t want);
+
+// Send as much of the out buffer as the socket accepts
+
+int flush_output(conn_t* conn);
+
+// Queue a reply header, continue with next_phase once it has been sent
+
+step_result_t conn_send_header(conn_t* conn, int opcode, uint64_t payload_len,
+                               int next_phase);
+
+// Queue a reply frame with a text message, then continue like above
+
+step_result_t conn_send(conn_t* conn, int opcode, int next_phase,
+                        const char* fmt, ...);
+
+// Queue a BUSY reply asking the client to retry after retry_ms
+
+step_result_t conn_send_busy(conn_t* conn, int next_phase, uint32_t retry_ms);
+
+// Turn a request away with BUSY, after draining its payload
+
+step_result_t busy_request(conn_t* conn, uint32_t retry_ms);
+
+// Answer MOVED with the node that owns a request's path
+
+step_result_t moved_request(conn_t* conn, const char* owner);
+
+// Fail a request after draining the payload the client is still sending
+
+step_result_t fail_request(conn_t* conn, const char* fmt, ...);
+
+// Drain the rest of a failed request's payload
+
+step_result_t discard_payload(conn_t* conn);
+
+// Let go of the snapshot a GET was sending
+
+void release_snapshot(conn_t* conn);
+
+// Borrow a transfer buffer from the pool until the request is finished
+
+int take_pool_buffer(conn_t* conn);
+
+// Give the connection's transfer buffer back
+
+void release_pool_buffer(conn_t* conn);
+
+// Reset per-request state and wait for the next request on the connection
+
+step_result_t finish_request(conn_t* conn);
+
+// Drop the file lock held by a connection, if it has one
+
+void conn_unlock(conn_t* conn);
+
+// Check a client supplied path stays inside ROOT_DIR
+
+int valid_remote_path(const char* path);
+
+// Read and dispatch the next request on a connection
+
+step_result_t read_request(conn_t* conn);
+
+// Run a connection's state machine until it has to wait
+
+void process_connection(conn_t* conn);
+
+// Close a connection and free everything it still holds
+
+void close_connection(conn_t* conn);
 
-// Thread function to handle a single client connection
+// Accept every pending connection on a reactor's listener
 
-void* client_handler(void* arg);
+void accept_connections(reactor_t* reactor);
 
-#endif
\ No newline at end of file
+#endif
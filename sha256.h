@@ -0,0 +1,41 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Small SHA-256 (FIPS 180-4), used to name content addressed chunks
+ */
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE (SHA256_DIGEST_SIZE * 2 + 1)
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;  // bytes hashed so far
+  unsigned char block[64];
+  size_t block_len;
+} sha256_ctx_t;
+
+// Start a new hash
+
+void sha256_init(sha256_ctx_t* ctx);
+
+// Hash more data
+
+void sha256_update(sha256_ctx_t* ctx, const void* data, size_t len);
+
+// Finish the hash and write the 32 byte digest
+
+void sha256_final(sha256_ctx_t* ctx, unsigned char* digest);
+
+// Hash a buffer in one call
+
+void sha256(const void* data, size_t len, unsigned char* digest);
+
+// Format a digest as lowercase hex, out needs SHA256_HEX_SIZE bytes
+
+void sha256_hex(const unsigned char* digest, char* out);
+
+#endif
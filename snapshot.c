@@ -0,0 +1,154 @@
+/*
+ * snapshot.c -- Published open files for lock-free GETs
+ */
+
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lockmgr.h"
+#include "metrics.h"
+
+snapshot_shard_t snapshot_shards[SNAPSHOT_SHARDS];
+
+void snapshot_init(void) {
+  for (int i = 0; i < SNAPSHOT_SHARDS; i++) {
+    pthread_mutex_init(&snapshot_shards[i].mutex, NULL);
+  }
+}
+
+static void free_snapshot(snapshot_t* snapshot) {
+  close(snapshot->fd);
+  free(snapshot);
+}
+
+static snapshot_shard_t* shard_of(uint64_t hash) {
+  return &snapshot_shards[hash % SNAPSHOT_SHARDS];
+}
+
+// Find a published snapshot, mutex held
+// @return its slot, or -1
+static int find_slot(snapshot_shard_t* shard, uint64_t hash,
+                     const char* path) {
+  for (int i = 0; i < SNAPSHOT_SHARD_MAX; i++) {
+    snapshot_t* snapshot = shard->slots[i];
+    if (snapshot != NULL && snapshot->hash == hash &&
+        strcmp(snapshot->path, path) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Take a snapshot out of its slot and drop the table's reference, mutex
+// held
+// @return the snapshot if that was its last reference, for the caller to
+//         free once the mutex is released, else NULL
+static snapshot_t* unpublish(snapshot_shard_t* shard, int slot) {
+  snapshot_t* snapshot = shard->slots[slot];
+
+  shard->slots[slot] = NULL;
+  return --snapshot->refs == 0 ? snapshot : NULL;
+}
+
+snapshot_t* snapshot_get(const char* path) {
+  uint64_t hash = hash_path(path);
+  snapshot_shard_t* shard = shard_of(hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  int slot = find_slot(shard, hash, path);
+  if (slot >= 0) {
+    snapshot_t* snapshot = shard->slots[slot];
+    snapshot->refs++;
+    snapshot->used = ++shard->clock;
+    pthread_mutex_unlock(&shard->mutex);
+    metrics_add(METRIC_SNAPSHOT_HITS, 1);
+    return snapshot;
+  }
+  uint64_t generation = shard->generation;
+  pthread_mutex_unlock(&shard->mutex);
+  metrics_add(METRIC_SNAPSHOT_MISSES, 1);
+
+  // Open outside the mutex, a commit may rename over the path meanwhile
+  size_t len = strlen(path);
+  snapshot_t* snapshot = malloc(sizeof(snapshot_t) + len + 1);
+  if (snapshot == NULL) {
+    return NULL;
+  }
+  snapshot->fd = open(path, O_RDONLY);
+  if (snapshot->fd < 0) {
+    free(snapshot);
+    return NULL;
+  }
+  if (fstat(snapshot->fd, &snapshot->st) != 0 ||
+      !S_ISREG(snapshot->st.st_mode)) {
+    free_snapshot(snapshot);
+    return NULL;
+  }
+  snapshot->hash = hash;
+  snapshot->refs = 1;
+  memcpy(snapshot->path, path, len + 1);
+
+  // Publish it unless something in the shard was retired since the
+  // lookup, the file opened may be the version that was just replaced
+  snapshot_t* evicted = NULL;
+  pthread_mutex_lock(&shard->mutex);
+  if (shard->generation == generation &&
+      find_slot(shard, hash, path) < 0) {
+    int free_slot = 0;
+    for (int i = 0; i < SNAPSHOT_SHARD_MAX; i++) {
+      if (shard->slots[i] == NULL) {
+        free_slot = i;
+        break;
+      }
+      if (shard->slots[i]->used < shard->slots[free_slot]->used) {
+        free_slot = i;
+      }
+    }
+    if (shard->slots[free_slot] != NULL) {
+      evicted = unpublish(shard, free_slot);
+    }
+    snapshot->refs++;
+    snapshot->used = ++shard->clock;
+    shard->slots[free_slot] = snapshot;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (evicted != NULL) {
+    free_snapshot(evicted);
+  }
+  return snapshot;
+}
+
+void snapshot_put(snapshot_t* snapshot) {
+  snapshot_shard_t* shard = shard_of(snapshot->hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  int unused = --snapshot->refs == 0;
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (unused) {
+    free_snapshot(snapshot);
+  }
+}
+
+void snapshot_retire(const char* path) {
+  uint64_t hash = hash_path(path);
+  snapshot_shard_t* shard = shard_of(hash);
+  snapshot_t* retired = NULL;
+
+  pthread_mutex_lock(&shard->mutex);
+  shard->generation++;
+  int slot = find_slot(shard, hash, path);
+  if (slot >= 0) {
+    retired = unpublish(shard, slot);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (retired != NULL) {
+    free_snapshot(retired);
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Open snapshots of committed files, so GET needs no file lock
+ *
+ * Commits rename a new file over the old one and nothing is ever changed
+ * in place, so a file opened once stays the same version for as long as
+ * it is open. A snapshot is such an open file plus its stat, refcounted
+ * and published in a table by path. A GET pins the current snapshot and
+ * streams it without any lock while WRITEs carry on; a commit or RM
+ * retires the snapshot under the file's exclusive lock, and the file is
+ * closed once the last GET still sending it lets go.
+ *
+ * The table only holds a few open files per shard and evicts the least
+ * recently used one when full. A GET that opened the file itself but
+ * raced a retire in its shard (the shard generation changed) keeps its
+ * snapshot to itself instead of publishing a possibly stale version.
+ */
+
+#define SNAPSHOT_SHARDS 16
+#define SNAPSHOT_SHARD_MAX 16
+
+// One version of a file, kept open by its references
+typedef struct snapshot {
+  uint64_t hash;
+  int refs;  // one for the table while published, one per GET sending it
+  int fd;
+  struct stat st;
+  uint64_t used;  // shard clock at the last lookup
+  char path[];
+} snapshot_t;
+
+// One shard of the table, a handful of slots and their mutex
+typedef struct {
+  pthread_mutex_t mutex;
+  snapshot_t* slots[SNAPSHOT_SHARD_MAX];
+  uint64_t generation;  // changes whenever a snapshot is retired
+  uint64_t clock;
+} snapshot_shard_t;
+
+// Initialize the snapshot table
+
+void snapshot_init(void);
+
+/**
+ * Pin the current version of a regular file, opening it on a miss
+ * @param path - full file path
+ * @return the snapshot with a reference for the caller, or NULL if the
+ *         path can't be opened or isn't a regular file
+ */
+snapshot_t* snapshot_get(const char* path);
+
+// Drop a reference from snapshot_get
+
+void snapshot_put(snapshot_t* snapshot);
+
+// Unpublish a file that is being replaced or removed, its lock held
+
+void snapshot_retire(const char* path);
+
+#endif
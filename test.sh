@@ -120,7 +120,7 @@ echo "Q3: RM Command Tests"
 echo "TEST 9: RM deletes file and all versions"
 ./rfs RM folder/test.txt
 
-if [ ! -f "server_root/folder/test.txt" ] && [ ! -f "server_root/folder/test.txt.v1" ] && [ ! -f "server_root/folder/test.txt.v2" ]; then
+if [ ! -f "server_root/folder/test.txt" ] && [ ! -f "server_root/folder/test.txt.v1" ] && [ ! -f "server_root/folder/test.txt.v2" ] && [ ! -f "server_root/.rfs/versions/folder/test.txt" ]; then
     echo "PASS: File and all versions deleted"
 else
     echo "FAIL: Some files still exist"
@@ -175,6 +175,707 @@ else
 fi
 echo ""
 
+# Q6: TRANSFER and SESSION Tests
+echo "Q6: TRANSFER and SESSION Tests"
+./server > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 13: Interrupted WRITE keeps the old file"
+echo "Keep me" > cut.txt
+./rfs WRITE cut.txt folder/cut.txt > /dev/null
+# WRITE header for folder/cut.txt announcing 1000000 bytes, then hang up
+exec 3<>/dev/tcp/127.0.0.1/2000
+printf 'RFS1\x01\x01\x00\x00\x00\x00\x00\x0efolder/cut.txt' >&3
+printf '\x00\x00\x00\x01\x00\x00\x00\x00\x00\x0f\x42\x40short' >&3
+exec 3>&-
+sleep 1
+CONTENT=$(cat server_root/folder/cut.txt)
+LEFT=$(ls server_root/.rfs/tmp | wc -l)
+if [ "$CONTENT" = "Keep me" ] && [ "$LEFT" -eq 0 ]; then
+    echo "PASS: Old file intact and no temp file left"
+else
+    echo "FAIL: Interrupted upload damaged the file (got: $CONTENT, temp files: $LEFT)"
+fi
+rm -f cut.txt
+echo ""
+
+echo "TEST 14: Delta WRITE sends only the changed blocks"
+head -c 1000000 /dev/urandom > delta.bin
+./rfs WRITE delta.bin folder/delta.bin > /dev/null
+printf 'a small edit' | dd of=delta.bin bs=1 seek=500000 conv=notrunc 2> /dev/null
+OUTPUT=$(./rfs -d WRITE delta.bin folder/delta.bin)
+LITERAL=$(echo "$OUTPUT" | sed -n 's/^Delta: .* (\([0-9]*\) literal).*/\1/p')
+if cmp -s delta.bin server_root/folder/delta.bin && [ -n "$LITERAL" ] && [ "$LITERAL" -lt 10000 ]; then
+    echo "PASS: Delta upload rebuilt the file from $LITERAL literal bytes"
+else
+    echo "FAIL: Delta upload did not work (literal: $LITERAL)"
+fi
+rm -f delta.bin
+echo ""
+
+echo "TEST 15: Resumable WRITE through an upload session"
+head -c 300000 /dev/urandom > resume.bin
+./rfs -R WRITE resume.bin folder/resume.bin > /dev/null
+LEFT=$(ls server_root/.rfs/tmp | wc -l)
+if cmp -s resume.bin server_root/folder/resume.bin && [ "$LEFT" -eq 0 ]; then
+    echo "PASS: Upload session committed and cleaned up"
+else
+    echo "FAIL: Resumable upload did not commit (session files left: $LEFT)"
+fi
+echo ""
+
+echo "TEST 16: Parallel WRITE and GET over 4 streams"
+head -c 20000000 /dev/urandom > parallel.bin
+./rfs -j 4 WRITE parallel.bin folder/parallel.bin > /dev/null
+./rfs -j 4 GET folder/parallel.bin parallel_copy.bin > /dev/null
+if cmp -s parallel.bin server_root/folder/parallel.bin && cmp -s parallel.bin parallel_copy.bin; then
+    echo "PASS: File assembled from parallel ranges both ways"
+else
+    echo "FAIL: Parallel transfer returned wrong data"
+fi
+rm -f parallel.bin parallel_copy.bin
+echo ""
+
+echo "TEST 17: Ranged GET and resumed GET"
+./rfs -o 1000 -l 500 GET folder/resume.bin part.bin > /dev/null
+head -c 100000 resume.bin > resumed.bin
+./rfs -R GET folder/resume.bin resumed.bin > /dev/null
+if tail -c +1001 resume.bin | head -c 500 | cmp -s - part.bin && cmp -s resume.bin resumed.bin; then
+    echo "PASS: Range fetched and partial download completed"
+else
+    echo "FAIL: Ranged or resumed GET returned wrong data"
+fi
+rm -f resume.bin part.bin resumed.bin
+echo ""
+
+echo "TEST 18: Cached GETs see every new WRITE"
+echo "setting=1" > hot.conf
+./rfs WRITE hot.conf hot/app.conf > /dev/null
+for i in 1 2 3 4 5; do
+    echo "GET hot/app.conf hot_$i.conf"
+done > hot_batch.txt
+./rfs BATCH hot_batch.txt > /dev/null
+echo "setting=2 changed" > hot.conf
+./rfs WRITE hot.conf hot/app.conf > /dev/null
+./rfs GET hot/app.conf hot_new.conf > /dev/null
+./rfs RM hot/app.conf > /dev/null
+if cat hot_1.conf hot_2.conf hot_3.conf hot_4.conf hot_5.conf | uniq | grep -qx "setting=1" \
+    && cmp -s hot.conf hot_new.conf \
+    && ! ./rfs GET hot/app.conf hot_gone.conf > /dev/null; then
+    echo "PASS: Repeated GETs served, WRITE and RM reached the cache"
+else
+    echo "FAIL: Cached GET returned stale data"
+fi
+rm -f hot.conf hot_*.conf hot_batch.txt
+echo ""
+
+echo "TEST 19: Version manifest records the latest version"
+for i in 1 2 3 4; do
+    echo "Manifest $i" > manifest.txt
+    ./rfs WRITE manifest.txt folder/manifest.txt > /dev/null
+done
+LATEST=$(cat server_root/.rfs/versions/folder/manifest.txt 2>/dev/null)
+if [ "$LATEST" = "3" ]; then
+    echo "PASS: Manifest points at version 3"
+else
+    echo "FAIL: Manifest has wrong latest version (got: $LATEST)"
+fi
+rm -f manifest.txt
+echo ""
+
+echo "TEST 20: Simultaneous GETs of the same file"
+head -c 2000000 /dev/urandom > shared.bin
+./rfs WRITE shared.bin folder/shared.bin
+PIDS=""
+for i in 1 2 3 4; do
+    ./rfs GET folder/shared.bin shared$i.bin &
+    PIDS="$PIDS $!"
+done
+wait $PIDS
+OK=1
+for i in 1 2 3 4; do
+    cmp -s shared.bin shared$i.bin || OK=0
+done
+if [ $OK -eq 1 ]; then
+    echo "PASS: All readers got the file"
+else
+    echo "FAIL: Concurrent reads returned wrong data"
+fi
+rm -f shared.bin shared1.bin shared2.bin shared3.bin shared4.bin
+echo ""
+
+echo "TEST 21: BATCH pipelines several commands over one connection"
+echo "Batch 1" > batch1.txt
+echo "Batch 2" > batch2.txt
+cat > batch.txt <<EOF
+WRITE batch1.txt batch/one.txt
+WRITE batch2.txt batch/two.txt
+GET batch/one.txt batch_copy.txt
+RM batch/two.txt
+EOF
+./rfs BATCH batch.txt > /dev/null
+CONTENT=$(cat batch_copy.txt 2>/dev/null)
+if [ -f "server_root/batch/one.txt" ] && [ ! -f "server_root/batch/two.txt" ] && [ "$CONTENT" = "Batch 1" ]; then
+    echo "PASS: Batch commands ran in order on one connection"
+else
+    echo "FAIL: Batch session did not complete"
+fi
+rm -f batch1.txt batch2.txt batch.txt batch_copy.txt
+echo ""
+
+echo "TEST 22: More files than the old lock table could hold"
+echo "Many files" > many.txt
+for i in $(seq 1 150); do
+    echo "WRITE many.txt many/file$i.txt"
+done > batch.txt
+./rfs BATCH batch.txt > /dev/null
+COUNT=$(ls server_root/many 2>/dev/null | wc -l)
+if [ "$COUNT" -eq 150 ]; then
+    echo "PASS: All 150 files written"
+else
+    echo "FAIL: Only $COUNT of 150 files written"
+fi
+rm -f many.txt batch.txt
+echo ""
+
+echo "TEST 23: WRITE -r, LIST and GET -r move a directory tree"
+mkdir -p tree/a/b tree/c
+for i in $(seq 1 20); do echo "File $i" > tree/a/b/file$i.txt; done
+echo "Top" > tree/top.txt
+echo "C" > tree/c/c.txt
+./rfs -r WRITE tree remote_tree > /dev/null
+ENTRIES=$(./rfs -r LIST remote_tree | grep -c '^f ')
+./rfs -r GET remote_tree tree_copy > /dev/null
+if [ "$ENTRIES" -eq 22 ] && diff -r tree tree_copy > /dev/null; then
+    echo "PASS: Tree uploaded, listed and downloaded over one connection each"
+else
+    echo "FAIL: Recursive transfer lost files (listed: $ENTRIES)"
+fi
+rm -rf tree tree_copy
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q7: CHUNK STORE Tests
+echo "Q7: CHUNK STORE Tests"
+./server -c > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 24: Chunked versions share unchanged chunks"
+head -c 3000000 /dev/urandom > dedup.bin
+./rfs WRITE dedup.bin dedup/data.bin > /dev/null
+BEFORE=$(find server_root/.rfs/chunks -type f | wc -l)
+printf 'changed' | dd of=dedup.bin bs=1 seek=1500000 conv=notrunc 2> /dev/null
+./rfs WRITE dedup.bin dedup/data.bin > /dev/null
+AFTER=$(find server_root/.rfs/chunks -type f | wc -l)
+./rfs WRITE dedup.bin dedup/data.bin > /dev/null
+./rfs GET dedup/data.bin.v2 dedup_v2.bin > /dev/null
+if cmp -s dedup.bin dedup_v2.bin && [ $((AFTER - BEFORE)) -le 3 ]; then
+    echo "PASS: New version stored $((AFTER - BEFORE)) new chunks"
+else
+    echo "FAIL: Chunk store did not dedup ($BEFORE -> $AFTER chunks)"
+fi
+rm -f dedup.bin dedup_v2.bin
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q8: COMPRESSION Tests
+echo "Q8: COMPRESSION Tests"
+./server -z > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 25: Compressed WRITE and GET of a log file"
+for i in $(seq 1 20000); do
+    echo "2026-01-01 00:00:00 INFO request $i served status=200"
+done > zlog.txt
+WRITE_OUT=$(./rfs -z WRITE zlog.txt zlog/app.log)
+GET_OUT=$(./rfs -z GET zlog/app.log zlog_back.txt)
+STORED=$(stat -c %s server_root/.rfs/compressed/zlog/app.log 2>/dev/null)
+if cmp -s zlog.txt zlog_back.txt && echo "$WRITE_OUT" | grep -q "Compressed:" \
+    && echo "$GET_OUT" | grep -q "Decompressed:" \
+    && [ -n "$STORED" ] && [ "$STORED" -lt $(($(stat -c %s zlog.txt) / 4)) ]; then
+    echo "PASS: Log file sent compressed, stored copy is $STORED bytes"
+else
+    echo "FAIL: Compressed transfer did not round trip"
+fi
+rm -f zlog.txt zlog_back.txt
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q9: SHARED MAPPING Tests
+echo "Q9: SHARED MAPPING Tests"
+./server -M > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 26: Concurrent GETs share one mapping that WRITE retires"
+head -c 3000000 /dev/urandom > mapped1.bin
+head -c 2500000 /dev/urandom > mapped2.bin
+./rfs WRITE mapped1.bin map/big.bin > /dev/null
+./rfs GET map/big.bin map_a.bin > /dev/null &
+PID1=$!
+./rfs GET map/big.bin map_b.bin > /dev/null &
+PID2=$!
+wait $PID1 $PID2
+./rfs WRITE mapped2.bin map/big.bin > /dev/null
+./rfs GET map/big.bin map_c.bin > /dev/null
+if cmp -s mapped1.bin map_a.bin && cmp -s mapped1.bin map_b.bin \
+    && cmp -s mapped2.bin map_c.bin; then
+    echo "PASS: Readers got the old mapping, the new version replaced it"
+else
+    echo "FAIL: Mapped GET returned wrong data"
+fi
+rm -f mapped1.bin mapped2.bin map_a.bin map_b.bin map_c.bin
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q10: IO_URING Tests
+echo "Q10: IO_URING Tests"
+# Two transfer buffers, so parallel streams also take the sendfile path
+./server -u -b 1 > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 27: WRITE and GET through io_uring"
+head -c 6000000 /dev/urandom > uring.bin
+./rfs WRITE uring.bin ring/uring.bin > /dev/null
+./rfs -j 4 WRITE uring.bin ring/parallel.bin > /dev/null
+./rfs GET ring/parallel.bin uring_copy.bin > /dev/null
+./rfs -o 300000 -l 700000 GET ring/uring.bin uring_part.bin > /dev/null
+if cmp -s uring.bin server_root/ring/uring.bin && cmp -s uring.bin uring_copy.bin \
+    && tail -c +300001 uring.bin | head -c 700000 | cmp -s - uring_part.bin; then
+    echo "PASS: Whole, parallel and ranged transfers match, buffers or not"
+else
+    echo "FAIL: io_uring transfer returned wrong data"
+fi
+rm -f uring.bin uring_copy.bin uring_part.bin
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q11: DURABILITY Tests
+echo "Q11: DURABILITY Tests"
+./server -s group > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 28: Concurrent WRITEs acknowledged after a group commit"
+PIDS=""
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    echo "durable $i" > durable$i.txt
+    ./rfs WRITE durable$i.txt sync/durable$i.txt > durable$i.out &
+    PIDS="$PIDS $!"
+done
+wait $PIDS
+OK=0
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    if grep -q "Success" durable$i.out && cmp -s durable$i.txt server_root/sync/durable$i.txt; then
+        OK=$((OK + 1))
+    fi
+done
+if [ "$OK" -eq 10 ]; then
+    echo "PASS: All 10 WRITEs were synced and acknowledged"
+else
+    echo "FAIL: Only $OK of 10 grouped WRITEs succeeded"
+fi
+rm -f durable*.txt durable*.out
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q12: SNAPSHOT Tests
+echo "Q12: SNAPSHOT Tests"
+./server > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 29: GETs during a WRITE see either the old or the new file"
+head -c 4000000 /dev/urandom > snap_old.bin
+head -c 4000000 /dev/urandom > snap_new.bin
+./rfs WRITE snap_old.bin snap.bin > /dev/null
+PIDS=""
+for i in 1 2 3 4 5 6 7 8; do
+    ./rfs GET snap.bin snap_get$i.bin > /dev/null &
+    PIDS="$PIDS $!"
+    if [ "$i" -eq 4 ]; then
+        ./rfs WRITE snap_new.bin snap.bin > snap_write.out &
+        PIDS="$PIDS $!"
+    fi
+done
+wait $PIDS
+OK=0
+for i in 1 2 3 4 5 6 7 8; do
+    if cmp -s snap_get$i.bin snap_old.bin || cmp -s snap_get$i.bin snap_new.bin; then
+        OK=$((OK + 1))
+    fi
+done
+./rfs GET snap.bin snap_final.bin > /dev/null
+if [ "$OK" -eq 8 ] && grep -q "Success" snap_write.out && cmp -s snap_final.bin snap_new.bin; then
+    echo "PASS: Every GET got one whole version, the next GET the new one"
+else
+    echo "FAIL: $OK of 8 GETs got a whole version, or the WRITE was lost"
+fi
+rm -f snap_*.bin snap_write.out
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q13: BENCHMARK and STATS Tests
+echo "Q13: BENCHMARK and STATS Tests"
+./server > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 30: rfs-bench runs a GET/WRITE mix and reports latencies"
+if ./rfs-bench -n 200 -c 4 -k 10 -s 1k,100k -r 70 -a 0.99 > bench.out &&
+   grep -q "^GET .* 0$" bench.out && grep -q "^WRITE .* 0$" bench.out &&
+   grep -q "200 operations" bench.out; then
+    echo "PASS: 200 operations ran without errors"
+else
+    echo "FAIL: Benchmark failed"
+    cat bench.out
+fi
+rm -f bench.out
+echo ""
+
+echo "TEST 31: STATS reports request counts and latency histograms"
+./rfs STATS > stats.out
+if grep -q '^rfs_requests_total{op="GET"} [1-9]' stats.out &&
+   grep -q '^rfs_request_duration_microseconds_count{op="WRITE"} [1-9]' stats.out &&
+   grep -q '^rfs_connections_active [1-9]' stats.out; then
+    echo "PASS: Metrics cover the benchmark's requests"
+else
+    echo "FAIL: STATS output is missing metrics"
+    cat stats.out
+fi
+rm -f stats.out
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q14: Admission Control Tests
+echo "Q14: Admission Control Tests"
+./server -T 1 > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 32: Transfers over the limit are told BUSY and retried"
+head -c 4194304 /dev/urandom > adm_big.bin
+./rfs WRITE adm_big.bin adm_big.bin > /dev/null
+PIDS=""
+for i in 1 2 3 4 5 6; do
+    ./rfs GET adm_big.bin adm_get$i.bin > /dev/null &
+    PIDS="$PIDS $!"
+done
+wait $PIDS
+OK=0
+for i in 1 2 3 4 5 6; do
+    if cmp -s adm_get$i.bin adm_big.bin; then
+        OK=$((OK + 1))
+    fi
+done
+if [ "$OK" -eq 6 ] && ./rfs STATS | grep -q '^rfs_busy_total [1-9]'; then
+    echo "PASS: All 6 GETs finished one at a time after backing off"
+else
+    echo "FAIL: $OK of 6 GETs finished, or none was turned away"
+fi
+rm -f adm_*.bin
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q15: Reactor Tests
+echo "Q15: Reactor Tests"
+./server -r 4 > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 33: Four event loops share the port and split the connections"
+./rfs-bench -n 400 -c 16 -k 20 -s 1k,200k -r 70 > bench.out
+LOOPS=$(./rfs STATS | grep -c '^rfs_reactor_connections_total{reactor="[0-3]"} [1-9]')
+if grep -q "^GET .* 0$" bench.out && grep -q "^WRITE .* 0$" bench.out &&
+   [ "$LOOPS" -ge 2 ]; then
+    echo "PASS: Connections went to $LOOPS event loops without errors"
+else
+    echo "FAIL: Benchmark failed or only $LOOPS event loop accepted"
+    cat bench.out
+fi
+rm -f bench.out
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q16: Cluster Tests
+echo "Q16: Cluster Tests"
+NODES=127.0.0.1:2001,127.0.0.1:2002
+rm -rf node1 node2 node3 cluster_src cluster_out
+rm -f ~/.rfs-ring-127.0.0.1-2001
+mkdir -p node1 node2 node3 cluster_src
+(cd node1 && ../server -p 2001 -N $NODES > /dev/null) &
+(cd node2 && ../server -p 2002 -N $NODES > /dev/null) &
+(cd node3 && ../server -p 2003 > /dev/null) &
+sleep 1
+
+count_files() {
+    ls "$1/server_root/shard" 2>/dev/null | wc -l
+}
+
+echo "TEST 34: Files are spread over the nodes and follow a new node"
+for i in $(seq 1 30); do
+    echo "cluster file $i" > cluster_src/f$i.txt
+done
+./rfs -p 2001 -r WRITE cluster_src shard > /dev/null
+BEFORE="$(count_files node1) $(count_files node2)"
+./rfs -p 2001 RING $NODES,127.0.0.1:2003 > /dev/null
+sleep 4
+AFTER="$(count_files node1) $(count_files node2) $(count_files node3)"
+./rfs -p 2001 -r GET shard cluster_out > /dev/null
+set -- $BEFORE $AFTER
+if [ "$1" -gt 0 ] && [ "$2" -gt 0 ] && [ $(($1 + $2)) -eq 30 ] &&
+   [ "$5" -gt 0 ] && [ $(($3 + $4 + $5)) -eq 30 ] &&
+   diff -r cluster_src cluster_out > /dev/null; then
+    echo "PASS: Split $1/$2 over two nodes, $3/$4/$5 over three"
+else
+    echo "FAIL: Files on the nodes were $BEFORE, then $AFTER"
+fi
+rm -rf cluster_src cluster_out
+echo ""
+
+for port in 2001 2002 2003; do
+    ./rfs -p $port STOP > /dev/null
+done
+sleep 1
+rm -rf node1 node2 node3
+rm -f ~/.rfs-ring-127.0.0.1-2001
+
+# Q17: Replication Tests
+echo "Q17: Replication Tests"
+rm -rf primary replica
+mkdir -p primary replica
+(cd replica && ../server -p 2002 > /dev/null) &
+sleep 1
+(cd primary && ../server -p 2001 -S 127.0.0.1:2002 > /dev/null) &
+sleep 1
+
+echo "TEST 35: WRITEs, versions and RMs reach the replica"
+echo "first copy" > repl1.txt
+echo "second copy" > repl2.txt
+./rfs -p 2001 WRITE repl1.txt repl.txt > /dev/null
+./rfs -p 2001 WRITE repl2.txt repl.txt > /dev/null
+./rfs -p 2001 WRITE repl1.txt gone.txt > /dev/null
+./rfs -p 2001 RM gone.txt > /dev/null
+sleep 1
+./rfs -p 2002 GET repl.txt repl_out.txt > /dev/null
+./rfs -p 2002 GET repl.txt.v1 repl_v1.txt > /dev/null
+./rfs -S 127.0.0.1:2002 -p 2001 GET repl.txt repl_any.txt > /dev/null
+if cmp -s repl2.txt repl_out.txt && cmp -s repl1.txt repl_v1.txt &&
+   cmp -s repl2.txt repl_any.txt &&
+   [ ! -e replica/server_root/gone.txt ]; then
+    echo "PASS: Replica has the file, its version, and not the removed one"
+else
+    echo "FAIL: Replica is out of step with the primary"
+fi
+rm -f repl1.txt repl2.txt repl_out.txt repl_v1.txt repl_any.txt
+echo ""
+
+for port in 2001 2002; do
+    ./rfs -p $port STOP > /dev/null
+done
+sleep 1
+rm -rf primary replica
+
+# Q18: Checksum Tests
+echo "Q18: Checksum Tests"
+./server > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 36: Checksummed WRITE and GET, a file corrupted on disk is caught"
+head -c 2000000 /dev/urandom > sum.bin
+./rfs -c WRITE sum.bin sums/sum.bin > /dev/null
+./rfs -c GET sums/sum.bin sum_copy.bin > /dev/null
+GOOD=$?
+printf 'X' | dd of=server_root/sums/sum.bin bs=1 seek=1000 conv=notrunc \
+    2> /dev/null
+if [ $GOOD -eq 0 ] && cmp -s sum.bin sum_copy.bin &&
+   ! ./rfs -c GET sums/sum.bin sum_bad.bin > /dev/null &&
+   [ ! -e sum_bad.bin ]; then
+    echo "PASS: Intact file checked out, corrupted one was refused"
+else
+    echo "FAIL: Checksums didn't catch the corruption"
+fi
+rm -f sum.bin sum_copy.bin sum_bad.bin
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q19: Pack Tests
+echo "Q19: Pack Tests"
+./server -P > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 37: Small files are packed, versioned, compacted and reloaded"
+mkdir -p packsrc
+for i in $(seq 1 40); do
+    echo "small file $i" > packsrc/p$i.txt
+done
+./rfs -r WRITE packsrc packs > /dev/null
+echo "rewritten" > pack_new.txt
+./rfs WRITE pack_new.txt packs/p1.txt > /dev/null
+./rfs GET packs/p1.txt pack_out.txt > /dev/null
+./rfs GET packs/p1.txt.v1 pack_v1.txt > /dev/null
+LISTED=$(./rfs LIST packs | grep -c "p[0-9]*\.txt")
+PLAIN=$(find server_root/packs -type f | wc -l)
+for i in $(seq 5 40); do
+    ./rfs RM packs/p$i.txt > /dev/null
+done
+sleep 1
+COMPACTED=$(./rfs STATS | grep -c "^rfs_pack_compactions_total [1-9]")
+./rfs STOP > /dev/null
+sleep 1
+./server -P > /dev/null &
+SERVER_PID=$!
+sleep 1
+./rfs GET packs/p3.txt pack_p3.txt > /dev/null
+if cmp -s pack_new.txt pack_out.txt && cmp -s packsrc/p1.txt pack_v1.txt &&
+   [ "$LISTED" -eq 41 ] && [ "$PLAIN" -eq 0 ] && [ "$COMPACTED" -eq 1 ] &&
+   cmp -s packsrc/p3.txt pack_p3.txt &&
+   ! ./rfs GET packs/p9.txt pack_p9.txt > /dev/null 2>&1; then
+    echo "PASS: Packed files survived compaction and a restart"
+else
+    echo "FAIL: Packed files went missing or came back"
+fi
+rm -rf packsrc pack_new.txt pack_out.txt pack_v1.txt pack_p3.txt pack_p9.txt
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q20: Metadata Index Tests
+echo "Q20: Metadata Index Tests"
+./server > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 38: The metadata index is rebuilt after a crash and kept by a STOP"
+mkdir -p indexsrc/sub
+for i in 1 2 3; do
+    echo "indexed $i" > indexsrc/i$i.txt
+    echo "nested $i" > indexsrc/sub/n$i.txt
+done
+./rfs -r WRITE indexsrc indexed > /dev/null
+./rfs WRITE indexsrc/i2.txt indexed/i1.txt > /dev/null
+./rfs RM indexed/sub/n2.txt > /dev/null
+./rfs -r LIST indexed | grep '^[fvd] ' | sort > index_before.txt
+# A crash, the index is left dirty
+disown $SERVER_PID
+kill -9 $SERVER_PID
+sleep 1
+./server > index2.log &
+SERVER_PID=$!
+sleep 1
+./rfs -r LIST indexed | grep '^[fvd] ' | sort > index_rebuilt.txt
+./rfs STOP > /dev/null
+sleep 1
+./server > index3.log &
+SERVER_PID=$!
+sleep 1
+./rfs -r LIST indexed | grep '^[fvd] ' | sort > index_clean.txt
+./rfs STOP > /dev/null
+sleep 1
+if [ "$(wc -l < index_before.txt)" -eq 7 ] &&
+   grep -q "^v .* i1.txt.v1$" index_before.txt &&
+   ! grep -q "n2.txt" index_before.txt &&
+   cmp -s index_before.txt index_clean.txt &&
+   cmp -s index_before.txt index_rebuilt.txt &&
+   grep -q "rebuilt from the tree" index2.log &&
+   grep -q "entries loaded" index3.log; then
+    echo "PASS: Same listing from the loaded and the rebuilt index"
+else
+    echo "FAIL: The index lost or invented entries"
+fi
+rm -rf indexsrc index_before.txt index_clean.txt index_rebuilt.txt
+rm -f index2.log index3.log
+echo ""
+
+# Q21: Packed Name Tests
+echo "Q21: Packed Name Tests"
+./server -P > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 39: A packed file and a directory can't share a name"
+echo "packed name" > name.txt
+./rfs WRITE name.txt names/x > /dev/null
+./rfs WRITE name.txt names/d/e > /dev/null
+if ! ./rfs WRITE name.txt names/x/y > /dev/null 2>&1 &&
+   ! ./rfs WRITE name.txt names/x/ > /dev/null 2>&1 &&
+   ! ./rfs WRITE name.txt names/d > /dev/null 2>&1 &&
+   ! ./rfs WRITE name.txt names/d/ > /dev/null 2>&1 &&
+   [ "$(./rfs LIST names | grep -c '^[fd] ')" -eq 2 ] &&
+   ./rfs RM names/x > /dev/null &&
+   ./rfs GET names/d/e name_out.txt > /dev/null && cmp -s name.txt name_out.txt
+then
+    echo "PASS: WRITEs through or over the other kind were refused"
+else
+    echo "FAIL: A packed file and a directory got the same name"
+fi
+rm -f name.txt name_out.txt
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
+# Q22: Chunked Version Listing Tests
+echo "Q22: Chunked Version Listing Tests"
+./server -c > /dev/null &
+SERVER_PID=$!
+sleep 1
+
+echo "TEST 40: Versions kept only as recipes are listed, after a crash too"
+for i in 1 2 3; do
+    head -c $((100000 * i)) /dev/urandom > chunked_v.bin
+    ./rfs WRITE chunked_v.bin chunklist/f.bin > /dev/null
+done
+./rfs LIST chunklist | grep '^[fv] ' | sort > chunklist_before.txt
+disown $SERVER_PID
+kill -9 $SERVER_PID
+sleep 1
+./server -c > /dev/null &
+SERVER_PID=$!
+sleep 1
+./rfs LIST chunklist | grep '^[fv] ' | sort > chunklist_rebuilt.txt
+if grep -q "^v *100000 .* f.bin.v1$" chunklist_before.txt &&
+   grep -q "^v *200000 .* f.bin.v2$" chunklist_before.txt &&
+   cmp -s chunklist_before.txt chunklist_rebuilt.txt; then
+    echo "PASS: Chunked versions were listed and rebuilt"
+else
+    echo "FAIL: Chunked versions were missing from LIST"
+fi
+rm -f chunked_v.bin chunklist_before.txt chunklist_rebuilt.txt
+echo ""
+
+./rfs STOP > /dev/null
+sleep 1
+
 echo "Cleanup"
 rm -f test.txt test2.txt downloaded.txt
 echo "Test files cleaned up"
@@ -0,0 +1,208 @@
+/*
+ * upload.c -- Upload sessions for resumable and parallel WRITEs
+ */
+
+#define _GNU_SOURCE
+
+#include "upload.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+
+void upload_paths(const unsigned char* token, char* data_path,
+                  char* map_path) {
+  char hex[UPLOAD_TOKEN_SIZE * 2 + 1];
+
+  for (int i = 0; i < UPLOAD_TOKEN_SIZE; i++) {
+    snprintf(hex + i * 2, 3, "%02x", token[i]);
+  }
+  snprintf(data_path, MAX_PATH, "%s/%s%s", TMP_DIR, UPLOAD_PREFIX, hex);
+  snprintf(map_path, MAX_PATH, "%s/%s%s.map", TMP_DIR, UPLOAD_PREFIX, hex);
+}
+
+// Read the size line of a session map
+static int read_map_size(FILE* fp, uint64_t* size) {
+  unsigned long long value;
+
+  if (fscanf(fp, "RFSUPLOAD 1 %llu\n", &value) != 1) {
+    return -1;
+  }
+  *size = value;
+  return 0;
+}
+
+// Create a session, or check an existing one is for a file of this size
+int upload_open(const unsigned char* token, uint64_t size) {
+  char data_path[MAX_PATH];
+  char map_path[MAX_PATH];
+  char line[64];
+
+  upload_paths(token, data_path, map_path);
+
+  int fd = open(map_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0 && errno == EEXIST) {
+    FILE* fp = fopen(map_path, "r");
+    uint64_t existing;
+    int ok = fp != NULL && read_map_size(fp, &existing) == 0 &&
+             existing == size;
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    return ok ? 0 : -1;
+  }
+  if (fd < 0) {
+    return -1;
+  }
+
+  int len = snprintf(line, sizeof(line), "RFSUPLOAD 1 %llu\n",
+                     (unsigned long long)size);
+  int written = write(fd, line, len);
+  close(fd);
+
+  int data_fd = open(data_path, O_WRONLY | O_CREAT, 0644);
+  if (written != len || data_fd < 0) {
+    unlink(map_path);
+    if (data_fd >= 0) {
+      close(data_fd);
+    }
+    return -1;
+  }
+#ifdef __linux__
+  if (size > 0) {
+    fallocate(data_fd, FALLOC_FL_KEEP_SIZE, 0, size);
+  }
+#endif
+  close(data_fd);
+  return 0;
+}
+
+// Read just the size line of a session's map
+int upload_size(const unsigned char* token, uint64_t* size) {
+  char data_path[MAX_PATH];
+  char map_path[MAX_PATH];
+
+  upload_paths(token, data_path, map_path);
+
+  FILE* fp = fopen(map_path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  int result = read_map_size(fp, size);
+  fclose(fp);
+  return result;
+}
+
+// qsort order for extents
+static int compare_extents(const void* a, const void* b) {
+  const upload_extent_t* x = a;
+  const upload_extent_t* y = b;
+
+  if (x->offset != y->offset) {
+    return x->offset < y->offset ? -1 : 1;
+  }
+  return 0;
+}
+
+// Load the ranges of a session, overlapping ranges are merged
+int upload_load(const unsigned char* token, uint64_t* size,
+                upload_extent_t** extents, size_t* count) {
+  char data_path[MAX_PATH];
+  char map_path[MAX_PATH];
+  unsigned long long offset, len;
+  size_t capacity = 16;
+
+  upload_paths(token, data_path, map_path);
+
+  FILE* fp = fopen(map_path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  if (read_map_size(fp, size) != 0) {
+    fclose(fp);
+    return -1;
+  }
+
+  upload_extent_t* list = malloc(capacity * sizeof(upload_extent_t));
+  size_t n = 0;
+  if (list == NULL) {
+    fclose(fp);
+    return -1;
+  }
+  while (fscanf(fp, "%llu %llu\n", &offset, &len) == 2) {
+    if (n == capacity) {
+      upload_extent_t* bigger =
+          realloc(list, capacity * 2 * sizeof(upload_extent_t));
+      if (bigger == NULL) {
+        break;
+      }
+      list = bigger;
+      capacity *= 2;
+    }
+    list[n].offset = offset;
+    list[n].len = len;
+    n++;
+  }
+  fclose(fp);
+
+  // Sort, then fold every range into the one before it where they touch
+  qsort(list, n, sizeof(upload_extent_t), compare_extents);
+  size_t merged = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (merged > 0 && list[i].offset <= list[merged - 1].offset +
+                                             list[merged - 1].len) {
+      uint64_t end = list[i].offset + list[i].len;
+      if (end > list[merged - 1].offset + list[merged - 1].len) {
+        list[merged - 1].len = end - list[merged - 1].offset;
+      }
+      continue;
+    }
+    list[merged++] = list[i];
+  }
+
+  *extents = list;
+  *count = merged;
+  return 0;
+}
+
+// Append a range to the session map, a single O_APPEND write so ranges
+// recorded by parallel connections never interleave
+int upload_record(const unsigned char* token, uint64_t offset, uint64_t len) {
+  char data_path[MAX_PATH];
+  char map_path[MAX_PATH];
+  char line[64];
+
+  upload_paths(token, data_path, map_path);
+
+  int fd = open(map_path, O_WRONLY | O_APPEND);
+  if (fd < 0) {
+    return -1;
+  }
+  int n = snprintf(line, sizeof(line), "%llu %llu\n",
+                   (unsigned long long)offset, (unsigned long long)len);
+  int result = write(fd, line, n) == n ? 0 : -1;
+  close(fd);
+  return result;
+}
+
+void upload_forget(const unsigned char* token) {
+  char data_path[MAX_PATH];
+  char map_path[MAX_PATH];
+
+  upload_paths(token, data_path, map_path);
+  unlink(map_path);
+}
+
+// Sessions survive restarts until they expire, other temp files don't
+// @param name - file name inside TMP_DIR
+// @param mtime - its modification time
+int upload_is_live(const char* name, long mtime) {
+  return strncmp(name, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) == 0 &&
+         time(NULL) - mtime < UPLOAD_EXPIRY;
+}
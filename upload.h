@@ -0,0 +1,85 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Upload sessions, for resumable and parallel WRITEs
+ *
+ * A session is named by a token the client picks (a hash of what it is
+ * uploading, so running the same upload again finds the same session).
+ * It is a data file plus a map of the byte ranges that have arrived,
+ * both in TMP_DIR:
+ *
+ *   up-<token hex>      data, written with pwrite at each range's offset
+ *   up-<token hex>.map  "RFSUPLOAD 1 <size>" then one "<offset> <length>"
+ *                       line per range written (appended, O_APPEND)
+ *
+ * Ranges may arrive in any order and over any number of connections. A
+ * connection that drops records how far it got, so the client only has
+ * to resend what is missing. COMMIT checks the whole file is there and
+ * then commits it like a normal WRITE. Sessions untouched for
+ * UPLOAD_EXPIRY seconds are deleted at startup.
+ *
+ * Payloads, integers big endian like the rest of protocol.h:
+ *
+ *   UPLOAD       token, u64 size
+ *                DATA reply: u64 size, u32 count, then count ranges
+ *                (u64 offset, u64 length) that have already arrived
+ *   WRITE_RANGE  token, u64 offset, then the bytes of the range
+ *   COMMIT       token, replies OK once the file is committed
+ */
+
+#define UPLOAD_TOKEN_SIZE 16
+#define UPLOAD_PREFIX "up-"
+#define UPLOAD_EXPIRY (24 * 60 * 60)
+#define UPLOAD_HEADER_SIZE (UPLOAD_TOKEN_SIZE + 8)  // UPLOAD and WRITE_RANGE
+
+// A range of the file that has arrived
+typedef struct {
+  uint64_t offset;
+  uint64_t len;
+} upload_extent_t;
+
+// Build the data and map paths of a session, each MAX_PATH bytes
+
+void upload_paths(const unsigned char* token, char* data_path,
+                  char* map_path);
+
+/**
+ * Open a session, creating it if it doesn't exist yet
+ * @param token - session token
+ * @param size - size of the whole file
+ * @return 0 on success, -1 on error or if the session has another size
+ */
+int upload_open(const unsigned char* token, uint64_t size);
+
+// Size of the file a session uploads, -1 if there is no such session
+
+int upload_size(const unsigned char* token, uint64_t* size);
+
+/**
+ * Read the ranges that have arrived, merged and sorted
+ * @param token - session token
+ * @param size - output, size of the whole file
+ * @param extents - output array, free() it
+ * @param count - output, number of extents
+ * @return 0 on success, -1 if there is no such session
+ */
+int upload_load(const unsigned char* token, uint64_t* size,
+                upload_extent_t** extents, size_t* count);
+
+// Record that a range of the data file has been written
+
+int upload_record(const unsigned char* token, uint64_t offset, uint64_t len);
+
+// Forget a session's map once its data has been committed
+
+void upload_forget(const unsigned char* token);
+
+// Is a TMP_DIR entry a session that still counts as live
+
+int upload_is_live(const char* name, long mtime);
+
+#endif
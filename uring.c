@@ -0,0 +1,260 @@
+/*
+ * uring.c -- per-worker io_uring rings for server -u
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+int uring_enabled = 0;
+
+#ifdef __linux__
+// A worker's ring, mapped from the kernel
+typedef struct {
+  int fd;
+  int fixed;  // the pool is registered, file I/O uses *_FIXED
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+} ring_t;
+
+static __thread ring_t* ring = NULL;
+
+// Create a ring and map its queues
+// @return the ring, or NULL if io_uring can't be used
+static ring_t* ring_create(void) {
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  // Kernels with IORING_FEAT_SINGLE_MMAP share one mapping for both rings
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && cq_size > sq_size) {
+    sq_size = cq_size;
+  }
+
+  unsigned char* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  unsigned char* cq = sq;
+  if (sq != MAP_FAILED && !single) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+  }
+  void* sqes =
+      mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+           IORING_OFF_SQES);
+  ring_t* r = malloc(sizeof(ring_t));
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+      r == NULL) {
+    // A worker without a ring falls back to syscalls, so the few pages
+    // that did get mapped are left alone
+    free(r);
+    close(fd);
+    return NULL;
+  }
+
+  r->fd = fd;
+  r->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  r->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + params.sq_off.array);
+  r->cq_head = (unsigned*)(cq + params.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  r->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  r->sqes = sqes;
+  r->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // Registration pins the pool; over RLIMIT_MEMLOCK the plain ops are used
+  int buffers = buf_pool_count();
+  struct iovec* iov = malloc(buffers * sizeof(struct iovec));
+  r->fixed = 0;
+  if (iov != NULL) {
+    for (int i = 0; i < buffers; i++) {
+      iov[i].iov_base = buf_pool_data(i);
+      iov[i].iov_len = BUF_POOL_SIZE;
+    }
+    r->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                       iov, buffers) == 0;
+    free(iov);
+  }
+  return r;
+}
+#endif
+
+void uring_init(void) {
+#ifdef __linux__
+  // Try one ring here, so a kernel without io_uring is reported up front
+  ring_t* probe = ring_create();
+  if (probe != NULL) {
+    int fixed = probe->fixed;
+    close(probe->fd);
+    free(probe);
+    printf("io_uring enabled (%d KB chunks, %s buffers)\n", URING_CHUNK >> 10,
+           fixed ? "registered" : "unregistered");
+    return;
+  }
+#endif
+  printf("io_uring not available, using plain syscalls for -u\n");
+}
+
+void uring_thread_init(void) {
+#ifdef __linux__
+  if (uring_enabled && ring == NULL) {
+    ring = ring_create();
+  }
+#endif
+}
+
+// Does an operation's result let the next operation of its link run
+static int op_complete(const uring_op_t* op) {
+  if (op->res < 0) {
+    return 0;
+  }
+  // Short file I/O ends a link, a short socket operation doesn't
+  return (op->opcode != URING_READ && op->opcode != URING_WRITE) ||
+         (size_t)op->res == op->len;
+}
+
+// Run a batch one syscall at a time, with the same link rules
+static void run_syscalls(uring_op_t* ops, int count) {
+  int cancelled = 0;
+
+  for (int i = 0; i < count; i++) {
+    uring_op_t* op = &ops[i];
+    unsigned char* data = buf_pool_data(op->buf) + op->buf_off;
+    ssize_t n;
+
+    if (cancelled) {
+      op->res = -ECANCELED;
+    } else {
+      do {
+        switch (op->opcode) {
+          case URING_READ:
+            n = pread(op->fd, data, op->len, op->offset);
+            break;
+          case URING_WRITE:
+            n = pwrite(op->fd, data, op->len, op->offset);
+            break;
+          case URING_SEND:
+            n = send(op->fd, data, op->len, MSG_DONTWAIT);
+            break;
+          default:
+            n = recv(op->fd, data, op->len, MSG_DONTWAIT);
+            break;
+        }
+      } while (n < 0 && errno == EINTR);
+      op->res = n < 0 ? -errno : (int)n;
+    }
+
+    // A link runs until an operation in it fails, then the rest of it
+    // is cancelled; the next chain starts fresh
+    if (op->link) {
+      cancelled = cancelled || !op_complete(op);
+    } else {
+      cancelled = 0;
+    }
+  }
+}
+
+int uring_run(uring_op_t* ops, int count) {
+#ifdef __linux__
+  if (ring == NULL) {
+    run_syscalls(ops, count);
+    return 0;
+  }
+
+  unsigned tail = *ring->sq_tail;
+  for (int i = 0; i < count; i++) {
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    uring_op_t* op = &ops[i];
+    int file_op = op->opcode == URING_READ || op->opcode == URING_WRITE;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = op->fd;
+    sqe->addr = (unsigned long)(buf_pool_data(op->buf) + op->buf_off);
+    sqe->len = op->len;
+    sqe->user_data = i;
+    if (file_op) {
+      sqe->off = op->offset;
+    } else {
+      sqe->msg_flags = MSG_DONTWAIT;
+    }
+    if (op->link) {
+      sqe->flags = IOSQE_IO_LINK;
+    }
+
+    switch (op->opcode) {
+      case URING_READ:
+        sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        break;
+      case URING_WRITE:
+        sqe->opcode = ring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        break;
+      case URING_SEND:
+        sqe->opcode = IORING_OP_SEND;
+        break;
+      default:
+        sqe->opcode = IORING_OP_RECV;
+        break;
+    }
+    if (file_op && ring->fixed) {
+      sqe->buf_index = op->buf;
+    }
+    ring->sq_array[index] = index;
+    tail++;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  int submitted = 0;
+  int completed = 0;
+  while (completed < count) {
+    int r = syscall(__NR_io_uring_enter, ring->fd, count - submitted,
+                    count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      return -1;
+    }
+    submitted = count;
+
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      ops[cqe->user_data].res = cqe->res;
+      completed++;
+      head++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+#else
+  run_syscalls(ops, count);
+  return 0;
+#endif
+}
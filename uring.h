@@ -0,0 +1,66 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "bufpool.h"
+
+/*
+ * io_uring backend for the data paths (server -u)
+ *
+ * Each worker thread owns a small ring, set up with the raw syscalls so
+ * no library is needed. A transfer borrows one buffer from the transfer
+ * buffer pool, which every ring has registered, and moves URING_CHUNK
+ * bytes per io_uring_enter():
+ *
+ *   GET    READ_FIXED of the file linked to a SEND of the same bytes
+ *   WRITE  WRITE_FIXED of the last chunk batched with the RECV of the
+ *          next one, each in its own half of the buffer
+ *
+ * Socket operations go in with MSG_DONTWAIT, so they complete at once
+ * with -EAGAIN or a short count and the event loop keeps its job. Where
+ * io_uring is missing the same operations run as plain syscalls.
+ */
+
+#define URING_ENTRIES 8
+#define URING_CHUNK (BUF_POOL_SIZE / 2)
+
+#define URING_READ 1   // file, at offset
+#define URING_WRITE 2  // file, at offset
+#define URING_SEND 3   // socket
+#define URING_RECV 4   // socket
+
+// One operation of a batch, res is filled in like a syscall's return
+// value, but as -errno; -ECANCELED if the one it was linked to failed
+typedef struct {
+  int opcode;
+  int fd;
+  int buf;         // pool buffer
+  size_t buf_off;  // where in the buffer the data is
+  size_t len;
+  off_t offset;    // file operations only
+  int link;        // only run the next operation if this one completes
+  int res;
+} uring_op_t;
+
+// Set by the -u flag
+extern int uring_enabled;
+
+// Check for io_uring and report what -u will use, after buf_pool_init()
+
+void uring_init(void);
+
+// Set up the calling worker thread's ring
+
+void uring_thread_init(void);
+
+/**
+ * Run a batch of operations with one io_uring_enter() and wait for all
+ * @param ops - operations in submission order, their res is set
+ * @param count - at most URING_ENTRIES
+ * @return 0, or -1 if the ring failed (res is not valid then)
+ */
+int uring_run(uring_op_t* ops, int count);
+
+#endif